@@ -0,0 +1,296 @@
+// Workload benchmarks, no SDL.
+//
+//   iceXtBench [--no-jit] <roms dir> <disk.img> [workload...]
+//
+// Runs each workload headless for a fixed number of clock cycles and
+// prints the results as JSON on stdout. Every workload runs in a process
+// of its own so its peak RSS is its own, the disk image is left untouched.
+//
+//   post      Super XT BIOS from reset up to INT 19h
+//   ramtest   roms/xtramtest.hex as the BIOS
+//   landmark  roms/landmark.hex as the BIOS, the Landmark diagnostic loop
+//   vram_txt  REP MOVSW of roms/test_vram_txt.hex into text mode memory
+//   vram_gfx  REP MOVSW of roms/test_vram_gfx.hex in CGA graphics mode
+//   dos       Super XT BIOS booting DOS from the disk image
+//
+// Every frame is drawn into a buffer, as the SDL frontend would. "jit"
+// tells whether code was translated, at the top whether the build has the
+// translator and it was asked for, in a workload whether it was still in
+// use at the end of the run.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "machine.h"
+
+
+typedef enum {
+  LOAD_BIOS,  // pcxtbios, the disk ROM and the disk image
+  LOAD_ROM,   // only the rom file, in place of the BIOS
+  LOAD_FILL,  // the VRAM fill program, with rom as the data it copies
+} load_t;
+
+typedef struct {
+  const char* name;
+  load_t      load;
+  const char* rom;
+  uint8_t     mode;      // video mode set by the VRAM fill program
+  int32_t     stop_int;  // -1 to run the whole budget
+  uint64_t    cycles;    // budget
+} workload_t;
+
+static const workload_t workloads[] = {
+  { "post",     LOAD_BIOS, NULL,                0, 0x19, 100000000 },
+  { "ramtest",  LOAD_ROM,  "xtramtest.hex",     0, -1,    50000000 },
+  { "landmark", LOAD_ROM,  "landmark.hex",      0, -1,    50000000 },
+  { "vram_txt", LOAD_FILL, "test_vram_txt.hex", 3, -1,    20000000 },
+  { "vram_gfx", LOAD_FILL, "test_vram_gfx.hex", 4, -1,    20000000 },
+  { "dos",      LOAD_BIOS, NULL,                0, -1,   220000000 },
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// clock of the original IBM PC, "speed" is the emulated MHz relative to it
+#define REFERENCE_MHZ 4.77
+
+// segment the VRAM fill program copies from
+#define FILL_DATA 0x1000
+
+// Write the VRAM fill program to the BIOS ROM at F000:E000 and point the
+// reset vector at it. It sets the video mode through INT 10h, whose vector
+// points at an IRET, and copies 16KB from FILL_DATA:0 to B800:0 forever
+// with interrupts off.
+static void fill_program(machine_t *m, uint8_t mode) {
+  static const uint8_t code[] = {
+    0xFA,                               // E000  cli
+    0x31, 0xC0,                         // E001  xor  ax, ax
+    0x8E, 0xD0,                         // E003  mov  ss, ax
+    0xBC, 0x00, 0x7C,                   // E005  mov  sp, 7C00h
+    0x8E, 0xD8,                         // E008  mov  ds, ax
+    0xC7, 0x06, 0x40, 0x00, 0x31, 0xE0, // E00A  mov  word [0040h], E031h
+    0xC7, 0x06, 0x42, 0x00, 0x00, 0xF0, // E010  mov  word [0042h], F000h
+    0xB8, 0x00, 0x00,                   // E016  mov  ax, mode
+    0xCD, 0x10,                         // E019  int  10h
+    0xFC,                               // E01B  cld
+    0xB8, 0x00, FILL_DATA >> 8,         // E01C  mov  ax, FILL_DATA
+    0x8E, 0xD8,                         // E01F  mov  ds, ax
+    0xB8, 0x00, 0xB8,                   // E021  mov  ax, B800h
+    0x8E, 0xC0,                         // E024  mov  es, ax
+    0x31, 0xF6,                         // E026  xor  si, si
+    0x31, 0xFF,                         // E028  xor  di, di
+    0xB9, 0x00, 0x20,                   // E02A  mov  cx, 2000h
+    0xF3, 0xA5,                         // E02D  rep  movsw
+    0xEB, 0xEB,                         // E02F  jmp  E01C
+    0xCF,                               // E031  iret
+  };
+  static const uint8_t reset[] = {
+    0xEA, 0x00, 0xE0, 0x00, 0xF0,       // FFF0  jmp  F000:E000
+  };
+  memcpy(m->memory + 0xFE000, code, sizeof(code));
+  m->memory[0xFE000 + 0x17] = mode;
+  memcpy(m->memory + 0xFFFF0, reset, sizeof(reset));
+}
+
+static bool load(machine_t *m, const workload_t* w, const char* roms, const char* disk) {
+  char path[1024];
+  char other[1024];
+  switch (w->load) {
+  case LOAD_BIOS:
+    snprintf(path,  sizeof(path),  "%s/pcxtbios.hex", roms);
+    snprintf(other, sizeof(other), "%s/diskrom.hex",  roms);
+    if (!machine_load(m, path, other, disk)) {
+      return false;
+    }
+    // keep the image as it is
+    snprintf(path, sizeof(path), "%s.%u.overlay", disk, (unsigned)getpid());
+    if (!disk_overlay(m, path)) {
+      return false;
+    }
+    remove(path);  // still open
+    return true;
+  case LOAD_ROM:
+    snprintf(path, sizeof(path), "%s/%s", roms, w->rom);
+    return machine_load_hex(m, 0xFE000, path, 0x2000);
+  case LOAD_FILL:
+    snprintf(path, sizeof(path), "%s/%s", roms, w->rom);
+    fill_program(m, w->mode);
+    return machine_load_hex(m, FILL_DATA * 16, path, 0x4000);
+  }
+  return false;
+}
+
+static double now_seconds(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Body of the process running one workload, prints its JSON object to out.
+static int run_workload(const workload_t* w, const char* roms, const char* disk,
+                        bool jit, FILE* out) {
+  machine_t* m = machine_create();
+  if (!m) {
+    return 1;
+  }
+  cpu_set_jit(m, jit);
+  if (!load(m, w, roms, disk)) {
+    fprintf(stderr, "%s: unable to load\n", w->name);
+    return 1;
+  }
+  uint32_t* pixels = malloc(DISPLAY_WIDTH * DISPLAY_HEIGHT * sizeof(uint32_t));
+  if (!pixels) {
+    return 1;
+  }
+
+  machine_stop_at_cycle(m, w->cycles);
+  machine_stop_at_int(m, w->stop_int);
+
+  uint32_t     frames = 0;
+  const double start  = now_seconds();
+  for (bool hit = false; !hit; ) {
+    cpu_set_debug(m, false);
+    hit = machine_run_frame(m);
+    if (!hit) {
+      display_draw(m, pixels, DISPLAY_WIDTH);
+      frames += 1;
+    }
+  }
+  const double seconds = now_seconds() - start;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  const uint64_t cycles       = cpu_get_cycles(m);
+  const uint64_t instructions = cpu_get_instructions(m);
+  const double   mhz          = cycles / seconds / 1e6;
+
+  fprintf(out,
+    "    { \"name\": \"%s\", \"cycles\": %llu, \"instructions\": %llu, "
+    "\"frames\": %u, \"seconds\": %.3f, \"ips\": %.0f, \"mhz\": %.2f, "
+    "\"speed\": %.2f, \"fps\": %.1f, \"peak_rss_kb\": %ld, \"jit\": %s }",
+    w->name, (unsigned long long)cycles, (unsigned long long)instructions,
+    frames, seconds, instructions / seconds, mhz,
+    mhz / REFERENCE_MHZ, frames / seconds, (long)usage.ru_maxrss,
+    cpu_get_jit(m) ? "true" : "false");
+  fflush(out);
+
+  free(pixels);
+  machine_destroy(m);
+  return 0;
+}
+
+// Run a workload in a child process with stdout, where the machine logs,
+// sent to /dev/null.
+static bool spawn(const workload_t* w, const char* roms, const char* disk, bool jit) {
+  fflush(NULL);
+  const pid_t pid = fork();
+  if (pid == 0) {
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    const int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    const int code = out ? run_workload(w, roms, disk, jit, out) : 1;
+    _exit(code);
+  }
+  int status = 0;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+    return false;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: iceXtBench [--no-jit] <roms dir> <disk.img> [workload...]\n"
+                  "workloads:");
+  for (uint32_t i = 0; i < NUM_WORKLOADS; ++i) {
+    fprintf(stderr, " %s", workloads[i].name);
+  }
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char** args) {
+
+  bool jit = true;
+
+  const char** paths = calloc(argc, sizeof(const char*));
+  uint32_t numPaths = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(args[i], "--no-jit") == 0) {
+      jit = false;
+      continue;
+    }
+    if (strncmp(args[i], "--", 2) == 0) {
+      fprintf(stderr, "Unknown option '%s'!\n", args[i]);
+      usage();
+      return 1;
+    }
+    paths[numPaths++] = args[i];
+  }
+  if (numPaths < 2) {
+    usage();
+    return 1;
+  }
+  const char* roms = paths[0];
+  const char* disk = paths[1];
+
+  // all of them when none are named
+  bool selected[NUM_WORKLOADS];
+  for (uint32_t i = 0; i < NUM_WORKLOADS; ++i) {
+    selected[i] = numPaths == 2;
+  }
+  for (uint32_t p = 2; p < numPaths; ++p) {
+    uint32_t i = 0;
+    while (i < NUM_WORKLOADS && strcmp(paths[p], workloads[i].name)) {
+      ++i;
+    }
+    if (i == NUM_WORKLOADS) {
+      fprintf(stderr, "Unknown workload '%s'!\n", paths[p]);
+      usage();
+      return 1;
+    }
+    selected[i] = true;
+  }
+
+  // what the workloads are asked for, with the translator compiled in or not
+  machine_t* probe = machine_create();
+  if (!probe) {
+    return 1;
+  }
+  cpu_set_jit(probe, jit);
+  jit = cpu_get_jit(probe);
+  machine_destroy(probe);
+
+  printf("{\n  \"clock_mhz\": %.2f,\n  \"reference_mhz\": %.2f,\n"
+         "  \"jit\": %s,\n  \"workloads\": [\n",
+    CPU_CLOCK / 1e6, REFERENCE_MHZ, jit ? "true" : "false");
+
+  uint32_t failed = 0;
+  bool     first  = true;
+  for (uint32_t i = 0; i < NUM_WORKLOADS; ++i) {
+    if (!selected[i]) {
+      continue;
+    }
+    if (!first) {
+      printf(",\n");
+    }
+    first = false;
+    if (!spawn(&workloads[i], roms, disk, jit)) {
+      fprintf(stderr, "%s: failed\n", workloads[i].name);
+      printf("    { \"name\": \"%s\", \"failed\": true }", workloads[i].name);
+      failed += 1;
+    }
+  }
+  printf("\n  ]\n}\n");
+
+  free(paths);
+  return failed ? 1 : 0;
+}
@@ -7,231 +7,692 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
 #include "udis86/udis86.h"
 
 #include "cpu.h"
+#include "cpu_decode.h"
+#include "machine.h"
 
-// Enable/disable 80286 stack emulation, 80286 and higher push the old value of
-// SP, 8086/80186 push new value.
+// The interpreter core is built for each CPU model, see cpu_core.h, with
+// the quirks below as constants.
+//
+// CPU_PUSH_80286: 80286 and higher push the old value of SP, 8086/80186
+// push the new value. This is used by some software to detect extra
+// instructions that are present in the 80186 also, so the 80186 model
+// emulates this even if no 80286 instructions are supported.
 //
-// This is used by some software to detect extra instructions that are present
-// in the 80186 also, so we emulate this even if no 80286 instructions are
-// supported.
-#define CPU_PUSH_80286
+// CPU_SHIFT_80186: 80186 shift behaviour - shift count is modulo 32. This
+// is used in some software to detect 80186 and higher, the V20 and 8088
+// use the whole count.
+
+// Enable lazy flag evaluation - the ALU operations only record their
+// operands and result, the flags are computed when something reads them.
+#define CPU_LAZY_FLAGS
+
+// CPU_CHECK_FLAGS has the reference interpreter evaluate the flags with
+// RefFlags() as it goes, see iceXtFuzz.
+
+// Translate hot code to x86-64 host code when built with CPU_JIT, see
+// cpu_jit.h. Only System V x86-64 hosts are supported. A profiling build
+// measures the interpreter only.
+#if defined(CPU_JIT) && defined(__x86_64__) && defined(__GNUC__) && !defined(_WIN32) && \
+    !defined(CPU_PROFILE)
+#define CPU_JIT_X64
+#endif
+
+// Run the common idioms of the BIOS and DOS inner loops as one sequence, see
+// do_fused(). A profiling build measures the instructions one by one.
+#ifndef CPU_PROFILE
+#define CPU_FUSE
+#endif
 
-// Enable 80186 shift behaviour - shift count is modulo 32.
-// This is used in some software to detect 80186 and higher.
-#define CPU_SHIFT_80186
+// Run the BIOS and disk ROM from C compiled at build time when built with
+// CPU_AOT, see cpu_aot.h. A profiling build measures the interpreter only.
+#ifdef CPU_PROFILE
+#undef CPU_AOT
+#endif
 
-#define SetZFB(x) (ZF = !(uint8_t)(x))
-#define SetZFW(x) (ZF = !(uint16_t)(x))
-#define SetPF(x)  (PF = parity_table[(uint8_t)(x)])
-#define SetSFW(x) (SF = (x)&0x8000)
-#define SetSFB(x) (SF = (x)&0x80)
+#define SetZFB(x) (cpu->ZF = !(uint8_t)(x))
+#define SetZFW(x) (cpu->ZF = !(uint16_t)(x))
+#define SetPF(x)  (cpu->PF = parity_table[(uint8_t)(x)])
+#define SetSFW(x) (cpu->SF = (x)&0x8000)
+#define SetSFB(x) (cpu->SF = (x)&0x80)
 
 #define CompressFlags()                                                                  \
-    (uint16_t)(CF | 2 | (PF << 2) | (!(!AF) << 4) | (ZF << 6) | (!(!SF) << 7) |          \
-               (TF << 8) | (IF << 9) | (DF << 10) | (!(!OF) << 11))
+    (SyncFlags(),                                                                        \
+     (uint16_t)(cpu->CF | 2 | (cpu->PF << 2) | (!(!cpu->AF) << 4) | (cpu->ZF << 6) |      \
+               (!(!cpu->SF) << 7) | (cpu->TF << 8) | (cpu->IF << 9) | (cpu->DF << 10) |   \
+               (!(!cpu->OF) << 11)))
 
 #define ExpandFlags(f)                                                                   \
     {                                                                                    \
-        CF = (f)&1;                                                                      \
-        PF = ((f)&4) == 4;                                                               \
-        AF = (f)&16;                                                                     \
-        ZF = ((f)&64) == 64;                                                             \
-        SF = (f)&128;                                                                    \
-        TF = ((f)&256) == 256;                                                           \
-        IF = ((f)&512) == 512;                                                           \
-        DF = ((f)&1024) == 1024;                                                         \
-        OF = (f)&2048;                                                                   \
+        SyncFlags();                                                                     \
+        cpu->CF = (f)&1;                                                                 \
+        cpu->PF = ((f)&4) == 4;                                                          \
+        cpu->AF = (f)&16;                                                                \
+        cpu->ZF = ((f)&64) == 64;                                                        \
+        cpu->SF = (f)&128;                                                               \
+        cpu->TF = ((f)&256) == 256;                                                      \
+        cpu->IF = ((f)&512) == 512;                                                      \
+        cpu->DF = ((f)&1024) == 1024;                                                    \
+        cpu->OF = (f)&2048;                                                              \
+    }
+
+// Interpreter core, see cpu_core.h. There is one for each CPU model with
+// and without the debug output and trace, select_core() picks the one in use.
+typedef struct {
+    void (*run)(void);                   // run_instructions() until run_end
+    void (*next_instruction)(void);
+    void (*do_instruction)(uint8_t code);
+    bool push_80286;                     // CPU_PUSH_80286, for the translator
+} cpu_core_t;
+
+// Instruction decode cache
+//
+// Instructions are decoded once and kept in a direct mapped cache indexed by
+// linear address. An entry holds the raw instruction bytes (prefixes, opcode,
+// modrm, displacement and immediates), so FETCH_B/FETCH_W are served without
+// going through mem_read(), and the predecoded modrm effective address so
+// GetModRMOffset() does not have to walk its switch again.
+//
+// An instruction starting one of the fused idioms, see dcache_fuse(), is
+// followed in its entry by the bytes of the instructions fused to it. The
+// entry then covers all of them, writing to any drops the sequence.
+#define DCACHE_BITS    16
+#define DCACHE_SIZE    (1 << DCACHE_BITS)
+#define DCACHE_MAX_LEN 15
+#define DCACHE_INVALID 0xffffffff
+
+typedef struct {
+    uint32_t addr;        // linear address of the first byte
+    uint8_t  len;         // length including prefixes
+    uint8_t  span;        // bytes covered, with the fused instructions
+    uint8_t  fuse;        // number of instructions fused to this one
+    uint8_t  ea_valid;    // modrm selects a memory operand
+    uint8_t  ea_base;     // base register or NoReg
+    uint8_t  ea_index;    // index register or NoReg
+    uint8_t  ea_seg;      // default segment
+    uint8_t  ea_disp_len; // displacement bytes following the modrm
+    uint16_t ea_disp;
+    uint8_t  bytes[DCACHE_MAX_LEN + 1];
+} decode_t;
+
+// Flags for each 16 byte line, non zero when it holds cached instructions
+// or translated code.
+#define DCACHE_LINE 4
+#define DCACHE_CODE 1
+#define DCACHE_JIT  2
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+// State of one CPU, owned by its machine.
+struct cpu_t {
+    machine_t *machine;
+
+    // The extra register is always zero, it is used as the "no register"
+    // base or index of a predecoded effective address.
+    uint16_t wregs[8 + 1];
+    uint16_t sregs[4];
+
+    uint16_t ip;
+    uint16_t start_ip; // IP at start of instruction, used on interrupts.
+
+    /* All the byte flags will either be 1 or 0 */
+    int8_t CF, PF, ZF, TF, IF, DF;
+
+    /* All the word flags may be either non-zero (true) or zero (false) */
+    uint32_t AF, OF, SF;
+
+    // Pending lazy flags, see SyncFlags()
+    uint8_t  lazy_op;
+    uint32_t lazy_dest, lazy_src, lazy_res;
+
+    /* Override segment execution */
+    uint8_t segment_override;
+
+    uint16_t irq_mask; // IRQs pending
+
+    uint64_t cycles;   // clock cycles since cpu_init(), see BUS_CYCLES
+    uint64_t retired;  // instructions executed since cpu_init()
+    uint64_t run_end;  // cpu_run() returns once cycles reaches this
+
+    // Set by HLT, the CPU sleeps until an interrupt is taken.
+    bool halted;
+    // Set by cpu_stop(), cpu_run() returns early.
+    bool stopped;
+
+    bool debug;
+    ud_t ud_obj;
+    // Binary trace being written, see trace.h, or NULL.
+    trace_t *trace;
+    // Run as the reference interpreter, see cpu_set_reference().
+    bool reference;
+
+    uint32_t ModRMAddress;
+
+    decode_t dcache[DCACHE_SIZE];
+    uint8_t  dcache_lines[(1024 * 1024) >> DCACHE_LINE];
+
+    // Entry of the instruction being executed and its unread bytes.
+    const decode_t *cur_decode;
+    const uint8_t  *fetch_ptr;
+    const uint8_t  *fetch_end;
+
+    cpu_model_t model;
+    const cpu_core_t *core;  // the one in use, see select_core()
+
+    bool jit_enabled;
+    struct jit_t *jit;
+#ifdef CPU_AOT
+    uint32_t aot_valid;  // bit per compiled ROM found mapped, see aot_check()
+    bool aot_checked;
+#endif
+#ifdef CPU_PROFILE
+    struct profile_t *profile;
+#endif
+};
+
+// The CPU being run on this thread. The cpu_* entry points make the CPU of
+// their machine current, the interpreter works on its state through it.
+static THREAD_LOCAL cpu_t *cpu;
+
+
+// Last flag setting operation, see SetFlags(). While it is pending CF..OF
+// hold stale values, SyncFlags() must be called before reading or partially
+// updating them.
+enum {
+    FLAGS_NONE,  // 8 bit operations have odd numbers
+    FLAGS_ADD8,  // also ADC, CF from bit 8 of the result
+    FLAGS_ADD16,
+    FLAGS_SUB8,  // also SBB, CMP and NEG
+    FLAGS_SUB16,
+    FLAGS_LOG8,  // AND, OR, XOR and TEST
+    FLAGS_LOG16,
+    FLAGS_INC8,  // INC and DEC leave CF unchanged
+    FLAGS_INC16,
+    FLAGS_DEC8,
+    FLAGS_DEC16,
+};
+
+// Even parity of each byte value
+#define P2(n) n, n ^ 1, n ^ 1, n
+#define P4(n) P2(n), P2(n ^ 1), P2(n ^ 1), P2(n)
+#define P6(n) P4(n), P4(n ^ 1), P4(n ^ 1), P4(n)
+static const uint8_t parity_table[256] = { P6(1), P6(0), P6(0), P6(1) };
+#undef P2
+#undef P4
+#undef P6
+
+static inline void EvalFlags(uint8_t op, uint32_t dest, uint32_t src, uint32_t res)
+{
+    switch(op)
+    {
+    case FLAGS_ADD8:
+        cpu->OF = (res ^ src) & (res ^ dest) & 0x80;
+        cpu->AF = (res ^ src ^ dest) & 0x10 ? 1 : 0;
+        cpu->CF = res >> 8;
+        break;
+    case FLAGS_ADD16:
+        cpu->OF = (res ^ src) & (res ^ dest) & 0x8000;
+        cpu->AF = (res ^ src ^ dest) & 0x10 ? 1 : 0;
+        cpu->CF = res >> 16;
+        break;
+    case FLAGS_SUB8:
+        cpu->CF = (res & 0x100) == 0x100;
+        cpu->OF = (dest ^ src) & (dest ^ res) & 0x80;
+        cpu->AF = (res ^ src ^ dest) & 0x10 ? 1 : 0;
+        break;
+    case FLAGS_SUB16:
+        cpu->CF = (res & 0x10000) == 0x10000;
+        cpu->OF = (dest ^ src) & (dest ^ res) & 0x8000;
+        cpu->AF = (res ^ src ^ dest) & 0x10 ? 1 : 0;
+        break;
+    case FLAGS_LOG8:
+    case FLAGS_LOG16:
+        cpu->CF = cpu->OF = cpu->AF = 0;
+        break;
+    case FLAGS_INC8:
+        cpu->OF = res == 0x80;
+        cpu->AF = (res ^ (res - 1)) & 0x10;
+        break;
+    case FLAGS_INC16:
+        cpu->OF = res == 0x8000;
+        cpu->AF = (res ^ (res - 1)) & 0x10;
+        break;
+    case FLAGS_DEC8:
+        cpu->OF = res == 0x7F;
+        cpu->AF = (res ^ (res + 1)) & 0x10;
+        break;
+    case FLAGS_DEC16:
+        cpu->OF = res == 0x7FFF;
+        cpu->AF = (res ^ (res + 1)) & 0x10;
+        break;
+    }
+
+    switch(op)
+    {
+    case FLAGS_ADD8:
+    case FLAGS_SUB8:
+    case FLAGS_LOG8:
+    case FLAGS_INC8:
+    case FLAGS_DEC8:
+        SetZFB(res);
+        SetSFB(res);
+        break;
+    default:
+        SetZFW(res);
+        SetSFW(res);
+        break;
+    }
+    SetPF(res);
+}
+
+#ifdef CPU_CHECK_FLAGS
+// Evaluate the flags of an operation the long way round, from the operand
+// values instead of the bits of the result EvalFlags() looks at. The
+// reference interpreter of a CPU_CHECK_FLAGS build sets its flags with this
+// and never leaves any pending, so a differential run checks the lazy flags
+// of the other core against an evaluator they share no code with.
+static void RefFlags(uint8_t op, uint32_t dest, uint32_t src, uint32_t res)
+{
+    const bool wide = op == FLAGS_ADD16 || op == FLAGS_SUB16 || op == FLAGS_LOG16 ||
+                      op == FLAGS_INC16 || op == FLAGS_DEC16;
+    const uint32_t mask = wide ? 0xFFFF : 0xFF;
+    const int32_t top = wide ? 0x8000 : 0x80;
+    const uint32_t d = dest & mask, s = src & mask, r = res & mask;
+    // the carry added or borrowed by ADC and SBB, the bits above mask cancel
+    const uint32_t carry = (op == FLAGS_ADD8 || op == FLAGS_ADD16 ? res - d - s : d - s - res) & 1;
+    const int32_t sd = d & top ? (int32_t)d - 2 * top : (int32_t)d;
+    const int32_t ss = s & top ? (int32_t)s - 2 * top : (int32_t)s;
+    uint32_t bits = 0, i;
+
+    switch(op)
+    {
+    case FLAGS_ADD8:
+    case FLAGS_ADD16:
+        cpu->CF = d + s + carry > mask;
+        cpu->AF = (d & 0xF) + (s & 0xF) + carry > 0xF;
+        cpu->OF = sd + ss + (int32_t)carry >= top || sd + ss + (int32_t)carry < -top;
+        break;
+    case FLAGS_SUB8:
+    case FLAGS_SUB16:
+        cpu->CF = d < s + carry;
+        cpu->AF = (d & 0xF) < (s & 0xF) + carry;
+        cpu->OF = sd - ss - (int32_t)carry >= top || sd - ss - (int32_t)carry < -top;
+        break;
+    case FLAGS_LOG8:
+    case FLAGS_LOG16:
+        cpu->CF = cpu->OF = cpu->AF = 0;
+        break;
+    case FLAGS_INC8:
+    case FLAGS_INC16:
+        cpu->OF = r == (uint32_t)top;
+        cpu->AF = (r & 0xF) == 0;
+        break;
+    case FLAGS_DEC8:
+    case FLAGS_DEC16:
+        cpu->OF = r == (uint32_t)top - 1;
+        cpu->AF = (r & 0xF) == 0xF;
+        break;
+    }
+    for(i = 0; i < 8; i++)
+        bits += (r >> i) & 1;
+    cpu->ZF = r == 0;
+    cpu->SF = (r & (uint32_t)top) != 0;
+    cpu->PF = !(bits & 1);
+}
+#endif
+
+#if defined(CPU_LAZY_FLAGS) && defined(CPU_CHECK_FLAGS)
+#define SetFlags(op, dest, src, res)                                           \
+    (cpu->reference ? RefFlags(op, dest, src, res) :                          \
+                      (void)(cpu->lazy_op = (op), cpu->lazy_dest = (dest),     \
+                             cpu->lazy_src = (src), cpu->lazy_res = (res)))
+#elif defined(CPU_LAZY_FLAGS)
+#define SetFlags(op, dest, src, res)                                           \
+    (cpu->lazy_op = (op), cpu->lazy_dest = (dest), cpu->lazy_src = (src), cpu->lazy_res = (res))
+#else
+#define SetFlags(op, dest, src, res) EvalFlags(op, dest, src, res)
+#endif
+
+static inline void SyncFlags(void)
+{
+    if(cpu->lazy_op != FLAGS_NONE)
+    {
+        EvalFlags(cpu->lazy_op, cpu->lazy_dest, cpu->lazy_src, cpu->lazy_res);
+        cpu->lazy_op = FLAGS_NONE;
     }
+}
 
-// Forward declarations
-static void do_instruction(uint8_t code);
+// Bring only CF up to date, used before an operation that reads CF or
+// leaves it unchanged.
+static inline void SyncCF(void)
+{
+    switch(cpu->lazy_op)
+    {
+    case FLAGS_ADD8:  cpu->CF = cpu->lazy_res >> 8; break;
+    case FLAGS_ADD16: cpu->CF = cpu->lazy_res >> 16; break;
+    case FLAGS_SUB8:  cpu->CF = (cpu->lazy_res & 0x100) == 0x100; break;
+    case FLAGS_SUB16: cpu->CF = (cpu->lazy_res & 0x10000) == 0x10000; break;
+    case FLAGS_LOG8:
+    case FLAGS_LOG16: cpu->CF = 0; break;
+    }
+}
 
-static uint16_t wregs[8];
-static uint16_t sregs[4];
+// Flag reads for the conditional jumps. ZF and SF come straight from the
+// pending result, the other flags need the full evaluation.
+static inline int8_t GetCF(void)
+{
+    SyncCF();
+    return cpu->CF;
+}
 
-static uint16_t ip;
-static uint16_t start_ip; // IP at start of instruction, used on interrupts.
+static inline int8_t GetZF(void)
+{
+    if(cpu->lazy_op == FLAGS_NONE)
+        return cpu->ZF;
+    return (cpu->lazy_op & 1) ? !(uint8_t)cpu->lazy_res : !(uint16_t)cpu->lazy_res;
+}
 
-/* All the byte flags will either be 1 or 0 */
-static int8_t CF, PF, ZF, TF, IF, DF;
+static inline uint32_t GetSF(void)
+{
+    if(cpu->lazy_op == FLAGS_NONE)
+        return cpu->SF;
+    return cpu->lazy_res & ((cpu->lazy_op & 1) ? 0x80 : 0x8000);
+}
 
-/* All the word flags may be either non-zero (true) or zero (false) */
-static uint32_t AF, OF, SF;
+static inline uint32_t GetOF(void)
+{
+    SyncFlags();
+    return cpu->OF;
+}
 
-/* Override segment execution */
-static uint8_t segment_override;
+static inline int8_t GetPF(void)
+{
+    SyncFlags();
+    return cpu->PF;
+}
 
-static uint8_t parity_table[256];
+// Clock cycles executed, the CPU is a NEC V20 on an 8 bit bus. Instructions
+// are charged their internal execution time from op_cycles[], effective
+// address calculation and BUS_CYCLES for every byte moved over the bus,
+// so word accesses cost twice as much as byte accesses. Instruction fetch
+// is assumed to be hidden by the prefetch queue. The total since cpu_init()
+// is the machine wide clock the other devices are timed from.
+#define BUS_CYCLES 4
 
-static uint16_t irq_mask; // IRQs pending
 
-bool cpu_debug;
+#ifdef CPU_JIT_X64
+static void jit_invalidate_page(uint32_t page);
+static void jit_flush(void);
+#endif
+
+// Drop the entries covering the written byte. Once a line holds no more
+// cached instructions it is unmarked, so data sharing a line with code that
+// has since been replaced stops paying for the lookups.
+static void dcache_invalidate(uint32_t addr)
+{
+    uint32_t line = addr & ~((1 << DCACHE_LINE) - 1);
+    uint32_t live = 0;
+    int32_t rel;
+#ifdef CPU_JIT_X64
+    if(cpu->dcache_lines[line >> DCACHE_LINE] & DCACHE_JIT)
+        jit_invalidate_page(line >> MEM_PAGE_BITS);
+    if(!(cpu->dcache_lines[line >> DCACHE_LINE] & DCACHE_CODE))
+        return;
+#endif
+    for(rel = 1 - DCACHE_MAX_LEN; rel < (1 << DCACHE_LINE); rel++)
+    {
+        uint32_t start = (line + rel) & 0xFFFFF;
+        decode_t *e = &cpu->dcache[start & (DCACHE_SIZE - 1)];
+        if(e->addr != start || rel + e->span <= 0)
+            continue;
+        if(((addr - start) & 0xFFFFF) < e->span)
+            e->addr = DCACHE_INVALID;
+        else
+            live = 1;
+    }
+    if(!live)
+        cpu->dcache_lines[line >> DCACHE_LINE] &= ~DCACHE_CODE;
+}
 
-static ud_t ud_obj;
+static void dcache_flush(void)
+{
+    uint32_t i;
+    for(i = 0; i < DCACHE_SIZE; i++)
+        cpu->dcache[i].addr = DCACHE_INVALID;
+    memset(cpu->dcache_lines, 0, sizeof(cpu->dcache_lines));
+#ifdef CPU_JIT_X64
+    jit_flush();
+#endif
+#ifdef CPU_AOT
+    cpu->aot_checked = false;
+#endif
+}
 
+// Memory read without bus cycle accounting, for instruction fetch.
+static inline uint8_t ReadMemAbsB(uint32_t addr)
+{
+    const mem_page_t *page = &cpu->machine->mem_map[(addr & 0xFFFFF) >> MEM_PAGE_BITS];
+    if(page->read)
+        return page->read[addr & MEM_PAGE_MASK];
+    return mem_read(cpu->machine, addr);
+}
 
-static uint8_t GetMemAbsB(uint32_t addr)
+static inline uint8_t GetMemAbsB(uint32_t addr)
 {
-    return mem_read(addr);
+    cpu->cycles += BUS_CYCLES;
+    return ReadMemAbsB(addr);
 }
 
-static uint16_t GetMemAbsW(uint32_t addr)
+static inline uint16_t GetMemAbsW(uint32_t addr)
 {
-    return mem_read(addr + 0) +
-          (mem_read(addr + 1) * 256);
+    const mem_page_t *page = &cpu->machine->mem_map[(addr & 0xFFFFF) >> MEM_PAGE_BITS];
+    uint32_t off = addr & MEM_PAGE_MASK;
+    if(page->read && off != MEM_PAGE_MASK)
+    {
+        cpu->cycles += 2 * BUS_CYCLES;
+        return page->read[off] | (page->read[off + 1] << 8);
+    }
+    return GetMemAbsB(addr) | (GetMemAbsB(addr + 1) << 8);
 }
 
 static void SetMemAbsB(uint32_t addr, uint8_t val)
 {
-    mem_write(addr, val);
+    const mem_page_t *page;
+    cpu->cycles += BUS_CYCLES;
+    addr &= 0xFFFFF;
+    if(cpu->dcache_lines[addr >> DCACHE_LINE])
+        dcache_invalidate(addr);
+    page = &cpu->machine->mem_map[addr >> MEM_PAGE_BITS];
+    if(page->write)
+        page->write[addr & MEM_PAGE_MASK] = val;
+    else
+        mem_write(cpu->machine, addr, val);
+    if(cpu->trace)
+        trace_write(cpu->trace, addr, val, false);
 }
 
 static void SetMemAbsW(uint32_t addr, uint16_t x)
 {
-    mem_write(addr + 0, x & 0xff);
-    mem_write(addr + 1, x >> 8);
+    const mem_page_t *page;
+    uint32_t off;
+    addr &= 0xFFFFF;
+    page = &cpu->machine->mem_map[addr >> MEM_PAGE_BITS];
+    off = addr & MEM_PAGE_MASK;
+    if(page->write && off != MEM_PAGE_MASK &&
+       !cpu->dcache_lines[addr >> DCACHE_LINE] &&
+       !cpu->dcache_lines[(addr + 1) >> DCACHE_LINE])
+    {
+        cpu->cycles += 2 * BUS_CYCLES;
+        page->write[off] = x & 0xff;
+        page->write[off + 1] = x >> 8;
+        if(cpu->trace)
+            trace_write(cpu->trace, addr, x, true);
+        return;
+    }
+    SetMemAbsB(addr + 0, x & 0xff);
+    SetMemAbsB(addr + 1, x >> 8);
 }
 
 static uint8_t GetMemB(uint8_t seg, uint16_t off)
 {
-  return mem_read(sregs[seg] * 16 + off);
+  return GetMemAbsB(cpu->sregs[seg] * 16 + off);
+}
+
+static uint8_t GetCodeB(uint16_t off)
+{
+    return ReadMemAbsB(cpu->sregs[CS] * 16 + off);
+}
+
+static inline uint8_t PortRead(uint32_t port)
+{
+    cpu->cycles += BUS_CYCLES;
+    return port_read(cpu->machine, port);
+}
+
+static inline void PortWrite(uint32_t port, uint8_t value)
+{
+    cpu->cycles += BUS_CYCLES;
+    port_write(cpu->machine, port, value);
 }
 
 static void SetMemB(uint16_t seg, uint16_t off, uint8_t val)
 {
-    SetMemAbsB(sregs[seg] * 16 + off, val);
+    SetMemAbsB(cpu->sregs[seg] * 16 + off, val);
 }
 
 static void SetMemW(uint16_t seg, uint16_t off, uint16_t val)
 {
-    SetMemAbsW(sregs[seg] * 16 + off, val);
+    SetMemAbsW(cpu->sregs[seg] * 16 + off, val);
 }
 
 static uint16_t GetMemW(uint16_t seg, uint16_t off)
 {
-    return GetMemAbsW(sregs[seg] * 16 + off);
+    return GetMemAbsW(cpu->sregs[seg] * 16 + off);
 }
 
 // Read memory via DS, with possible segment override.
 static uint8_t GetMemDSB(uint16_t off)
 {
-    if(segment_override != NoSeg)
-        return GetMemB(segment_override, off);
+    if(cpu->segment_override != NoSeg)
+        return GetMemB(cpu->segment_override, off);
     else
         return GetMemB(DS, off);
 }
 
 static uint16_t GetMemDSW(uint16_t off)
 {
-    if(segment_override != NoSeg)
-        return GetMemW(segment_override, off);
+    if(cpu->segment_override != NoSeg)
+        return GetMemW(cpu->segment_override, off);
     else
         return GetMemW(DS, off);
 }
 
 static void PutMemDSB(uint16_t off, uint8_t val)
 {
-    if(segment_override != NoSeg)
-        SetMemB(segment_override, off, val);
+    if(cpu->segment_override != NoSeg)
+        SetMemB(cpu->segment_override, off, val);
     else
         SetMemB(DS, off, val);
 }
 
 static void PutMemDSW(uint16_t off, uint16_t val)
 {
-    if(segment_override != NoSeg)
-        SetMemW(segment_override, off, val);
+    if(cpu->segment_override != NoSeg)
+        SetMemW(cpu->segment_override, off, val);
     else
         SetMemW(DS, off, val);
 }
 
 static uint32_t GetAbsAddrSeg(uint8_t seg, uint16_t off)
 {
-    if(segment_override != NoSeg && (seg == DS || seg == SS))
-        return sregs[segment_override] * 16 + off;
+    if(cpu->segment_override != NoSeg && (seg == DS || seg == SS))
+        return cpu->sregs[cpu->segment_override] * 16 + off;
     else
-        return sregs[seg] * 16 + off;
+        return cpu->sregs[seg] * 16 + off;
 }
 
 static void PushWord(uint16_t w)
 {
-    wregs[SP] -= 2;
-    SetMemW(SS, wregs[SP], w);
+    cpu->wregs[SP] -= 2;
+    SetMemW(SS, cpu->wregs[SP], w);
 }
 
-#ifdef CPU_PUSH_80286
-#define PUSH_SP()                                                              \
-    PushWord(wregs[SP]);                                                       \
-    break;
-#else
 #define PUSH_SP()                                                              \
-    PushWord(wregs[SP] - 2);                                                   \
+    PushWord(CPU_PUSH_80286 ? cpu->wregs[SP] : cpu->wregs[SP] - 2);            \
     break;
-#endif
 
 static uint16_t PopWord(void)
 {
-    uint16_t tmp = GetMemW(SS, wregs[SP]);
-    wregs[SP] += 2;
+    uint16_t tmp = GetMemW(SS, cpu->wregs[SP]);
+    cpu->wregs[SP] += 2;
     return tmp;
 }
 
 #define PUSH_WR(reg)                                                           \
-    PushWord(wregs[reg]);                                                      \
+    PushWord(cpu->wregs[reg]);                                                 \
     break;
 #define POP_WR(reg)                                                            \
-    wregs[reg] = PopWord();                                                    \
+    cpu->wregs[reg] = PopWord();                                               \
     break;
 
 #define XCHG_AX_WR(reg)                                                        \
     {                                                                          \
-        uint16_t tmp = wregs[reg];                                             \
-        wregs[reg] = wregs[AX];                                                \
-        wregs[AX] = tmp;                                                       \
+        uint16_t tmp = cpu->wregs[reg];                                        \
+        cpu->wregs[reg] = cpu->wregs[AX];                                      \
+        cpu->wregs[AX] = tmp;                                                  \
         break;                                                                 \
     }
 
 #define INC_WR(reg)                                                            \
     {                                                                          \
-        uint16_t tmp = wregs[reg] + 1;                                         \
-        OF = tmp == 0x8000;                                                    \
-        AF = (tmp ^ (tmp - 1)) & 0x10;                                         \
-        SetZFW(tmp);                                                           \
-        SetSFW(tmp);                                                           \
-        SetPF(tmp);                                                            \
-        wregs[reg] = tmp;                                                      \
+        uint16_t tmp = cpu->wregs[reg] + 1;                                    \
+        SyncCF();                                                              \
+        SetFlags(FLAGS_INC16, 0, 0, tmp);                                      \
+        cpu->wregs[reg] = tmp;                                                 \
         break;                                                                 \
     }
 
 #define DEC_WR(reg)                                                            \
     {                                                                          \
-        uint16_t tmp = wregs[reg] - 1;                                         \
-        OF = tmp == 0x7FFF;                                                    \
-        AF = (tmp ^ (tmp + 1)) & 0x10;                                         \
-        SetZFW(tmp);                                                           \
-        SetSFW(tmp);                                                           \
-        SetPF(tmp);                                                            \
-        wregs[reg] = tmp;                                                      \
+        uint16_t tmp = cpu->wregs[reg] - 1;                                    \
+        SyncCF();                                                              \
+        SetFlags(FLAGS_DEC16, 0, 0, tmp);                                      \
+        cpu->wregs[reg] = tmp;                                                 \
         break;                                                                 \
     }
 
-static uint8_t FETCH_B(void)
+static inline uint8_t FETCH_B(void)
 {
-    uint8_t x = GetMemB(CS, ip);
-    ip++;
-    return x;
+    cpu->ip++;
+    if(cpu->fetch_ptr != cpu->fetch_end)
+        return *cpu->fetch_ptr++;
+    return GetCodeB(cpu->ip - 1);
 }
 
-static uint16_t FETCH_W(void)
+static inline uint16_t FETCH_W(void)
 {
-    uint16_t x = GetMemW(CS, ip);
-    ip += 2;
-    return x;
+    if(cpu->fetch_end - cpu->fetch_ptr >= 2)
+    {
+        uint16_t x = cpu->fetch_ptr[0] | (cpu->fetch_ptr[1] << 8);
+        cpu->fetch_ptr += 2;
+        cpu->ip += 2;
+        return x;
+    }
+    uint16_t x = FETCH_B();
+    return x | (FETCH_B() << 8);
 }
 
 #define GET_br8()                                                              \
@@ -249,16 +710,16 @@ static uint16_t FETCH_W(void)
 #define SET_r8b() SetModRMRegB(ModRM, dest)
 
 #define GET_ald8()                                                             \
-    uint8_t dest = wregs[AX] & 0xFF;                                           \
+    uint8_t dest = cpu->wregs[AX] & 0xFF;                                      \
     uint8_t src = FETCH_B()
 
-#define SET_ald8() wregs[AX] = (wregs[AX] & 0xFF00) | (dest & 0x00FF)
+#define SET_ald8() cpu->wregs[AX] = (cpu->wregs[AX] & 0xFF00) | (dest & 0x00FF)
 
 #define GET_axd16()                                                            \
     uint16_t src = FETCH_W();                                                  \
-    uint16_t dest = wregs[AX];
+    uint16_t dest = cpu->wregs[AX];
 
-#define SET_axd16() wregs[AX] = dest
+#define SET_axd16() cpu->wregs[AX] = dest
 
 #define GET_wr16()                                                             \
     int32_t ModRM = FETCH_B();                                                     \
@@ -274,95 +735,113 @@ static uint16_t FETCH_W(void)
 
 #define SET_r16w() SetModRMRegW(ModRM, dest)
 
-void cpu_init(void)
+void cpu_init(machine_t *m)
 {
+    cpu = m->cpu;
+
     /* initialize */
-    ud_init(&ud_obj);
-    ud_set_mode(&ud_obj, 16);
-    ud_set_syntax(&ud_obj, UD_SYN_INTEL);
+    ud_init(&cpu->ud_obj);
+    ud_set_mode(&cpu->ud_obj, 16);
+    ud_set_syntax(&cpu->ud_obj, UD_SYN_INTEL);
 
-    uint32_t i, j, c;
+    uint32_t i;
 
     for(i = 0; i < 4; i++) {
-        sregs[i] = 0;
+        cpu->sregs[i] = 0;
     }
 
     for (i = 0; i < 8; i++) {
-        wregs[i] = 0;
+        cpu->wregs[i] = 0;
     }
 
-    for(i = 0; i < 256; i++)
-    {
-        for(j = i, c = 0; j > 0; j >>= 1)
-            if(j & 1)
-                c++;
-        parity_table[i] = !(c & 1);
-    }
+    cpu->CF = cpu->PF = cpu->AF = cpu->ZF = cpu->SF = cpu->TF = cpu->IF = cpu->DF = cpu->OF = 0;
+    cpu->lazy_op = FLAGS_NONE;
 
-    CF = PF = AF = ZF = SF = TF = IF = DF = OF = 0;
+    cpu->segment_override = NoSeg;
+    cpu->irq_mask = 0;
 
-    segment_override = NoSeg;
+    dcache_flush();
 
-    sregs[CS] = 0xffff;
-    ip = 0x0;
+    cpu->cycles = 0;
+    cpu->retired = 0;
+    cpu->halted = false;
+
+    cpu->sregs[CS] = 0xffff;
+    cpu->ip = 0x0;
 }
 
 static uint8_t GetModRMRegB(uint32_t ModRM)
 {
     uint32_t reg = (ModRM >> 3) & 3;
     if(ModRM & 0x20)
-        return wregs[reg] >> 8;
+        return cpu->wregs[reg] >> 8;
     else
-        return wregs[reg] & 0xFF;
+        return cpu->wregs[reg] & 0xFF;
 }
 
 static void SetModRMRegB(uint32_t ModRM, uint8_t val)
 {
     uint32_t reg = (ModRM >> 3) & 3;
     if(ModRM & 0x20)
-        wregs[reg] = (wregs[reg] & 0x00FF) | (val << 8);
+        cpu->wregs[reg] = (cpu->wregs[reg] & 0x00FF) | (val << 8);
     else
-        wregs[reg] = (wregs[reg] & 0xFF00) | val;
+        cpu->wregs[reg] = (cpu->wregs[reg] & 0xFF00) | val;
 }
 
-#define GetModRMRegW(ModRM) (wregs[(ModRM & 0x38) >> 3])
-#define SetModRMRegW(ModRM, val) wregs[(ModRM & 0x38) >> 3] = val;
+#define GetModRMRegW(ModRM) (cpu->wregs[(ModRM & 0x38) >> 3])
+#define SetModRMRegW(ModRM, val) cpu->wregs[(ModRM & 0x38) >> 3] = val;
 
 // Used on LEA instruction
 static uint16_t GetModRMOffset(uint32_t ModRM)
 {
+    if(cpu->cur_decode && cpu->cur_decode->ea_valid)
+    {
+        cpu->ip += cpu->cur_decode->ea_disp_len;
+        cpu->fetch_ptr += cpu->cur_decode->ea_disp_len;
+        return cpu->wregs[cpu->cur_decode->ea_base] + cpu->wregs[cpu->cur_decode->ea_index] +
+               cpu->cur_decode->ea_disp;
+    }
+
     switch(ModRM & 0xC7)
     {
-    case 0x00: return wregs[BX] + wregs[SI];
-    case 0x01: return wregs[BX] + wregs[DI];
-    case 0x02: return wregs[BP] + wregs[SI];
-    case 0x03: return wregs[BP] + wregs[DI];
-    case 0x04: return wregs[SI];
-    case 0x05: return wregs[DI];
+    case 0x00: return cpu->wregs[BX] + cpu->wregs[SI];
+    case 0x01: return cpu->wregs[BX] + cpu->wregs[DI];
+    case 0x02: return cpu->wregs[BP] + cpu->wregs[SI];
+    case 0x03: return cpu->wregs[BP] + cpu->wregs[DI];
+    case 0x04: return cpu->wregs[SI];
+    case 0x05: return cpu->wregs[DI];
     case 0x06: return FETCH_W();
-    case 0x07: return wregs[BX];
-    case 0x40: return wregs[BX] + wregs[SI] + (int8_t)FETCH_B();
-    case 0x41: return wregs[BX] + wregs[DI] + (int8_t)FETCH_B();
-    case 0x42: return wregs[BP] + wregs[SI] + (int8_t)FETCH_B();
-    case 0x43: return wregs[BP] + wregs[DI] + (int8_t)FETCH_B();
-    case 0x44: return wregs[SI] + (int8_t)FETCH_B();
-    case 0x45: return wregs[DI] + (int8_t)FETCH_B();
-    case 0x46: return wregs[BP] + (int8_t)FETCH_B();
-    case 0x47: return wregs[BX] + (int8_t)FETCH_B();
-    case 0x80: return FETCH_W() + wregs[BX] + wregs[SI];
-    case 0x81: return FETCH_W() + wregs[BX] + wregs[DI];
-    case 0x82: return FETCH_W() + wregs[BP] + wregs[SI];
-    case 0x83: return FETCH_W() + wregs[BP] + wregs[DI];
-    case 0x84: return FETCH_W() + wregs[SI];
-    case 0x85: return FETCH_W() + wregs[DI];
-    case 0x86: return FETCH_W() + wregs[BP];
-    case 0x87: return FETCH_W() + wregs[BX];
+    case 0x07: return cpu->wregs[BX];
+    case 0x40: return cpu->wregs[BX] + cpu->wregs[SI] + (int8_t)FETCH_B();
+    case 0x41: return cpu->wregs[BX] + cpu->wregs[DI] + (int8_t)FETCH_B();
+    case 0x42: return cpu->wregs[BP] + cpu->wregs[SI] + (int8_t)FETCH_B();
+    case 0x43: return cpu->wregs[BP] + cpu->wregs[DI] + (int8_t)FETCH_B();
+    case 0x44: return cpu->wregs[SI] + (int8_t)FETCH_B();
+    case 0x45: return cpu->wregs[DI] + (int8_t)FETCH_B();
+    case 0x46: return cpu->wregs[BP] + (int8_t)FETCH_B();
+    case 0x47: return cpu->wregs[BX] + (int8_t)FETCH_B();
+    case 0x80: return FETCH_W() + cpu->wregs[BX] + cpu->wregs[SI];
+    case 0x81: return FETCH_W() + cpu->wregs[BX] + cpu->wregs[DI];
+    case 0x82: return FETCH_W() + cpu->wregs[BP] + cpu->wregs[SI];
+    case 0x83: return FETCH_W() + cpu->wregs[BP] + cpu->wregs[DI];
+    case 0x84: return FETCH_W() + cpu->wregs[SI];
+    case 0x85: return FETCH_W() + cpu->wregs[DI];
+    case 0x86: return FETCH_W() + cpu->wregs[BP];
+    case 0x87: return FETCH_W() + cpu->wregs[BX];
     default:   return 0; // TODO: illegal instruction
     }
 }
 
+// Effective address calculation clocks for each r/m field, one more when a
+// displacement is added.
+static const uint8_t ea_cycles[8] = { 3, 3, 3, 3, 2, 2, 2, 2 };
+
 static uint32_t GetModRMAddress(uint32_t ModRM)
 {
+    cpu->cycles += ea_cycles[ModRM & 7] + ((ModRM & 0xC0) != 0);
+    if(cpu->cur_decode && cpu->cur_decode->ea_valid)
+        return GetAbsAddrSeg(cpu->cur_decode->ea_seg, GetModRMOffset(ModRM));
+
     uint16_t disp = GetModRMOffset(ModRM);
     switch(ModRM & 0xC7)
     {
@@ -397,13 +876,12 @@ static uint32_t GetModRMAddress(uint32_t ModRM)
     }
 }
 
-static uint32_t ModRMAddress;
 static uint16_t GetModRMRMW(uint32_t ModRM)
 {
     if(ModRM >= 0xc0)
-        return wregs[ModRM & 7];
-    ModRMAddress = GetModRMAddress(ModRM);
-    return GetMemAbsW(ModRMAddress);
+        return cpu->wregs[ModRM & 7];
+    cpu->ModRMAddress = GetModRMAddress(ModRM);
+    return GetMemAbsW(cpu->ModRMAddress);
 }
 
 static uint8_t GetModRMRMB(uint32_t ModRM)
@@ -412,20 +890,20 @@ static uint8_t GetModRMRMB(uint32_t ModRM)
     {
         uint32_t reg = ModRM & 3;
         if(ModRM & 4)
-            return wregs[reg] >> 8;
+            return cpu->wregs[reg] >> 8;
         else
-            return wregs[reg] & 0xFF;
+            return cpu->wregs[reg] & 0xFF;
     }
-    ModRMAddress = GetModRMAddress(ModRM);
-    return GetMemAbsB(ModRMAddress);
+    cpu->ModRMAddress = GetModRMAddress(ModRM);
+    return GetMemAbsB(cpu->ModRMAddress);
 }
 
 static void SetModRMRMW(uint32_t ModRM, uint16_t val)
 {
     if(ModRM >= 0xc0)
-        wregs[ModRM & 7] = val;
+        cpu->wregs[ModRM & 7] = val;
     else
-        SetMemAbsW(ModRMAddress, val);
+        SetMemAbsW(cpu->ModRMAddress, val);
 }
 
 static void SetModRMRMB(uint32_t ModRM, uint8_t val)
@@ -434,48 +912,266 @@ static void SetModRMRMB(uint32_t ModRM, uint8_t val)
     {
         uint32_t reg = ModRM & 3;
         if(ModRM & 4)
-            wregs[reg] = (wregs[reg] & 0x00FF) | (val << 8);
+            cpu->wregs[reg] = (cpu->wregs[reg] & 0x00FF) | (val << 8);
         else
-            wregs[reg] = (wregs[reg] & 0xFF00) | val;
+            cpu->wregs[reg] = (cpu->wregs[reg] & 0xFF00) | val;
     }
     else
-        SetMemAbsB(ModRMAddress, val);
+        SetMemAbsB(cpu->ModRMAddress, val);
+}
+
+// Execution clocks of each opcode with register operands, from the uPD70108
+// instruction set tables minus the bus transfers which are counted as they
+// happen. Taken branches, multiply/divide, shift counts, repeated string
+// elements and interrupts add their extra clocks where they are executed.
+static const uint8_t op_cycles[256] = {
+    /*       0    1    2    3    4    5    6    7    8    9    A    B    C    D    E    F */
+    /* 0 */  2,   2,   2,   2,   4,   4,   4,   4,   2,   2,   2,   2,   4,   4,   4,   2,
+    /* 1 */  2,   2,   2,   2,   4,   4,   4,   4,   2,   2,   2,   2,   4,   4,   4,   4,
+    /* 2 */  2,   2,   2,   2,   4,   4,   2,   3,   2,   2,   2,   2,   4,   4,   2,   3,
+    /* 3 */  2,   2,   2,   2,   4,   4,   2,   3,   2,   2,   2,   2,   4,   4,   2,   3,
+    /* 4 */  2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,
+    /* 5 */  4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,
+    /* 6 */  3,  11,   7,   2,   2,   2,   2,   2,   3,  30,   3,  30,   5,   5,   5,   5,
+    /* 7 */  4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,
+    /* 8 */  4,   4,   4,   4,   2,   2,   3,   3,   2,   2,   2,   2,   2,   4,   2,   4,
+    /* 9 */  3,   3,   3,   3,   3,   3,   3,   3,   2,   4,  13,   2,   4,   4,   3,   2,
+    /* A */  6,   6,   6,   6,   3,   3,   5,   5,   4,   4,   3,   3,   3,   3,   3,   3,
+    /* B */  4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,
+    /* C */  7,   7,  12,  11,   7,   7,   4,   4,  12,   2,  10,  13,   2,   2,   2,  15,
+    /* D */  2,   2,   7,   7,  15,   7,   2,   5,   2,   2,   2,   2,   2,   2,   2,   2,
+    /* E */  5,   5,   5,   5,   5,   5,   4,   4,  12,  13,  15,  12,   4,   4,   4,   4,
+    /* F */  2,   2,   7,   7,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,
+};
+
+#ifdef CPU_FUSE
+// Look for one of the fused idioms starting with the instruction just
+// decoded into e:
+//
+//   CMP, TEST, INC r16 or DEC r16  Jcc
+//   IN AL,imm8    TEST AL,imm8     Jcc    polling a device
+//   MOV r/m8,r8   INC r16          LOOP   storing a block
+//
+// The bytes of the instructions fused to it are added to the entry. They
+// are only taken from memory that reads back the same.
+static void dcache_fuse(decode_t *e)
+{
+    uint32_t avail, prefixes = 0, num = 0, size = 0;
+    uint8_t op, modrm, next[4];
+
+    while(decode_table[e->bytes[prefixes]] & D_PREFIX)
+        if((e->bytes[prefixes++] & 0xE7) != 0x26)
+            return; // not a segment override
+    op = e->bytes[prefixes];
+    modrm = e->bytes[prefixes + 1];
+    for(avail = 0; avail < sizeof(next); avail++)
+    {
+        uint32_t off = cpu->ip + e->len + avail;
+        uint32_t addr = (cpu->sregs[CS] * 16 + off) & 0xFFFFF;
+        const mem_page_t *page = &cpu->machine->mem_map[addr >> MEM_PAGE_BITS];
+        if(off > 0xFFFF || e->len + avail >= DCACHE_MAX_LEN || !page->read)
+            break;
+        next[avail] = page->read[addr & MEM_PAGE_MASK];
+    }
+
+    switch(op)
+    {
+    case 0x80:
+    case 0x83:
+        if((modrm & 0x38) != 0x38)
+            break; // only CMP r/m,imm
+        /* fall through */
+    case 0x38: case 0x39: case 0x3A: case 0x3B: case 0x3C: case 0x3D:
+    case 0x84: case 0x85: case 0xA8: case 0xA9:
+    case 0x40: case 0x41: case 0x42: case 0x43:
+    case 0x44: case 0x45: case 0x46: case 0x47:
+    case 0x48: case 0x49: case 0x4A: case 0x4B:
+    case 0x4C: case 0x4D: case 0x4E: case 0x4F:
+        if(avail >= 2 && (next[0] & 0xF0) == 0x70)
+            num = 1, size = 2;
+        break;
+    case 0xE4:
+        if(avail >= 4 && next[0] == 0xA8 && (next[2] & 0xF0) == 0x70)
+            num = 2, size = 4;
+        break;
+    case 0x88:
+        if(modrm < 0xC0 && avail >= 3 && (next[0] & 0xF8) == 0x40 && next[1] == 0xE2)
+            num = 2, size = 3;
+        break;
+    }
+    memcpy(e->bytes + e->len, next, size);
+    e->span = e->len + size;
+    e->fuse = num;
 }
+#endif
 
-static void next_instruction(void)
+// Decode the instruction at CS:ip into its cache entry. Returns NULL when the
+// instruction can not be cached, it is then fetched straight from memory.
+static decode_t *dcache_fill(uint32_t addr)
 {
-    start_ip = ip;
-    do_instruction(FETCH_B());
+    decode_t *e = &cpu->dcache[addr & (DCACHE_SIZE - 1)];
+    uint32_t len = 0, disp_pos = 0, i;
+    uint8_t op, info;
+
+    e->addr = DCACHE_INVALID;
+
+    do
+    {
+        if(len >= DCACHE_MAX_LEN)
+            return NULL;
+        op = GetCodeB(cpu->ip + len++);
+        info = decode_table[op];
+    } while(info & D_PREFIX);
+
+    e->ea_valid = 0;
+    if(info & D_MODRM)
+    {
+        uint8_t modrm = GetCodeB(cpu->ip + len++);
+
+        if((info & D_GRP3) && (modrm & 0x30))
+            info &= ~(D_IMM8 | D_IMM16);
+
+        if(modrm < 0xc0)
+        {
+            const uint8_t *form = modrm_ea[modrm & 7];
+            e->ea_valid = 1;
+            e->ea_base = form[0];
+            e->ea_index = form[1];
+            e->ea_seg = form[2];
+            e->ea_disp_len = modrm >> 6;
+            if((modrm & 0xC7) == 0x06)
+            {
+                e->ea_base = NoReg;
+                e->ea_seg = DS;
+                e->ea_disp_len = 2;
+            }
+            disp_pos = len;
+            len += e->ea_disp_len;
+        }
+    }
+    len += (info & D_IMM8) ? 1 : 0;
+    len += (info & D_IMM16) ? 2 : 0;
+    len += (info & D_FAR) ? 4 : 0;
+
+    // Instructions wrapping around the end of the code segment are not
+    // linear in memory.
+    if(len > DCACHE_MAX_LEN || cpu->ip + len > 0x10000)
+        return NULL;
+
+    for(i = 0; i < len; i++)
+        e->bytes[i] = GetCodeB(cpu->ip + i);
+
+    if(e->ea_valid)
+    {
+        const uint8_t *disp = e->bytes + disp_pos;
+        if(e->ea_disp_len == 1)
+            e->ea_disp = (int8_t)disp[0];
+        else if(e->ea_disp_len == 2)
+            e->ea_disp = disp[0] | (disp[1] << 8);
+        else
+            e->ea_disp = 0;
+    }
+
+    e->len = len;
+    e->span = len;
+    e->fuse = 0;
+#ifdef CPU_FUSE
+    dcache_fuse(e);
+#endif
+    e->addr = addr;
+    cpu->dcache_lines[addr >> DCACHE_LINE] |= DCACHE_CODE;
+    cpu->dcache_lines[((addr + e->span - 1) & 0xFFFFF) >> DCACHE_LINE] |= DCACHE_CODE;
+    return e;
+}
+
+#ifdef CPU_PROFILE
+#include "cpu_profile.h"
+#endif
+
+// Look up the instruction at CS:ip and fetch its first byte.
+static uint8_t begin_instruction(void)
+{
+    uint32_t addr = (cpu->sregs[CS] * 16 + cpu->ip) & 0xFFFFF;
+    decode_t *e = &cpu->dcache[addr & (DCACHE_SIZE - 1)];
+
+    // The reference interpreter never fills the cache, it always misses.
+    if(e->addr != addr)
+        e = cpu->reference ? NULL : dcache_fill(addr);
+
+    cpu->cur_decode = e;
+    cpu->fetch_ptr = e ? e->bytes : NULL;
+    cpu->fetch_end = e ? e->bytes + e->len : NULL;
+
+    cpu->start_ip = cpu->ip;
+    cpu->retired++;
+    return FETCH_B();
+}
+
+// Record the instruction about to be executed, after begin_instruction().
+static void trace_instruction(void)
+{
+    uint32_t addr = (cpu->sregs[CS] * 16 + cpu->start_ip) & 0xFFFFF;
+    trace_state_t s;
+    uint8_t bytes[TRACE_MAX_LEN + 1] = { 0 };
+    uint32_t i;
+
+    memcpy(s.regs, cpu->wregs, sizeof(cpu->wregs));
+    memcpy(s.regs + 8, cpu->sregs, sizeof(cpu->sregs));
+    s.regs[12] = CompressFlags();
+    s.pc = cpu->start_ip;
+    if(cpu->cur_decode)
+    {
+        trace_insn(cpu->trace, &s, addr, cpu->cur_decode->bytes, cpu->cur_decode->len, true);
+        return;
+    }
+    // Not cached, pass what can be read without touching a device.
+    for(i = 0; i < TRACE_MAX_LEN; i++)
+    {
+        const mem_page_t *page = &cpu->machine->mem_map[((addr + i) & 0xFFFFF) >> MEM_PAGE_BITS];
+        bytes[i] = page->read ? page->read[(addr + i) & MEM_PAGE_MASK] : 0;
+    }
+    trace_insn(cpu->trace, &s, addr, bytes, TRACE_MAX_LEN, false);
+}
+
+static void end_instruction(void)
+{
+    cpu->cur_decode = NULL;
+    cpu->fetch_ptr = cpu->fetch_end = NULL;
 }
 
 static void interrupt(uint32_t int_num)
 {
     uint16_t dest_seg, dest_off;
 
+    cpu->cycles += 20;
+
     dest_off = GetMemAbsW(int_num * 4);
     dest_seg = GetMemAbsW(int_num * 4 + 2);
 
     PushWord(CompressFlags());
-    PushWord(sregs[CS]);
-    PushWord(ip);
+    PushWord(cpu->sregs[CS]);
+    PushWord(cpu->ip);
 
-    ip = dest_off;
-    sregs[CS] = dest_seg;
+    cpu->ip = dest_off;
+    cpu->sregs[CS] = dest_seg;
 
-    TF = IF = 0; /* Turn of trap and interrupts... */
+    cpu->TF = cpu->IF = 0; /* Turn of trap and interrupts... */
 
-    int_notify(int_num);
+    if(cpu->trace)
+        trace_int(cpu->trace, int_num);
+
+    int_notify(cpu->machine, int_num);
 }
 
 static void do_retf(void)
 {
-    ip = PopWord();
-    sregs[CS] = PopWord();
+    cpu->ip = PopWord();
+    cpu->sregs[CS] = PopWord();
 }
 
 static void trap_1(void)
 {
-    next_instruction();
+    cpu->core->next_instruction();
     interrupt(1);
 }
 
@@ -483,7 +1179,7 @@ static void do_popf(void)
 {
     uint16_t tmp = PopWord();
     ExpandFlags(tmp);
-    if(TF)
+    if(cpu->TF)
         trap_1(); // this is the only way the TRAP flag can be set
 }
 
@@ -496,168 +1192,103 @@ static void do_iret(void)
 // BOUND or DIV0
 static void cpu_trap(uint32_t num)
 {
-    ip = start_ip;
+    cpu->ip = cpu->start_ip;
     interrupt(num);
 }
 
-void cpu_interrupt(uint8_t irqn)
+void cpu_interrupt(machine_t *m, uint8_t irqn)
 {
-  irq_mask |= 1 << irqn;
+  cpu = m->cpu;
+  cpu->irq_mask |= 1 << irqn;
 }
 
 #define ADD_8()                                                                \
     uint32_t tmp = dest + src;                                                 \
-    OF = (tmp ^ src) & (tmp ^ dest) & 0x80;                                    \
-    AF = (tmp ^ src ^ dest) & 0x10 ? 1 : 0;                                    \
-    CF = tmp >> 8;                                                             \
-    dest = tmp;                                                                \
-    SetZFB(dest);                                                              \
-    SetSFB(dest);                                                              \
-    SetPF(dest)
+    SetFlags(FLAGS_ADD8, dest, src, tmp);                                      \
+    dest = tmp
 
 #define ADD_16()                                                               \
     uint32_t tmp = dest + src;                                                 \
-    OF = (tmp ^ src) & (tmp ^ dest) & 0x8000;                                  \
-    AF = (tmp ^ src ^ dest) & 0x10 ? 1 : 0;                                    \
-    CF = tmp >> 16;                                                            \
-    dest = tmp;                                                                \
-    SetZFW(dest);                                                              \
-    SetSFW(dest);                                                              \
-    SetPF(dest)
+    SetFlags(FLAGS_ADD16, dest, src, tmp);                                     \
+    dest = tmp
 
 #define ADC_8()                                                                \
-    uint32_t tmp = dest + src + CF;                                            \
-    OF = (tmp ^ src) & (tmp ^ dest) & 0x80;                                    \
-    AF = (tmp ^ src ^ dest) & 0x10 ? 1 : 0;                                    \
-    CF = tmp >> 8;                                                             \
-    dest = tmp;                                                                \
-    SetZFB(dest);                                                              \
-    SetSFB(dest);                                                              \
-    SetPF(dest);
+    uint32_t tmp;                                                              \
+    SyncCF();                                                                  \
+    tmp = dest + src + cpu->CF;                                                \
+    SetFlags(FLAGS_ADD8, dest, src, tmp);                                      \
+    dest = tmp;
 
 #define ADC_16()                                                               \
-    uint32_t tmp = dest + src + CF;                                            \
-    OF = (tmp ^ src) & (tmp ^ dest) & 0x8000;                                  \
-    AF = (tmp ^ src ^ dest) & 0x10 ? 1 : 0;                                    \
-    CF = tmp >> 16;                                                            \
-    dest = tmp;                                                                \
-    SetZFW(dest);                                                              \
-    SetSFW(dest);                                                              \
-    SetPF(dest);
+    uint32_t tmp;                                                              \
+    SyncCF();                                                                  \
+    tmp = dest + src + cpu->CF;                                                \
+    SetFlags(FLAGS_ADD16, dest, src, tmp);                                     \
+    dest = tmp;
 
 #define SBB_8()                                                                \
-    uint32_t tmp = dest - src - CF;                                            \
-    CF = (tmp & 0x100) == 0x100;                                               \
-    OF = (dest ^ src) & (dest ^ tmp) & 0x80;                                   \
-    AF = (tmp ^ src ^ dest) & 0x10 ? 1 : 0;                                    \
-    dest = tmp;                                                                \
-    SetZFB(dest);                                                              \
-    SetSFB(dest);                                                              \
-    SetPF(dest);
+    uint32_t tmp;                                                              \
+    SyncCF();                                                                  \
+    tmp = dest - src - cpu->CF;                                                \
+    SetFlags(FLAGS_SUB8, dest, src, tmp);                                      \
+    dest = tmp;
 
 #define SBB_16()                                                               \
-    uint32_t tmp = dest - src - CF;                                            \
-    CF = (tmp & 0x10000) == 0x10000;                                           \
-    OF = (dest ^ src) & (dest ^ tmp) & 0x8000;                                 \
-    AF = (tmp ^ src ^ dest) & 0x10 ? 1 : 0;                                    \
-    dest = tmp;                                                                \
-    SetZFW(dest);                                                              \
-    SetSFW(dest);                                                              \
-    SetPF(dest);
+    uint32_t tmp;                                                              \
+    SyncCF();                                                                  \
+    tmp = dest - src - cpu->CF;                                                \
+    SetFlags(FLAGS_SUB16, dest, src, tmp);                                     \
+    dest = tmp;
 
 #define SUB_8()                                                                \
     uint32_t tmp = dest - src;                                                 \
-    CF = (tmp & 0x100) == 0x100;                                               \
-    OF = (dest ^ src) & (dest ^ tmp) & 0x80;                                   \
-    AF = (tmp ^ src ^ dest) & 0x10 ? 1 : 0;                                    \
-    dest = tmp;                                                                \
-    SetZFB(dest);                                                              \
-    SetSFB(dest);                                                              \
-    SetPF(dest)
+    SetFlags(FLAGS_SUB8, dest, src, tmp);                                      \
+    dest = tmp
 
 #define SUB_16()                                                               \
     uint32_t tmp = dest - src;                                                 \
-    CF = (tmp & 0x10000) == 0x10000;                                           \
-    OF = (dest ^ src) & (dest ^ tmp) & 0x8000;                                 \
-    AF = (tmp ^ src ^ dest) & 0x10 ? 1 : 0;                                    \
-    dest = tmp;                                                                \
-    SetZFW(dest);                                                              \
-    SetSFW(dest);                                                              \
-    SetPF(dest);
+    SetFlags(FLAGS_SUB16, dest, src, tmp);                                     \
+    dest = tmp;
 
 #define CMP_8()                                                                \
     uint16_t tmp = dest - src;                                                 \
-    CF = (tmp & 0x100) == 0x100;                                               \
-    OF = (dest ^ src) & (dest ^ tmp) & 0x80;                                   \
-    AF = (tmp ^ src ^ dest) & 0x10 ? 1 : 0;                                    \
-    SetZFB(tmp);                                                               \
-    SetSFB(tmp);                                                               \
-    SetPF(tmp);
+    SetFlags(FLAGS_SUB8, dest, src, tmp);
 
 #define CMP_16()                                                               \
     uint32_t tmp = dest - src;                                                 \
-    CF = (tmp & 0x10000) == 0x10000;                                           \
-    OF = (dest ^ src) & (dest ^ tmp) & 0x8000;                                 \
-    AF = (tmp ^ src ^ dest) & 0x10 ? 1 : 0;                                    \
-    SetZFW(tmp);                                                               \
-    SetSFW(tmp);                                                               \
-    SetPF(tmp);
+    SetFlags(FLAGS_SUB16, dest, src, tmp);
 
 #define OR_8()                                                                 \
     dest |= src;                                                               \
-    CF = OF = AF = 0;                                                          \
-    SetZFB(dest);                                                              \
-    SetSFB(dest);                                                              \
-    SetPF(dest);
+    SetFlags(FLAGS_LOG8, 0, 0, dest);
 
 #define OR_16()                                                                \
     dest |= src;                                                               \
-    CF = OF = AF = 0;                                                          \
-    SetZFW(dest);                                                              \
-    SetSFW(dest);                                                              \
-    SetPF(dest);
+    SetFlags(FLAGS_LOG16, 0, 0, dest);
 
 #define AND_8()                                                                \
     dest &= src;                                                               \
-    CF = OF = AF = 0;                                                          \
-    SetZFB(dest);                                                              \
-    SetSFB(dest);                                                              \
-    SetPF(dest);
+    SetFlags(FLAGS_LOG8, 0, 0, dest);
 
 #define AND_16()                                                               \
     dest &= src;                                                               \
-    CF = OF = AF = 0;                                                          \
-    SetZFW(dest);                                                              \
-    SetSFW(dest);                                                              \
-    SetPF(dest);
+    SetFlags(FLAGS_LOG16, 0, 0, dest);
 
 #define XOR_8()                                                                \
     dest ^= src;                                                               \
-    CF = OF = AF = 0;                                                          \
-    SetZFB(dest);                                                              \
-    SetSFB(dest);                                                              \
-    SetPF(dest);
+    SetFlags(FLAGS_LOG8, 0, 0, dest);
 
 #define XOR_16()                                                               \
     dest ^= src;                                                               \
-    CF = OF = AF = 0;                                                          \
-    SetZFW(dest);                                                              \
-    SetSFW(dest);                                                              \
-    SetPF(dest);
+    SetFlags(FLAGS_LOG16, 0, 0, dest);
 
 #define TEST_8()                                                               \
     src &= dest;                                                               \
-    CF = OF = AF = 0;                                                          \
-    SetZFB(src);                                                               \
-    SetSFB(src);                                                               \
-    SetPF(src);
+    SetFlags(FLAGS_LOG8, 0, 0, src);
 
 #define TEST_16()                                                              \
     src &= dest;                                                               \
-    CF = OF = AF = 0;                                                          \
-    SetZFW(src);                                                               \
-    SetSFW(src);                                                               \
-    SetPF(src);
+    SetFlags(FLAGS_LOG16, 0, 0, src);
 
 #define XCHG_8()                                                               \
     uint8_t tmp = dest;                                                        \
@@ -722,20 +1353,20 @@ void cpu_interrupt(uint8_t irqn)
     break;
 
 #define MOV_BRH(reg)                                                           \
-    wregs[reg] = ((0x00FF & wregs[reg]) | (FETCH_B() << 8));                   \
+    cpu->wregs[reg] = ((0x00FF & cpu->wregs[reg]) | (FETCH_B() << 8));         \
     break;
 #define MOV_BRL(reg)                                                           \
-    wregs[reg] = ((0xFF00 & wregs[reg]) | FETCH_B());                          \
+    cpu->wregs[reg] = ((0xFF00 & cpu->wregs[reg]) | FETCH_B());                \
     break;
 #define MOV_WRi(reg)                                                           \
-    wregs[reg] = FETCH_W();                                                    \
+    cpu->wregs[reg] = FETCH_W();                                               \
     break;
 
 #define SEG_OVERRIDE(seg)                                                      \
     {                                                                          \
-        segment_override = seg;                                                \
+        cpu->segment_override = seg;                                           \
         do_instruction(FETCH_B());                                             \
-        segment_override = NoSeg;                                              \
+        cpu->segment_override = NoSeg;                                         \
     }                                                                          \
     break;
 
@@ -747,50 +1378,52 @@ static void i_undefined(void)
 
 static void i_das(void)
 {
-    uint8_t old_al = wregs[AX] & 0xFF;
-    uint8_t old_CF = CF;
+    SyncFlags();
+    uint8_t old_al = cpu->wregs[AX] & 0xFF;
+    uint8_t old_CF = cpu->CF;
     uint32_t al = old_al;
-    CF = 0;
-    if(AF || (old_al & 0x0F) > 9)
+    cpu->CF = 0;
+    if(cpu->AF || (old_al & 0x0F) > 9)
     {
         al = al - 6;
-        CF = old_CF || al > 0xFF;
+        cpu->CF = old_CF || al > 0xFF;
         al = al & 0xFF;
-        AF = 1;
+        cpu->AF = 1;
     }
     else
-        AF = 0;
+        cpu->AF = 0;
     if(old_CF || old_al > 0x99)
     {
         al = (al - 0x60) & 0xFF;
-        CF = 1;
+        cpu->CF = 1;
     }
     SetZFB(al);
     SetPF(al);
     SetSFB(al);
-    wregs[AX] = (wregs[AX] & 0xFF00) | al;
+    cpu->wregs[AX] = (cpu->wregs[AX] & 0xFF00) | al;
 }
 
 static void i_daa(void)
 {
-    uint8_t al = wregs[AX] & 0xFF;
-    if(AF || ((al & 0xf) > 9))
+    SyncFlags();
+    uint8_t al = cpu->wregs[AX] & 0xFF;
+    if(cpu->AF || ((al & 0xf) > 9))
     {
         al += 6;
-        AF = 1;
+        cpu->AF = 1;
     }
     else
-        AF = 0;
+        cpu->AF = 0;
 
-    if(CF || (al > 0x9f))
+    if(cpu->CF || (al > 0x9f))
     {
         al += 0x60;
-        CF = 1;
+        cpu->CF = 1;
     }
     else
-        CF = 0;
+        cpu->CF = 0;
 
-    wregs[AX] = (wregs[AX] & 0xFF00) | al;
+    cpu->wregs[AX] = (cpu->wregs[AX] & 0xFF00) | al;
     SetPF(al);
     SetSFB(al);
     SetZFB(al);
@@ -798,54 +1431,57 @@ static void i_daa(void)
 
 static void i_aaa(void)
 {
-    uint16_t ax = wregs[AX];
-    if(AF || (ax & 0xF) > 9)
+    SyncFlags();
+    uint16_t ax = cpu->wregs[AX];
+    if(cpu->AF || (ax & 0xF) > 9)
     {
         ax = ((ax + 0x100) & 0xFF00) | ((ax + 6) & 0x0F);
-        AF = 1;
-        CF = 1;
+        cpu->AF = 1;
+        cpu->CF = 1;
     }
     else
     {
-        AF = 0;
-        CF = 0;
+        cpu->AF = 0;
+        cpu->CF = 0;
         ax = ax & 0xFF0F;
     }
     SetZFB(ax);
     SetPF(ax);
     SetSFB(ax);
-    wregs[AX] = ax;
+    cpu->wregs[AX] = ax;
 }
 
 static void i_aas(void)
 {
-    uint16_t ax = wregs[AX];
-    if(AF || (ax & 0xF) > 9)
+    SyncFlags();
+    uint16_t ax = cpu->wregs[AX];
+    if(cpu->AF || (ax & 0xF) > 9)
     {
         ax = (ax - 0x106) & 0xFF0F;
-        AF = 1;
-        CF = 1;
+        cpu->AF = 1;
+        cpu->CF = 1;
     }
     else
     {
-        AF = 0;
-        CF = 0;
+        cpu->AF = 0;
+        cpu->CF = 0;
         ax = ax & 0xFF0F;
     }
     SetZFB(ax);
     SetPF(ax);
     SetSFB(ax);
-    wregs[AX] = ax;
+    cpu->wregs[AX] = ax;
 }
 
 #define IMUL_2                                                                 \
     uint32_t result = (int16_t)src * (int16_t)mult;                            \
+    SyncFlags();                                                               \
     dest = result & 0xFFFF;                                                    \
     SetSFW(dest);                                                              \
     SetZFW(dest);                                                              \
     SetPF(dest);                                                               \
     result &= 0xFFFF8000;                                                      \
-    CF = OF = ((result != 0) && (result != 0xFFFF8000))
+    cpu->CF = cpu->OF = ((result != 0) && (result != 0xFFFF8000))
 
 static void i_imul_r16w_d16(void)
 {
@@ -863,11 +1499,38 @@ static void i_imul_r16w_d8(void)
     SET_r16w();
 }
 
+// Condition of the conditional jump op, 70h to 7Fh.
+static inline uint32_t jcc_cond(uint8_t op)
+{
+    switch(op & 0x0F)
+    {
+    case 0x0: return GetOF();
+    case 0x1: return !GetOF();
+    case 0x2: return GetCF();
+    case 0x3: return !GetCF();
+    case 0x4: return GetZF();
+    case 0x5: return !GetZF();
+    case 0x6: return GetCF() || GetZF();
+    case 0x7: return !GetCF() && !GetZF();
+    case 0x8: return GetSF();
+    case 0x9: return !GetSF();
+    case 0xA: return GetPF();
+    case 0xB: return !GetPF();
+    case 0xC: return (!GetSF() != !GetOF()) && !GetZF();
+    case 0xD: return (!GetSF() == !GetOF()) || GetZF();
+    case 0xE: return (!GetSF() != !GetOF()) || GetZF();
+    default:  return (!GetSF() == !GetOF()) && !GetZF();
+    }
+}
+
 static void do_cjump(uint32_t cond)
 {
     int8_t disp = FETCH_B();
     if(cond)
-        ip = ip + disp;
+    {
+        cpu->ip = cpu->ip + disp;
+        cpu->cycles += 10;
+    }
 }
 
 static void i_80pre(void)
@@ -1124,13 +1787,13 @@ static void i_mov_wsreg(void)
 {
     int32_t ModRM = FETCH_B();
     GetModRMRMW(ModRM);
-    SetModRMRMW(ModRM, sregs[(ModRM & 0x18) >> 3]);
+    SetModRMRMW(ModRM, cpu->sregs[(ModRM & 0x18) >> 3]);
 }
 
 static void i_mov_sregw(void)
 {
     int32_t ModRM = FETCH_B();
-    sregs[(ModRM & 0x18) >> 3] = GetModRMRMW(ModRM);
+    cpu->sregs[(ModRM & 0x18) >> 3] = GetModRMRMW(ModRM);
 }
 
 static void i_lea(void)
@@ -1150,7 +1813,7 @@ static void i_popw(void)
     //    if( GetModRMRegW(ModRM) != 0 )
     //        return; // TODO: illegal instruction - ignored in 8086
     if(ModRM < 0xc0)
-        ModRMAddress = GetModRMAddress(ModRM);
+        cpu->ModRMAddress = GetModRMAddress(ModRM);
     SetModRMRMW(ModRM, PopWord());
 }
 
@@ -1159,168 +1822,168 @@ static void i_call_far(void)
     uint16_t tgt_ip = FETCH_W();
     uint16_t tgt_cs = FETCH_W();
 
-    PushWord(sregs[CS]);
-    PushWord(ip);
+    PushWord(cpu->sregs[CS]);
+    PushWord(cpu->ip);
 
-    ip = tgt_ip;
-    sregs[CS] = tgt_cs;
+    cpu->ip = tgt_ip;
+    cpu->sregs[CS] = tgt_cs;
 }
 
 static void i_sahf(void)
 {
-    uint16_t tmp = (CompressFlags() & 0xff00) | ((wregs[AX] >> 8) & 0xD5);
+    uint16_t tmp = (CompressFlags() & 0xff00) | ((cpu->wregs[AX] >> 8) & 0xD5);
     ExpandFlags(tmp);
 }
 
 static void i_lahf(void)
 {
-    wregs[AX] = (wregs[AX] & 0xFF) | (CompressFlags() << 8);
+    cpu->wregs[AX] = (cpu->wregs[AX] & 0xFF) | (CompressFlags() << 8);
 }
 
 static void i_mov_aldisp(void)
 {
     uint16_t addr = FETCH_W();
-    wregs[AX] = (wregs[AX] & 0xFF00) | GetMemDSB(addr);
+    cpu->wregs[AX] = (cpu->wregs[AX] & 0xFF00) | GetMemDSB(addr);
 }
 
 static void i_mov_axdisp(void)
 {
     uint16_t addr = FETCH_W();
-    wregs[AX] = GetMemDSW(addr);
+    cpu->wregs[AX] = GetMemDSW(addr);
 }
 
 static void i_mov_dispal(void)
 {
     uint16_t addr = FETCH_W();
-    PutMemDSB(addr, wregs[AX] & 0xFF);
+    PutMemDSB(addr, cpu->wregs[AX] & 0xFF);
 }
 
 static void i_mov_dispax(void)
 {
     uint16_t addr = FETCH_W();
-    PutMemDSW(addr, wregs[AX]);
+    PutMemDSW(addr, cpu->wregs[AX]);
 }
 
 static void i_movsb(void)
 {
-    SetMemB(ES, wregs[DI], GetMemDSB(wregs[SI]));
+    SetMemB(ES, cpu->wregs[DI], GetMemDSB(cpu->wregs[SI]));
 
-    wregs[SI] += 1 - 2 * DF;
-    wregs[DI] += 1 - 2 * DF;
+    cpu->wregs[SI] += 1 - 2 * cpu->DF;
+    cpu->wregs[DI] += 1 - 2 * cpu->DF;
 }
 
 static void i_movsw(void)
 {
-    SetMemW(ES, wregs[DI], GetMemDSW(wregs[SI]));
+    SetMemW(ES, cpu->wregs[DI], GetMemDSW(cpu->wregs[SI]));
 
-    wregs[SI] += 2 - 4 * DF;
-    wregs[DI] += 2 - 4 * DF;
+    cpu->wregs[SI] += 2 - 4 * cpu->DF;
+    cpu->wregs[DI] += 2 - 4 * cpu->DF;
 }
 
 static void i_cmpsb(void)
 {
-    uint32_t src = GetMemB(ES, wregs[DI]);
-    uint32_t dest = GetMemDSB(wregs[SI]);
+    uint32_t src = GetMemB(ES, cpu->wregs[DI]);
+    uint32_t dest = GetMemDSB(cpu->wregs[SI]);
     CMP_8();
-    wregs[DI] += 1 - 2 * DF;
-    wregs[SI] += 1 - 2 * DF;
+    cpu->wregs[DI] += 1 - 2 * cpu->DF;
+    cpu->wregs[SI] += 1 - 2 * cpu->DF;
 }
 
 static void i_cmpsw(void)
 {
-    uint32_t src = GetMemW(ES, wregs[DI]);
-    uint32_t dest = GetMemDSW(wregs[SI]);
+    uint32_t src = GetMemW(ES, cpu->wregs[DI]);
+    uint32_t dest = GetMemDSW(cpu->wregs[SI]);
     CMP_16();
-    wregs[DI] += -4 * DF + 2;
-    wregs[SI] += -4 * DF + 2;
+    cpu->wregs[DI] += -4 * cpu->DF + 2;
+    cpu->wregs[SI] += -4 * cpu->DF + 2;
 }
 
 static void i_stosb(void)
 {
-    SetMemB(ES, wregs[DI], wregs[AX] & 0xff);
-    wregs[DI] += 1 - 2 * DF;
+    SetMemB(ES, cpu->wregs[DI], cpu->wregs[AX] & 0xff);
+    cpu->wregs[DI] += 1 - 2 * cpu->DF;
 }
 
 static void i_stosw(void)
 {
-    SetMemW(ES, wregs[DI], wregs[AX]);
-    wregs[DI] += 2 - 4 * DF;
+    SetMemW(ES, cpu->wregs[DI], cpu->wregs[AX]);
+    cpu->wregs[DI] += 2 - 4 * cpu->DF;
 }
 
 static void i_lodsb(void)
 {
-    wregs[AX] = (wregs[AX] & 0xFF00) | GetMemDSB(wregs[SI]);
-    wregs[SI] += 1 - 2 * DF;
+    cpu->wregs[AX] = (cpu->wregs[AX] & 0xFF00) | GetMemDSB(cpu->wregs[SI]);
+    cpu->wregs[SI] += 1 - 2 * cpu->DF;
 }
 
 static void i_lodsw(void)
 {
-    wregs[AX] = GetMemDSW(wregs[SI]);
-    wregs[SI] += 2 - 4 * DF;
+    cpu->wregs[AX] = GetMemDSW(cpu->wregs[SI]);
+    cpu->wregs[SI] += 2 - 4 * cpu->DF;
 }
 
 static void i_scasb(void)
 {
-    uint32_t src = GetMemB(ES, wregs[DI]);
-    uint32_t dest = wregs[AX] & 0xFF;
+    uint32_t src = GetMemB(ES, cpu->wregs[DI]);
+    uint32_t dest = cpu->wregs[AX] & 0xFF;
     CMP_8();
-    wregs[DI] += 1 - 2 * DF;
+    cpu->wregs[DI] += 1 - 2 * cpu->DF;
 }
 
 static void i_scasw(void)
 {
-    uint32_t src = GetMemW(ES, wregs[DI]);
-    uint32_t dest = wregs[AX];
+    uint32_t src = GetMemW(ES, cpu->wregs[DI]);
+    uint32_t dest = cpu->wregs[AX];
     CMP_16();
-    wregs[DI] += 2 - 4 * DF;
+    cpu->wregs[DI] += 2 - 4 * cpu->DF;
 }
 
 static void i_insb(void)
 {
-    SetMemB(ES, wregs[DI], port_read(wregs[DX]));
-    wregs[DI] += 1 - 2 * DF;
+    SetMemB(ES, cpu->wregs[DI], PortRead(cpu->wregs[DX]));
+    cpu->wregs[DI] += 1 - 2 * cpu->DF;
 }
 
 static void i_insw(void)
 {
-    uint16_t val = port_read(wregs[DX]);
-    val |= port_read(wregs[DX] + 1) << 8;
-    SetMemW(ES, wregs[DI], val);
-    wregs[DI] += 2 - 4 * DF;
+    uint16_t val = PortRead(cpu->wregs[DX]);
+    val |= PortRead(cpu->wregs[DX] + 1) << 8;
+    SetMemW(ES, cpu->wregs[DI], val);
+    cpu->wregs[DI] += 2 - 4 * cpu->DF;
 }
 
 static void i_outsb(void)
 {
-    uint8_t val = (wregs[AX] & 0xFF00) | GetMemDSB(wregs[SI]);
-    port_write(wregs[DX], val);
-    wregs[SI] += 1 - 2 * DF;
+    uint8_t val = (cpu->wregs[AX] & 0xFF00) | GetMemDSB(cpu->wregs[SI]);
+    PortWrite(cpu->wregs[DX], val);
+    cpu->wregs[SI] += 1 - 2 * cpu->DF;
 }
 
 static void i_outsw(void)
 {
-    uint16_t val = GetMemDSW(wregs[SI]);
-    port_write(wregs[DX], val & 0xFF);
-    port_write(wregs[DX] + 1, val >> 8);
-    wregs[SI] += 2 - 4 * DF;
+    uint16_t val = GetMemDSW(cpu->wregs[SI]);
+    PortWrite(cpu->wregs[DX], val & 0xFF);
+    PortWrite(cpu->wregs[DX] + 1, val >> 8);
+    cpu->wregs[SI] += 2 - 4 * cpu->DF;
 }
 
 static void i_ret_d16(void)
 {
     uint16_t count = FETCH_W();
-    ip = PopWord();
-    wregs[SP] += count;
+    cpu->ip = PopWord();
+    cpu->wregs[SP] += count;
 }
 
 static void i_ret(void)
 {
-    ip = PopWord();
+    cpu->ip = PopWord();
 }
 
 static void i_les_dw(void)
 {
     GET_r16w();
     dest = src;
-    sregs[ES] = GetMemAbsW(ModRMAddress + 2);
+    cpu->sregs[ES] = GetMemAbsW(cpu->ModRMAddress + 2);
     SET_r16w();
 }
 
@@ -1328,7 +1991,7 @@ static void i_lds_dw(void)
 {
     GET_r16w();
     dest = src;
-    sregs[DS] = GetMemAbsW(ModRMAddress + 2);
+    cpu->sregs[DS] = GetMemAbsW(cpu->ModRMAddress + 2);
     SET_r16w();
 }
 
@@ -1336,7 +1999,7 @@ static void i_mov_bd8(void)
 {
     int32_t ModRM = FETCH_B();
     if(ModRM < 0xc0)
-        ModRMAddress = GetModRMAddress(ModRM);
+        cpu->ModRMAddress = GetModRMAddress(ModRM);
     uint8_t dest = FETCH_B();
     SET_br8();
 }
@@ -1345,7 +2008,7 @@ static void i_mov_wd16(void)
 {
     int32_t ModRM = FETCH_B();
     if(ModRM < 0xc0)
-        ModRMAddress = GetModRMAddress(ModRM);
+        cpu->ModRMAddress = GetModRMAddress(ModRM);
     uint16_t dest = FETCH_W();
     SET_wr16();
 }
@@ -1354,7 +2017,7 @@ static void i_retf_d16(void)
 {
     uint16_t count = FETCH_W();
     do_retf();
-    wregs[SP] += count;
+    cpu->wregs[SP] += count;
 }
 
 static void i_int3(void)
@@ -1369,61 +2032,63 @@ static void i_int(void)
 
 static void i_into(void)
 {
-    if(OF)
+    SyncFlags();
+    if(cpu->OF)
         interrupt(4);
 }
 
 static uint8_t shift1_b(uint8_t val, int32_t ModRM)
 {
-    AF = 0;
+    SyncFlags();
+    cpu->AF = 0;
     switch(ModRM & 0x38)
     {
     case 0x00: /* ROL eb,1 */
-        CF = (val & 0x80) != 0;
-        val = (val << 1) + CF;
-        OF = !(val & 0x80) != !CF;
+        cpu->CF = (val & 0x80) != 0;
+        val = (val << 1) + cpu->CF;
+        cpu->OF = !(val & 0x80) != !cpu->CF;
         break;
     case 0x08: /* ROR eb,1 */
-        CF = (val & 0x01) != 0;
-        val = (val >> 1) + (CF << 7);
-        OF = !(val & 0x40) != !(val & 0x80);
+        cpu->CF = (val & 0x01) != 0;
+        val = (val >> 1) + (cpu->CF << 7);
+        cpu->OF = !(val & 0x40) != !(val & 0x80);
         break;
     case 0x10: /* RCL eb,1 */
     {
-        uint8_t oldCF = CF;
-        CF = (val & 0x80) != 0;
+        uint8_t oldCF = cpu->CF;
+        cpu->CF = (val & 0x80) != 0;
         val = (val << 1) | oldCF;
-        OF = !(val & 0x80) != !CF;
+        cpu->OF = !(val & 0x80) != !cpu->CF;
         break;
     }
     case 0x18: /* RCR eb,1 */
     {
-        uint8_t oldCF = CF;
-        CF = val & 1;
+        uint8_t oldCF = cpu->CF;
+        cpu->CF = val & 1;
         val = (val >> 1) | (oldCF << 7);
-        OF = !(val & 0x40) != !(val & 0x80);
+        cpu->OF = !(val & 0x40) != !(val & 0x80);
         break;
     }
     case 0x20: /* SHL eb,1 */
     case 0x30:
-        CF = (val & 0x80) != 0;
+        cpu->CF = (val & 0x80) != 0;
         val = val << 1;
-        OF = !(val & 0x80) != !CF;
+        cpu->OF = !(val & 0x80) != !cpu->CF;
         SetZFB(val);
         SetSFB(val);
         SetPF(val);
         break;
     case 0x28: /* SHR eb,1 */
-        CF = (val & 0x01) != 0;
-        OF = (val & 0x80) != 0;
+        cpu->CF = (val & 0x01) != 0;
+        cpu->OF = (val & 0x80) != 0;
         val = val >> 1;
         SetSFB(val);
         SetZFB(val);
         SetPF(val);
         break;
     case 0x38: /* SAR eb,1 */
-        CF = (val & 0x01) != 0;
-        OF = 0;
+        cpu->CF = (val & 0x01) != 0;
+        cpu->OF = 0;
         val = (val >> 1) | (val & 0x80);
         SetSFB(val);
         SetZFB(val);
@@ -1435,68 +2100,65 @@ static uint8_t shift1_b(uint8_t val, int32_t ModRM)
 
 static uint8_t shifts_b(uint8_t val, int32_t ModRM, uint32_t count)
 {
-
-#ifdef CPU_SHIFT_80186
-    count &= 0x1F;
-#endif
-
+    cpu->cycles += count;
     if(!count)
         return val; // No flags affected.
 
     if(count == 1)
         return shift1_b(val, ModRM);
 
-    AF = 0;
-    OF = 0;
+    SyncFlags();
+    cpu->AF = 0;
+    cpu->OF = 0;
     switch(ModRM & 0x38)
     {
     case 0x00: /* ROL eb,CL */
         for(; count > 0; count--)
         {
-            CF = (val & 0x80) != 0;
-            val = (val << 1) | CF;
+            cpu->CF = (val & 0x80) != 0;
+            val = (val << 1) | cpu->CF;
         }
-        OF = !(val & 0x80) != !CF;
+        cpu->OF = !(val & 0x80) != !cpu->CF;
         break;
     case 0x08: /* ROR eb,CL */
         for(; count > 0; count--)
         {
-            CF = (val & 0x01) != 0;
-            val = (val >> 1) | (CF << 7);
+            cpu->CF = (val & 0x01) != 0;
+            val = (val >> 1) | (cpu->CF << 7);
         }
-        OF = !(val & 0x40) != !(val & 0x80);
+        cpu->OF = !(val & 0x40) != !(val & 0x80);
         break;
     case 0x10: /* RCL eb,CL */
         for(; count > 0; count--)
         {
-            uint8_t oldCF = CF;
-            CF = (val & 0x80) != 0;
+            uint8_t oldCF = cpu->CF;
+            cpu->CF = (val & 0x80) != 0;
             val = (val << 1) | oldCF;
         }
-        OF = !(val & 0x80) != !CF;
+        cpu->OF = !(val & 0x80) != !cpu->CF;
         break;
     case 0x18: /* RCR eb,CL */
         for(; count > 0; count--)
         {
-            uint8_t oldCF = CF;
-            CF = val & 1;
+            uint8_t oldCF = cpu->CF;
+            cpu->CF = val & 1;
             val = (val >> 1) | (oldCF << 7);
         }
-        OF = !(val & 0x40) != !(val & 0x80);
+        cpu->OF = !(val & 0x40) != !(val & 0x80);
         break;
     case 0x20:
     case 0x30: /* SHL eb,CL */
         if(count >= 9)
         {
-            CF = 0;
+            cpu->CF = 0;
             val = 0;
         }
         else
         {
-            CF = (val & (0x100 >> count)) != 0;
+            cpu->CF = (val & (0x100 >> count)) != 0;
             val <<= count;
         }
-        OF = !(val & 0x80) != !CF;
+        cpu->OF = !(val & 0x80) != !cpu->CF;
         SetZFB(val);
         SetSFB(val);
         SetPF(val);
@@ -1504,12 +2166,12 @@ static uint8_t shifts_b(uint8_t val, int32_t ModRM, uint32_t count)
     case 0x28: /* SHR eb,CL */
         if(count >= 9)
         {
-            CF = 0;
+            cpu->CF = 0;
             val = 0;
         }
         else
         {
-            CF = ((val >> (count - 1)) & 0x1) != 0;
+            cpu->CF = ((val >> (count - 1)) & 0x1) != 0;
             val >>= count;
         }
         SetSFB(val);
@@ -1517,7 +2179,7 @@ static uint8_t shifts_b(uint8_t val, int32_t ModRM, uint32_t count)
         SetZFB(val);
         break;
     case 0x38: /* SAR eb,CL */
-        CF = (((int8_t)val >> (count - 1)) & 0x01) != 0;
+        cpu->CF = (((int8_t)val >> (count - 1)) & 0x01) != 0;
         for(; count > 0; count--)
             val = (val >> 1) | (val & 0x80);
         SetSFB(val);
@@ -1530,55 +2192,56 @@ static uint8_t shifts_b(uint8_t val, int32_t ModRM, uint32_t count)
 
 static uint16_t shift1_w(uint16_t val, int32_t ModRM)
 {
-    AF = 0;
+    SyncFlags();
+    cpu->AF = 0;
     switch(ModRM & 0x38)
     {
     case 0x00: /* ROL ew,1 */
-        CF = (val & 0x8000) != 0;
-        val = (val << 1) + CF;
-        OF = !(val & 0x8000) != !CF;
+        cpu->CF = (val & 0x8000) != 0;
+        val = (val << 1) + cpu->CF;
+        cpu->OF = !(val & 0x8000) != !cpu->CF;
         break;
     case 0x08: /* ROR ew,1 */
-        CF = (val & 0x01) != 0;
-        val = (val >> 1) + (CF << 15);
-        OF = !(val & 0x4000) != !(val & 0x8000);
+        cpu->CF = (val & 0x01) != 0;
+        val = (val >> 1) + (cpu->CF << 15);
+        cpu->OF = !(val & 0x4000) != !(val & 0x8000);
         break;
     case 0x10: /* RCL ew,1 */
     {
-        uint8_t oldCF = CF;
-        CF = (val & 0x8000) != 0;
+        uint8_t oldCF = cpu->CF;
+        cpu->CF = (val & 0x8000) != 0;
         val = (val << 1) | oldCF;
-        OF = !(val & 0x8000) != !CF;
+        cpu->OF = !(val & 0x8000) != !cpu->CF;
     }
     break;
     case 0x18: /* RCR ew,1 */
     {
-        uint8_t oldCF = CF;
-        CF = val & 1;
+        uint8_t oldCF = cpu->CF;
+        cpu->CF = val & 1;
         val = (val >> 1) | (oldCF << 15);
-        OF = !(val & 0x4000) != !(val & 0x8000);
+        cpu->OF = !(val & 0x4000) != !(val & 0x8000);
     }
     break;
     case 0x20: /* SHL eb,1 */
     case 0x30:
-        CF = (val & 0x8000) != 0;
+        cpu->CF = (val & 0x8000) != 0;
         val = val << 1;
-        OF = !(val & 0x8000) != !CF;
+        cpu->OF = !(val & 0x8000) != !cpu->CF;
         SetZFW(val);
         SetSFW(val);
         SetPF(val);
         break;
     case 0x28: /* SHR eb,1 */
-        CF = (val & 0x01) != 0;
-        OF = (val & 0x8000) != 0;
+        cpu->CF = (val & 0x01) != 0;
+        cpu->OF = (val & 0x8000) != 0;
         val = val >> 1;
         SetSFW(val);
         SetZFW(val);
         SetPF(val);
         break;
     case 0x38: /* SAR eb,1 */
-        CF = (val & 0x01) != 0;
-        OF = 0;
+        cpu->CF = (val & 0x01) != 0;
+        cpu->OF = 0;
         val = (val >> 1) | (val & 0x8000);
         SetSFW(val);
         SetZFW(val);
@@ -1590,67 +2253,65 @@ static uint16_t shift1_w(uint16_t val, int32_t ModRM)
 
 static uint16_t shifts_w(uint16_t val, int32_t ModRM, uint32_t count)
 {
-#ifdef CPU_SHIFT_80186
-    count &= 0x1F;
-#endif
-
+    cpu->cycles += count;
     if(!count)
         return val; // No flags affected.
 
     if(count == 1)
         return shift1_w(val, ModRM);
 
-    AF = 0;
-    OF = 0;
+    SyncFlags();
+    cpu->AF = 0;
+    cpu->OF = 0;
     switch(ModRM & 0x38)
     {
     case 0x00: /* ROL ew,CL */
         for(; count > 0; count--)
         {
-            CF = (val & 0x8000) != 0;
-            val = (val << 1) | CF;
+            cpu->CF = (val & 0x8000) != 0;
+            val = (val << 1) | cpu->CF;
         }
-        OF = !(val & 0x8000) != !CF;
+        cpu->OF = !(val & 0x8000) != !cpu->CF;
         break;
     case 0x08: /* ROR ew,CL */
         for(; count > 0; count--)
         {
-            CF = (val & 0x01) != 0;
-            val = (val >> 1) | (CF << 15);
+            cpu->CF = (val & 0x01) != 0;
+            val = (val >> 1) | (cpu->CF << 15);
         }
-        OF = !(val & 0x4000) != !(val & 0x8000);
+        cpu->OF = !(val & 0x4000) != !(val & 0x8000);
         break;
     case 0x10: /* RCL ew,CL */
         for(; count > 0; count--)
         {
-            uint8_t oldCF = CF;
-            CF = (val & 0x8000) != 0;
+            uint8_t oldCF = cpu->CF;
+            cpu->CF = (val & 0x8000) != 0;
             val = (val << 1) | oldCF;
         }
-        OF = !(val & 0x8000) != !CF;
+        cpu->OF = !(val & 0x8000) != !cpu->CF;
         break;
     case 0x18: /* RCR ew,CL */
         for(; count > 0; count--)
         {
-            uint8_t oldCF = CF;
-            CF = val & 1;
+            uint8_t oldCF = cpu->CF;
+            cpu->CF = val & 1;
             val = (val >> 1) | (oldCF << 15);
         }
-        OF = !(val & 0x4000) != !(val & 0x8000);
+        cpu->OF = !(val & 0x4000) != !(val & 0x8000);
         break;
     case 0x20:
     case 0x30: /* SHL eb,CL */
         if(count > 16)
         {
-            CF = 0;
+            cpu->CF = 0;
             val = 0;
         }
         else
         {
-            CF = (val & (0x10000 >> count)) != 0;
+            cpu->CF = (val & (0x10000 >> count)) != 0;
             val <<= count;
         }
-        OF = !(val & 0x8000) != !CF;
+        cpu->OF = !(val & 0x8000) != !cpu->CF;
         SetZFW(val);
         SetSFW(val);
         SetPF(val);
@@ -1658,12 +2319,12 @@ static uint16_t shifts_w(uint16_t val, int32_t ModRM, uint32_t count)
     case 0x28: /* SHR eb,CL */
         if(count > 16)
         {
-            CF = 0;
+            cpu->CF = 0;
             val = 0;
         }
         else
         {
-            CF = ((val >> (count - 1)) & 0x1) != 0;
+            cpu->CF = ((val >> (count - 1)) & 0x1) != 0;
             val >>= count;
         }
         SetSFW(val);
@@ -1671,7 +2332,7 @@ static uint16_t shifts_w(uint16_t val, int32_t ModRM, uint32_t count)
         SetPF(val);
         break;
     case 0x38: /* SAR eb,CL */
-        CF = (((int8_t)val >> (count - 1)) & 0x01) != 0;
+        cpu->CF = (((int8_t)val >> (count - 1)) & 0x01) != 0;
         for(; count > 0; count--)
             val = (val >> 1) | (val & 0x8000);
         SetSFW(val);
@@ -1683,24 +2344,28 @@ static uint16_t shifts_w(uint16_t val, int32_t ModRM, uint32_t count)
     return val;
 }
 
-static void i_c0pre(void)
+// The shifts by CL or an immediate take the count with count_mask,
+// SHIFT_COUNT_MASK of the core.
+#define SHIFT_COUNT_MASK (CPU_SHIFT_80186 ? 0x1F : 0xFF)
+
+static void i_c0pre(uint8_t count_mask)
 {
     int32_t ModRM = FETCH_B();
     uint8_t dest = GetModRMRMB(ModRM);
     uint8_t count = FETCH_B();
 
-    dest = shifts_b(dest, ModRM, count);
+    dest = shifts_b(dest, ModRM, count & count_mask);
 
     SetModRMRMB(ModRM, dest);
 }
 
-static void i_c1pre(void)
+static void i_c1pre(uint8_t count_mask)
 {
     int32_t ModRM = FETCH_B();
     uint16_t dest = GetModRMRMW(ModRM);
     uint8_t count = FETCH_B();
 
-    dest = shifts_w(dest, ModRM, count);
+    dest = shifts_w(dest, ModRM, count & count_mask);
 
     SetModRMRMW(ModRM, dest);
 }
@@ -1725,54 +2390,56 @@ static void i_d1pre(void)
     SetModRMRMW(ModRM, dest);
 }
 
-static void i_d2pre(void)
+static void i_d2pre(uint8_t count_mask)
 {
     int32_t ModRM = FETCH_B();
     uint8_t dest = GetModRMRMB(ModRM);
 
-    dest = shifts_b(dest, ModRM, wregs[CX] & 0xFF);
+    dest = shifts_b(dest, ModRM, cpu->wregs[CX] & count_mask);
 
     SetModRMRMB(ModRM, dest);
 }
 
-static void i_d3pre(void)
+static void i_d3pre(uint8_t count_mask)
 {
     int32_t ModRM = FETCH_B();
     uint16_t dest = GetModRMRMW(ModRM);
 
-    dest = shifts_w(dest, ModRM, wregs[CX] & 0xFF);
+    dest = shifts_w(dest, ModRM, cpu->wregs[CX] & count_mask);
 
     SetModRMRMW(ModRM, dest);
 }
 
 static void i_aam(void)
 {
+    SyncFlags();
     uint32_t mult = FETCH_B();
 
     if(mult == 0)
         cpu_trap(0);
     else
     {
-        uint32_t al = wregs[AX] & 0xFF;
-        wregs[AX] = ((al % mult) & 0xFF) | ((al / mult) << 8);
+        uint32_t al = cpu->wregs[AX] & 0xFF;
+        cpu->wregs[AX] = ((al % mult) & 0xFF) | ((al / mult) << 8);
 
         SetPF(al);
-        SetZFW(wregs[AX]);
-        SetSFW(wregs[AX]);
+        SetZFW(cpu->wregs[AX]);
+        SetSFW(cpu->wregs[AX]);
     }
 }
 
 static void i_aad(void)
 {
+    SyncFlags();
     uint32_t mult = FETCH_B();
 
-    uint16_t ax = wregs[AX];
+    uint16_t ax = cpu->wregs[AX];
     ax = 0xFF & ((ax >> 8) * mult + ax);
 
-    wregs[AX] = ax;
-    AF = 0;
-    OF = 0;
-    CF = 0;
+    cpu->wregs[AX] = ax;
+    cpu->AF = 0;
+    cpu->OF = 0;
+    cpu->CF = 0;
     SetPF(ax);
     SetSFB(ax);
     SetZFB(ax);
@@ -1780,7 +2447,7 @@ static void i_aad(void)
 
 static void i_xlat(void)
 {
-    wregs[AX] = (wregs[AX] & 0xFF00) | GetMemDSB(wregs[BX] + (wregs[AX] & 0xFF));
+    cpu->wregs[AX] = (cpu->wregs[AX] & 0xFF00) | GetMemDSB(cpu->wregs[BX] + (cpu->wregs[AX] & 0xFF));
 }
 
 static void i_escape(void)
@@ -1792,71 +2459,83 @@ static void i_escape(void)
 static void i_loopne(void)
 {
     int32_t disp = (int8_t)FETCH_B();
-    wregs[CX]--;
-    if(!ZF && wregs[CX])
-        ip = ip + disp;
+    cpu->wregs[CX]--;
+    if(!GetZF() && cpu->wregs[CX])
+    {
+        cpu->ip = cpu->ip + disp;
+        cpu->cycles += 9;
+    }
 }
 
 static void i_loope(void)
 {
     int32_t disp = (int8_t)FETCH_B();
-    wregs[CX]--;
-    if(ZF && wregs[CX])
-        ip = ip + disp;
+    cpu->wregs[CX]--;
+    if(GetZF() && cpu->wregs[CX])
+    {
+        cpu->ip = cpu->ip + disp;
+        cpu->cycles += 9;
+    }
 }
 
 static void i_loop(void)
 {
     int32_t disp = (int8_t)FETCH_B();
-    wregs[CX]--;
-    if(wregs[CX])
-        ip = ip + disp;
+    cpu->wregs[CX]--;
+    if(cpu->wregs[CX])
+    {
+        cpu->ip = cpu->ip + disp;
+        cpu->cycles += 8;
+    }
 }
 
 static void i_jcxz(void)
 {
     int32_t disp = (int8_t)FETCH_B();
-    if(wregs[CX] == 0)
-        ip = ip + disp;
+    if(cpu->wregs[CX] == 0)
+    {
+        cpu->ip = cpu->ip + disp;
+        cpu->cycles += 8;
+    }
 }
 
 static void i_inal(void)
 {
     uint32_t port = FETCH_B();
-    wregs[AX] = (wregs[AX] & 0xFF00) | port_read(port);
+    cpu->wregs[AX] = (cpu->wregs[AX] & 0xFF00) | PortRead(port);
 }
 
 static void i_inax(void)
 {
     uint32_t port = FETCH_B();
-    wregs[AX] = port_read(port);
-    wregs[AX] |= port_read(port + 1) << 8;
+    cpu->wregs[AX] = PortRead(port);
+    cpu->wregs[AX] |= PortRead(port + 1) << 8;
 }
 
 static void i_outal(void)
 {
     uint32_t port = FETCH_B();
-    port_write(port, wregs[AX] & 0xFF);
+    PortWrite(port, cpu->wregs[AX] & 0xFF);
 }
 
 static void i_outax(void)
 {
     uint32_t port = FETCH_B();
-    port_write(port, wregs[AX] & 0xFF);
-    port_write(port + 1, wregs[AX] >> 8);
+    PortWrite(port, cpu->wregs[AX] & 0xFF);
+    PortWrite(port + 1, cpu->wregs[AX] >> 8);
 }
 
 static void i_call_d16(void)
 {
     uint16_t disp = FETCH_W();
-    PushWord(ip);
-    ip = ip + disp;
+    PushWord(cpu->ip);
+    cpu->ip = cpu->ip + disp;
 }
 
 static void i_jmp_d16(void)
 {
     uint16_t disp = FETCH_W();
-    ip = ip + disp;
+    cpu->ip = cpu->ip + disp;
 }
 
 static void i_jmp_far(void)
@@ -1864,38 +2543,316 @@ static void i_jmp_far(void)
     uint16_t nip = FETCH_W();
     uint16_t ncs = FETCH_W();
 
-    sregs[CS] = ncs;
-    ip = nip;
+    cpu->sregs[CS] = ncs;
+    cpu->ip = nip;
 }
 
 static void i_jmp_d8(void)
 {
     int8_t disp = FETCH_B();
-    ip = ip + disp;
+    cpu->ip = cpu->ip + disp;
 }
 
 static void i_inaldx(void)
 {
-    wregs[AX] = (wregs[AX] & 0xFF00) | port_read(wregs[DX]);
+    cpu->wregs[AX] = (cpu->wregs[AX] & 0xFF00) | PortRead(cpu->wregs[DX]);
 }
 
 static void i_inaxdx(void)
 {
-    uint32_t port = wregs[DX];
-    wregs[AX] = port_read(port);
-    wregs[AX] |= port_read(port + 1) << 8;
+    uint32_t port = cpu->wregs[DX];
+    cpu->wregs[AX] = PortRead(port);
+    cpu->wregs[AX] |= PortRead(port + 1) << 8;
 }
 
 static void i_outdxal(void)
 {
-    port_write(wregs[DX], wregs[AX] & 0xFF);
+    PortWrite(cpu->wregs[DX], cpu->wregs[AX] & 0xFF);
 }
 
 static void i_outdxax(void)
 {
-    uint32_t port = wregs[DX];
-    port_write(port, wregs[AX] & 0xFF);
-    port_write(port + 1, wregs[AX] >> 8);
+    uint32_t port = cpu->wregs[DX];
+    PortWrite(port, cpu->wregs[AX] & 0xFF);
+    PortWrite(port + 1, cpu->wregs[AX] >> 8);
+}
+
+// Host pointer to size bytes of guest RAM at addr, or NULL when the range is
+// not directly mapped host memory in one piece.
+static uint8_t *ram_span(uint32_t addr, uint32_t size, bool write)
+{
+    const mem_page_t *page;
+    uint8_t *base;
+    uint32_t a;
+
+    if(addr + size > 0x100000)
+        return NULL;
+    page = &cpu->machine->mem_map[addr >> MEM_PAGE_BITS];
+    base = write ? page->write : page->read;
+    if(!base)
+        return NULL;
+    base += addr & MEM_PAGE_MASK;
+    for(a = (addr | MEM_PAGE_MASK) + 1; a < addr + size; a += MEM_PAGE_SIZE)
+    {
+        page = &cpu->machine->mem_map[a >> MEM_PAGE_BITS];
+        if((write ? page->write : page->read) != base + (a - addr))
+            return NULL;
+    }
+    return base;
+}
+
+static void dcache_invalidate_range(uint32_t addr, uint32_t size)
+{
+    uint32_t a;
+    for(a = addr; a < addr + size; a++)
+    {
+        if(cpu->dcache_lines[a >> DCACHE_LINE])
+            dcache_invalidate(a);
+        else
+            a |= (1 << DCACHE_LINE) - 1;
+    }
+}
+
+// Lowest offset touched by a string operation repeated count times on
+// elements of size bytes starting at off. Fails if it wraps around the
+// segment.
+static bool rep_range(uint32_t off, uint32_t count, uint32_t size, uint16_t *low)
+{
+    if(cpu->DF)
+    {
+        if(off < (count - 1) * size || off + size > 0x10000)
+            return false;
+        *low = off - (count - 1) * size;
+    }
+    else
+    {
+        if(off + count * size > 0x10000)
+            return false;
+        *low = off;
+    }
+    return true;
+}
+
+// Bulk versions of REP MOVS/STOS/LODS for blocks in plain RAM. They return
+// false, leaving everything untouched, when the element loop is needed, as
+// when the writes are traced or for the reference interpreter.
+static bool rep_movs_bulk(uint32_t size, uint32_t count)
+{
+    uint8_t seg = (cpu->segment_override != NoSeg) ? cpu->segment_override : DS;
+    uint32_t bytes = size * count, src, dest;
+    uint16_t src_low, dest_low;
+    uint8_t *from, *to;
+
+    if(count < 2 || cpu->trace || cpu->reference ||
+       !rep_range(cpu->wregs[SI], count, size, &src_low) ||
+       !rep_range(cpu->wregs[DI], count, size, &dest_low))
+        return false;
+
+    src = cpu->sregs[seg] * 16 + src_low;
+    dest = cpu->sregs[ES] * 16 + dest_low;
+
+    // An overlapping copy matches memmove() only when the destination trails
+    // the source in the direction of the copy.
+    if(src < dest + bytes && dest < src + bytes && (cpu->DF ? dest < src : dest > src))
+        return false;
+
+    from = ram_span(src, bytes, false);
+    to = ram_span(dest, bytes, true);
+    if(!from || !to)
+        return false;
+
+    dcache_invalidate_range(dest, bytes);
+    memmove(to, from, bytes);
+    cpu->cycles += 2 * bytes * BUS_CYCLES;
+    cpu->wregs[SI] += cpu->DF ? -bytes : bytes;
+    cpu->wregs[DI] += cpu->DF ? -bytes : bytes;
+    return true;
+}
+
+static bool rep_stos_bulk(uint32_t size, uint32_t count)
+{
+    uint32_t bytes = size * count, dest, i;
+    uint16_t dest_low;
+    uint8_t *to;
+
+    if(count < 2 || cpu->trace || cpu->reference ||
+       !rep_range(cpu->wregs[DI], count, size, &dest_low))
+        return false;
+
+    dest = cpu->sregs[ES] * 16 + dest_low;
+    to = ram_span(dest, bytes, true);
+    if(!to)
+        return false;
+
+    dcache_invalidate_range(dest, bytes);
+    if(size == 1 || (cpu->wregs[AX] >> 8) == (cpu->wregs[AX] & 0xff))
+        memset(to, cpu->wregs[AX] & 0xff, bytes);
+    else
+    {
+        for(i = 0; i < bytes; i += 2)
+        {
+            to[i] = cpu->wregs[AX] & 0xff;
+            to[i + 1] = cpu->wregs[AX] >> 8;
+        }
+    }
+    cpu->wregs[DI] += cpu->DF ? -bytes : bytes;
+    cpu->cycles += bytes * BUS_CYCLES;
+    return true;
+}
+
+static bool rep_lods_bulk(uint32_t size, uint32_t count)
+{
+    uint8_t seg = (cpu->segment_override != NoSeg) ? cpu->segment_override : DS;
+    uint32_t bytes = size * count;
+    uint16_t src_low;
+    uint8_t *from;
+
+    if(count < 2 || cpu->reference || !rep_range(cpu->wregs[SI], count, size, &src_low))
+        return false;
+
+    from = ram_span(cpu->sregs[seg] * 16 + src_low, bytes, false);
+    if(!from)
+        return false;
+
+    // Only the last element loaded is left in AL/AX.
+    if(!cpu->DF)
+        from += bytes - size;
+    if(size == 1)
+        cpu->wregs[AX] = (cpu->wregs[AX] & 0xFF00) | from[0];
+    else
+        cpu->wregs[AX] = from[0] | (from[1] << 8);
+    cpu->wregs[SI] += cpu->DF ? -bytes : bytes;
+    cpu->cycles += bytes * BUS_CYCLES;
+    return true;
+}
+
+// Host pointer to the string element at seg:off and the number of elements,
+// at most count, from there in the direction of DF that stay inside both
+// the segment and the memory page. Returns 0 if the page is not host memory.
+static uint32_t rep_run(uint8_t seg, uint32_t off, uint32_t size,
+                        uint32_t count, const uint8_t **ptr)
+{
+    uint32_t addr = cpu->sregs[seg] * 16 + off;
+    uint32_t in_page = addr & MEM_PAGE_MASK;
+    const uint8_t *base;
+    uint32_t seg_left, page_left, n;
+
+    if(addr > 0xFFFFF || off + size > 0x10000 || in_page + size > MEM_PAGE_SIZE)
+        return 0;
+    base = cpu->machine->mem_map[addr >> MEM_PAGE_BITS].read;
+    if(!base)
+        return 0;
+
+    // Bytes to the end of the segment and of the page in the direction of DF.
+    seg_left = cpu->DF ? off : 0x10000 - off;
+    page_left = cpu->DF ? in_page : MEM_PAGE_SIZE - in_page;
+    n = (seg_left < page_left) ? seg_left : page_left;
+    n = cpu->DF ? n / size + 1 : n / size;
+
+    *ptr = base + in_page;
+    return (n < count) ? n : count;
+}
+
+static inline uint16_t rep_load(const uint8_t *ptr, uint32_t size)
+{
+    return (size == 1) ? ptr[0] : (ptr[0] | (ptr[1] << 8));
+}
+
+// Number of elements REPE (equal) or REPNE (!equal) compares out of count:
+// up to and including the first one that ends the repeat. The elements at
+// q are compared with the ones at p (CMPS), or with value when p is NULL
+// (SCAS), stepping by step bytes.
+static uint32_t rep_scan(const uint8_t *p, const uint8_t *q, uint16_t value,
+                         uint32_t size, int32_t step, uint32_t count, bool equal)
+{
+    uint32_t i = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+    if(step > 0)
+    {
+        const uint32_t per = 16 / size;
+        const __m128i pattern = (size == 1) ? _mm_set1_epi8((char)value)
+                                            : _mm_set1_epi16((short)value);
+        for(; i + per <= count; i += per)
+        {
+            __m128i b = _mm_loadu_si128((const __m128i *)(q + i * size));
+            __m128i a = p ? _mm_loadu_si128((const __m128i *)(p + i * size)) : pattern;
+            uint32_t same = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+            uint32_t hit;
+            if(size == 2)
+                same &= (same >> 1) & 0x5555;
+            hit = equal ? (~same & ((size == 1) ? 0xFFFF : 0x5555)) : same;
+            if(hit)
+                return i + __builtin_ctz(hit) / size + 1;
+        }
+    }
+#endif
+
+    if(!p && size == 1 && step > 0 && !equal)
+    {
+        const uint8_t *hit = memchr(q + i, value & 0xFF, count - i);
+        return hit ? (uint32_t)(hit - q) + 1 : count;
+    }
+
+    for(; i < count; i++)
+    {
+        uint16_t x = rep_load(q + (int32_t)i * step, size);
+        uint16_t y = p ? rep_load(p + (int32_t)i * step, size)
+                       : ((size == 1) ? (value & 0xFF) : value);
+        if((x == y) != equal)
+            return i + 1;
+    }
+    return count;
+}
+
+// Fast REPE/REPNE CMPS and SCAS over RAM. Runs of elements are compared
+// directly in host memory and the flags are only set from the last element
+// compared. Stops early, with ZF still equal to flagval, when an element is
+// not in host memory or wraps around its segment, the element loop then
+// does the rest.
+static void rep_cmps_scas_bulk(bool cmps, uint32_t size, uint32_t *count,
+                               int32_t flagval)
+{
+    uint8_t seg = (cpu->segment_override != NoSeg) ? cpu->segment_override : DS;
+    int32_t step = cpu->DF ? -(int32_t)size : (int32_t)size;
+
+    while(*count > 0 && !cpu->reference)
+    {
+        const uint8_t *p = NULL, *q;
+        uint32_t n = rep_run(ES, cpu->wregs[DI], size, *count, &q), k;
+        uint32_t dest, src;
+
+        if(cmps && n)
+            n = rep_run(seg, cpu->wregs[SI], size, n, &p);
+        if(!n)
+            return;
+
+        k = rep_scan(p, q, cpu->wregs[AX], size, step, n, flagval);
+
+        src = rep_load(q + (int32_t)(k - 1) * step, size);
+        if(cmps)
+            dest = rep_load(p + (int32_t)(k - 1) * step, size);
+        else
+            dest = (size == 1) ? (cpu->wregs[AX] & 0xFF) : cpu->wregs[AX];
+
+        if(size == 1)
+        {
+            CMP_8();
+        }
+        else
+        {
+            CMP_16();
+        }
+
+        if(cmps)
+            cpu->wregs[SI] += k * step;
+        cpu->wregs[DI] += k * step;
+        *count -= k;
+        cpu->cycles += (cmps ? 2 : 1) * k * size * BUS_CYCLES;
+
+        if(GetZF() != flagval)
+            return;
+    }
 }
 
 static void rep(int32_t flagval)
@@ -1903,171 +2860,211 @@ static void rep(int32_t flagval)
     /* Handles rep- and repnz- prefixes. flagval is the value of ZF for the
        loop  to continue for CMPS and SCAS instructions. */
     uint8_t next = FETCH_B();
-    uint32_t count = wregs[CX];
+    uint32_t count = cpu->wregs[CX];
+    const uint16_t start = cpu->wregs[CX];
+    uint32_t element = 0; // clocks per element besides the bus transfers
+#ifdef CPU_PROFILE
+    const uint64_t profile_start = profile_ticks();
+    profile_opcode(next);
+#endif
 
     switch(next)
     {
     case 0x26: /* ES: */
-        segment_override = ES;
+        cpu->segment_override = ES;
         rep(flagval);
-        segment_override = NoSeg;
+        cpu->segment_override = NoSeg;
         break;
     case 0x2e: /* CS: */
-        segment_override = CS;
+        cpu->segment_override = CS;
         rep(flagval);
-        segment_override = NoSeg;
+        cpu->segment_override = NoSeg;
         break;
     case 0x36: /* SS: */
-        segment_override = SS;
+        cpu->segment_override = SS;
         rep(flagval);
-        segment_override = NoSeg;
+        cpu->segment_override = NoSeg;
         break;
     case 0x3e: /* DS: */
-        segment_override = DS;
+        cpu->segment_override = DS;
         rep(flagval);
-        segment_override = NoSeg;
+        cpu->segment_override = NoSeg;
         break;
     case 0x6c: /* REP INSB */
         for(; count > 0; count--)
             i_insb();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0x6d: /* REP INSW */
         for(; count > 0; count--)
             i_insw();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0x6e: /* REP OUTSB */
         for(; count > 0; count--)
             i_outsb();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0x6f: /* REP OUTSW */
         for(; count > 0; count--)
             i_outsw();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0xa4: /* REP MOVSB */
+        if(rep_movs_bulk(1, count))
+            count = 0;
         for(; count > 0; count--)
             i_movsb();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0xa5: /* REP MOVSW */
+        if(rep_movs_bulk(2, count))
+            count = 0;
         for(; count > 0; count--)
             i_movsw();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0xa6: /* REP(N)E CMPSB */
-        for(ZF = flagval; (ZF == flagval) && (count > 0); count--)
+        element = 6;
+        SyncFlags();
+        cpu->ZF = flagval;
+        rep_cmps_scas_bulk(true, 1, &count, flagval);
+        for(; (GetZF() == flagval) && (count > 0); count--)
             i_cmpsb();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0xa7: /* REP(N)E CMPSW */
-        for(ZF = flagval; (ZF == flagval) && (count > 0); count--)
+        element = 6;
+        SyncFlags();
+        cpu->ZF = flagval;
+        rep_cmps_scas_bulk(true, 2, &count, flagval);
+        for(; (GetZF() == flagval) && (count > 0); count--)
             i_cmpsw();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0xaa: /* REP STOSB */
+        if(rep_stos_bulk(1, count))
+            count = 0;
         for(; count > 0; count--)
             i_stosb();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
-    case 0xab: /* REP LODSW */
+    case 0xab: /* REP STOSW */
+        if(rep_stos_bulk(2, count))
+            count = 0;
         for(; count > 0; count--)
             i_stosw();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0xac: /* REP LODSB */
+        element = 5;
+        if(rep_lods_bulk(1, count))
+            count = 0;
         for(; count > 0; count--)
             i_lodsb();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0xad: /* REP LODSW */
+        element = 5;
+        if(rep_lods_bulk(2, count))
+            count = 0;
         for(; count > 0; count--)
             i_lodsw();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0xae: /* REP(N)E SCASB */
-        for(ZF = flagval; (ZF == flagval) && (count > 0); count--)
+        element = 6;
+        SyncFlags();
+        cpu->ZF = flagval;
+        rep_cmps_scas_bulk(false, 1, &count, flagval);
+        for(; (GetZF() == flagval) && (count > 0); count--)
             i_scasb();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     case 0xaf: /* REP(N)E SCASW */
-        for(ZF = flagval; (ZF == flagval) && (count > 0); count--)
+        element = 6;
+        SyncFlags();
+        cpu->ZF = flagval;
+        rep_cmps_scas_bulk(false, 2, &count, flagval);
+        for(; (GetZF() == flagval) && (count > 0); count--)
             i_scasw();
-        wregs[CX] = count;
+        cpu->wregs[CX] = count;
         break;
     default: /* Ignore REP */
-        do_instruction(next);
+        cpu->core->do_instruction(next);
     }
+    cpu->cycles += element * (uint16_t)(start - cpu->wregs[CX]);
+#ifdef CPU_PROFILE
+    profile_rep(next, flagval, (uint16_t)(start - cpu->wregs[CX]), profile_start);
+#endif
 }
 
+// Extra clocks of the multiply and divide forms of the F6 and F7 groups.
+static const uint8_t f6_cycles[8] = { 0, 0, 0, 0, 19, 34, 17, 30 };
+static const uint8_t f7_cycles[8] = { 0, 0, 0, 0, 27, 42, 23, 38 };
+
 static void i_f6pre(void)
 {
     int32_t ModRM = FETCH_B();
     uint8_t dest = GetModRMRMB(ModRM);
 
+    cpu->cycles += f6_cycles[(ModRM >> 3) & 7];
+
     switch(ModRM & 0x38)
     {
     case 0x00: /* TEST Eb, data8 */
     case 0x08: /* ??? */
         dest &= FETCH_B();
-        CF = OF = AF = 0;
-        SetZFB(dest);
-        SetSFB(dest);
-        SetPF(dest);
+        SetFlags(FLAGS_LOG8, 0, 0, dest);
         break;
     case 0x10: /* NOT Eb */
         SetModRMRMB(ModRM, ~dest);
         break;
     case 0x18: /* NEG Eb */
+        SetFlags(FLAGS_SUB8, 0, dest, 0 - (uint32_t)dest);
         dest = 0x100 - dest;
-        CF = (dest != 0);
-        OF = (dest == 0x80);
-        AF = (dest ^ (0x100 - dest)) & 0x10;
-        SetZFB(dest);
-        SetSFB(dest);
-        SetPF(dest);
         SetModRMRMB(ModRM, dest);
         break;
     case 0x20: /* MUL AL, Eb */
     {
-        uint16_t result = dest * (wregs[AX] & 0xFF);
+        SyncFlags();
+        uint16_t result = dest * (cpu->wregs[AX] & 0xFF);
 
-        wregs[AX] = result;
+        cpu->wregs[AX] = result;
         SetSFB(result);
         SetPF(result);
         SetZFW(result);
-        CF = OF = (result > 0xFF);
+        cpu->CF = cpu->OF = (result > 0xFF);
     }
     break;
     case 0x28: /* IMUL AL, Eb */
     {
-        uint16_t result = (int8_t)dest * (int8_t)(wregs[AX] & 0xFF);
+        SyncFlags();
+        uint16_t result = (int8_t)dest * (int8_t)(cpu->wregs[AX] & 0xFF);
 
-        wregs[AX] = result;
+        cpu->wregs[AX] = result;
         SetSFB(result);
         SetPF(result);
         SetZFW(result);
         result &= 0xFF80;
-        CF = OF = (result != 0) && (result != 0xFF80);
+        cpu->CF = cpu->OF = (result != 0) && (result != 0xFF80);
     }
     break;
     case 0x30: /* DIV AL, Ew */
     {
-        if(dest && wregs[AX] / dest < 0x100)
-            wregs[AX] = (wregs[AX] % dest) * 256 + (wregs[AX] / dest);
+        if(dest && cpu->wregs[AX] / dest < 0x100)
+            cpu->wregs[AX] = (cpu->wregs[AX] % dest) * 256 + (cpu->wregs[AX] / dest);
         else
             cpu_trap(0);
     }
     break;
     case 0x38: /* IDIV AL, Ew */
     {
-        int16_t numer = wregs[AX];
+        int16_t numer = cpu->wregs[AX];
         int16_t div;
 
         if(dest && (div = numer / (int8_t)dest) < 0x80 && div >= -0x80)
-            wregs[AX] = (numer % (int8_t)dest) * 256 + (uint8_t)div;
+            cpu->wregs[AX] = (numer % (int8_t)dest) * 256 + (uint8_t)div;
         else
             cpu_trap(0);
     }
@@ -2080,15 +3077,14 @@ static void i_f7pre(void)
     int32_t ModRM = FETCH_B();
     uint16_t dest = GetModRMRMW(ModRM);
 
+    cpu->cycles += f7_cycles[(ModRM >> 3) & 7];
+
     switch(ModRM & 0x38)
     {
     case 0x00: /* TEST Ew, data16 */
     case 0x08: /* ??? */
         dest &= FETCH_W();
-        CF = OF = AF = 0;
-        SetZFW(dest);
-        SetSFW(dest);
-        SetPF(dest);
+        SetFlags(FLAGS_LOG16, 0, 0, dest);
         break;
 
     case 0x10: /* NOT Ew */
@@ -2096,48 +3092,45 @@ static void i_f7pre(void)
         break;
 
     case 0x18: /* NEG Ew */
+        SetFlags(FLAGS_SUB16, 0, dest, 0 - (uint32_t)dest);
         dest = 0x10000 - dest;
-        CF = (dest != 0);
-        OF = (dest == 0x8000);
-        AF = (dest ^ (0x10000 - dest)) & 0x10;
-        SetZFW(dest);
-        SetSFW(dest);
-        SetPF(dest);
         SetModRMRMW(ModRM, dest);
         break;
     case 0x20: /* MUL AX, Ew */
     {
-        uint32_t result = dest * wregs[AX];
+        SyncFlags();
+        uint32_t result = dest * cpu->wregs[AX];
 
-        wregs[AX] = result & 0xFFFF;
-        wregs[DX] = result >> 16;
+        cpu->wregs[AX] = result & 0xFFFF;
+        cpu->wregs[DX] = result >> 16;
 
         SetSFW(result);
         SetPF(result);
-        SetZFW(wregs[AX] | wregs[DX]);
-        CF = OF = (result > 0xFFFF);
+        SetZFW(cpu->wregs[AX] | cpu->wregs[DX]);
+        cpu->CF = cpu->OF = (result > 0xFFFF);
     }
     break;
 
     case 0x28: /* IMUL AX, Ew */
     {
-        uint32_t result = (int16_t)dest * (int16_t)wregs[AX];
-        wregs[AX] = result & 0xFFFF;
-        wregs[DX] = result >> 16;
+        SyncFlags();
+        uint32_t result = (int16_t)dest * (int16_t)cpu->wregs[AX];
+        cpu->wregs[AX] = result & 0xFFFF;
+        cpu->wregs[DX] = result >> 16;
         SetSFW(result);
         SetPF(result);
-        SetZFW(wregs[AX] | wregs[DX]);
+        SetZFW(cpu->wregs[AX] | cpu->wregs[DX]);
         result &= 0xFFFF8000;
-        CF = OF = (result != 0) && (result != 0xFFFF8000);
+        cpu->CF = cpu->OF = (result != 0) && (result != 0xFFFF8000);
     }
     break;
     case 0x30: /* DIV AX, Ew */
     {
-        uint32_t numer = (wregs[DX] << 16) + wregs[AX];
+        uint32_t numer = (cpu->wregs[DX] << 16) + cpu->wregs[AX];
         if(dest && numer / dest < 0x10000)
         {
-            wregs[AX] = numer / dest;
-            wregs[DX] = numer % dest;
+            cpu->wregs[AX] = numer / dest;
+            cpu->wregs[DX] = numer % dest;
         }
         else
             cpu_trap(0);
@@ -2145,13 +3138,13 @@ static void i_f7pre(void)
     break;
     case 0x38: /* IDIV AL, Ew */
     {
-        int32_t numer = (wregs[DX] << 16) + wregs[AX];
+        int32_t numer = (cpu->wregs[DX] << 16) + cpu->wregs[AX];
         int32_t div;
 
         if(dest && (div = numer / (int16_t)dest) < 0x8000 && div >= -0x8000)
         {
-            wregs[AX] = div;
-            wregs[DX] = numer % (int16_t)dest;
+            cpu->wregs[AX] = div;
+            cpu->wregs[DX] = numer % (int16_t)dest;
         }
         else
             cpu_trap(0);
@@ -2162,32 +3155,32 @@ static void i_f7pre(void)
 
 static void i_sti(void)
 {
-    IF = 1;
+    cpu->IF = 1;
 }
 
 static void i_pusha(void)
 {
-    uint16_t tmp = wregs[SP];
-    PushWord(wregs[AX]);
-    PushWord(wregs[CX]);
-    PushWord(wregs[DX]);
-    PushWord(wregs[BX]);
+    uint16_t tmp = cpu->wregs[SP];
+    PushWord(cpu->wregs[AX]);
+    PushWord(cpu->wregs[CX]);
+    PushWord(cpu->wregs[DX]);
+    PushWord(cpu->wregs[BX]);
     PushWord(tmp);
-    PushWord(wregs[BP]);
-    PushWord(wregs[SI]);
-    PushWord(wregs[DI]);
+    PushWord(cpu->wregs[BP]);
+    PushWord(cpu->wregs[SI]);
+    PushWord(cpu->wregs[DI]);
 }
 
 static void i_popa(void)
 {
-    wregs[DI] = PopWord();
-    wregs[SI] = PopWord();
-    wregs[BP] = PopWord();
+    cpu->wregs[DI] = PopWord();
+    cpu->wregs[SI] = PopWord();
+    cpu->wregs[BP] = PopWord();
     PopWord();
-    wregs[BX] = PopWord();
-    wregs[DX] = PopWord();
-    wregs[CX] = PopWord();
-    wregs[AX] = PopWord();
+    cpu->wregs[BX] = PopWord();
+    cpu->wregs[DX] = PopWord();
+    cpu->wregs[CX] = PopWord();
+    cpu->wregs[AX] = PopWord();
 }
 
 static void i_bound(void)
@@ -2195,7 +3188,7 @@ static void i_bound(void)
     int32_t ModRM = FETCH_B();
     uint16_t src = GetModRMRegW(ModRM);
     uint16_t low = GetModRMRMW(ModRM);
-    uint16_t hi = GetMemAbsW(ModRMAddress + 2);
+    uint16_t hi = GetMemAbsW(cpu->ModRMAddress + 2);
     if(src < low || src > hi)
         cpu_trap(5);
 }
@@ -2205,65 +3198,60 @@ static void i_fepre(void)
     int32_t ModRM = FETCH_B();
     uint8_t dest = GetModRMRMB(ModRM);
 
+    SyncCF();
     if((ModRM & 0x38) == 0)
     {
         dest = dest + 1;
-        OF = (dest == 0x80);
-        AF = (dest ^ (dest - 1)) & 0x10;
+        SetFlags(FLAGS_INC8, 0, 0, dest);
     }
     else
     {
         dest--;
-        OF = (dest == 0x7F);
-        AF = (dest ^ (dest + 1)) & 0x10;
+        SetFlags(FLAGS_DEC8, 0, 0, dest);
     }
-    SetZFB(dest);
-    SetSFB(dest);
-    SetPF(dest);
     SetModRMRMB(ModRM, dest);
 }
 
+// Extra clocks of the FF group, for the calls, jumps and push.
+static const uint8_t ff_cycles[8] = { 0, 0, 10, 14, 9, 13, 2, 0 };
+
 static void i_ffpre(void)
 {
     int32_t ModRM = FETCH_B();
     uint16_t dest = GetModRMRMW(ModRM);
 
+    cpu->cycles += ff_cycles[(ModRM >> 3) & 7];
+
     switch(ModRM & 0x38)
     {
     case 0x00: /* INC ew */
         dest = dest + 1;
-        OF = (dest == 0x8000);
-        AF = (dest ^ (dest - 1)) & 0x10;
-        SetZFW(dest);
-        SetSFW(dest);
-        SetPF(dest);
+        SyncCF();
+        SetFlags(FLAGS_INC16, 0, 0, dest);
         SetModRMRMW(ModRM, dest);
         break;
     case 0x08: /* DEC ew */
         dest = dest - 1;
-        OF = (dest == 0x7FFF);
-        AF = (dest ^ (dest + 1)) & 0x10;
-        SetZFW(dest);
-        SetSFW(dest);
-        SetPF(dest);
+        SyncCF();
+        SetFlags(FLAGS_DEC16, 0, 0, dest);
         SetModRMRMW(ModRM, dest);
         break;
     case 0x10: /* CALL ew */
-        PushWord(ip);
-        ip = dest;
+        PushWord(cpu->ip);
+        cpu->ip = dest;
         break;
     case 0x18: /* CALL FAR ea */
-        PushWord(sregs[CS]);
-        PushWord(ip);
-        ip = dest;
-        sregs[CS] = GetMemAbsW(ModRMAddress + 2);
+        PushWord(cpu->sregs[CS]);
+        PushWord(cpu->ip);
+        cpu->ip = dest;
+        cpu->sregs[CS] = GetMemAbsW(cpu->ModRMAddress + 2);
         break;
     case 0x20: /* JMP ea */
-        ip = dest;
+        cpu->ip = dest;
         break;
     case 0x28: /* JMP FAR ea */
-        ip = dest;
-        sregs[CS] = GetMemAbsW(ModRMAddress + 2);
+        cpu->ip = dest;
+        cpu->sregs[CS] = GetMemAbsW(cpu->ModRMAddress + 2);
         break;
     case 0x30: /* PUSH ea */
         PushWord(dest);
@@ -2277,13 +3265,13 @@ static void i_enter(void)
 {
     uint16_t stk = FETCH_W();
     uint8_t lvl = FETCH_B();
-    PushWord(wregs[BP]);         // push BP
-    wregs[BP] = wregs[SP];       // BP <- SP
-    wregs[SP] = wregs[SP] - stk; // SP -= stk
+    PushWord(cpu->wregs[BP]);         // push BP
+    cpu->wregs[BP] = cpu->wregs[SP];       // BP <- SP
+    cpu->wregs[SP] = cpu->wregs[SP] - stk; // SP -= stk
     if(lvl)
     {
         uint32_t i;
-        uint32_t tmp = wregs[BP];
+        uint32_t tmp = cpu->wregs[BP];
         for(i = 1; i < lvl; i++)
             PushWord(GetMemW(SS, (tmp - i * 2))); // push SS:[BP - 2*i]
         PushWord(tmp);                            // push BP
@@ -2292,426 +3280,163 @@ static void i_enter(void)
 
 static void i_leave(void)
 {
-    wregs[SP] = wregs[BP]; // SP <- BP
-    wregs[BP] = PopWord();
+    cpu->wregs[SP] = cpu->wregs[BP]; // SP <- BP
+    cpu->wregs[BP] = PopWord();
 }
 
 static void i_halt(void)
 {
-    printf("HALT instruction!\n");
-    exit(0);
-}
-
-void cpu_dump_state() {
-  printf("  AX %04x\n", wregs[AX]);
-  printf("  CX %04x\n", wregs[CX]);
-  printf("  DX %04x\n", wregs[DX]);
-  printf("  BX %04x\n", wregs[BX]);
-  printf("  SP %04x\n", wregs[SP]);
-  printf("  BP %04x\n", wregs[BP]);
-  printf("  SI %04x\n", wregs[SI]);
-  printf("  DI %04x\n", wregs[DI]);
-  printf("  ES %04x\n", sregs[ES]);
-  printf("  CS %04x\n", sregs[CS]);
-  printf("  SS %04x\n", sregs[SS]);
-  printf("  DS %04x\n", sregs[DS]);
-  printf("  IP %04x\n", cpu_get_IP());
+    cpu->halted = true;
+    cpu->run_end = cpu->cycles;  // stop cpu_run() after this instruction
+}
+
+void cpu_dump_state(machine_t *m) {
+  cpu = m->cpu;
+  SyncFlags();
+  printf("  AX %04x\n", cpu->wregs[AX]);
+  printf("  CX %04x\n", cpu->wregs[CX]);
+  printf("  DX %04x\n", cpu->wregs[DX]);
+  printf("  BX %04x\n", cpu->wregs[BX]);
+  printf("  SP %04x\n", cpu->wregs[SP]);
+  printf("  BP %04x\n", cpu->wregs[BP]);
+  printf("  SI %04x\n", cpu->wregs[SI]);
+  printf("  DI %04x\n", cpu->wregs[DI]);
+  printf("  ES %04x\n", cpu->sregs[ES]);
+  printf("  CS %04x\n", cpu->sregs[CS]);
+  printf("  SS %04x\n", cpu->sregs[SS]);
+  printf("  DS %04x\n", cpu->sregs[DS]);
+  printf("  IP %04x\n", cpu->ip);
   printf("     %c%c%c%c%c%c%c%c\n",
-    OF ? 'O' : '.',
-    DF ? 'D' : '.',
-    IF ? 'I' : '.',
-    SF ? 'S' : '.',
-    ZF ? 'Z' : '.',
-    AF ? 'A' : '.',
-    PF ? 'P' : '.',
-    CF ? 'C' : '.');
+    cpu->OF ? 'O' : '.',
+    cpu->DF ? 'D' : '.',
+    cpu->IF ? 'I' : '.',
+    cpu->SF ? 'S' : '.',
+    cpu->ZF ? 'Z' : '.',
+    cpu->AF ? 'A' : '.',
+    cpu->PF ? 'P' : '.',
+    cpu->CF ? 'C' : '.');
 }
 
 static void dump_reg_change(bool silent) {
+  SyncFlags();
 
-  static uint16_t p_wregs[8];
-  static uint16_t p_sregs[4];
+  static THREAD_LOCAL uint16_t p_wregs[8];
+  static THREAD_LOCAL uint16_t p_sregs[4];
 
-  static int8_t p_CF, p_PF, p_ZF, p_TF, p_IF, p_DF;
-  static uint32_t p_AF, p_OF, p_SF;
+  static THREAD_LOCAL int8_t p_CF, p_PF, p_ZF, p_TF, p_IF, p_DF;
+  static THREAD_LOCAL uint32_t p_AF, p_OF, p_SF;
 
   if (!silent) {
-    if (wregs[AX] != p_wregs[AX]) {
-      printf("  AX %04x => %04x\n", p_wregs[AX], wregs[AX]);
+    if (cpu->wregs[AX] != p_wregs[AX]) {
+      printf("  AX %04x => %04x\n", p_wregs[AX], cpu->wregs[AX]);
     }
-    if (wregs[CX] != p_wregs[CX]) {
-      printf("  CX %04x => %04x\n", p_wregs[CX], wregs[CX]);
+    if (cpu->wregs[CX] != p_wregs[CX]) {
+      printf("  CX %04x => %04x\n", p_wregs[CX], cpu->wregs[CX]);
     }
-    if (wregs[DX] != p_wregs[DX]) {
-      printf("  DX %04x => %04x\n", p_wregs[DX], wregs[DX]);
+    if (cpu->wregs[DX] != p_wregs[DX]) {
+      printf("  DX %04x => %04x\n", p_wregs[DX], cpu->wregs[DX]);
     }
-    if (wregs[BX] != p_wregs[BX]) {
-      printf("  BX %04x => %04x\n", p_wregs[BX], wregs[BX]);
+    if (cpu->wregs[BX] != p_wregs[BX]) {
+      printf("  BX %04x => %04x\n", p_wregs[BX], cpu->wregs[BX]);
     }
-    if (wregs[SP] != p_wregs[SP]) {
-      printf("  SP %04x => %04x\n", p_wregs[SP], wregs[SP]);
+    if (cpu->wregs[SP] != p_wregs[SP]) {
+      printf("  SP %04x => %04x\n", p_wregs[SP], cpu->wregs[SP]);
     }
-    if (wregs[BP] != p_wregs[BP]) {
-      printf("  BP %04x => %04x\n", p_wregs[BP], wregs[BP]);
+    if (cpu->wregs[BP] != p_wregs[BP]) {
+      printf("  BP %04x => %04x\n", p_wregs[BP], cpu->wregs[BP]);
     }
-    if (wregs[SI] != p_wregs[SI]) {
-      printf("  SI %04x => %04x\n", p_wregs[SI], wregs[SI]);
+    if (cpu->wregs[SI] != p_wregs[SI]) {
+      printf("  SI %04x => %04x\n", p_wregs[SI], cpu->wregs[SI]);
     }
-    if (wregs[DI] != p_wregs[DI]) {
-      printf("  DI %04x => %04x\n", p_wregs[DI], wregs[DI]);
+    if (cpu->wregs[DI] != p_wregs[DI]) {
+      printf("  DI %04x => %04x\n", p_wregs[DI], cpu->wregs[DI]);
     }
-    if (sregs[ES] != p_sregs[ES]) {
-      printf("  ES %04x => %04x\n", p_sregs[ES], sregs[ES]);
+    if (cpu->sregs[ES] != p_sregs[ES]) {
+      printf("  ES %04x => %04x\n", p_sregs[ES], cpu->sregs[ES]);
     }
-    if (sregs[CS] != p_sregs[CS]) {
-      printf("  CS %04x => %04x\n", p_sregs[CS], sregs[CS]);
+    if (cpu->sregs[CS] != p_sregs[CS]) {
+      printf("  CS %04x => %04x\n", p_sregs[CS], cpu->sregs[CS]);
     }
-    if (sregs[SS] != p_sregs[SS]) {
-      printf("  SS %04x => %04x\n", p_sregs[SS], sregs[SS]);
+    if (cpu->sregs[SS] != p_sregs[SS]) {
+      printf("  SS %04x => %04x\n", p_sregs[SS], cpu->sregs[SS]);
     }
-    if (sregs[DS] != p_sregs[DS]) {
-      printf("  DS %04x => %04x\n", p_sregs[DS], sregs[DS]);
+    if (cpu->sregs[DS] != p_sregs[DS]) {
+      printf("  DS %04x => %04x\n", p_sregs[DS], cpu->sregs[DS]);
     }
   }
 
   for (uint32_t i = 0; i < 8; ++i) {
-    p_wregs[i] = wregs[i];
+    p_wregs[i] = cpu->wregs[i];
   }
   for (uint32_t i = 0; i < 4; ++i) {
-    p_sregs[i] = sregs[i];
+    p_sregs[i] = cpu->sregs[i];
   }
-  p_CF = CF;
-  p_PF = PF;
-  p_ZF = ZF;
-  p_TF = TF;
-  p_IF = IF;
-  p_DF = DF;
-  p_AF = AF;
-  p_OF = OF;
-  p_SF = SF;
+  p_CF = cpu->CF;
+  p_PF = cpu->PF;
+  p_ZF = cpu->ZF;
+  p_TF = cpu->TF;
+  p_IF = cpu->IF;
+  p_DF = cpu->DF;
+  p_AF = cpu->AF;
+  p_OF = cpu->OF;
+  p_SF = cpu->SF;
 }
 
 static void dump_all(void) {
-  printf("  AX => %04x\n", wregs[AX]);
-  printf("  CX => %04x\n", wregs[CX]);
-  printf("  DX => %04x\n", wregs[DX]);
-  printf("  BX => %04x\n", wregs[BX]);
-  printf("  SP => %04x\n", wregs[SP]);
-  printf("  BP => %04x\n", wregs[BP]);
-  printf("  SI => %04x\n", wregs[SI]);
-  printf("  DI => %04x\n", wregs[DI]);
-  printf("  ES => %04x\n", sregs[ES]);
-  printf("  CS => %04x\n", sregs[CS]);
-  printf("  SS => %04x\n", sregs[SS]);
-  printf("  DS => %04x\n", sregs[DS]);
+  printf("  AX => %04x\n", cpu->wregs[AX]);
+  printf("  CX => %04x\n", cpu->wregs[CX]);
+  printf("  DX => %04x\n", cpu->wregs[DX]);
+  printf("  BX => %04x\n", cpu->wregs[BX]);
+  printf("  SP => %04x\n", cpu->wregs[SP]);
+  printf("  BP => %04x\n", cpu->wregs[BP]);
+  printf("  SI => %04x\n", cpu->wregs[SI]);
+  printf("  DI => %04x\n", cpu->wregs[DI]);
+  printf("  ES => %04x\n", cpu->sregs[ES]);
+  printf("  CS => %04x\n", cpu->sregs[CS]);
+  printf("  SS => %04x\n", cpu->sregs[SS]);
+  printf("  DS => %04x\n", cpu->sregs[DS]);
 
   dump_reg_change(true);
 }
 
 static void dump_inst(void)
 {
-    uint32_t nip = start_ip; // (cpu_get_IP() + 0xFFFF) & 0xFFFF; // subtract 1!
+    uint32_t nip = cpu->start_ip; // (cpu_get_IP() + 0xFFFF) & 0xFFFF; // subtract 1!
 
-    uint32_t laddr = cpu_get_address(sregs[CS], nip);
+    uint32_t laddr = cpu_get_address(cpu->sregs[CS], nip);
 
     printf("%c%c%c%c%c%c%c%c ",
-          OF ? 'O' : '.',
-          DF ? 'D' : '.',
-          IF ? 'I' : '.',
-          SF ? 'S' : '.',
-          ZF ? 'Z' : '.',
-          AF ? 'A' : '.',
-          PF ? 'P' : '.',
-          CF ? 'C' : '.');
+          cpu->OF ? 'O' : '.',
+          cpu->DF ? 'D' : '.',
+          cpu->IF ? 'I' : '.',
+          cpu->SF ? 'S' : '.',
+          cpu->ZF ? 'Z' : '.',
+          cpu->AF ? 'A' : '.',
+          cpu->PF ? 'P' : '.',
+          cpu->CF ? 'C' : '.');
     printf("%04x ", nip);
     printf("%05x: ", laddr);
 
-    ud_set_input_buffer(&ud_obj, memory + laddr, 128);
-    ud_set_pc(&ud_obj, nip);
+    ud_set_input_buffer(&cpu->ud_obj, cpu->machine->memory + laddr, 128);
+    ud_set_pc(&cpu->ud_obj, nip);
 
-    ud_disassemble(&ud_obj);
+    ud_disassemble(&cpu->ud_obj);
 
-    const char* str = ud_insn_asm(&ud_obj);
+    const char* str = ud_insn_asm(&cpu->ud_obj);
     printf("%s\n", str);
 }
 
-static void do_instruction(uint8_t code)
-{
-    if (cpu_debug) {
-      dump_reg_change(false);
-      dump_inst();
-    }
-    switch(code)
-    {
-    case 0x00: OP_br8(ADD);
-    case 0x01: OP_wr16(ADD);
-    case 0x02: OP_r8b(ADD);
-    case 0x03: OP_r16w(ADD);
-    case 0x04: OP_ald8(ADD);
-    case 0x05: OP_axd16(ADD);
-    case 0x06: PushWord(sregs[ES]);                            break;
-    case 0x07: sregs[ES] = PopWord();                          break;
-    case 0x08: OP_br8(OR);
-    case 0x09: OP_wr16(OR);
-    case 0x0A: OP_r8b(OR);
-    case 0x0B: OP_r16w(OR);
-    case 0x0C: OP_ald8(OR);
-    case 0x0D: OP_axd16(OR);
-    case 0x0e: PushWord(sregs[CS]);                            break;
-    case 0x0f: i_undefined();                                  break;
-    case 0x10: OP_br8(ADC);
-    case 0x11: OP_wr16(ADC);
-    case 0x12: OP_r8b(ADC);
-    case 0x13: OP_r16w(ADC);
-    case 0x14: OP_ald8(ADC);
-    case 0x15: OP_axd16(ADC);
-    case 0x16: PushWord(sregs[SS]);                            break;
-    case 0x17: sregs[SS] = PopWord();                          break;
-    case 0x18: OP_br8(SBB);
-    case 0x19: OP_wr16(SBB);
-    case 0x1A: OP_r8b(SBB);
-    case 0x1B: OP_r16w(SBB);
-    case 0x1C: OP_ald8(SBB);
-    case 0x1D: OP_axd16(SBB);
-    case 0x1e: PushWord(sregs[DS]);                            break;
-    case 0x1f: sregs[DS] = PopWord();                          break;
-    case 0x20: OP_br8(AND);
-    case 0x21: OP_wr16(AND);
-    case 0x22: OP_r8b(AND);
-    case 0x23: OP_r16w(AND);
-    case 0x24: OP_ald8(AND);
-    case 0x25: OP_axd16(AND);
-    case 0x26: SEG_OVERRIDE(ES);
-    case 0x27: i_daa();                                        break;
-    case 0x28: OP_br8(SUB);
-    case 0x29: OP_wr16(SUB);
-    case 0x2A: OP_r8b(SUB);
-    case 0x2B: OP_r16w(SUB);
-    case 0x2C: OP_ald8(SUB);
-    case 0x2D: OP_axd16(SUB);
-    case 0x2E: SEG_OVERRIDE(CS);
-    case 0x2f: i_das();                                        break;
-    case 0x30: OP_br8(XOR);
-    case 0x31: OP_wr16(XOR);
-    case 0x32: OP_r8b(XOR);
-    case 0x33: OP_r16w(XOR);
-    case 0x34: OP_ald8(XOR);
-    case 0x35: OP_axd16(XOR);
-    case 0x36: SEG_OVERRIDE(SS);
-    case 0x37: i_aaa();                                        break;
-    case 0x38: OP_br8(CMP);
-    case 0x39: OP_wr16(CMP);
-    case 0x3A: OP_r8b(CMP);
-    case 0x3B: OP_r16w(CMP);
-    case 0x3C: OP_ald8(CMP);
-    case 0x3D: OP_axd16(CMP);
-    case 0x3E: SEG_OVERRIDE(DS);
-    case 0x3f: i_aas();                                        break;
-    case 0x40: INC_WR(AX);
-    case 0x41: INC_WR(CX);
-    case 0x42: INC_WR(DX);
-    case 0x43: INC_WR(BX);
-    case 0x44: INC_WR(SP);
-    case 0x45: INC_WR(BP);
-    case 0x46: INC_WR(SI);
-    case 0x47: INC_WR(DI);
-    case 0x48: DEC_WR(AX);
-    case 0x49: DEC_WR(CX);
-    case 0x4a: DEC_WR(DX);
-    case 0x4b: DEC_WR(BX);
-    case 0x4c: DEC_WR(SP);
-    case 0x4d: DEC_WR(BP);
-    case 0x4e: DEC_WR(SI);
-    case 0x4f: DEC_WR(DI);
-    case 0x50: PUSH_WR(AX);
-    case 0x51: PUSH_WR(CX);
-    case 0x52: PUSH_WR(DX);
-    case 0x53: PUSH_WR(BX);
-    case 0x54: PUSH_SP();
-    case 0x55: PUSH_WR(BP);
-    case 0x56: PUSH_WR(SI);
-    case 0x57: PUSH_WR(DI);
-    case 0x58: POP_WR(AX);
-    case 0x59: POP_WR(CX);
-    case 0x5a: POP_WR(DX);
-    case 0x5b: POP_WR(BX);
-    case 0x5c: POP_WR(SP);
-    case 0x5d: POP_WR(BP);
-    case 0x5e: POP_WR(SI);
-    case 0x5f: POP_WR(DI);
-    case 0x60: i_pusha();                                      break; /* 186 */
-    case 0x61: i_popa();                                       break; /* 186 */
-    case 0x62: i_bound();                                      break; /* 186 */
-    case 0x63: i_undefined();                                  break;
-    case 0x64: i_undefined();                                  break;
-    case 0x65: i_undefined();                                  break;
-    case 0x66: i_undefined();                                  break;
-    case 0x67: i_undefined();                                  break;
-    case 0x68: PushWord(FETCH_W());                            break; /* 186 */
-    case 0x69: i_imul_r16w_d16();                              break; /* 186 */
-    case 0x6a: PushWord((int8_t)FETCH_B());                    break; /* 186 */
-    case 0x6b: i_imul_r16w_d8();                               break; /* 186 */
-    case 0x6c: i_insb();                                       break; /* 186 */
-    case 0x6d: i_insw();                                       break; /* 186 */
-    case 0x6e: i_outsb();                                      break; /* 186 */
-    case 0x6f: i_outsw();                                      break; /* 186 */
-    case 0x70: do_cjump(OF);                                   break;
-    case 0x71: do_cjump(!OF);                                  break;
-    case 0x72: do_cjump(CF);                                   break;
-    case 0x73: do_cjump(!CF);                                  break;
-    case 0x74: do_cjump(ZF);                                   break;
-    case 0x75: do_cjump(!ZF);                                  break;
-    case 0x76: do_cjump(CF || ZF);                             break;
-    case 0x77: do_cjump(!CF && !ZF);                           break;
-    case 0x78: do_cjump(SF);                                   break;
-    case 0x79: do_cjump(!SF);                                  break;
-    case 0x7a: do_cjump(PF);                                   break;
-    case 0x7b: do_cjump(!PF);                                  break;
-    case 0x7c: do_cjump((!SF != !OF) && !ZF);                  break;
-    case 0x7d: do_cjump((!SF == !OF) || ZF);                   break;
-    case 0x7e: do_cjump((!SF != !OF) || ZF);                   break;
-    case 0x7f: do_cjump((!SF == !OF) && !ZF);                  break;
-    case 0x80: i_80pre();                                      break;
-    case 0x81: i_81pre();                                      break;
-    case 0x82: i_82pre();                                      break;
-    case 0x83: i_83pre();                                      break;
-    case 0x84: OP_br8(TEST);
-    case 0x85: OP_wr16(TEST);
-    case 0x86: i_xchg_br8();                                   break;
-    case 0x87: i_xchg_wr16();                                  break;
-    case 0x88: OP_br8(MOV);
-    case 0x89: OP_wr16(MOV);
-    case 0x8a: OP_r8b(MOV);
-    case 0x8b: OP_r16w(MOV);
-    case 0x8c: i_mov_wsreg();                                  break;
-    case 0x8d: i_lea();                                        break;
-    case 0x8e: i_mov_sregw();                                  break;
-    case 0x8f: i_popw();                                       break;
-    case 0x90: /* NOP */                                       break;
-    case 0x91: XCHG_AX_WR(CX);
-    case 0x92: XCHG_AX_WR(DX);
-    case 0x93: XCHG_AX_WR(BX);
-    case 0x94: XCHG_AX_WR(SP);
-    case 0x95: XCHG_AX_WR(BP);
-    case 0x96: XCHG_AX_WR(SI);
-    case 0x97: XCHG_AX_WR(DI);
-    case 0x98: wregs[AX] = (int8_t)(0xFF & wregs[AX]);         break;
-    case 0x99: wregs[DX] = (wregs[AX] & 0x8000) ? 0xffff : 0;  break;
-    case 0x9a: i_call_far();                                   break;
-    case 0x9b: /* WAIT */                                      break;
-    case 0x9c: PushWord(CompressFlags());                      break;
-    case 0x9d: do_popf();                                      break;
-    case 0x9e: i_sahf();                                       break;
-    case 0x9f: i_lahf();                                       break;
-    case 0xa0: i_mov_aldisp();                                 break;
-    case 0xa1: i_mov_axdisp();                                 break;
-    case 0xa2: i_mov_dispal();                                 break;
-    case 0xa3: i_mov_dispax();                                 break;
-    case 0xa4: i_movsb();                                      break;
-    case 0xa5: i_movsw();                                      break;
-    case 0xa6: i_cmpsb();                                      break;
-    case 0xa7: i_cmpsw();                                      break;
-    case 0xa8: OP_ald8(TEST);
-    case 0xa9: OP_axd16(TEST);
-    case 0xaa: i_stosb();                                      break;
-    case 0xab: i_stosw();                                      break;
-    case 0xac: i_lodsb();                                      break;
-    case 0xad: i_lodsw();                                      break;
-    case 0xae: i_scasb();                                      break;
-    case 0xaf: i_scasw();                                      break;
-    case 0xb0: MOV_BRL(AX);
-    case 0xb1: MOV_BRL(CX);
-    case 0xb2: MOV_BRL(DX);
-    case 0xb3: MOV_BRL(BX);
-    case 0xb4: MOV_BRH(AX);
-    case 0xb5: MOV_BRH(CX);
-    case 0xb6: MOV_BRH(DX);
-    case 0xb7: MOV_BRH(BX);
-    case 0xb8: MOV_WRi(AX);
-    case 0xb9: MOV_WRi(CX);
-    case 0xba: MOV_WRi(DX);
-    case 0xbb: MOV_WRi(BX);
-    case 0xbc: MOV_WRi(SP);
-    case 0xbd: MOV_WRi(BP);
-    case 0xbe: MOV_WRi(SI);
-    case 0xbf: MOV_WRi(DI);
-    case 0xc0: i_c0pre();                                      break; /* 186 */
-    case 0xc1: i_c1pre();                                      break; /* 186 */
-    case 0xc2: i_ret_d16();                                    break;
-    case 0xc3: i_ret();                                        break;
-    case 0xc4: i_les_dw();                                     break;
-    case 0xc5: i_lds_dw();                                     break;
-    case 0xc6: i_mov_bd8();                                    break;
-    case 0xc7: i_mov_wd16();                                   break;
-    case 0xc8: i_enter();                                      break;
-    case 0xc9: i_leave();                                      break;
-    case 0xca: i_retf_d16();                                   break;
-    case 0xcb: do_retf();                                      break;
-    case 0xcc: i_int3();                                       break;
-    case 0xcd: i_int();                                        break;
-    case 0xce: i_into();                                       break;
-    case 0xcf: do_iret();                                      break;
-    case 0xd0: i_d0pre();                                      break;
-    case 0xd1: i_d1pre();                                      break;
-    case 0xd2: i_d2pre();                                      break;
-    case 0xd3: i_d3pre();                                      break;
-    case 0xd4: i_aam();                                        break;
-    case 0xd5: i_aad();                                        break;
-    case 0xd6: i_undefined();                                  break;
-    case 0xd7: i_xlat();                                       break;
-    case 0xd8: i_escape();                                     break;
-    case 0xd9: i_escape();                                     break;
-    case 0xda: i_escape();                                     break;
-    case 0xdb: i_escape();                                     break;
-    case 0xdc: i_escape();                                     break;
-    case 0xdd: i_escape();                                     break;
-    case 0xde: i_escape();                                     break;
-    case 0xdf: i_escape();                                     break;
-    case 0xe0: i_loopne();                                     break;
-    case 0xe1: i_loope();                                      break;
-    case 0xe2: i_loop();                                       break;
-    case 0xe3: i_jcxz();                                       break;
-    case 0xe4: i_inal();                                       break;
-    case 0xe5: i_inax();                                       break;
-    case 0xe6: i_outal();                                      break;
-    case 0xe7: i_outax();                                      break;
-    case 0xe8: i_call_d16();                                   break;
-    case 0xe9: i_jmp_d16();                                    break;
-    case 0xea: i_jmp_far();                                    break;
-    case 0xeb: i_jmp_d8();                                     break;
-    case 0xec: i_inaldx();                                     break;
-    case 0xed: i_inaxdx();                                     break;
-    case 0xee: i_outdxal();                                    break;
-    case 0xef: i_outdxax();                                    break;
-    case 0xf0: /* LOCK */                                      break;
-    case 0xf1: i_undefined();                                  break;
-    case 0xf2: rep(0);                                         break;
-    case 0xf3: rep(1);                                         break;
-    case 0xf4: i_halt();
-    case 0xf5: CF = !CF;                                       break;
-    case 0xf6: i_f6pre();                                      break;
-    case 0xf7: i_f7pre();                                      break;
-    case 0xf8: CF = 0;                                         break;
-    case 0xf9: CF = 1;                                         break;
-    case 0xfa: IF = 0;                                         break;
-    case 0xfb: i_sti();                                        break;
-    case 0xfc: DF = 0;                                         break;
-    case 0xfd: DF = 1;                                         break;
-    case 0xfe: i_fepre();                                      break;
-    case 0xff: i_ffpre();                                      break;
-    };
-}
-
-void cpu_step(void)
+static void check_irq(void)
 {
     // emulate a very simple PIC
-    if (IF && irq_mask)
+    if (cpu->IF && cpu->irq_mask)
     {
         // Get lower set bit (highest priority IRQ)
-        uint16_t bit = irq_mask & -irq_mask;
+        uint16_t bit = cpu->irq_mask & -cpu->irq_mask;
         if (bit)
         {
-            irq_mask &= ~bit;  // deassert IRQ when serviced
+            cpu->irq_mask &= ~bit;  // deassert IRQ when serviced
+            cpu->halted = false;
             switch (bit) {
             case 0b01:
                 interrupt(8);
@@ -2722,69 +3447,348 @@ void cpu_step(void)
             }
         }
     }
+}
+
+#ifdef CPU_FUSE
+// Whether the interpreter loop would go on to the instruction after this
+// one of a fused sequence, without stopping or taking an interrupt, and it
+// is still the one decoded.
+static inline bool fused_continue(const decode_t *e, uint32_t addr)
+{
+    return cpu->cycles < cpu->run_end && !(cpu->IF && cpu->irq_mask) && e->addr == addr;
+}
+
+#endif
+
+// The interpreter cores, one for each CPU model and one more for each with
+// the debug output and trace. The compiled ROM blocks are built for the
+// default model.
+#define CPU_PUSH_80286  1
+#define CPU_SHIFT_80186 1
+#define CORE(name) name##_80186
+#define CORE_TRACE 0
+#define CORE_AOT   1
+#include "cpu_core.h"
+#define CORE(name) name##_80186_traced
+#define CORE_TRACE 1
+#define CORE_AOT   0
+#include "cpu_core.h"
+#undef CPU_SHIFT_80186
+#undef CPU_PUSH_80286
+
+#define CPU_PUSH_80286  0
+#define CPU_SHIFT_80186 0
+#define CORE(name) name##_v20
+#define CORE_TRACE 0
+#define CORE_AOT   0
+#include "cpu_core.h"
+#define CORE(name) name##_v20_traced
+#define CORE_TRACE 1
+#define CORE_AOT   0
+#include "cpu_core.h"
+#undef CPU_SHIFT_80186
+#undef CPU_PUSH_80286
+
+static const cpu_core_t *const cpu_cores[CPU_MODELS][2] = {
+    [CPU_80186] = { &core_80186, &core_80186_traced },
+    [CPU_V20]   = { &core_v20,   &core_v20_traced },
+};
+
+// Pick the core for the CPU model, traced while the debug output or the
+// trace is on. cpu_set_debug() and cpu_set_trace() end the run so that
+// cpu_run() picks again.
+static void select_core(void)
+{
+    cpu->core = cpu_cores[cpu->model][cpu->debug || cpu->trace];
+}
+
+uint32_t cpu_step(machine_t *m)
+{
+    cpu = m->cpu;
+    const uint64_t start = cpu->cycles;
+
+    check_irq();
+    if(cpu->halted)
+        return 0;
 
     // execute instruction
-    next_instruction();
+    select_core();
+    cpu->core->next_instruction();
+    if(cpu->reference)
+        SyncFlags();
+    return (uint32_t)(cpu->cycles - start);
+}
+
+// The reference interpreter, see cpu_set_reference(). Flags are brought up
+// to date after every instruction, so none of the lazy flag reads of the
+// next one take their shortcut.
+static void run_reference(void)
+{
+    while(cpu->cycles < cpu->run_end)
+    {
+        check_irq();
+        cpu->core->next_instruction();
+        SyncFlags();
+    }
+}
+
+#ifdef CPU_JIT_X64
+#include "cpu_jit.h"
+#endif
+
+cpu_t *cpu_create(machine_t *m)
+{
+    cpu = calloc(1, sizeof(cpu_t));
+    if(!cpu)
+        return NULL;
+    cpu->machine = m;
+    cpu->model = CPU_80186;
+    select_core();
+    cpu->jit_enabled = true;
+#ifdef CPU_PROFILE
+    profile_create();
+    if(!cpu->profile)
+    {
+        free(cpu);
+        return NULL;
+    }
+#endif
+    return cpu;
+}
+
+void cpu_destroy(cpu_t *c)
+{
+    cpu = c;
+#ifdef CPU_JIT_X64
+    jit_destroy();
+#endif
+#ifdef CPU_PROFILE
+    profile_destroy();
+#endif
+    free(c);
+    cpu = NULL;
+}
+
+uint32_t cpu_run(machine_t *m, uint32_t budget)
+{
+    cpu = m->cpu;
+    const uint64_t start = cpu->cycles;
+    const uint64_t end = start + budget;
+
+    cpu->stopped = false;
+    while(cpu->cycles < end && !cpu->stopped)
+    {
+        if(cpu->halted)
+        {
+            // Sleep until an interrupt wakes the CPU, or through to the end
+            // of the budget which the caller sets to its next event.
+            check_irq();
+            if(cpu->halted)
+            {
+                cpu->cycles = end;
+                break;
+            }
+        }
+        cpu->run_end = end;
+        select_core();
+        if(cpu->reference)
+        {
+            run_reference();
+            continue;
+        }
+#ifdef CPU_JIT_X64
+        if(cpu->jit_enabled && !cpu->debug && !cpu->trace && jit_init())
+        {
+            jit_run();
+            continue;
+        }
+#endif
+        cpu->core->run();
+    }
+    return (uint32_t)(cpu->cycles - start);
+}
+
+bool cpu_halted(machine_t *m) { cpu = m->cpu; return cpu->halted; }
+
+void cpu_get_state(machine_t *m, cpu_state_t *s)
+{
+    cpu = m->cpu;
+    memcpy(s->regs, cpu->wregs, sizeof(s->regs));
+    memcpy(s->segs, cpu->sregs, sizeof(s->segs));
+    s->pc       = cpu->ip;
+    s->flags    = CompressFlags();
+    s->irqs     = cpu->irq_mask;
+    s->sleeping = cpu->halted;
+    s->clock    = cpu->cycles;
+}
+
+void cpu_set_registers(machine_t *m, const cpu_state_t *s)
+{
+    cpu = m->cpu;
+    memcpy(cpu->wregs, s->regs, sizeof(s->regs));
+    memcpy(cpu->sregs, s->segs, sizeof(s->segs));
+    cpu->ip = s->pc;
+    ExpandFlags(s->flags);
+    cpu->irq_mask = s->irqs;
+    cpu->halted   = s->sleeping;
+    cpu->cycles   = s->clock;
+    cpu->segment_override = NoSeg;
+}
+
+void cpu_set_state(machine_t *m, const cpu_state_t *s)
+{
+    cpu_set_registers(m, s);
+    dcache_flush();
+}
+
+void cpu_invalidate(machine_t *m, uint32_t addr, uint32_t size)
+{
+    cpu = m->cpu;
+    dcache_invalidate_range(addr, size);
+#ifdef CPU_AOT
+    cpu->aot_checked = false;
+#endif
+}
+
+void cpu_stop(machine_t *m)
+{
+    cpu = m->cpu;
+    cpu->stopped = true;
+    cpu->run_end = cpu->cycles;  // leave the inner loops after this instruction
+}
+
+void cpu_set_jit(machine_t *m, bool enable)
+{
+    cpu = m->cpu;
+    cpu->jit_enabled = enable;
+}
+
+bool cpu_get_jit(machine_t *m)
+{
+#ifdef CPU_JIT_X64
+    cpu = m->cpu;
+    return cpu->jit_enabled;
+#else
+    (void)m;
+    return false;
+#endif
+}
+
+void cpu_set_model(machine_t *m, cpu_model_t model)
+{
+    cpu = m->cpu;
+    cpu->model = model;
+    select_core();
+    dcache_flush();  // translated code depends on the model
+}
+
+void cpu_set_debug(machine_t *m, bool enable)
+{
+    cpu = m->cpu;
+    if(cpu->debug != enable)
+        cpu->run_end = cpu->cycles;  // continue in the other core, see select_core()
+    cpu->debug = enable;
+}
+
+void cpu_set_trace(machine_t *m, trace_t *t)
+{
+    cpu = m->cpu;
+    if(!cpu->trace != !t)
+        cpu->run_end = cpu->cycles;
+    cpu->trace = t;
+}
+
+void cpu_set_reference(machine_t *m, bool enable)
+{
+    cpu = m->cpu;
+    cpu->reference = enable;
+    dcache_flush();
 }
 
 // Set CPU registers from outside
-void cpu_set_AH(uint8_t  v) { wregs[AX] = (v << 8)   | (wregs[AX] & 0x00ff); }
-void cpu_set_AL(uint8_t  v) { wregs[AX] = (v & 0xff) | (wregs[AX] & 0xff00); }
-void cpu_set_AX(uint16_t v) { wregs[AX] = v; }
-
-void cpu_set_CH(uint8_t  v) { wregs[CX] = (v << 8)   | (wregs[CX] & 0x00ff); }
-void cpu_set_CL(uint8_t  v) { wregs[CX] = (v & 0xff) | (wregs[CX] & 0xff00); }
-void cpu_set_CX(uint16_t v) { wregs[CX] = v; }
-
-void cpu_set_DH(uint8_t  v) { wregs[DX] = (v << 8)   | (wregs[DX] & 0x00ff); }
-void cpu_set_DL(uint8_t  v) { wregs[DX] = (v & 0xff) | (wregs[DX] & 0xff00); }
-void cpu_set_DX(uint16_t v) { wregs[DX] = v; }
-
-void cpu_set_BH(uint8_t  v) { wregs[BX] = (v << 8)   | (wregs[BX] & 0x00ff); }
-void cpu_set_BL(uint8_t  v) { wregs[BX] = (v & 0xff) | (wregs[BX] & 0xff00); }
-void cpu_set_BX(uint16_t v) { wregs[BX] = v; }
-
-void cpu_set_SP(uint16_t v) { wregs[SP] = v; }
-void cpu_set_BP(uint16_t v) { wregs[BP] = v; }
-void cpu_set_SI(uint16_t v) { wregs[SI] = v; }
-void cpu_set_DI(uint16_t v) { wregs[DI] = v; }
-void cpu_set_ES(uint16_t v) { sregs[ES] = v; }
-void cpu_set_CS(uint16_t v) { sregs[CS] = v; }
-void cpu_set_SS(uint16_t v) { sregs[SS] = v; }
-void cpu_set_DS(uint16_t v) { sregs[DS] = v; }
-void cpu_set_IP(uint16_t v) { ip = v; }
-
-void cpu_set_CF(uint8_t v) { CF = v ? 1 : 0; }
+void cpu_set_AH(machine_t *m, uint8_t  v) { cpu = m->cpu; cpu->wregs[AX] = (v << 8)   | (cpu->wregs[AX] & 0x00ff); }
+void cpu_set_AL(machine_t *m, uint8_t  v) { cpu = m->cpu; cpu->wregs[AX] = (v & 0xff) | (cpu->wregs[AX] & 0xff00); }
+void cpu_set_AX(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->wregs[AX] = v; }
+
+void cpu_set_CH(machine_t *m, uint8_t  v) { cpu = m->cpu; cpu->wregs[CX] = (v << 8)   | (cpu->wregs[CX] & 0x00ff); }
+void cpu_set_CL(machine_t *m, uint8_t  v) { cpu = m->cpu; cpu->wregs[CX] = (v & 0xff) | (cpu->wregs[CX] & 0xff00); }
+void cpu_set_CX(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->wregs[CX] = v; }
+
+void cpu_set_DH(machine_t *m, uint8_t  v) { cpu = m->cpu; cpu->wregs[DX] = (v << 8)   | (cpu->wregs[DX] & 0x00ff); }
+void cpu_set_DL(machine_t *m, uint8_t  v) { cpu = m->cpu; cpu->wregs[DX] = (v & 0xff) | (cpu->wregs[DX] & 0xff00); }
+void cpu_set_DX(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->wregs[DX] = v; }
+
+void cpu_set_BH(machine_t *m, uint8_t  v) { cpu = m->cpu; cpu->wregs[BX] = (v << 8)   | (cpu->wregs[BX] & 0x00ff); }
+void cpu_set_BL(machine_t *m, uint8_t  v) { cpu = m->cpu; cpu->wregs[BX] = (v & 0xff) | (cpu->wregs[BX] & 0xff00); }
+void cpu_set_BX(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->wregs[BX] = v; }
+
+void cpu_set_SP(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->wregs[SP] = v; }
+void cpu_set_BP(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->wregs[BP] = v; }
+void cpu_set_SI(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->wregs[SI] = v; }
+void cpu_set_DI(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->wregs[DI] = v; }
+void cpu_set_ES(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->sregs[ES] = v; }
+void cpu_set_CS(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->sregs[CS] = v; }
+void cpu_set_SS(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->sregs[SS] = v; }
+void cpu_set_DS(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->sregs[DS] = v; }
+void cpu_set_IP(machine_t *m, uint16_t v) { cpu = m->cpu; cpu->ip = v; }
+
+void cpu_set_CF(machine_t *m, uint8_t v) { cpu = m->cpu; SyncFlags(); cpu->CF = v ? 1 : 0; }
 
 // Get CPU registers from outside
-uint16_t cpu_get_AX(void) { return wregs[AX]; }
-uint8_t  cpu_get_AH(void) { return wregs[AX] >> 8; }
-uint8_t  cpu_get_AL(void) { return wregs[AX] & 0xff; }
-uint16_t cpu_get_CX(void) { return wregs[CX]; }
-uint8_t  cpu_get_CH(void) { return wregs[CX] >> 8; }
-uint8_t  cpu_get_CL(void) { return wregs[CX] & 0xff; }
-uint16_t cpu_get_DX(void) { return wregs[DX]; }
-uint8_t  cpu_get_DH(void) { return wregs[DX] >> 8; }
-uint8_t  cpu_get_DL(void) { return wregs[DX] & 0xff; }
-uint16_t cpu_get_BX(void) { return wregs[BX]; }
-uint8_t  cpu_get_BH(void) { return wregs[BX] >> 8; }
-uint8_t  cpu_get_BL(void) { return wregs[BX] & 0xff; }
-uint16_t cpu_get_SP(void) { return wregs[SP]; }
-uint16_t cpu_get_BP(void) { return wregs[BP]; }
-uint16_t cpu_get_SI(void) { return wregs[SI]; }
-uint16_t cpu_get_DI(void) { return wregs[DI]; }
-uint16_t cpu_get_ES(void) { return sregs[ES]; }
-uint16_t cpu_get_CS(void) { return sregs[CS]; }
-uint16_t cpu_get_SS(void) { return sregs[SS]; }
-uint16_t cpu_get_DS(void) { return sregs[DS]; }
-uint16_t cpu_get_IP(void) { return ip; }
+uint16_t cpu_get_AX(machine_t *m) { cpu = m->cpu; return cpu->wregs[AX]; }
+uint8_t  cpu_get_AH(machine_t *m) { cpu = m->cpu; return cpu->wregs[AX] >> 8; }
+uint8_t  cpu_get_AL(machine_t *m) { cpu = m->cpu; return cpu->wregs[AX] & 0xff; }
+uint16_t cpu_get_CX(machine_t *m) { cpu = m->cpu; return cpu->wregs[CX]; }
+uint8_t  cpu_get_CH(machine_t *m) { cpu = m->cpu; return cpu->wregs[CX] >> 8; }
+uint8_t  cpu_get_CL(machine_t *m) { cpu = m->cpu; return cpu->wregs[CX] & 0xff; }
+uint16_t cpu_get_DX(machine_t *m) { cpu = m->cpu; return cpu->wregs[DX]; }
+uint8_t  cpu_get_DH(machine_t *m) { cpu = m->cpu; return cpu->wregs[DX] >> 8; }
+uint8_t  cpu_get_DL(machine_t *m) { cpu = m->cpu; return cpu->wregs[DX] & 0xff; }
+uint16_t cpu_get_BX(machine_t *m) { cpu = m->cpu; return cpu->wregs[BX]; }
+uint8_t  cpu_get_BH(machine_t *m) { cpu = m->cpu; return cpu->wregs[BX] >> 8; }
+uint8_t  cpu_get_BL(machine_t *m) { cpu = m->cpu; return cpu->wregs[BX] & 0xff; }
+uint16_t cpu_get_SP(machine_t *m) { cpu = m->cpu; return cpu->wregs[SP]; }
+uint16_t cpu_get_BP(machine_t *m) { cpu = m->cpu; return cpu->wregs[BP]; }
+uint16_t cpu_get_SI(machine_t *m) { cpu = m->cpu; return cpu->wregs[SI]; }
+uint16_t cpu_get_DI(machine_t *m) { cpu = m->cpu; return cpu->wregs[DI]; }
+uint16_t cpu_get_ES(machine_t *m) { cpu = m->cpu; return cpu->sregs[ES]; }
+uint16_t cpu_get_CS(machine_t *m) { cpu = m->cpu; return cpu->sregs[CS]; }
+uint16_t cpu_get_SS(machine_t *m) { cpu = m->cpu; return cpu->sregs[SS]; }
+uint16_t cpu_get_DS(machine_t *m) { cpu = m->cpu; return cpu->sregs[DS]; }
+uint16_t cpu_get_IP(machine_t *m) { cpu = m->cpu; return cpu->ip; }
+
+uint64_t cpu_get_cycles(machine_t *m) { cpu = m->cpu; return cpu->cycles; }
+
+uint64_t cpu_get_instructions(machine_t *m) { cpu = m->cpu; return cpu->retired; }
+
+#ifdef CPU_PROFILE
+void cpu_profile_reset(machine_t *m)
+{
+    cpu = m->cpu;
+    memset(cpu->profile->entries, 0, sizeof(cpu->profile->entries));
+    memset(cpu->profile->reps, 0, sizeof(cpu->profile->reps));
+    cpu->profile->used = 0;
+    cpu->profile->dropped = 0;
+}
+
+bool cpu_profile_write(machine_t *m, const char *path, bool folded)
+{
+    cpu = m->cpu;
+    FILE *fd = fopen(path, "w");
+    if(!fd)
+        return false;
+    const bool ok = folded ? profile_folded(fd) : profile_report(fd);
+    return (fclose(fd) == 0) && ok;
+}
+#endif
 
 uint32_t cpu_get_address(uint16_t segment, uint16_t offset)
 {
     return 0xFFFFF & (segment * 16 + offset);
 }
 
-uint16_t cpu_get_stack(uint16_t disp)
+uint16_t cpu_get_stack(machine_t *m, uint16_t disp)
 {
-    return GetMemW(SS, wregs[SP] + disp);
+    cpu = m->cpu;
+    return GetMemW(SS, cpu->wregs[SP] + disp);
 }
@@ -7,71 +7,171 @@
 enum { AX, CX, DX, BX, SP, BP, SI, DI };
 enum { ES, CS, SS, DS, NoSeg };
 
-extern uint8_t memory[1024 * 1024];
-extern uint8_t io[1024 * 64];
-extern bool cpu_debug;
+// One emulated machine, see machine.h. Every cpu_* function works on the
+// CPU of the machine passed in, machines can be run concurrently from
+// different threads.
+typedef struct machine_t machine_t;
+typedef struct cpu_t cpu_t;
+typedef struct trace_t trace_t;
+
+// The V20 runs at half the 20MHz bus clock of the gateware.
+#define CPU_CLOCK 10000000
 
 uint32_t cpu_get_address(uint16_t segment, uint16_t offset);
 
-uint8_t port_read (uint32_t port);
-void    port_write(uint32_t port, uint8_t value);
-uint8_t mem_read  (uint32_t addr);
-void    mem_write (uint32_t addr, uint8_t data);
-void    int_notify(uint8_t num);
-
-void cpu_step(void);
-void cpu_init(void);
-void cpu_interrupt(uint8_t irqn);
-
-uint8_t  cpu_get_AH(void);
-uint8_t  cpu_get_AL(void);
-uint16_t cpu_get_AX(void);
-uint8_t  cpu_get_CH(void);
-uint8_t  cpu_get_CL(void);
-uint16_t cpu_get_CX(void);
-uint8_t  cpu_get_DH(void);
-uint8_t  cpu_get_DL(void);
-uint16_t cpu_get_DX(void);
-uint8_t  cpu_get_BH(void);
-uint8_t  cpu_get_BL(void);
-uint16_t cpu_get_BX(void);
-uint16_t cpu_get_SP(void);
-uint16_t cpu_get_BP(void);
-uint16_t cpu_get_SI(void);
-uint16_t cpu_get_DI(void);
-uint16_t cpu_get_ES(void);
-uint16_t cpu_get_CS(void);
-uint16_t cpu_get_SS(void);
-uint16_t cpu_get_DS(void);
-uint16_t cpu_get_IP(void);
+// Guest memory map in 4KB pages. A page with a host pointer is accessed
+// directly by the CPU, otherwise the access goes through mem_read() and
+// mem_write(). A page with a read pointer but no write pointer is ROM.
+#define MEM_PAGE_BITS 12
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_BITS)
+#define MEM_PAGE_MASK (MEM_PAGE_SIZE - 1)
+#define MEM_PAGES     ((1024 * 1024) >> MEM_PAGE_BITS)
+
+typedef struct {
+  uint8_t *read;                               // host memory or NULL
+  uint8_t *write;                              // host memory or NULL
+  uint8_t (*read_fn) (machine_t *m, uint32_t addr);  // memory mapped device
+  void    (*write_fn)(machine_t *m, uint32_t addr, uint8_t data);
+} mem_page_t;
+
+// Bus of the machine, implemented in machine.c
+uint8_t port_read (machine_t *m, uint32_t port);
+void    port_write(machine_t *m, uint32_t port, uint8_t value);
+uint8_t mem_read  (machine_t *m, uint32_t addr);
+void    mem_write (machine_t *m, uint32_t addr, uint8_t data);
+void    int_notify(machine_t *m, uint8_t num);
+
+// Allocate the CPU of machine m, it still has to be reset with cpu_init().
+cpu_t *cpu_create (machine_t *m);
+void   cpu_destroy(cpu_t *cpu);
+
+// Execute one instruction, or run until at least budget clock cycles have
+// passed. Both return the number of clock cycles executed. After HLT the
+// CPU sleeps until an interrupt is taken: cpu_step() returns 0 and
+// cpu_run() skips to the end of its budget.
+uint32_t cpu_step  (machine_t *m);
+uint32_t cpu_run   (machine_t *m, uint32_t budget);
+bool     cpu_halted(machine_t *m);
+// Make cpu_run() return after the current instruction, for devices to
+// call from a port or memory access.
+void     cpu_stop  (machine_t *m);
+
+// Enable or disable translation of hot code to host code, when the
+// translator is compiled in (ICEXT_JIT). It is enabled by default.
+void cpu_set_jit(machine_t *m, bool enable);
+// Whether code is translated: the translator is compiled in, enabled and
+// has not fallen back to interpreting because the host refused it
+// executable memory.
+bool cpu_get_jit(machine_t *m);
+// CPU models, they differ in the quirks software uses to tell them apart.
+typedef enum {
+  CPU_80186,  // the default, PUSH SP pushes the old SP as on the 80286
+  CPU_V20,    // NEC V20, PUSH SP and shift counts as on the 8088
+  CPU_MODELS
+} cpu_model_t;
+
+// Emulate the given CPU model, the interpreter is built for each of them.
+void cpu_set_model(machine_t *m, cpu_model_t model);
+// Trace every instruction executed to stdout.
+void cpu_set_debug(machine_t *m, bool enable);
+// Record every instruction executed, with its memory writes, to a binary
+// trace, NULL to stop. See trace.h, trace_open() and trace_enable() set it.
+void cpu_set_trace(machine_t *m, trace_t *t);
+// Run every instruction through the plain do_instruction() switch, fetched
+// from memory without the decode cache, with the flags evaluated at the end
+// of each instruction, string instructions element by element and no
+// translation. The baseline the faster paths are checked against, see
+// iceXtLockstep.
+void cpu_set_reference(machine_t *m, bool enable);
+void cpu_init(machine_t *m);
+void cpu_interrupt(machine_t *m, uint8_t irqn);
+
+uint8_t  cpu_get_AH(machine_t *m);
+uint8_t  cpu_get_AL(machine_t *m);
+uint16_t cpu_get_AX(machine_t *m);
+uint8_t  cpu_get_CH(machine_t *m);
+uint8_t  cpu_get_CL(machine_t *m);
+uint16_t cpu_get_CX(machine_t *m);
+uint8_t  cpu_get_DH(machine_t *m);
+uint8_t  cpu_get_DL(machine_t *m);
+uint16_t cpu_get_DX(machine_t *m);
+uint8_t  cpu_get_BH(machine_t *m);
+uint8_t  cpu_get_BL(machine_t *m);
+uint16_t cpu_get_BX(machine_t *m);
+uint16_t cpu_get_SP(machine_t *m);
+uint16_t cpu_get_BP(machine_t *m);
+uint16_t cpu_get_SI(machine_t *m);
+uint16_t cpu_get_DI(machine_t *m);
+uint16_t cpu_get_ES(machine_t *m);
+uint16_t cpu_get_CS(machine_t *m);
+uint16_t cpu_get_SS(machine_t *m);
+uint16_t cpu_get_DS(machine_t *m);
+uint16_t cpu_get_IP(machine_t *m);
+
+#ifdef CPU_PROFILE
+// Host time profile of the interpreter, in builds with ICEXT_PROFILE. The
+// counters run from cpu_create() or the last reset on. The report lists the
+// opcodes, ModRM forms, prefix combinations and rep() variants sorted by
+// host timestamp ticks, the folded form has one "cpu;prefix;...;opcode;form
+// ticks" line per combination for flame graph tools.
+void cpu_profile_reset(machine_t *m);
+bool cpu_profile_write(machine_t *m, const char *path, bool folded);
+#endif
+
+// Clock cycles executed since cpu_init()
+uint64_t cpu_get_cycles(machine_t *m);
+// Instructions executed since cpu_init(), a repeated string instruction
+// counts once
+uint64_t cpu_get_instructions(machine_t *m);
+
+// Architectural state of the CPU, for saving and restoring a machine.
+typedef struct {
+  uint16_t regs[8];   // AX, CX, DX, BX, SP, BP, SI, DI
+  uint16_t segs[4];   // ES, CS, SS, DS
+  uint16_t pc;        // IP
+  uint16_t flags;
+  uint16_t irqs;      // IRQs pending
+  uint8_t  sleeping;  // halted by HLT
+  uint64_t clock;     // clock cycles since cpu_init()
+} cpu_state_t;
+
+void cpu_get_state(machine_t *m, cpu_state_t *s);
+// Also drops all decoded and translated code, memory may have changed.
+void cpu_set_state(machine_t *m, const cpu_state_t *s);
+// The same keeping the decoded and translated code, for callers that report
+// the memory they changed themselves with cpu_invalidate().
+void cpu_set_registers(machine_t *m, const cpu_state_t *s);
+// Drop the decoded and translated code of size bytes of memory at linear
+// address addr, after writing them other than through the CPU.
+void cpu_invalidate(machine_t *m, uint32_t addr, uint32_t size);
 
 // Set CPU registers from outside
-void cpu_set_AH(uint8_t  v);
-void cpu_set_AL(uint8_t  v);
-void cpu_set_AX(uint16_t v);
-
-void cpu_set_CH(uint8_t  v);
-void cpu_set_CL(uint8_t  v);
-void cpu_set_CX(uint16_t v);
-
-void cpu_set_DH(uint8_t  v);
-void cpu_set_DL(uint8_t  v);
-void cpu_set_DX(uint16_t v);
-
-void cpu_set_BH(uint8_t  v);
-void cpu_set_BL(uint8_t  v);
-void cpu_set_BX(uint16_t v);
-
-void cpu_set_SP(uint16_t v);
-void cpu_set_BP(uint16_t v);
-void cpu_set_SI(uint16_t v);
-void cpu_set_DI(uint16_t v);
-void cpu_set_ES(uint16_t v);
-void cpu_set_CS(uint16_t v);
-void cpu_set_SS(uint16_t v);
-void cpu_set_DS(uint16_t v);
-void cpu_set_IP(uint16_t v);
-
-void cpu_set_CF(uint8_t  v);
-
-void cpu_dump_state();
+void cpu_set_AH(machine_t *m, uint8_t  v);
+void cpu_set_AL(machine_t *m, uint8_t  v);
+void cpu_set_AX(machine_t *m, uint16_t v);
+
+void cpu_set_CH(machine_t *m, uint8_t  v);
+void cpu_set_CL(machine_t *m, uint8_t  v);
+void cpu_set_CX(machine_t *m, uint16_t v);
+
+void cpu_set_DH(machine_t *m, uint8_t  v);
+void cpu_set_DL(machine_t *m, uint8_t  v);
+void cpu_set_DX(machine_t *m, uint16_t v);
+
+void cpu_set_BH(machine_t *m, uint8_t  v);
+void cpu_set_BL(machine_t *m, uint8_t  v);
+void cpu_set_BX(machine_t *m, uint16_t v);
+
+void cpu_set_SP(machine_t *m, uint16_t v);
+void cpu_set_BP(machine_t *m, uint16_t v);
+void cpu_set_SI(machine_t *m, uint16_t v);
+void cpu_set_DI(machine_t *m, uint16_t v);
+void cpu_set_ES(machine_t *m, uint16_t v);
+void cpu_set_CS(machine_t *m, uint16_t v);
+void cpu_set_SS(machine_t *m, uint16_t v);
+void cpu_set_DS(machine_t *m, uint16_t v);
+void cpu_set_IP(machine_t *m, uint16_t v);
+
+void cpu_set_CF(machine_t *m, uint8_t  v);
+
+void cpu_dump_state(machine_t *m);
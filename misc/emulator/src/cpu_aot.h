@@ -0,0 +1,109 @@
+// BIOS and disk ROM code compiled to C ahead of time.
+//
+// This file is included by the core of the CPU_80186 model, see
+// cpu_core.h, when CPU_AOT is defined. It works directly on the CPU state
+// in cpu.c. cpu_aot_rom.h is generated by iceXtRomC (romc.c) from the ROM
+// images at build time and holds one function per basic block found in
+// them. A block runs the opcode bodies of cpu_opcodes.h on decode cache
+// entries filled in at build time, in the order the interpreter would, and
+// stops where the interpreter loop would stop or take an interrupt, so a
+// run gives the same result with and without it. What saves time is the
+// dispatch and decode cache lookup of each instruction.
+//
+// The blocks are used only with that model and while the ROMs mapped hold
+// the bytes they were compiled from, which is checked again after the
+// decode cache is flushed or invalidated.
+
+typedef struct {
+    uint32_t base;
+    uint32_t size;
+    uint64_t hash;          // FNV-1a of the image
+    const uint16_t *index;  // first aot_blocks[] entry at each byte, or 0
+} aot_rom_t;
+
+typedef struct {
+    uint32_t addr;
+    uint16_t cs;
+    void (*code)(void);
+} aot_block_t;
+
+// Begin instruction k of aot_insns[] as begin_instruction() does, with its
+// first byte fetched.
+#define AOT_INSN(k)                                                            \
+    cpu->cur_decode = &aot_insns[k];                                           \
+    cpu->fetch_ptr = aot_insns[k].bytes + 1;                                   \
+    cpu->fetch_end = aot_insns[k].bytes + aot_insns[k].len;                    \
+    cpu->start_ip = cpu->ip++;                                                 \
+    cpu->retired++
+
+// Whether the interpreter loop would go on to next in the same segment.
+#define AOT_MORE(next, cs)                                                     \
+    (cpu->ip == (next) && cpu->sregs[CS] == (cs) &&                            \
+     cpu->cycles < cpu->run_end && !(cpu->IF && cpu->irq_mask))
+
+#include "cpu_aot_rom.h"
+
+static uint64_t aot_hash(const uint8_t *p, uint32_t n)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    uint32_t i;
+    for(i = 0; i < n; i++)
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    return h;
+}
+
+// Find the ROMs which are mapped read only with the compiled contents.
+static void aot_check(void)
+{
+    uint32_t r, addr;
+    cpu->aot_valid = 0;
+    cpu->aot_checked = true;
+    if(cpu->model != CPU_80186)
+        return;
+    for(r = 0; r < AOT_ROMS; r++)
+    {
+        const aot_rom_t *rom = &aot_roms[r];
+        const mem_page_t *first = &cpu->machine->mem_map[rom->base >> MEM_PAGE_BITS];
+        bool mapped = true;
+        for(addr = rom->base; addr < rom->base + rom->size; addr += MEM_PAGE_SIZE)
+        {
+            const mem_page_t *page = &cpu->machine->mem_map[addr >> MEM_PAGE_BITS];
+            if(!page->read || page->write ||
+               page->read != first->read + (addr - rom->base))
+                mapped = false;
+        }
+        if(mapped && aot_hash(first->read, rom->size) == rom->hash)
+            cpu->aot_valid |= 1u << r;
+    }
+}
+
+// Run the compiled block at CS:ip, if there is one. Returns false to leave
+// the instruction to the interpreter.
+static bool aot_run(void)
+{
+    uint32_t addr = (cpu->sregs[CS] * 16 + cpu->ip) & 0xFFFFF;
+    uint32_t r;
+
+    if(!cpu->aot_checked)
+        aot_check();
+    for(r = 0; r < AOT_ROMS; r++)
+    {
+        const aot_rom_t *rom = &aot_roms[r];
+        const aot_block_t *b;
+        if(addr - rom->base >= rom->size)
+            continue;
+        if(!(cpu->aot_valid & (1u << r)) || !rom->index[addr - rom->base])
+            return false;
+        for(b = &aot_blocks[rom->index[addr - rom->base]]; b->addr == addr; b++)
+        {
+            if(b->cs == cpu->sregs[CS])
+            {
+                b->code();
+                end_instruction();
+                return true;
+            }
+        }
+        return false;
+    }
+    return false;
+}
@@ -0,0 +1,261 @@
+// Interpreter core: the do_instruction() switch and the loops around it.
+//
+// This file is included by cpu.c once for each CPU model and once more for
+// each with the debug output and the instruction trace, and works directly
+// on the CPU state in there. The includer defines:
+//
+//   CORE(name)       the name of a function of this core, e.g. name##_v20
+//   CPU_PUSH_80286   1 for the PUSH SP of the 80286, see cpu.c
+//   CPU_SHIFT_80186  1 for shift counts modulo 32, see cpu.c
+//   CORE_TRACE       1 to write the debug output and instruction trace
+//   CORE_AOT         1 to run the compiled ROM blocks, see cpu_aot.h
+//
+// The opcode bodies are expanded here, so the quirks of the model are
+// constants in them. A core without CORE_TRACE has no test for the debug
+// output or the trace at all, cpu_run() picks the traced one while either
+// is on. Each core ends with its cpu_core_t, CORE(core).
+
+#define do_instruction   CORE(do_instruction)
+#define next_instruction CORE(next_instruction)
+#define do_fused         CORE(do_fused)
+#define run_instructions CORE(run_instructions)
+
+static void do_instruction(uint8_t code);
+
+// Fused sequences and compiled blocks would run instructions without their
+// output.
+#if defined(CPU_FUSE) && !CORE_TRACE
+#define CORE_FUSE
+#endif
+#if defined(CPU_AOT) && CORE_AOT && !CORE_TRACE
+#define CORE_RUN_AOT
+#include "cpu_aot.h"
+#endif
+
+static void do_instruction(uint8_t code)
+{
+#ifdef CPU_PROFILE
+    profile_begin(code);
+#endif
+#if CORE_TRACE
+    if (cpu->debug) {
+      dump_reg_change(false);
+      dump_inst();
+    }
+#endif
+    cpu->cycles += op_cycles[code];
+    switch(code)
+    {
+#define OPCODE(n, body)                                                        \
+    case n:                                                                    \
+        do { body; } while(0);                                                 \
+        break;
+#include "cpu_opcodes.h"
+#undef OPCODE
+    };
+#ifdef CPU_PROFILE
+    profile_end();
+#endif
+}
+
+static void next_instruction(void)
+{
+    uint8_t code = begin_instruction();
+#if CORE_TRACE
+    if(cpu->trace)
+        trace_instruction();
+#endif
+    do_instruction(code);
+    end_instruction();
+}
+
+#ifdef CORE_FUSE
+// Run the instruction begun with code and the instructions fused to it, see
+// dcache_fuse(), counting and timing each as when run one by one. The
+// fused ones are taken from the entry without decoding them, a sequence
+// jumping back to its start runs again without going through dispatch.
+static void do_fused(uint8_t code)
+{
+    const decode_t *e = cpu->cur_decode;
+    const uint32_t addr = e->addr;
+    const uint16_t first_ip = cpu->start_ip;
+
+    for(;;)
+    {
+        const uint8_t *p = e->bytes + e->len;
+        uint32_t n;
+
+        do_instruction(code);
+        for(n = e->fuse; n > 0; n--, p += (p[0] & 0xF0) == 0x40 ? 1 : 2)
+        {
+            uint8_t op = p[0];
+            if(!fused_continue(e, addr))
+                return;
+            cpu->start_ip = cpu->ip;
+            cpu->retired++;
+            cpu->cycles += op_cycles[op];
+            if((op & 0xF0) == 0x70)
+            {
+                cpu->ip += 2;
+                if(jcc_cond(op))
+                {
+                    cpu->ip += (int8_t)p[1];
+                    cpu->cycles += 10;
+                }
+            }
+            else if(op == 0xA8) // TEST AL,imm8
+            {
+                cpu->ip += 2;
+                SetFlags(FLAGS_LOG8, 0, 0, cpu->wregs[AX] & p[1] & 0xFF);
+            }
+            else if(op == 0xE2) // LOOP
+            {
+                cpu->ip += 2;
+                if(--cpu->wregs[CX])
+                {
+                    cpu->ip += (int8_t)p[1];
+                    cpu->cycles += 8;
+                }
+            }
+            else // INC or DEC r16
+            {
+                uint16_t tmp = cpu->wregs[op & 7] + ((op & 8) ? -1 : 1);
+                cpu->ip += 1;
+                SyncCF();
+                SetFlags((op & 8) ? FLAGS_DEC16 : FLAGS_INC16, 0, 0, tmp);
+                cpu->wregs[op & 7] = tmp;
+            }
+        }
+
+        if(cpu->ip != first_ip || !fused_continue(e, addr))
+            return;
+        cpu->start_ip = cpu->ip;
+        cpu->retired++;
+        cpu->fetch_ptr = e->bytes;
+        cpu->fetch_end = e->bytes + e->len;
+        code = FETCH_B();
+    }
+}
+#endif
+
+#if defined(CPU_THREADED_DISPATCH) && defined(__GNUC__) && !defined(CPU_PROFILE)
+// Threaded dispatch core. Every handler ends with its own jump to the next
+// handler rather than going back through the single indirect jump of the
+// do_instruction() switch, which gives the host branch predictor one slot
+// per opcode. Prefixes still go through do_instruction().
+static void run_instructions(void)
+{
+#define OPCODE(n, body) &&op_##n,
+    static const void *const handlers[256] = {
+#include "cpu_opcodes.h"
+    };
+#undef OPCODE
+
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        end_instruction();                                                     \
+        if(cpu->cycles >= cpu->run_end)                                        \
+            return;                                                            \
+        check_irq();                                                           \
+        AOT_DISPATCH();                                                        \
+        code = begin_instruction();                                            \
+        TRACE_DISPATCH();                                                      \
+        FUSED_DISPATCH();                                                      \
+        cpu->cycles += op_cycles[code];                                        \
+        goto *handlers[code];                                                  \
+    } while(0)
+
+#if CORE_TRACE
+#define TRACE_DISPATCH()                                                       \
+    if(cpu->trace)                                                             \
+        trace_instruction();                                                   \
+    if(cpu->debug) {                                                           \
+        dump_reg_change(false);                                                \
+        dump_inst();                                                           \
+    }
+#else
+#define TRACE_DISPATCH()
+#endif
+
+#ifdef CORE_FUSE
+#define FUSED_DISPATCH()                                                       \
+    if(cpu->cur_decode && cpu->cur_decode->fuse)                               \
+        goto fused
+#else
+#define FUSED_DISPATCH()
+#endif
+
+#ifdef CORE_RUN_AOT
+#define AOT_DISPATCH()                                                         \
+    if(aot_run())                                                              \
+        goto aot_done
+#else
+#define AOT_DISPATCH()
+#endif
+
+    uint8_t code;
+
+    DISPATCH();
+
+#ifdef CORE_FUSE
+fused:
+    do_fused(code);
+    DISPATCH();
+#endif
+
+#ifdef CORE_RUN_AOT
+aot_done:
+    DISPATCH();
+#endif
+
+#define OPCODE(n, body)                                                        \
+    op_##n:                                                                    \
+        do { body; } while(0);                                                 \
+        DISPATCH();
+#include "cpu_opcodes.h"
+#undef OPCODE
+#undef AOT_DISPATCH
+#undef FUSED_DISPATCH
+#undef TRACE_DISPATCH
+#undef DISPATCH
+}
+#else
+static void run_instructions(void)
+{
+    while(cpu->cycles < cpu->run_end)
+    {
+        check_irq();
+#ifdef CORE_RUN_AOT
+        if(aot_run())
+            continue;
+#endif
+#ifdef CORE_FUSE
+        uint8_t code = begin_instruction();
+        if(cpu->cur_decode && cpu->cur_decode->fuse)
+        {
+            do_fused(code);
+            end_instruction();
+            continue;
+        }
+        do_instruction(code);
+        end_instruction();
+#else
+        next_instruction();
+#endif
+    }
+}
+#endif
+
+static const cpu_core_t CORE(core) = {
+    run_instructions, next_instruction, do_instruction, CPU_PUSH_80286
+};
+
+#undef CORE_RUN_AOT
+#undef CORE_FUSE
+#undef run_instructions
+#undef do_fused
+#undef next_instruction
+#undef do_instruction
+#undef CORE_AOT
+#undef CORE_TRACE
+#undef CORE
@@ -0,0 +1,57 @@
+// Instruction encoding tables, shared by the CPU and the ROM compiler
+// (romc.c).
+#pragma once
+#include <stdint.h>
+
+#include "cpu.h"
+
+// Base or index register of an effective address that has none.
+#define NoReg 8
+
+// Operand layout of each opcode, used to find the instruction length.
+#define D_MODRM  0x01
+#define D_IMM8   0x02
+#define D_IMM16  0x04
+#define D_FAR    0x08 // 32 bit far pointer
+#define D_PREFIX 0x10
+#define D_GRP3   0x20 // immediate only present for TEST (F6/F7 /0 and /1)
+
+static const uint8_t decode_table[256] = {
+#define M  D_MODRM
+#define B  D_IMM8
+#define W  D_IMM16
+#define P  D_PREFIX
+    /*       0    1    2    3    4    5    6    7    8    9    A    B    C    D    E    F */
+    /* 0 */  M,   M,   M,   M,   B,   W,   0,   0,   M,   M,   M,   M,   B,   W,   0,   0,
+    /* 1 */  M,   M,   M,   M,   B,   W,   0,   0,   M,   M,   M,   M,   B,   W,   0,   0,
+    /* 2 */  M,   M,   M,   M,   B,   W,   P,   0,   M,   M,   M,   M,   B,   W,   P,   0,
+    /* 3 */  M,   M,   M,   M,   B,   W,   P,   0,   M,   M,   M,   M,   B,   W,   P,   0,
+    /* 4 */  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    /* 5 */  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    /* 6 */  0,   0,   M,   0,   0,   0,   0,   0,   W, M|W,   B, M|B,   0,   0,   0,   0,
+    /* 7 */  B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,
+    /* 8 */M|B, M|W, M|B, M|B,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,
+    /* 9 */  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,D_FAR,0,   0,   0,   0,   0,
+    /* A */  W,   W,   W,   W,   0,   0,   0,   0,   B,   W,   0,   0,   0,   0,   0,   0,
+    /* B */  B,   B,   B,   B,   B,   B,   B,   B,   W,   W,   W,   W,   W,   W,   W,   W,
+    /* C */M|B, M|B,   W,   0,   M,   M, M|B, M|W, W|B,   0,   W,   0,   0,   B,   0,   0,
+    /* D */  M,   M,   M,   M,   B,   B,   0,   0,   M,   M,   M,   M,   M,   M,   M,   M,
+    /* E */  B,   B,   B,   B,   B,   B,   B,   B,   W,   W,D_FAR,B,   0,   0,   0,   0,
+    /* F */  0,   0,   P,   P,   0,   0,M|B|D_GRP3,M|W|D_GRP3,0,0,0,   0,   0,   0,   M,   M,
+#undef M
+#undef B
+#undef W
+#undef P
+};
+
+// Base, index and default segment for each modrm r/m field.
+static const uint8_t modrm_ea[8][3] = {
+    { BX, SI,    DS },
+    { BX, DI,    DS },
+    { BP, SI,    SS },
+    { BP, DI,    SS },
+    { SI, NoReg, DS },
+    { DI, NoReg, DS },
+    { BP, NoReg, SS },
+    { BX, NoReg, DS },
+};
@@ -0,0 +1,1336 @@
+// Dynamic translator from guest code to x86-64 host code.
+//
+// This file is included by cpu.c when CPU_JIT_X64 is defined, it works
+// directly on the CPU state in there. Only System V x86-64 hosts are
+// supported.
+//
+// Addresses that are executed often are translated into a host code block
+// which runs up to the next jump. Register, ALU, move and stack
+// instructions are generated inline, with the guest registers a block uses
+// most kept in host registers. Memory accesses call GetMemAbsB/W and
+// SetMemAbsB/W, so devices see the same accesses as from the interpreter,
+// and every other instruction calls back into the interpreter. Blocks
+// account clock cycles as the interpreter does and check the cpu_run()
+// budget after each instruction, a run gives the same result with and
+// without the translator.
+//
+// Lines holding translated code are marked DCACHE_JIT in dcache_lines[], a
+// write to one of them drops all blocks of its 4KB page.
+//
+// The code buffer is never writable and executable at once, the pages a
+// block is emitted to are writable only while it is emitted. Where the host
+// does not allow executable memory at all everything is interpreted.
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define JIT_CODE_SIZE   (8 << 20)
+#define JIT_BLOCK_SPACE (64 << 10)  // enough for the largest block
+#define JIT_MAX_BLOCKS  16384
+#define JIT_MAX_INSNS   64
+#define JIT_HASH_BITS   14
+#define JIT_HASH_SIZE   (1 << JIT_HASH_BITS)
+
+// Executions of an address in the interpreter before it is translated.
+#ifndef JIT_HEAT
+#define JIT_HEAT 16
+#endif
+
+typedef struct jit_block {
+    uint32_t addr;               // linear address of the first instruction
+    uint16_t cs;
+    void (*code)(void);
+    struct jit_block *page_next; // blocks starting in the same page
+} jit_block_t;
+
+// Translator state of a CPU, allocated when it first runs.
+struct jit_t {
+    uint8_t *code;
+    uint32_t code_used;
+    jit_block_t blocks[JIT_MAX_BLOCKS];
+    uint32_t num_blocks;
+    jit_block_t *table[JIT_HASH_SIZE];
+    jit_block_t *pages[MEM_PAGES];
+    uint8_t heat[JIT_HASH_SIZE];
+
+    uint16_t cs;  // CS of the running block
+    uint8_t exit; // set when blocks were dropped, the running block has to
+                  // return after the current instruction
+};
+
+#define jit_code       (cpu->jit->code)
+#define jit_code_used  (cpu->jit->code_used)
+#define jit_blocks     (cpu->jit->blocks)
+#define jit_num_blocks (cpu->jit->num_blocks)
+#define jit_table      (cpu->jit->table)
+#define jit_pages      (cpu->jit->pages)
+#define jit_heat       (cpu->jit->heat)
+#define jit_cs         (cpu->jit->cs)
+#define jit_exit       (cpu->jit->exit)
+
+static uint32_t jit_hash(uint32_t addr)
+{
+    return (addr * 2654435761u) >> (32 - JIT_HASH_BITS);
+}
+
+static void jit_flush(void)
+{
+    uint32_t i;
+    if(!cpu->jit)
+        return;
+    memset(jit_table, 0, sizeof(jit_table));
+    memset(jit_pages, 0, sizeof(jit_pages));
+    for(i = 0; i < sizeof(cpu->dcache_lines); i++)
+        cpu->dcache_lines[i] &= ~DCACHE_JIT;
+    jit_num_blocks = 0;
+    jit_code_used = 0;
+    jit_exit = 1;
+}
+
+static void jit_invalidate_page(uint32_t page)
+{
+    jit_block_t *b;
+    uint32_t line;
+
+    for(b = jit_pages[page]; b; b = b->page_next)
+    {
+        jit_block_t **slot = &jit_table[jit_hash(b->addr)];
+        if(*slot == b)
+            *slot = NULL;
+    }
+    jit_pages[page] = NULL;
+
+    line = (page << MEM_PAGE_BITS) >> DCACHE_LINE;
+    for(; line < ((page + 1) << MEM_PAGE_BITS) >> DCACHE_LINE; line++)
+        cpu->dcache_lines[line] &= ~DCACHE_JIT;
+    jit_exit = 1;
+}
+
+// Functions called from translated code
+
+static int jit_step(uint32_t ips)
+{
+    // ips holds the instruction IP and in the upper half the IP following
+    // it. Returns non zero when the block has to return.
+    cpu->ip = ips;
+    cpu->core->next_instruction();
+    return cpu->ip != (ips >> 16) || cpu->sregs[CS] != jit_cs || (cpu->IF && cpu->irq_mask) ||
+           cpu->cycles >= cpu->run_end || jit_exit;
+}
+
+static uint32_t jit_read8(uint32_t addr)
+{
+    return GetMemAbsB(addr);
+}
+
+static uint32_t jit_read16(uint32_t addr)
+{
+    return GetMemAbsW(addr);
+}
+
+static int jit_write8(uint32_t addr, uint32_t val)
+{
+    SetMemAbsB(addr, val);
+    return jit_exit;
+}
+
+static int jit_write16(uint32_t addr, uint32_t val)
+{
+    SetMemAbsW(addr, val);
+    return jit_exit;
+}
+
+static void jit_sync_cf(void)
+{
+    SyncCF();
+}
+
+// x86-64 code emitter
+
+enum {
+    H_RAX, H_RCX, H_RDX, H_RBX, H_RSP, H_RBP, H_RSI, H_RDI,
+    H_R8, H_R9, H_R10, H_R11, H_R12, H_R13, H_R14, H_R15
+};
+
+// ALU opcodes in the "op r/m32, r32" form
+#define X_ADD  0x01
+#define X_OR   0x09
+#define X_AND  0x21
+#define X_SUB  0x29
+#define X_XOR  0x31
+#define X_CMP  0x39
+#define X_TEST 0x85
+
+// Condition codes
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+
+// Displacement of a CPU state variable from wregs, which RBX points to in
+// translated code.
+#define JIT_OFF(var) ((int32_t)((uint8_t *)&(var) - (uint8_t *)cpu->wregs))
+
+static THREAD_LOCAL uint8_t *jit_out;
+
+static void jit_b(uint8_t x)
+{
+    *jit_out++ = x;
+}
+
+static void jit_d(uint32_t x)
+{
+    memcpy(jit_out, &x, 4);
+    jit_out += 4;
+}
+
+static void jit_q(uint64_t x)
+{
+    memcpy(jit_out, &x, 8);
+    jit_out += 8;
+}
+
+static void jit_rex(int w, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+    if(rex != 0x40)
+        jit_b(rex);
+}
+
+static void jit_modrm_rr(int reg, int rm)
+{
+    jit_b(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [rbx + disp32]
+static void jit_modrm_mem(int reg, int32_t disp)
+{
+    jit_b(0x80 | ((reg & 7) << 3) | H_RBX);
+    jit_d(disp);
+}
+
+static void jit_alu_rr(uint8_t op, int dst, int src)
+{
+    jit_rex(0, src, dst);
+    jit_b(op);
+    jit_modrm_rr(src, dst);
+}
+
+static void jit_mov_rr(int dst, int src)
+{
+    jit_alu_rr(0x89, dst, src);
+}
+
+// op dst, imm with the /ext number of the 81 group
+static void jit_alu_ri(int ext, int dst, uint32_t imm)
+{
+    jit_rex(0, 0, dst);
+    if((int32_t)imm == (int8_t)imm)
+    {
+        jit_b(0x83);
+        jit_modrm_rr(ext, dst);
+        jit_b(imm);
+    }
+    else
+    {
+        jit_b(0x81);
+        jit_modrm_rr(ext, dst);
+        jit_d(imm);
+    }
+}
+
+static void jit_mov_ri(int dst, uint32_t imm)
+{
+    jit_rex(0, 0, dst);
+    jit_b(0xB8 + (dst & 7));
+    jit_d(imm);
+}
+
+// shift with the /ext number of the C1 group
+static void jit_shift_ri(int ext, int dst, uint8_t n)
+{
+    jit_rex(0, 0, dst);
+    jit_b(0xC1);
+    jit_modrm_rr(ext, dst);
+    jit_b(n);
+}
+
+static void jit_movzx16_rr(int dst, int src)
+{
+    jit_rex(0, dst, src);
+    jit_b(0x0F);
+    jit_b(0xB7);
+    jit_modrm_rr(dst, src);
+}
+
+static void jit_load16(int dst, int32_t disp)
+{
+    jit_rex(0, dst, H_RBX);
+    jit_b(0x0F);
+    jit_b(0xB7);
+    jit_modrm_mem(dst, disp);
+}
+
+static void jit_store16(int32_t disp, int src)
+{
+    jit_b(0x66);
+    jit_rex(0, src, H_RBX);
+    jit_b(0x89);
+    jit_modrm_mem(src, disp);
+}
+
+static void jit_store32(int32_t disp, int src)
+{
+    jit_rex(0, src, H_RBX);
+    jit_b(0x89);
+    jit_modrm_mem(src, disp);
+}
+
+static void jit_store8_imm(int32_t disp, uint8_t imm)
+{
+    jit_b(0xC6);
+    jit_modrm_mem(0, disp);
+    jit_b(imm);
+}
+
+static void jit_store16_imm(int32_t disp, uint16_t imm)
+{
+    jit_b(0x66);
+    jit_b(0xC7);
+    jit_modrm_mem(0, disp);
+    jit_b(imm & 0xff);
+    jit_b(imm >> 8);
+}
+
+static void jit_add64_imm(int32_t disp, uint32_t imm)
+{
+    jit_b(0x48);
+    jit_b(0x81);
+    jit_modrm_mem(0, disp);
+    jit_d(imm);
+}
+
+static void jit_load64(int dst, int32_t disp)
+{
+    jit_rex(1, dst, H_RBX);
+    jit_b(0x8B);
+    jit_modrm_mem(dst, disp);
+}
+
+static void jit_cmp64_mem(int reg, int32_t disp)
+{
+    jit_rex(1, reg, H_RBX);
+    jit_b(0x3B);
+    jit_modrm_mem(reg, disp);
+}
+
+// [rsp + slot]
+static void jit_stack_store(uint8_t slot, int src)
+{
+    jit_rex(0, src, 0);
+    jit_b(0x89);
+    jit_b(0x44 | ((src & 7) << 3));
+    jit_b(0x24);
+    jit_b(slot);
+}
+
+static void jit_stack_load(int dst, uint8_t slot)
+{
+    jit_rex(0, dst, 0);
+    jit_b(0x8B);
+    jit_b(0x44 | ((dst & 7) << 3));
+    jit_b(0x24);
+    jit_b(slot);
+}
+
+static void jit_call(const void *fn)
+{
+    jit_b(0x48);
+    jit_b(0xB8);
+    jit_q((uint64_t)(uintptr_t)fn);
+    jit_b(0xFF);
+    jit_b(0xD0);
+}
+
+// Jumps return the location of their rel32 for jit_patch().
+static uint8_t *jit_jcc(uint8_t cc)
+{
+    jit_b(0x0F);
+    jit_b(0x80 | cc);
+    jit_d(0);
+    return jit_out - 4;
+}
+
+static uint8_t *jit_jmp(void)
+{
+    jit_b(0xE9);
+    jit_d(0);
+    return jit_out - 4;
+}
+
+static void jit_patch(uint8_t *rel, const uint8_t *target)
+{
+    int32_t d = (int32_t)(target - (rel + 4));
+    memcpy(rel, &d, 4);
+}
+
+// Block translation
+
+// Guest registers 0..7 are cached in these callee saved host registers.
+static const uint8_t jit_cache_regs[] = { H_RBP, H_R12, H_R13, H_R14, H_R15 };
+
+typedef struct {
+    uint16_t pos;      // IP of the first prefix byte
+    uint16_t next;     // IP of the following instruction
+    uint8_t  seg;      // segment override or NoSeg
+    bool     rep;      // REP prefix present
+    uint8_t  cost;     // clocks of the prefixes and opcode
+    uint8_t  op;
+    uint8_t  modrm;
+    bool     mem;      // modrm selects a memory operand
+    uint8_t  ea_base;
+    uint8_t  ea_index;
+    uint8_t  ea_seg;
+    uint16_t disp;
+    uint16_t imm;
+} jit_insn_t;
+
+// State of the block being translated on this thread
+// host register of each guest register or -1
+static THREAD_LOCAL int8_t   jit_host[8];
+// guest register uses, counted in the first pass
+static THREAD_LOCAL uint16_t jit_uses[8];
+// guest registers the block writes
+static THREAD_LOCAL uint8_t  jit_written;
+// cached registers to store on exit
+static THREAD_LOCAL uint8_t  jit_store_set;
+// lazy_op of the previous instruction or 0xff
+static THREAD_LOCAL uint8_t  jit_flags_known;
+// jumps to the epilogue
+static THREAD_LOCAL uint8_t *jit_fixups[4 * JIT_MAX_INSNS];
+static THREAD_LOCAL uint32_t jit_num_fixups;
+// exits that set IP
+static THREAD_LOCAL struct {
+    uint8_t *rel;
+    uint16_t next;
+    bool retire;  // leaving before the instruction was counted
+} jit_stubs[4 * JIT_MAX_INSNS];
+static THREAD_LOCAL uint32_t jit_num_stubs;
+
+static void jit_to_epilogue(uint8_t *rel)
+{
+    jit_fixups[jit_num_fixups++] = rel;
+}
+
+static void jit_to_stub(uint8_t *rel, uint16_t next, bool retire)
+{
+    jit_stubs[jit_num_stubs].rel = rel;
+    jit_stubs[jit_num_stubs].next = next;
+    jit_stubs[jit_num_stubs].retire = retire;
+    jit_num_stubs++;
+}
+
+static void g_load16(int dst, int g)
+{
+    jit_uses[g]++;
+    if(jit_host[g] >= 0)
+        jit_mov_rr(dst, jit_host[g]);
+    else
+        jit_load16(dst, JIT_OFF(cpu->wregs[g]));
+}
+
+// Store the low 16 bits of src, cached registers hold zero extended values.
+static void g_store16(int g, int src)
+{
+    jit_uses[g]++;
+    jit_written |= 1 << g;
+    if(jit_host[g] >= 0)
+        jit_movzx16_rr(jit_host[g], src);
+    else
+        jit_store16(JIT_OFF(cpu->wregs[g]), src);
+}
+
+// AL, CL, DL, BL, AH, CH, DH, BH
+static void g_load8(int dst, int r8)
+{
+    g_load16(dst, r8 & 3);
+    if(r8 & 4)
+        jit_shift_ri(5, dst, 8);
+    else
+        jit_alu_ri(4, dst, 0xff);
+}
+
+// Clobbers src and R8.
+static void g_store8(int r8, int src)
+{
+    g_load16(H_R8, r8 & 3);
+    jit_alu_ri(4, src, 0xff);
+    if(r8 & 4)
+    {
+        jit_alu_ri(4, H_R8, 0xff);
+        jit_shift_ri(4, src, 8);
+    }
+    else
+        jit_alu_ri(4, H_R8, 0xff00);
+    jit_alu_rr(X_OR, H_R8, src);
+    g_store16(r8 & 3, H_R8);
+}
+
+static void g_load(int dst, int r, int w)
+{
+    if(w)
+        g_load16(dst, r);
+    else
+        g_load8(dst, r);
+}
+
+static void g_store(int r, int src, int w)
+{
+    if(w)
+        g_store16(r, src);
+    else
+        g_store8(r, src);
+}
+
+// Write cached registers back to wregs[].
+static void jit_flush_regs(void)
+{
+    int g;
+    for(g = 0; g < 8; g++)
+        if(jit_host[g] >= 0 && (jit_store_set & (1 << g)))
+            jit_store16(JIT_OFF(cpu->wregs[g]), jit_host[g]);
+}
+
+static void jit_reload_regs(void)
+{
+    int g;
+    for(g = 0; g < 8; g++)
+        if(jit_host[g] >= 0)
+            jit_load16(jit_host[g], JIT_OFF(cpu->wregs[g]));
+}
+
+static void jit_cycles(uint32_t n)
+{
+    if(n)
+        jit_add64_imm(JIT_OFF(cpu->cycles), n);
+}
+
+// Count an instruction translated inline, interpreted ones count themselves.
+static void jit_retire(void)
+{
+    jit_add64_imm(JIT_OFF(cpu->retired), 1);
+}
+
+// Return to the dispatcher with IP set to next when the cycle budget ran out.
+static void jit_check_budget(uint16_t next)
+{
+    jit_load64(H_RAX, JIT_OFF(cpu->cycles));
+    jit_cmp64_mem(H_RAX, JIT_OFF(cpu->run_end));
+    jit_to_stub(jit_jcc(CC_AE), next, false);
+}
+
+static void jit_exit_to(uint16_t next)
+{
+    jit_flush_regs();
+    jit_store16_imm(JIT_OFF(cpu->ip), next);
+    jit_to_epilogue(jit_jmp());
+}
+
+// Offset of the memory operand into EAX.
+static void jit_ea_offset(const jit_insn_t *in)
+{
+    jit_mov_ri(H_RAX, in->disp);
+    if(in->ea_base != NoReg)
+    {
+        g_load16(H_RCX, in->ea_base);
+        jit_alu_rr(X_ADD, H_RAX, H_RCX);
+    }
+    if(in->ea_index != NoReg)
+    {
+        g_load16(H_RCX, in->ea_index);
+        jit_alu_rr(X_ADD, H_RAX, H_RCX);
+    }
+    jit_movzx16_rr(H_RAX, H_RAX);
+}
+
+// Linear address of seg:EAX into EDI and stack slot 0.
+static void jit_linear(uint8_t seg)
+{
+    jit_load16(H_RDI, JIT_OFF(cpu->sregs[seg]));
+    jit_shift_ri(4, H_RDI, 4);
+    jit_alu_rr(X_ADD, H_RDI, H_RAX);
+    jit_stack_store(0, H_RDI);
+}
+
+// Also sets ModRMAddress, which register forms of LES and LDS read.
+static void jit_ea(const jit_insn_t *in)
+{
+    jit_ea_offset(in);
+    jit_linear(in->seg != NoSeg ? in->seg : in->ea_seg);
+    jit_store32(JIT_OFF(cpu->ModRMAddress), H_RDI);
+}
+
+// Read the address in EDI into EAX.
+static void jit_read(int w)
+{
+    jit_call(w ? (const void *)jit_read16 : (const void *)jit_read8);
+}
+
+// Write src to the address in stack slot 0.
+static void jit_write(int w, int src, uint16_t next)
+{
+    jit_mov_rr(H_RSI, src);
+    jit_stack_load(H_RDI, 0);
+    jit_call(w ? (const void *)jit_write16 : (const void *)jit_write8);
+    jit_alu_rr(X_TEST, H_RAX, H_RAX);
+    jit_to_stub(jit_jcc(CC_NE), next, true);
+}
+
+static void jit_rm_load(const jit_insn_t *in, int w)
+{
+    if(!in->mem)
+    {
+        g_load(H_RAX, in->modrm & 7, w);
+        return;
+    }
+    jit_ea(in);
+    jit_read(w);
+}
+
+static void jit_rm_store(const jit_insn_t *in, int w, int src)
+{
+    if(!in->mem)
+        g_store(in->modrm & 7, src, w);
+    else
+        jit_write(w, src, in->next);
+}
+
+static void jit_lazy(uint8_t kind, int dest, int src, int res)
+{
+    jit_store8_imm(JIT_OFF(cpu->lazy_op), kind);
+    jit_store32(JIT_OFF(cpu->lazy_res), res);
+    if(dest >= 0)
+    {
+        jit_store32(JIT_OFF(cpu->lazy_dest), dest);
+        jit_store32(JIT_OFF(cpu->lazy_src), src);
+    }
+    jit_flags_known = kind;
+}
+
+#define ALU_ADD  0
+#define ALU_OR   1
+#define ALU_AND  4
+#define ALU_SUB  5
+#define ALU_XOR  6
+#define ALU_CMP  7
+#define ALU_TEST 8
+
+// EDX = EAX op ECX, recording the flags like the ALU macros.
+static void jit_alu(int alu, int w)
+{
+    static const uint8_t host_op[9] = {
+        X_ADD, X_OR, 0, 0, X_AND, X_SUB, X_XOR, X_SUB, X_AND
+    };
+
+    jit_mov_rr(H_RDX, H_RAX);
+    jit_alu_rr(host_op[alu], H_RDX, H_RCX);
+    switch(alu)
+    {
+    case ALU_ADD:
+        jit_lazy(w ? FLAGS_ADD16 : FLAGS_ADD8, H_RAX, H_RCX, H_RDX);
+        break;
+    case ALU_SUB:
+    case ALU_CMP:
+        jit_lazy(w ? FLAGS_SUB16 : FLAGS_SUB8, H_RAX, H_RCX, H_RDX);
+        break;
+    default:
+        jit_lazy(w ? FLAGS_LOG16 : FLAGS_LOG8, -1, -1, H_RDX);
+        break;
+    }
+}
+
+static uint32_t jit_ea_cycles(const jit_insn_t *in)
+{
+    if(!in->mem)
+        return 0;
+    return ea_cycles[in->modrm & 7] + ((in->modrm & 0xC0) != 0);
+}
+
+// Generate an instruction inline. Returns false if it has to go through the
+// interpreter.
+static bool jit_inline(const jit_insn_t *in)
+{
+    const uint8_t op = in->op;
+    const int reg = (in->modrm >> 3) & 7;
+    const int w = op & 1;
+    int alu;
+
+    if(in->rep)
+        return false;
+
+    if(op < 0x40 && (op & 7) < 6)
+    {
+        alu = op >> 3;
+        if(alu == 2 || alu == 3)
+            return false; // ADC and SBB need CF
+        jit_cycles(in->cost + jit_ea_cycles(in));
+        switch(op & 7)
+        {
+        case 0: // r/m, reg
+        case 1:
+            jit_rm_load(in, w);
+            g_load(H_RCX, reg, w);
+            jit_alu(alu, w);
+            // the interpreter writes the operand back for CMP as well
+            if(in->mem || alu != ALU_CMP)
+                jit_rm_store(in, w, alu == ALU_CMP ? H_RAX : H_RDX);
+            break;
+        case 2: // reg, r/m
+        case 3:
+            jit_rm_load(in, w);
+            jit_mov_rr(H_RCX, H_RAX);
+            g_load(H_RAX, reg, w);
+            jit_alu(alu, w);
+            if(alu != ALU_CMP)
+                g_store(reg, H_RDX, w);
+            break;
+        default: // AL/AX, imm
+            g_load(H_RAX, AX, w);
+            jit_mov_ri(H_RCX, in->imm);
+            jit_alu(alu, w);
+            if(alu != ALU_CMP)
+                g_store(AX, H_RDX, w);
+            break;
+        }
+        return true;
+    }
+
+    if(op >= 0x40 && op <= 0x4f) // INC/DEC reg
+    {
+        const int dec = op & 8;
+        jit_cycles(in->cost);
+        if(jit_flags_known == FLAGS_LOG8 || jit_flags_known == FLAGS_LOG16)
+            jit_store8_imm(JIT_OFF(cpu->CF), 0);
+        else if(jit_flags_known < FLAGS_INC8 || jit_flags_known > FLAGS_DEC16)
+            jit_call((const void *)jit_sync_cf);
+        g_load16(H_RAX, op & 7);
+        jit_alu_ri(dec ? 5 : 0, H_RAX, 1);
+        jit_movzx16_rr(H_RAX, H_RAX);
+        jit_lazy(dec ? FLAGS_DEC16 : FLAGS_INC16, -1, -1, H_RAX);
+        g_store16(op & 7, H_RAX);
+        return true;
+    }
+
+    // PUSH reg, SP pushes its old value
+    if(op >= 0x50 && op <= 0x57 && (op != 0x54 || cpu->core->push_80286))
+    {
+        jit_cycles(in->cost);
+        g_load16(H_RSI, op & 7);
+        g_load16(H_RAX, SP);
+        jit_alu_ri(5, H_RAX, 2);
+        jit_movzx16_rr(H_RAX, H_RAX);
+        g_store16(SP, H_RAX);
+        jit_linear(SS);
+        jit_write(1, H_RSI, in->next);
+        return true;
+    }
+
+    if(op >= 0x58 && op <= 0x5f) // POP reg
+    {
+        jit_cycles(in->cost);
+        g_load16(H_RAX, SP);
+        jit_linear(SS);
+        jit_read(1);
+        g_load16(H_RCX, SP);
+        jit_alu_ri(0, H_RCX, 2);
+        g_store16(SP, H_RCX);
+        g_store16(op & 7, H_RAX);
+        return true;
+    }
+
+    if(op >= 0x80 && op <= 0x83) // ALU r/m, imm
+    {
+        alu = reg;
+        if(alu == 2 || alu == 3)
+            return false;
+        jit_cycles(in->cost + jit_ea_cycles(in));
+        jit_rm_load(in, w);
+        jit_mov_ri(H_RCX, op == 0x83 ? (uint16_t)(int8_t)in->imm : in->imm);
+        jit_alu(alu, w);
+        if(alu != ALU_CMP)
+            jit_rm_store(in, w, H_RDX);
+        return true;
+    }
+
+    if(op >= 0x90 && op <= 0x97) // NOP, XCHG AX, reg
+    {
+        jit_cycles(in->cost);
+        if(op != 0x90)
+        {
+            g_load16(H_RAX, AX);
+            g_load16(H_RCX, op & 7);
+            g_store16(AX, H_RCX);
+            g_store16(op & 7, H_RAX);
+        }
+        return true;
+    }
+
+    if(op >= 0xb0 && op <= 0xbf) // MOV reg, imm
+    {
+        jit_cycles(in->cost);
+        jit_mov_ri(H_RDX, in->imm);
+        g_store(op & 7, H_RDX, op & 8);
+        return true;
+    }
+
+    switch(op)
+    {
+    case 0x84: // TEST r/m, reg
+    case 0x85:
+        jit_cycles(in->cost + jit_ea_cycles(in));
+        jit_rm_load(in, w);
+        g_load(H_RCX, reg, w);
+        jit_alu(ALU_TEST, w);
+        if(in->mem)
+            jit_rm_store(in, w, H_RAX);
+        return true;
+
+    case 0x88: // MOV r/m, reg
+    case 0x89:
+        jit_cycles(in->cost + jit_ea_cycles(in));
+        if(in->mem)
+            jit_rm_load(in, w); // the interpreter reads the operand too
+        g_load(H_RCX, reg, w);
+        jit_rm_store(in, w, H_RCX);
+        return true;
+
+    case 0x8a: // MOV reg, r/m
+    case 0x8b:
+        jit_cycles(in->cost + jit_ea_cycles(in));
+        jit_rm_load(in, w);
+        g_store(reg, H_RAX, w);
+        return true;
+
+    case 0x8d: // LEA
+        if(!in->mem)
+            return false;
+        jit_cycles(in->cost);
+        jit_ea_offset(in);
+        g_store16(reg, H_RAX);
+        return true;
+
+    case 0x98: // CBW
+        jit_cycles(in->cost);
+        g_load16(H_RAX, AX);
+        jit_b(0x0F); // movsx eax, al
+        jit_b(0xBE);
+        jit_b(0xC0);
+        g_store16(AX, H_RAX);
+        return true;
+
+    case 0x99: // CWD
+        jit_cycles(in->cost);
+        g_load16(H_RAX, AX);
+        jit_shift_ri(4, H_RAX, 16);
+        jit_shift_ri(7, H_RAX, 31);
+        g_store16(DX, H_RAX);
+        return true;
+
+    case 0xa0: // MOV AL/AX, [disp]
+    case 0xa1:
+        jit_cycles(in->cost);
+        jit_mov_ri(H_RAX, in->imm);
+        jit_linear(in->seg != NoSeg ? in->seg : DS);
+        jit_read(w);
+        g_store(AX, H_RAX, w);
+        return true;
+
+    case 0xa2: // MOV [disp], AL/AX
+    case 0xa3:
+        jit_cycles(in->cost);
+        jit_mov_ri(H_RAX, in->imm);
+        jit_linear(in->seg != NoSeg ? in->seg : DS);
+        g_load(H_RCX, AX, w);
+        jit_write(w, H_RCX, in->next);
+        return true;
+
+    case 0xa8: // TEST AL/AX, imm
+    case 0xa9:
+        jit_cycles(in->cost);
+        g_load(H_RAX, AX, w);
+        jit_mov_ri(H_RCX, in->imm);
+        jit_alu(ALU_TEST, w);
+        return true;
+
+    case 0xc6: // MOV r/m, imm
+    case 0xc7:
+        jit_cycles(in->cost + jit_ea_cycles(in));
+        if(in->mem)
+            jit_ea(in);
+        jit_mov_ri(H_RDX, in->imm);
+        jit_rm_store(in, w, H_RDX);
+        return true;
+
+    case 0xfa: // CLI
+        jit_cycles(in->cost);
+        jit_store8_imm(JIT_OFF(cpu->IF), 0);
+        return true;
+
+    case 0xfc: // CLD
+    case 0xfd: // STD
+        jit_cycles(in->cost);
+        jit_store8_imm(JIT_OFF(cpu->DF), op & 1);
+        return true;
+    }
+    return false;
+}
+
+static bool jit_is_jump(uint8_t op)
+{
+    return (op >= 0x70 && op <= 0x7f) || op == 0xe2 || op == 0xe3 ||
+           op == 0xe9 || op == 0xeb;
+}
+
+// Continue at IP target after a taken jump. A jump back to the start of the
+// block loops inside the translated code.
+static void jit_branch(uint16_t target, uint16_t start, const uint8_t *loop)
+{
+    if(target == start)
+    {
+        jit_check_budget(target);
+        jit_patch(jit_jmp(), loop);
+    }
+    else
+        jit_exit_to(target);
+}
+
+// Jumps ending a block. Returns false if it is not one of them.
+static bool jit_jump(const jit_insn_t *in, uint16_t start, const uint8_t *loop)
+{
+    const uint8_t op = in->op;
+    const uint16_t target = in->next + (int8_t)in->imm;
+    uint8_t *skip;
+
+    if(in->rep || !jit_is_jump(op))
+        return false;
+
+    jit_retire();
+    if(op >= 0x70 && op <= 0x7f)
+    {
+        jit_cycles(in->cost);
+        jit_mov_ri(H_RDI, op);
+        jit_call((const void *)jcc_cond);
+        jit_alu_rr(X_TEST, H_RAX, H_RAX);
+        skip = jit_jcc(CC_E);
+        jit_cycles(10);
+    }
+    else if(op == 0xe2) // LOOP
+    {
+        jit_cycles(in->cost);
+        g_load16(H_RAX, CX);
+        jit_alu_ri(5, H_RAX, 1);
+        g_store16(CX, H_RAX);
+        jit_alu_ri(4, H_RAX, 0xffff);
+        skip = jit_jcc(CC_E);
+        jit_cycles(8);
+    }
+    else if(op == 0xe3) // JCXZ
+    {
+        jit_cycles(in->cost);
+        g_load16(H_RAX, CX);
+        jit_alu_rr(X_TEST, H_RAX, H_RAX);
+        skip = jit_jcc(CC_NE);
+        jit_cycles(8);
+    }
+    else if(op == 0xeb || op == 0xe9) // JMP
+    {
+        jit_cycles(in->cost);
+        jit_branch(op == 0xeb ? target : in->next + in->imm, start, loop);
+        return true;
+    }
+    else
+        return false;
+
+    jit_branch(target, start, loop);
+    jit_patch(skip, jit_out);
+    jit_exit_to(in->next);
+    return true;
+}
+
+// Interpreted instructions after which the block returns.
+static bool jit_ends_block(const jit_insn_t *in)
+{
+    switch(in->op)
+    {
+    case 0x9a: case 0x9d: case 0xc2: case 0xc3: case 0xca: case 0xcb:
+    case 0xcc: case 0xcd: case 0xce: case 0xcf: case 0xe0: case 0xe1:
+    case 0xe8: case 0xea: case 0xf4: case 0xfb:
+        return true;
+    case 0xff:
+        return ((in->modrm >> 3) & 7) >= 2 && ((in->modrm >> 3) & 7) <= 5;
+    }
+    return in->rep;
+}
+
+// Decode the instruction at cs:at. Fails if it is not in the page or wraps
+// around the segment.
+static bool jit_decode(uint16_t cs, uint16_t at, uint32_t page, jit_insn_t *in)
+{
+    const uint32_t base = cs * 16;
+    uint8_t bytes[DCACHE_MAX_LEN];
+    uint32_t len = 0, disp_pos = 0, i, end;
+    uint8_t info;
+
+    in->pos = at;
+    in->seg = NoSeg;
+    in->rep = false;
+    in->cost = 0;
+    in->mem = false;
+    in->modrm = 0;
+    in->disp = 0;
+    in->imm = 0;
+
+    do
+    {
+        if(len >= DCACHE_MAX_LEN || at + len > 0xFFFF)
+            return false;
+        if(((base + at + len) & 0xFFFFF) >> MEM_PAGE_BITS != page)
+            return false;
+        in->op = bytes[len] = ReadMemAbsB(base + at + len);
+        len++;
+        info = decode_table[in->op];
+        in->cost += op_cycles[in->op];
+        if(in->op == 0xf2 || in->op == 0xf3)
+            in->rep = true;
+        else if(info & D_PREFIX)
+            in->seg = (in->op >> 3) & 3;
+    } while(info & D_PREFIX);
+
+    end = len;
+    if(info & D_MODRM)
+    {
+        in->modrm = ReadMemAbsB(base + at + end);
+        end++;
+        if((info & D_GRP3) && (in->modrm & 0x30))
+            info &= ~(D_IMM8 | D_IMM16);
+        if(in->modrm < 0xc0)
+        {
+            const uint8_t *form = modrm_ea[in->modrm & 7];
+            uint32_t disp_len = in->modrm >> 6;
+            in->mem = true;
+            in->ea_base = form[0];
+            in->ea_index = form[1];
+            in->ea_seg = form[2];
+            if((in->modrm & 0xC7) == 0x06)
+            {
+                in->ea_base = NoReg;
+                in->ea_seg = DS;
+                disp_len = 2;
+            }
+            disp_pos = end;
+            end += disp_len;
+        }
+    }
+    i = end;
+    end += (info & D_IMM8) ? 1 : 0;
+    end += (info & D_IMM16) ? 2 : 0;
+    end += (info & D_FAR) ? 4 : 0;
+
+    if(end > DCACHE_MAX_LEN || at + end > 0x10000 ||
+       ((base + at + end - 1) & 0xFFFFF) >> MEM_PAGE_BITS != page)
+        return false;
+    for(; len < end; len++)
+        bytes[len] = ReadMemAbsB(base + at + len);
+
+    if(in->mem)
+    {
+        if(disp_pos + 1 == i)
+            in->disp = (int8_t)bytes[disp_pos];
+        else if(disp_pos + 2 == i)
+            in->disp = bytes[disp_pos] | (bytes[disp_pos + 1] << 8);
+    }
+    if(info & D_IMM16)
+        in->imm = bytes[i] | (bytes[i + 1] << 8);
+    else if(info & D_IMM8)
+        in->imm = bytes[i];
+    in->next = at + end;
+    return true;
+}
+
+static void jit_prologue(void)
+{
+    static const uint8_t saved[] = { H_RBX, H_RBP, H_R12, H_R13, H_R14, H_R15 };
+    uint32_t i;
+    for(i = 0; i < sizeof(saved); i++)
+    {
+        jit_rex(0, 0, saved[i]);
+        jit_b(0x50 + (saved[i] & 7));
+    }
+    jit_b(0x48); // sub rsp, 24 for the stack slots and call alignment
+    jit_b(0x83);
+    jit_b(0xEC);
+    jit_b(24);
+    jit_b(0x48); // mov rbx, wregs
+    jit_b(0xBB);
+    jit_q((uint64_t)(uintptr_t)cpu->wregs);
+    jit_reload_regs();
+}
+
+static void jit_epilogue(void)
+{
+    static const uint8_t saved[] = { H_R15, H_R14, H_R13, H_R12, H_RBP, H_RBX };
+    uint32_t i;
+    jit_b(0x48); // add rsp, 24
+    jit_b(0x83);
+    jit_b(0xC4);
+    jit_b(24);
+    for(i = 0; i < sizeof(saved); i++)
+    {
+        jit_rex(0, 0, saved[i]);
+        jit_b(0x58 + (saved[i] & 7));
+    }
+    jit_b(0xC3);
+}
+
+static void jit_emit_block(const jit_insn_t *insns, uint32_t n)
+{
+    const uint8_t *loop, *epilogue;
+    uint32_t i;
+    bool ended = false;
+
+    jit_num_fixups = jit_num_stubs = 0;
+    jit_flags_known = 0xff;
+
+    jit_prologue();
+    loop = jit_out;
+
+    for(i = 0; i < n && !ended; i++)
+    {
+        const jit_insn_t *in = &insns[i];
+
+        if(jit_jump(in, insns[0].pos, loop))
+        {
+            ended = true;
+            break;
+        }
+        if(jit_inline(in))
+        {
+            jit_retire();
+            jit_check_budget(in->next);
+            continue;
+        }
+
+        jit_flush_regs();
+        jit_mov_ri(H_RDI, in->pos | (in->next << 16));
+        jit_call((const void *)jit_step);
+        jit_flags_known = 0xff;
+        if(jit_ends_block(in))
+        {
+            jit_to_epilogue(jit_jmp());
+            ended = true;
+            break;
+        }
+        jit_alu_rr(X_TEST, H_RAX, H_RAX);
+        jit_to_epilogue(jit_jcc(CC_NE));
+        jit_reload_regs();
+    }
+    if(!ended)
+        jit_exit_to(insns[n - 1].next);
+
+    epilogue = jit_out;
+    jit_epilogue();
+
+    for(i = 0; i < jit_num_stubs; i++)
+    {
+        jit_patch(jit_stubs[i].rel, jit_out);
+        if(jit_stubs[i].retire)
+            jit_retire();
+        jit_exit_to(jit_stubs[i].next);
+    }
+    for(i = 0; i < jit_num_fixups; i++)
+        jit_patch(jit_fixups[i], epilogue);
+}
+
+// Make the pages of the block emitted at start writable, or executable
+// again when write is false.
+static bool jit_protect(uint8_t *start, bool write)
+{
+    const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uint8_t *from = (uint8_t *)((uintptr_t)start & ~(page - 1));
+    uint8_t *to = (uint8_t *)(((uintptr_t)start + JIT_BLOCK_SPACE + page - 1) & ~(page - 1));
+
+    if(to > jit_code + JIT_CODE_SIZE)
+        to = jit_code + JIT_CODE_SIZE;
+    return mprotect(from, to - from,
+                    write ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+}
+
+// Drop all blocks and interpret from now on, when the code buffer can no
+// longer be switched between writable and executable.
+static void jit_disable(void)
+{
+    fprintf(stderr, "JIT code buffer not executable, interpreting\n");
+    jit_flush();
+    cpu->jit_enabled = false;
+}
+
+static jit_block_t *jit_translate(uint32_t addr)
+{
+    const uint16_t cs = cpu->sregs[CS];
+    const uint32_t page = addr >> MEM_PAGE_BITS;
+    jit_insn_t insns[JIT_MAX_INSNS];
+    uint32_t n = 0, i, g, best;
+    uint16_t at = cpu->ip;
+    uint8_t *start;
+    jit_block_t *b;
+
+    if(!cpu->machine->mem_map[page].read || !cpu->jit_enabled)
+        return NULL; // only RAM and ROM
+
+    while(n < JIT_MAX_INSNS && jit_decode(cs, at, page, &insns[n]))
+    {
+        at = insns[n].next;
+        if(jit_is_jump(insns[n++].op) || jit_ends_block(&insns[n - 1]))
+            break;
+    }
+    if(n == 0)
+        return NULL;
+
+    if(jit_num_blocks == JIT_MAX_BLOCKS ||
+       jit_code_used + JIT_BLOCK_SPACE > JIT_CODE_SIZE)
+        jit_flush();
+    start = jit_code + jit_code_used;
+    if(!jit_protect(start, true))
+    {
+        jit_disable();
+        return NULL;
+    }
+
+    // The first pass counts the register uses with nothing cached, the
+    // most used registers are then given host registers.
+    memset(jit_host, -1, sizeof(jit_host));
+    memset(jit_uses, 0, sizeof(jit_uses));
+    jit_written = jit_store_set = 0;
+    jit_out = start;
+    jit_emit_block(insns, n);
+
+    for(i = 0; i < sizeof(jit_cache_regs); i++)
+    {
+        best = 8;
+        for(g = 0; g < 8; g++)
+            if(jit_host[g] < 0 && jit_uses[g] >= 2 &&
+               (best == 8 || jit_uses[g] > jit_uses[best]))
+                best = g;
+        if(best == 8)
+            break;
+        jit_host[best] = jit_cache_regs[i];
+    }
+    jit_store_set = jit_written;
+    jit_out = start;
+    jit_emit_block(insns, n);
+
+    jit_code_used += jit_out - start;
+    if(!jit_protect(start, false))
+    {
+        jit_disable();
+        return NULL;
+    }
+
+    b = &jit_blocks[jit_num_blocks++];
+    b->addr = addr;
+    b->cs = cs;
+    b->code = (void (*)(void))start;
+    b->page_next = jit_pages[page];
+    jit_pages[page] = b;
+    jit_table[jit_hash(addr)] = b;
+
+    for(i = addr >> DCACHE_LINE; i <= (addr + (uint16_t)(at - cpu->ip) - 1) >> DCACHE_LINE; i++)
+        cpu->dcache_lines[i] |= DCACHE_JIT;
+    return b;
+}
+
+static bool jit_init(void)
+{
+    struct jit_t *jit;
+    void *p;
+
+    if(cpu->jit)
+        return true;
+    jit = calloc(1, sizeof(*jit));
+    p = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    // Fails where the host forbids executable memory.
+    if(p != MAP_FAILED && mprotect(p, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(p, JIT_CODE_SIZE);
+        p = MAP_FAILED;
+    }
+    if(!jit || p == MAP_FAILED)
+    {
+        fprintf(stderr, "JIT code buffer unavailable, interpreting\n");
+        if(p != MAP_FAILED)
+            munmap(p, JIT_CODE_SIZE);
+        free(jit);
+        cpu->jit_enabled = false;
+        return false;
+    }
+    jit->code = p;
+    cpu->jit = jit;
+    jit_flush();
+    return true;
+}
+
+static void jit_destroy(void)
+{
+    if(!cpu->jit)
+        return;
+    munmap(jit_code, JIT_CODE_SIZE);
+    free(cpu->jit);
+    cpu->jit = NULL;
+}
+
+// Run translated blocks, interpreting code that is not hot yet, until the
+// cycles reach run_end.
+static void jit_run(void)
+{
+    while(cpu->cycles < cpu->run_end)
+    {
+        uint32_t addr, h;
+        jit_block_t *b;
+
+        check_irq();
+        addr = (cpu->sregs[CS] * 16 + cpu->ip) & 0xFFFFF;
+        h = jit_hash(addr);
+        b = jit_table[h];
+        if(!b || b->addr != addr || b->cs != cpu->sregs[CS])
+        {
+            b = NULL;
+            if(++jit_heat[h] >= JIT_HEAT)
+            {
+                jit_heat[h] = 0;
+                b = jit_translate(addr);
+            }
+        }
+        if(b)
+        {
+            jit_cs = b->cs;
+            jit_exit = 0;
+            b->code();
+        }
+#ifdef CPU_AOT
+        else if(aot_run())
+            continue;
+#endif
+        else
+            cpu->core->next_instruction();
+    }
+}
+
+#undef jit_exit
+#undef jit_cs
+#undef jit_heat
+#undef jit_pages
+#undef jit_table
+#undef jit_num_blocks
+#undef jit_blocks
+#undef jit_code_used
+#undef jit_code
@@ -0,0 +1,262 @@
+// Opcode handler bodies, one OPCODE(code, body) entry per opcode.
+//
+// This file is included by cpu.c with OPCODE() defined to build either the
+// cases of the do_instruction() switch or the labels of the threaded
+// dispatch core. A body may use 'break' to finish early.
+
+OPCODE(0x00, OP_br8(ADD))
+OPCODE(0x01, OP_wr16(ADD))
+OPCODE(0x02, OP_r8b(ADD))
+OPCODE(0x03, OP_r16w(ADD))
+OPCODE(0x04, OP_ald8(ADD))
+OPCODE(0x05, OP_axd16(ADD))
+OPCODE(0x06, PushWord(cpu->sregs[ES]))
+OPCODE(0x07, cpu->sregs[ES] = PopWord())
+OPCODE(0x08, OP_br8(OR))
+OPCODE(0x09, OP_wr16(OR))
+OPCODE(0x0a, OP_r8b(OR))
+OPCODE(0x0b, OP_r16w(OR))
+OPCODE(0x0c, OP_ald8(OR))
+OPCODE(0x0d, OP_axd16(OR))
+OPCODE(0x0e, PushWord(cpu->sregs[CS]))
+OPCODE(0x0f, i_undefined())
+OPCODE(0x10, OP_br8(ADC))
+OPCODE(0x11, OP_wr16(ADC))
+OPCODE(0x12, OP_r8b(ADC))
+OPCODE(0x13, OP_r16w(ADC))
+OPCODE(0x14, OP_ald8(ADC))
+OPCODE(0x15, OP_axd16(ADC))
+OPCODE(0x16, PushWord(cpu->sregs[SS]))
+OPCODE(0x17, cpu->sregs[SS] = PopWord())
+OPCODE(0x18, OP_br8(SBB))
+OPCODE(0x19, OP_wr16(SBB))
+OPCODE(0x1a, OP_r8b(SBB))
+OPCODE(0x1b, OP_r16w(SBB))
+OPCODE(0x1c, OP_ald8(SBB))
+OPCODE(0x1d, OP_axd16(SBB))
+OPCODE(0x1e, PushWord(cpu->sregs[DS]))
+OPCODE(0x1f, cpu->sregs[DS] = PopWord())
+OPCODE(0x20, OP_br8(AND))
+OPCODE(0x21, OP_wr16(AND))
+OPCODE(0x22, OP_r8b(AND))
+OPCODE(0x23, OP_r16w(AND))
+OPCODE(0x24, OP_ald8(AND))
+OPCODE(0x25, OP_axd16(AND))
+OPCODE(0x26, SEG_OVERRIDE(ES))
+OPCODE(0x27, i_daa())
+OPCODE(0x28, OP_br8(SUB))
+OPCODE(0x29, OP_wr16(SUB))
+OPCODE(0x2a, OP_r8b(SUB))
+OPCODE(0x2b, OP_r16w(SUB))
+OPCODE(0x2c, OP_ald8(SUB))
+OPCODE(0x2d, OP_axd16(SUB))
+OPCODE(0x2e, SEG_OVERRIDE(CS))
+OPCODE(0x2f, i_das())
+OPCODE(0x30, OP_br8(XOR))
+OPCODE(0x31, OP_wr16(XOR))
+OPCODE(0x32, OP_r8b(XOR))
+OPCODE(0x33, OP_r16w(XOR))
+OPCODE(0x34, OP_ald8(XOR))
+OPCODE(0x35, OP_axd16(XOR))
+OPCODE(0x36, SEG_OVERRIDE(SS))
+OPCODE(0x37, i_aaa())
+OPCODE(0x38, OP_br8(CMP))
+OPCODE(0x39, OP_wr16(CMP))
+OPCODE(0x3a, OP_r8b(CMP))
+OPCODE(0x3b, OP_r16w(CMP))
+OPCODE(0x3c, OP_ald8(CMP))
+OPCODE(0x3d, OP_axd16(CMP))
+OPCODE(0x3e, SEG_OVERRIDE(DS))
+OPCODE(0x3f, i_aas())
+OPCODE(0x40, INC_WR(AX))
+OPCODE(0x41, INC_WR(CX))
+OPCODE(0x42, INC_WR(DX))
+OPCODE(0x43, INC_WR(BX))
+OPCODE(0x44, INC_WR(SP))
+OPCODE(0x45, INC_WR(BP))
+OPCODE(0x46, INC_WR(SI))
+OPCODE(0x47, INC_WR(DI))
+OPCODE(0x48, DEC_WR(AX))
+OPCODE(0x49, DEC_WR(CX))
+OPCODE(0x4a, DEC_WR(DX))
+OPCODE(0x4b, DEC_WR(BX))
+OPCODE(0x4c, DEC_WR(SP))
+OPCODE(0x4d, DEC_WR(BP))
+OPCODE(0x4e, DEC_WR(SI))
+OPCODE(0x4f, DEC_WR(DI))
+OPCODE(0x50, PUSH_WR(AX))
+OPCODE(0x51, PUSH_WR(CX))
+OPCODE(0x52, PUSH_WR(DX))
+OPCODE(0x53, PUSH_WR(BX))
+OPCODE(0x54, PUSH_SP())
+OPCODE(0x55, PUSH_WR(BP))
+OPCODE(0x56, PUSH_WR(SI))
+OPCODE(0x57, PUSH_WR(DI))
+OPCODE(0x58, POP_WR(AX))
+OPCODE(0x59, POP_WR(CX))
+OPCODE(0x5a, POP_WR(DX))
+OPCODE(0x5b, POP_WR(BX))
+OPCODE(0x5c, POP_WR(SP))
+OPCODE(0x5d, POP_WR(BP))
+OPCODE(0x5e, POP_WR(SI))
+OPCODE(0x5f, POP_WR(DI))
+OPCODE(0x60, i_pusha())                   /* 186 */
+OPCODE(0x61, i_popa())                    /* 186 */
+OPCODE(0x62, i_bound())                   /* 186 */
+OPCODE(0x63, i_undefined())
+OPCODE(0x64, i_undefined())
+OPCODE(0x65, i_undefined())
+OPCODE(0x66, i_undefined())
+OPCODE(0x67, i_undefined())
+OPCODE(0x68, PushWord(FETCH_W()))         /* 186 */
+OPCODE(0x69, i_imul_r16w_d16())           /* 186 */
+OPCODE(0x6a, PushWord((int8_t)FETCH_B())) /* 186 */
+OPCODE(0x6b, i_imul_r16w_d8())            /* 186 */
+OPCODE(0x6c, i_insb())                    /* 186 */
+OPCODE(0x6d, i_insw())                    /* 186 */
+OPCODE(0x6e, i_outsb())                   /* 186 */
+OPCODE(0x6f, i_outsw())                   /* 186 */
+OPCODE(0x70, do_cjump(jcc_cond(0x70)))
+OPCODE(0x71, do_cjump(jcc_cond(0x71)))
+OPCODE(0x72, do_cjump(jcc_cond(0x72)))
+OPCODE(0x73, do_cjump(jcc_cond(0x73)))
+OPCODE(0x74, do_cjump(jcc_cond(0x74)))
+OPCODE(0x75, do_cjump(jcc_cond(0x75)))
+OPCODE(0x76, do_cjump(jcc_cond(0x76)))
+OPCODE(0x77, do_cjump(jcc_cond(0x77)))
+OPCODE(0x78, do_cjump(jcc_cond(0x78)))
+OPCODE(0x79, do_cjump(jcc_cond(0x79)))
+OPCODE(0x7a, do_cjump(jcc_cond(0x7a)))
+OPCODE(0x7b, do_cjump(jcc_cond(0x7b)))
+OPCODE(0x7c, do_cjump(jcc_cond(0x7c)))
+OPCODE(0x7d, do_cjump(jcc_cond(0x7d)))
+OPCODE(0x7e, do_cjump(jcc_cond(0x7e)))
+OPCODE(0x7f, do_cjump(jcc_cond(0x7f)))
+OPCODE(0x80, i_80pre())
+OPCODE(0x81, i_81pre())
+OPCODE(0x82, i_82pre())
+OPCODE(0x83, i_83pre())
+OPCODE(0x84, OP_br8(TEST))
+OPCODE(0x85, OP_wr16(TEST))
+OPCODE(0x86, i_xchg_br8())
+OPCODE(0x87, i_xchg_wr16())
+OPCODE(0x88, OP_br8(MOV))
+OPCODE(0x89, OP_wr16(MOV))
+OPCODE(0x8a, OP_r8b(MOV))
+OPCODE(0x8b, OP_r16w(MOV))
+OPCODE(0x8c, i_mov_wsreg())
+OPCODE(0x8d, i_lea())
+OPCODE(0x8e, i_mov_sregw())
+OPCODE(0x8f, i_popw())
+OPCODE(0x90, /* NOP */)
+OPCODE(0x91, XCHG_AX_WR(CX))
+OPCODE(0x92, XCHG_AX_WR(DX))
+OPCODE(0x93, XCHG_AX_WR(BX))
+OPCODE(0x94, XCHG_AX_WR(SP))
+OPCODE(0x95, XCHG_AX_WR(BP))
+OPCODE(0x96, XCHG_AX_WR(SI))
+OPCODE(0x97, XCHG_AX_WR(DI))
+OPCODE(0x98, cpu->wregs[AX] = (int8_t)(0xFF & cpu->wregs[AX]))
+OPCODE(0x99, cpu->wregs[DX] = (cpu->wregs[AX] & 0x8000) ? 0xffff : 0)
+OPCODE(0x9a, i_call_far())
+OPCODE(0x9b, /* WAIT */)
+OPCODE(0x9c, PushWord(CompressFlags()))
+OPCODE(0x9d, do_popf())
+OPCODE(0x9e, i_sahf())
+OPCODE(0x9f, i_lahf())
+OPCODE(0xa0, i_mov_aldisp())
+OPCODE(0xa1, i_mov_axdisp())
+OPCODE(0xa2, i_mov_dispal())
+OPCODE(0xa3, i_mov_dispax())
+OPCODE(0xa4, i_movsb())
+OPCODE(0xa5, i_movsw())
+OPCODE(0xa6, i_cmpsb())
+OPCODE(0xa7, i_cmpsw())
+OPCODE(0xa8, OP_ald8(TEST))
+OPCODE(0xa9, OP_axd16(TEST))
+OPCODE(0xaa, i_stosb())
+OPCODE(0xab, i_stosw())
+OPCODE(0xac, i_lodsb())
+OPCODE(0xad, i_lodsw())
+OPCODE(0xae, i_scasb())
+OPCODE(0xaf, i_scasw())
+OPCODE(0xb0, MOV_BRL(AX))
+OPCODE(0xb1, MOV_BRL(CX))
+OPCODE(0xb2, MOV_BRL(DX))
+OPCODE(0xb3, MOV_BRL(BX))
+OPCODE(0xb4, MOV_BRH(AX))
+OPCODE(0xb5, MOV_BRH(CX))
+OPCODE(0xb6, MOV_BRH(DX))
+OPCODE(0xb7, MOV_BRH(BX))
+OPCODE(0xb8, MOV_WRi(AX))
+OPCODE(0xb9, MOV_WRi(CX))
+OPCODE(0xba, MOV_WRi(DX))
+OPCODE(0xbb, MOV_WRi(BX))
+OPCODE(0xbc, MOV_WRi(SP))
+OPCODE(0xbd, MOV_WRi(BP))
+OPCODE(0xbe, MOV_WRi(SI))
+OPCODE(0xbf, MOV_WRi(DI))
+OPCODE(0xc0, i_c0pre(SHIFT_COUNT_MASK))                   /* 186 */
+OPCODE(0xc1, i_c1pre(SHIFT_COUNT_MASK))                   /* 186 */
+OPCODE(0xc2, i_ret_d16())
+OPCODE(0xc3, i_ret())
+OPCODE(0xc4, i_les_dw())
+OPCODE(0xc5, i_lds_dw())
+OPCODE(0xc6, i_mov_bd8())
+OPCODE(0xc7, i_mov_wd16())
+OPCODE(0xc8, i_enter())
+OPCODE(0xc9, i_leave())
+OPCODE(0xca, i_retf_d16())
+OPCODE(0xcb, do_retf())
+OPCODE(0xcc, i_int3())
+OPCODE(0xcd, i_int())
+OPCODE(0xce, i_into())
+OPCODE(0xcf, do_iret())
+OPCODE(0xd0, i_d0pre())
+OPCODE(0xd1, i_d1pre())
+OPCODE(0xd2, i_d2pre(SHIFT_COUNT_MASK))
+OPCODE(0xd3, i_d3pre(SHIFT_COUNT_MASK))
+OPCODE(0xd4, i_aam())
+OPCODE(0xd5, i_aad())
+OPCODE(0xd6, i_undefined())
+OPCODE(0xd7, i_xlat())
+OPCODE(0xd8, i_escape())
+OPCODE(0xd9, i_escape())
+OPCODE(0xda, i_escape())
+OPCODE(0xdb, i_escape())
+OPCODE(0xdc, i_escape())
+OPCODE(0xdd, i_escape())
+OPCODE(0xde, i_escape())
+OPCODE(0xdf, i_escape())
+OPCODE(0xe0, i_loopne())
+OPCODE(0xe1, i_loope())
+OPCODE(0xe2, i_loop())
+OPCODE(0xe3, i_jcxz())
+OPCODE(0xe4, i_inal())
+OPCODE(0xe5, i_inax())
+OPCODE(0xe6, i_outal())
+OPCODE(0xe7, i_outax())
+OPCODE(0xe8, i_call_d16())
+OPCODE(0xe9, i_jmp_d16())
+OPCODE(0xea, i_jmp_far())
+OPCODE(0xeb, i_jmp_d8())
+OPCODE(0xec, i_inaldx())
+OPCODE(0xed, i_inaxdx())
+OPCODE(0xee, i_outdxal())
+OPCODE(0xef, i_outdxax())
+OPCODE(0xf0, /* LOCK */)
+OPCODE(0xf1, i_undefined())
+OPCODE(0xf2, rep(0))
+OPCODE(0xf3, rep(1))
+OPCODE(0xf4, i_halt())
+OPCODE(0xf5, SyncFlags(); cpu->CF = !cpu->CF)
+OPCODE(0xf6, i_f6pre())
+OPCODE(0xf7, i_f7pre())
+OPCODE(0xf8, SyncFlags(); cpu->CF = 0)
+OPCODE(0xf9, SyncFlags(); cpu->CF = 1)
+OPCODE(0xfa, cpu->IF = 0)
+OPCODE(0xfb, i_sti())
+OPCODE(0xfc, cpu->DF = 0)
+OPCODE(0xfd, cpu->DF = 1)
+OPCODE(0xfe, i_fepre())
+OPCODE(0xff, i_ffpre())
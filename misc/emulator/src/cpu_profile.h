@@ -0,0 +1,363 @@
+// Host time profile of the interpreter.
+//
+// This file is included by cpu.c when CPU_PROFILE is defined (ICEXT_PROFILE),
+// without it none of the counters are compiled in. Every instruction going
+// through do_instruction() is counted by its prefixes, opcode and ModRM
+// form together with the host timestamp ticks it took, prefixes included.
+// Repeated string instructions are also counted by their rep() variant
+// with the elements they processed.
+//
+// The translator and the threaded dispatch core are bypassed in a
+// profiling build, every instruction runs through the handlers measured.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define profile_ticks() __rdtsc()
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define profile_ticks() __rdtsc()
+#else
+#include <time.h>
+static inline uint64_t profile_ticks(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+#endif
+
+#define PROFILE_BITS  13  // far more slots than the combinations seen
+#define PROFILE_SLOTS (1 << PROFILE_BITS)
+
+// ModRM forms, memory forms are mod * 8 + r/m
+#define FORM_REG   24
+#define FORM_NONE  25
+#define NUM_FORMS  26
+
+#define PREFIX_ES    0x01
+#define PREFIX_CS    0x02
+#define PREFIX_SS    0x04
+#define PREFIX_DS    0x08
+#define PREFIX_REP   0x10
+#define PREFIX_REPNE 0x20
+#define NUM_PREFIXES 0x40
+
+typedef struct {
+    uint32_t key;    // profile_key() + 1, 0 when the slot is free
+    uint64_t count;
+    uint64_t ticks;
+} profile_entry_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t elements;
+    uint64_t ticks;
+} profile_rep_t;
+
+struct profile_t {
+    profile_entry_t entries[PROFILE_SLOTS];
+    uint32_t used;
+    uint64_t dropped;  // instructions not counted, the table was full
+
+    profile_rep_t reps[2][256];  // [REP, REPNE][string opcode]
+
+    // Instruction being executed, prefixes run the next opcode from
+    // a nested do_instruction() call.
+    uint32_t depth;
+    uint64_t start;
+    uint8_t  prefixes;
+    uint8_t  opcode;
+    uint8_t  form;
+};
+
+static const char *const opcode_names[256] = {
+    /* 00 */ "add Eb,Gb", "add Ev,Gv", "add Gb,Eb", "add Gv,Ev", "add AL,Ib", "add AX,Iv", "push ES", "pop ES",
+    /* 08 */ "or Eb,Gb", "or Ev,Gv", "or Gb,Eb", "or Gv,Ev", "or AL,Ib", "or AX,Iv", "push CS", "(0f)",
+    /* 10 */ "adc Eb,Gb", "adc Ev,Gv", "adc Gb,Eb", "adc Gv,Ev", "adc AL,Ib", "adc AX,Iv", "push SS", "pop SS",
+    /* 18 */ "sbb Eb,Gb", "sbb Ev,Gv", "sbb Gb,Eb", "sbb Gv,Ev", "sbb AL,Ib", "sbb AX,Iv", "push DS", "pop DS",
+    /* 20 */ "and Eb,Gb", "and Ev,Gv", "and Gb,Eb", "and Gv,Ev", "and AL,Ib", "and AX,Iv", "es:", "daa",
+    /* 28 */ "sub Eb,Gb", "sub Ev,Gv", "sub Gb,Eb", "sub Gv,Ev", "sub AL,Ib", "sub AX,Iv", "cs:", "das",
+    /* 30 */ "xor Eb,Gb", "xor Ev,Gv", "xor Gb,Eb", "xor Gv,Ev", "xor AL,Ib", "xor AX,Iv", "ss:", "aaa",
+    /* 38 */ "cmp Eb,Gb", "cmp Ev,Gv", "cmp Gb,Eb", "cmp Gv,Ev", "cmp AL,Ib", "cmp AX,Iv", "ds:", "aas",
+    /* 40 */ "inc AX", "inc CX", "inc DX", "inc BX", "inc SP", "inc BP", "inc SI", "inc DI",
+    /* 48 */ "dec AX", "dec CX", "dec DX", "dec BX", "dec SP", "dec BP", "dec SI", "dec DI",
+    /* 50 */ "push AX", "push CX", "push DX", "push BX", "push SP", "push BP", "push SI", "push DI",
+    /* 58 */ "pop AX", "pop CX", "pop DX", "pop BX", "pop SP", "pop BP", "pop SI", "pop DI",
+    /* 60 */ "pusha", "popa", "bound Gv,Ma", "(63)", "(64)", "(65)", "(66)", "(67)",
+    /* 68 */ "push Iv", "imul Gv,Ev,Iv", "push Ib", "imul Gv,Ev,Ib", "insb", "insw", "outsb", "outsw",
+    /* 70 */ "jo", "jno", "jb", "jnb", "jz", "jnz", "jbe", "ja",
+    /* 78 */ "js", "jns", "jp", "jnp", "jl", "jnl", "jle", "jg",
+    /* 80 */ "grp1 Eb,Ib", "grp1 Ev,Iv", "grp1 Eb,Ib (82)", "grp1 Ev,Ib", "test Eb,Gb", "test Ev,Gv", "xchg Eb,Gb", "xchg Ev,Gv",
+    /* 88 */ "mov Eb,Gb", "mov Ev,Gv", "mov Gb,Eb", "mov Gv,Ev", "mov Ew,Sw", "lea Gv,M", "mov Sw,Ew", "pop Ev",
+    /* 90 */ "nop", "xchg CX,AX", "xchg DX,AX", "xchg BX,AX", "xchg SP,AX", "xchg BP,AX", "xchg SI,AX", "xchg DI,AX",
+    /* 98 */ "cbw", "cwd", "call Ap", "wait", "pushf", "popf", "sahf", "lahf",
+    /* A0 */ "mov AL,Ob", "mov AX,Ov", "mov Ob,AL", "mov Ov,AX", "movsb", "movsw", "cmpsb", "cmpsw",
+    /* A8 */ "test AL,Ib", "test AX,Iv", "stosb", "stosw", "lodsb", "lodsw", "scasb", "scasw",
+    /* B0 */ "mov AL,Ib", "mov CL,Ib", "mov DL,Ib", "mov BL,Ib", "mov AH,Ib", "mov CH,Ib", "mov DH,Ib", "mov BH,Ib",
+    /* B8 */ "mov AX,Iv", "mov CX,Iv", "mov DX,Iv", "mov BX,Iv", "mov SP,Iv", "mov BP,Iv", "mov SI,Iv", "mov DI,Iv",
+    /* C0 */ "grp2 Eb,Ib", "grp2 Ev,Ib", "ret Iw", "ret", "les Gv,Mp", "lds Gv,Mp", "mov Eb,Ib", "mov Ev,Iv",
+    /* C8 */ "enter", "leave", "retf Iw", "retf", "int3", "int Ib", "into", "iret",
+    /* D0 */ "grp2 Eb,1", "grp2 Ev,1", "grp2 Eb,CL", "grp2 Ev,CL", "aam", "aad", "salc", "xlat",
+    /* D8 */ "esc (d8)", "esc (d9)", "esc (da)", "esc (db)", "esc (dc)", "esc (dd)", "esc (de)", "esc (df)",
+    /* E0 */ "loopnz", "loopz", "loop", "jcxz", "in AL,Ib", "in AX,Ib", "out Ib,AL", "out Ib,AX",
+    /* E8 */ "call Jv", "jmp Jv", "jmp Ap", "jmp Jb", "in AL,DX", "in AX,DX", "out DX,AL", "out DX,AX",
+    /* F0 */ "lock", "(f1)", "repne", "rep", "hlt", "cmc", "grp3 Eb", "grp3 Ev",
+    /* F8 */ "clc", "stc", "cli", "sti", "cld", "std", "grp4 Eb", "grp5 Ev",
+};
+
+static const char *const form_names[NUM_FORMS] = {
+    "[bx+si]",    "[bx+di]",    "[bp+si]",    "[bp+di]",
+    "[si]",       "[di]",       "[d16]",      "[bx]",
+    "[bx+si+d8]", "[bx+di+d8]", "[bp+si+d8]", "[bp+di+d8]",
+    "[si+d8]",    "[di+d8]",    "[bp+d8]",    "[bx+d8]",
+    "[bx+si+d16]","[bx+di+d16]","[bp+si+d16]","[bp+di+d16]",
+    "[si+d16]",   "[di+d16]",   "[bp+d16]",   "[bx+d16]",
+    "reg",        "-",
+};
+
+static const char *const prefix_names[6] = {
+    "es:", "cs:", "ss:", "ds:", "rep", "repne",
+};
+
+static void profile_create(void)
+{
+    cpu->profile = calloc(1, sizeof(struct profile_t));
+}
+
+static void profile_destroy(void)
+{
+    free(cpu->profile);
+    cpu->profile = NULL;
+}
+
+// Note an opcode byte of the current instruction, a prefix or the opcode.
+static inline void profile_opcode(uint8_t code)
+{
+    switch(code)
+    {
+    case 0x26: cpu->profile->prefixes |= PREFIX_ES;    return;
+    case 0x2e: cpu->profile->prefixes |= PREFIX_CS;    return;
+    case 0x36: cpu->profile->prefixes |= PREFIX_SS;    return;
+    case 0x3e: cpu->profile->prefixes |= PREFIX_DS;    return;
+    case 0xf2: cpu->profile->prefixes |= PREFIX_REPNE; return;
+    case 0xf3: cpu->profile->prefixes |= PREFIX_REP;   return;
+    }
+    cpu->profile->opcode = code;
+    cpu->profile->form = FORM_NONE;
+    if(decode_table[code] & D_MODRM)
+    {
+        // the ModRM byte is next, not fetched yet
+        const uint8_t modrm = (cpu->fetch_ptr != cpu->fetch_end) ? *cpu->fetch_ptr : GetCodeB(cpu->ip);
+        if(modrm >= 0xc0)
+            cpu->profile->form = FORM_REG;
+        else
+            cpu->profile->form = (modrm >> 6) * 8 + (modrm & 7);
+    }
+}
+
+static inline void profile_begin(uint8_t code)
+{
+    if(cpu->profile->depth++ == 0)
+    {
+        cpu->profile->prefixes = 0;
+        cpu->profile->start = profile_ticks();
+    }
+    profile_opcode(code);
+}
+
+static inline uint32_t profile_key(uint8_t prefixes, uint8_t opcode, uint8_t form)
+{
+    return (prefixes << 16) | (opcode << 8) | form;
+}
+
+static inline void profile_end(void)
+{
+    if(--cpu->profile->depth)
+        return;
+
+    const uint64_t ticks = profile_ticks() - cpu->profile->start;
+    const uint32_t key = profile_key(cpu->profile->prefixes, cpu->profile->opcode, cpu->profile->form) + 1;
+    uint32_t slot = (key * 0x9E3779B1u) >> (32 - PROFILE_BITS);
+
+    while(cpu->profile->entries[slot].key != key)
+    {
+        if(!cpu->profile->entries[slot].key)
+        {
+            // keep a free slot so lookups end
+            if(cpu->profile->used == PROFILE_SLOTS - 1)
+            {
+                cpu->profile->dropped++;
+                return;
+            }
+            cpu->profile->entries[slot].key = key;
+            cpu->profile->used++;
+            break;
+        }
+        slot = (slot + 1) & (PROFILE_SLOTS - 1);
+    }
+    cpu->profile->entries[slot].count++;
+    cpu->profile->entries[slot].ticks += ticks;
+}
+
+// A repeated string instruction finished after elements iterations.
+static inline void profile_rep(uint8_t code, int32_t flagval, uint32_t elements, uint64_t start)
+{
+    switch(code)
+    {
+    case 0x6c: case 0x6d: case 0x6e: case 0x6f:
+    case 0xa4: case 0xa5: case 0xa6: case 0xa7:
+    case 0xaa: case 0xab: case 0xac: case 0xad: case 0xae: case 0xaf:
+        break;
+    default:
+        return;  // a segment prefix, counted by the nested rep(), or ignored
+    }
+    profile_rep_t *r = &cpu->profile->reps[flagval ? 0 : 1][code];
+    r->count++;
+    r->elements += elements;
+    r->ticks += profile_ticks() - start;
+}
+
+//----------------------------------------------------------------
+// Report
+
+typedef struct {
+    const char *name;
+    char        buf[48];
+    uint64_t    count;
+    uint64_t    ticks;
+    uint64_t    elements;  // of a rep() variant
+} profile_row_t;
+
+static int profile_row_cmp(const void *a, const void *b)
+{
+    const profile_row_t *x = a, *y = b;
+    if(x->ticks != y->ticks)
+        return x->ticks < y->ticks ? 1 : -1;
+    return x->count < y->count ? 1 : (x->count > y->count ? -1 : 0);
+}
+
+static void profile_prefix_name(uint8_t prefixes, char *buf, size_t size, const char *sep)
+{
+    size_t len = 0;
+    buf[0] = 0;
+    for(uint32_t i = 0; i < 6; i++)
+    {
+        if(prefixes & (1 << i))
+            len += snprintf(buf + len, size - len, "%s%s", len ? sep : "", prefix_names[i]);
+    }
+}
+
+// Print rows sorted by ticks, dropping the empty ones.
+static void profile_table(FILE *fd, const char *title, profile_row_t *rows, uint32_t num,
+                          uint64_t count, uint64_t ticks)
+{
+    qsort(rows, num, sizeof(*rows), profile_row_cmp);
+    fprintf(fd, "\n%-24s %14s %7s %16s %7s %9s\n", title, "count", "%", "ticks", "%", "ticks/op");
+    for(uint32_t i = 0; i < num && rows[i].count; i++)
+    {
+        fprintf(fd, "%-24s %14llu %6.2f%% %16llu %6.2f%% %9.1f\n",
+                rows[i].name ? rows[i].name : rows[i].buf,
+                (unsigned long long)rows[i].count, rows[i].count * 100.0 / (count ? count : 1),
+                (unsigned long long)rows[i].ticks, rows[i].ticks * 100.0 / (ticks ? ticks : 1),
+                (double)rows[i].ticks / rows[i].count);
+    }
+}
+
+static bool profile_report(FILE *fd)
+{
+    profile_row_t *opcodes = calloc(256, sizeof(profile_row_t));
+    profile_row_t *forms = calloc(NUM_FORMS, sizeof(profile_row_t));
+    profile_row_t *prefixes = calloc(NUM_PREFIXES, sizeof(profile_row_t));
+    profile_row_t *reps = calloc(2 * 256, sizeof(profile_row_t));
+    if(!opcodes || !forms || !prefixes || !reps)
+    {
+        free(opcodes);
+        free(forms);
+        free(prefixes);
+        free(reps);
+        return false;
+    }
+
+    uint64_t count = 0, ticks = 0;
+    uint32_t i;
+    for(i = 0; i < PROFILE_SLOTS; i++)
+    {
+        const profile_entry_t *e = &cpu->profile->entries[i];
+        if(!e->key)
+            continue;
+        const uint32_t key = e->key - 1;
+        const uint8_t p = key >> 16, op = (key >> 8) & 0xff, form = key & 0xff;
+        opcodes[op].count += e->count;
+        opcodes[op].ticks += e->ticks;
+        forms[form].count += e->count;
+        forms[form].ticks += e->ticks;
+        prefixes[p].count += e->count;
+        prefixes[p].ticks += e->ticks;
+        count += e->count;
+        ticks += e->ticks;
+    }
+    for(i = 0; i < 256; i++)
+        opcodes[i].name = opcode_names[i];
+    for(i = 0; i < NUM_FORMS; i++)
+        forms[i].name = form_names[i];
+    for(i = 0; i < NUM_PREFIXES; i++)
+        profile_prefix_name(i, prefixes[i].buf, sizeof(prefixes[i].buf), " ");
+    prefixes[0].name = "(none)";
+
+    fprintf(fd, "instructions %llu, ticks %llu, not counted %llu\n",
+            (unsigned long long)count, (unsigned long long)ticks,
+            (unsigned long long)cpu->profile->dropped);
+
+    profile_table(fd, "opcode", opcodes, 256, count, ticks);
+    profile_table(fd, "modrm form", forms, NUM_FORMS, count, ticks);
+    profile_table(fd, "prefixes", prefixes, NUM_PREFIXES, count, ticks);
+
+    // rep() variants, with the elements they processed
+    uint32_t num = 0;
+    for(i = 0; i < 2 * 256; i++)
+    {
+        const profile_rep_t *r = &cpu->profile->reps[i / 256][i % 256];
+        if(!r->count)
+            continue;
+        snprintf(reps[num].buf, sizeof(reps[num].buf), "%s %s",
+                 prefix_names[4 + i / 256], opcode_names[i % 256]);
+        reps[num].count = r->count;
+        reps[num].ticks = r->ticks;
+        reps[num].elements = r->elements;
+        num++;
+    }
+    qsort(reps, num, sizeof(*reps), profile_row_cmp);
+    fprintf(fd, "\n%-24s %14s %16s %9s %16s %9s\n", "rep", "count", "elements", "avg", "ticks", "ticks/el");
+    for(i = 0; i < num; i++)
+    {
+        const uint64_t elements = reps[i].elements;
+        fprintf(fd, "%-24s %14llu %16llu %9.1f %16llu %9.1f\n", reps[i].buf,
+                (unsigned long long)reps[i].count, (unsigned long long)elements,
+                (double)elements / reps[i].count, (unsigned long long)reps[i].ticks,
+                elements ? (double)reps[i].ticks / elements : 0.0);
+    }
+
+    free(opcodes);
+    free(forms);
+    free(prefixes);
+    free(reps);
+    return true;
+}
+
+// One line per prefixes, opcode and form: cpu;prefix;...;opcode;form ticks
+static bool profile_folded(FILE *fd)
+{
+    for(uint32_t i = 0; i < PROFILE_SLOTS; i++)
+    {
+        const profile_entry_t *e = &cpu->profile->entries[i];
+        if(!e->key)
+            continue;
+        const uint32_t key = e->key - 1;
+        char prefixes[48];
+        profile_prefix_name(key >> 16, prefixes, sizeof(prefixes), ";");
+        fprintf(fd, "cpu;%s%s%s;%s %llu\n", prefixes, prefixes[0] ? ";" : "",
+                opcode_names[(key >> 8) & 0xff], form_names[key & 0xff],
+                (unsigned long long)e->ticks);
+    }
+    return true;
+}
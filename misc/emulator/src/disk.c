@@ -1,41 +1,20 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "disk.h"
-#include "cpu.h"
+#include "journal.h"
+#include "machine.h"
 
 #ifdef USE_SERIAL_SD
-#include "serial.h"
+#include "libserial.h"
 #endif  // USE_SERIAL_SD
 
 
-static FILE* disk;
-static uint64_t disk_size = 0;
-
 #define USE_HDD 1
 
-#if USE_HDD
-static uint32_t disk_heads     = 16;
-static uint32_t disk_sectors   = 63;
-static uint32_t disk_cylinders = 0;
-#else
-static uint32_t disk_heads     = 2;
-static uint32_t disk_sectors   = 18;
-static uint32_t disk_cylinders = 80;
-#endif
-
-static int spi_cs = 1;
-static int sd_idle = 1;
-
-static uint64_t shift_in  = ~0llu;
-static uint64_t shift_out = ~0llu;
-
-static uint32_t sector;
-static uint32_t read_count  = 0;
-static uint32_t write_count = 0;
-static bool wait_for_start = false;
-
 #ifdef USE_SERIAL_SD
 static serial_t* serial;
 #endif  //USE_SERIAL_SD
@@ -45,7 +24,13 @@ static uint8_t _spi_cs;
 static uint8_t rx_buf;
 
 #ifdef USE_SERIAL_SD
-static uint8_t xfer(uint8_t tx, uint8_t cs) {
+static uint8_t xfer(machine_t *m, uint8_t tx, uint8_t cs) {
+
+  // a replay takes the replies of the card from the journal
+  if (journal_replaying(m)) {
+    rx_buf = (uint8_t)journal_take(m, JOURNAL_SD_REPLY);
+    return rx_buf;
+  }
 
   int ntx, nrx;
 
@@ -63,12 +48,13 @@ static uint8_t xfer(uint8_t tx, uint8_t cs) {
   assert(nrx == 1);
 
   rx_buf = rx;
+  journal_put(m, JOURNAL_SD_REPLY, rx);
 
   return rx;
 }
 
-static void spi_send(uint8_t tx) {
-  xfer(tx, _spi_cs);
+static void spi_send(machine_t *m, uint8_t tx) {
+  xfer(m, tx, _spi_cs);
 }
 
 static uint8_t spi_recv(void) {
@@ -76,33 +62,71 @@ static uint8_t spi_recv(void) {
 }
 #endif  // USE_SERIAL_SD
 
-static void set_stack_cf() {
-  uint32_t sp = cpu_get_address(cpu_get_SS(), cpu_get_SP());
-  memory[sp+4] |= 1;
+static void set_stack_cf(machine_t *m) {
+  uint32_t sp = cpu_get_address(cpu_get_SS(m), cpu_get_SP(m));
+  m->memory[sp+4] |= 1;
 }
 
-static void clr_stack_cf() {
-  uint32_t sp = cpu_get_address(cpu_get_SS(), cpu_get_SP());
-  memory[sp+4] &= 0xfe;
+static void clr_stack_cf(machine_t *m) {
+  uint32_t sp = cpu_get_address(cpu_get_SS(m), cpu_get_SP(m));
+  m->memory[sp+4] &= 0xfe;
+}
+
+void disk_init(machine_t *m) {
+  disk_t *d = &m->disk;
+  memset(d, 0, sizeof(*d));
+#if USE_HDD
+  d->disk_heads     = 16;
+  d->disk_sectors   = 63;
+  d->disk_cylinders = 0;
+#else
+  d->disk_heads     = 2;
+  d->disk_sectors   = 18;
+  d->disk_cylinders = 80;
+#endif
+  d->spi_cs    = 1;
+  d->sd_idle   = 1;
+  d->shift_in  = ~0llu;
+  d->shift_out = ~0llu;
+}
+
+void disk_close(machine_t *m) {
+  disk_t *d = &m->disk;
+  if (d->disk) {
+    fclose(d->disk);
+    d->disk = NULL;
+  }
+  if (d->overlay) {
+    fclose(d->overlay);
+    d->overlay = NULL;
+  }
+  free(d->written);
+  free(d->path);
+  d->written = NULL;
+  d->path    = NULL;
+  d->io      = NULL;
 }
 
-bool disk_load(const char* path) {
-  disk = fopen(path, "rb+");
-  if (!disk) {
+bool disk_load(machine_t *m, const char* path) {
+  disk_t *d = &m->disk;
+  d->disk = fopen(path, "rb+");
+  if (!d->disk) {
     return false;
   }
+  d->io   = d->disk;
+  d->path = strdup(path);
 
-  fseek(disk, 0, SEEK_END);
-  disk_size = ftell(disk);
-  fseek(disk, 0, SEEK_SET);
+  fseek(d->disk, 0, SEEK_END);
+  d->disk_size = ftell(d->disk);
+  fseek(d->disk, 0, SEEK_SET);
 
-  if (!disk_cylinders) {
-    disk_cylinders = disk_size / (disk_heads * disk_sectors * 512);
+  if (!d->disk_cylinders) {
+    d->disk_cylinders = d->disk_size / (d->disk_heads * d->disk_sectors * 512);
   }
 
-  printf("sectors  : %u\n", disk_sectors);
-  printf("heads    : %u\n", disk_heads);
-  printf("cylinders: %u\n", disk_cylinders);
+  printf("sectors  : %u\n", d->disk_sectors);
+  printf("heads    : %u\n", d->disk_heads);
+  printf("cylinders: %u\n", d->disk_cylinders);
 
 #ifdef USE_SERIAL_SD
   serial = serial_open(14, 115200);
@@ -114,189 +138,254 @@ bool disk_load(const char* path) {
   return true;
 }
 
+bool disk_overlay(machine_t *m, const char* path) {
+  disk_t *d = &m->disk;
+  if (!d->disk || d->overlay) {
+    return false;
+  }
+
+  // reopen the image read only, which also gives a forked process a file
+  // position of its own
+  FILE* image = fopen(d->path, "rb");
+  if (!image) {
+    return false;
+  }
+  FILE* overlay = fopen(path, "w+b");
+  if (!overlay) {
+    fclose(image);
+    return false;
+  }
+
+  const long pos = ftell(d->io);
+  fclose(d->disk);
+  d->disk    = image;
+  d->overlay = overlay;
+  d->written = calloc((d->disk_size / 512 + 7) / 8, 1);
+  d->io      = d->disk;
+  fseek(d->io, pos, SEEK_SET);
+  return true;
+}
+
+// File holding the current contents of a sector.
+static FILE* sector_file(disk_t* d, uint32_t sector) {
+  if (d->overlay && sector < d->disk_size / 512 &&
+      (d->written[sector / 8] & (1 << (sector % 8)))) {
+    return d->overlay;
+  }
+  return d->disk;
+}
+
+// File to write a sector to, a sector is copied to the overlay on its first
+// write.
+static FILE* sector_write_file(disk_t* d, uint32_t sector) {
+  if (!d->overlay) {
+    return d->disk;
+  }
+  if (sector < d->disk_size / 512 &&
+      !(d->written[sector / 8] & (1 << (sector % 8)))) {
+    uint8_t data[512] = { 0 };
+    fseek(d->disk, 512 * sector, SEEK_SET);
+    fread(data, 1, sizeof(data), d->disk);
+    fseek(d->overlay, 512 * sector, SEEK_SET);
+    fwrite(data, 1, sizeof(data), d->overlay);
+    d->written[sector / 8] |= 1 << (sector % 8);
+  }
+  return d->overlay;
+}
+
 #ifdef USE_SERIAL_SD
-void disk_spi_ctrl(uint8_t tx) {
+void disk_spi_ctrl(machine_t *m, uint8_t tx) {
   _spi_cs = tx & 1;
 }
 
-void disk_spi_write(uint8_t tx) {
-  spi_send(tx);
+void disk_spi_write(machine_t *m, uint8_t tx) {
+  spi_send(m, tx);
 }
 
-uint8_t disk_spi_read() {
+uint8_t disk_spi_read(machine_t *m) {
   return spi_recv();
 }
 #else
-void disk_spi_ctrl(uint8_t tx) {
-  spi_cs = tx & 1;
+void disk_spi_ctrl(machine_t *m, uint8_t tx) {
+  m->disk.spi_cs = tx & 1;
 }
 
-void disk_spi_write(uint8_t tx) {
+void disk_spi_write(machine_t *m, uint8_t tx) {
+  disk_t *d = &m->disk;
 
-  if (spi_cs == 1) {
+  if (d->spi_cs == 1) {
     return;
   }
 
-  shift_in  = (shift_in  << 8) | tx;
-  shift_out = (shift_out << 8);
+  d->shift_in  = (d->shift_in  << 8) | tx;
+  d->shift_out = (d->shift_out << 8);
 
-  if (write_count) {
-    if (wait_for_start) {
-      if ((shift_in & 0xff) == 0xfe) {
-        wait_for_start = false;
+  if (d->write_count) {
+    if (d->wait_for_start) {
+      if ((d->shift_in & 0xff) == 0xfe) {
+        d->wait_for_start = false;
       }
     }
     else {
-      uint8_t out = shift_in & 0xff;
-      fwrite(&out, 1, 1, disk);
-      if (0 == --write_count) {
+      uint8_t out = d->shift_in & 0xff;
+      fwrite(&out, 1, 1, d->io);
+      d->write_sum = (d->write_sum ^ out) * 16777619u;
+      if (0 == --d->write_count) {
+        journal_check(m, JOURNAL_DISK_WRITE, d->write_sum);
         //            ..--..--..--..--
-        shift_out = 0xffAAAA05ffff00ffllu;
+        d->shift_out = 0xffAAAA05ffff00ffllu;
 
         // clear input so data cant be mistaken for a
         // command
-        shift_in  = 0xffffffffffffffffllu;
+        d->shift_in  = 0xffffffffffffffffllu;
       }
     }
   }
 
-  if (read_count) {
+  if (d->read_count) {
     uint8_t out = 0;
-    fread(&out, 1, 1, disk);
-    shift_out |= out;
-    read_count -= 1;
+    fread(&out, 1, 1, d->io);
+    d->shift_out |= out;
+    d->read_count -= 1;
   }
   else {
-    shift_out |= 0xff;
+    d->shift_out |= 0xff;
   }
 
-  if (read_count || write_count) {
+  if (d->read_count || d->write_count) {
     return;
   }
 
-  const uint8_t cmd = (shift_in >> 48);
+  const uint8_t cmd = (d->shift_in >> 48);
   switch (cmd) {
   case (0x40 | 0):  // CMD0
     //printf("CMD0\n");
     //            ..--..--..--..--
-    sd_idle = 1;
-    shift_out = 0xffff01fffffffffflu;
-    shift_in = ~0llu;
+    d->sd_idle = 1;
+    d->shift_out = 0xffff01fffffffffflu;
+    d->shift_in = ~0llu;
     break;
   case (0x40 | 8):  // CMD8
     //printf("CMD8\n");
     //            ..--..--..--..--
-    shift_out = 0xffff01000000aafflu;
-    shift_in = ~0llu;
+    d->shift_out = 0xffff01000000aafflu;
+    d->shift_in = ~0llu;
     break;
   case (0x40 | 58): // CMD58
     //printf("CMD58\n");
     //                      ..--..--..--..--
-    shift_out = sd_idle ? 0xffff0100000000fflu :
+    d->shift_out = d->sd_idle ? 0xffff0100000000fflu :
                           0xffff0000000000fflu;
-    shift_in = ~0llu;
+    d->shift_in = ~0llu;
     break;
   case (0x40 | 55): // CMD55
     //printf("CMD55\n");
     //                      ..--..--..--..--
-    shift_out = sd_idle ? 0xffff01fffffffffflu :
+    d->shift_out = d->sd_idle ? 0xffff01fffffffffflu :
                           0xffff00fffffffffflu;
-    shift_in = ~0llu;
+    d->shift_in = ~0llu;
     break;
   case (0x40 | 41): // ACMD41
     //printf("ACMD41\n");
     //                      ..--..--..--..--
-    shift_out = sd_idle ? 0xffff01fffffffffflu :
+    d->shift_out = d->sd_idle ? 0xffff01fffffffffflu :
                           0xffff00fffffffffflu;
-    shift_in = ~0llu;
-    sd_idle = 0;
+    d->shift_in = ~0llu;
+    d->sd_idle = 0;
     break;
   case (0x40 | 24): // CMD24 (write single sector)
     //            ..--..--..--..--
-    shift_out = 0xfffffffffffffffflu;
-    sector = shift_in >> 16;
-    shift_in = ~0llu;
-    shift_out = 0xffff00fffffffffflu;
-    fseek(disk, 512 * sector, SEEK_SET);
-    write_count = 512;
-    wait_for_start = true;
-    printf("write sector:%u\n", sector);
+    d->shift_out = 0xfffffffffffffffflu;
+    d->sector = d->shift_in >> 16;
+    d->shift_in = ~0llu;
+    d->shift_out = 0xffff00fffffffffflu;
+    d->io = sector_write_file(d, d->sector);
+    fseek(d->io, 512 * d->sector, SEEK_SET);
+    d->write_count = 512;
+    d->write_sum   = (2166136261u ^ d->sector) * 16777619u;
+    d->wait_for_start = true;
+    printf("write sector:%u\n", d->sector);
     break;
   case (0x40 | 17): // CMD17 (read single sector)
     //            ..--..--..--..--
-    shift_out = 0xffff00fffffffffelu;
-    sector    = shift_in >> 16;
-    shift_in = ~0llu;
-    fseek(disk, 512 * sector, SEEK_SET);
-    read_count = 512;
+    d->shift_out = 0xffff00fffffffffelu;
+    d->sector    = d->shift_in >> 16;
+    d->shift_in = ~0llu;
+    d->io = sector_file(d, d->sector);
+    fseek(d->io, 512 * d->sector, SEEK_SET);
+    d->read_count = 512;
     break;
   }
 }
 
-uint8_t disk_spi_read() {
-  return (shift_out >> 56) & 0xff;
+uint8_t disk_spi_read(machine_t *m) {
+  return (m->disk.shift_out >> 56) & 0xff;
 }
 #endif
 
-static bool disk_int13_00(void) {
+static bool disk_int13_00(machine_t *m) {
+  (void)m;
   return true;
 }
 
-static bool disk_int13_02(void) {
+static bool disk_int13_02(machine_t *m) {
+  disk_t *d = &m->disk;
 
-  const uint32_t CYLINDERS = disk_cylinders;
-  const uint32_t SECTORS   = disk_sectors;
-  const uint32_t HEADS     = disk_heads;
+  const uint32_t CYLINDERS = d->disk_cylinders;
+  const uint32_t SECTORS   = d->disk_sectors;
+  const uint32_t HEADS     = d->disk_heads;
 
-  const uint8_t count    = cpu_get_AL();
-  const uint8_t cylinder = cpu_get_CH();
-  const uint8_t sector   = cpu_get_CL() - 1;
-  const uint8_t head     = cpu_get_DH();
-  const uint8_t drive    = cpu_get_DL();
+  const uint8_t count    = cpu_get_AL(m);
+  const uint8_t cylinder = cpu_get_CH(m);
+  const uint8_t sector   = cpu_get_CL(m) - 1;
+  const uint8_t head     = cpu_get_DH(m);
+  const uint8_t drive    = cpu_get_DL(m);
 
-  const uint32_t es   = cpu_get_ES();
-  const uint32_t bx   = cpu_get_BX();
+  const uint32_t es   = cpu_get_ES(m);
+  const uint32_t bx   = cpu_get_BX(m);
   const uint32_t dest = cpu_get_address(es, bx);
 
   const uint32_t lba = (cylinder * HEADS + head) * SECTORS + sector;
 
   printf("sector: %x dest: %x\n", lba, dest);
 
-  fseek(disk, lba * 512, SEEK_SET);
-  fread(&memory[dest], 1, 512 * count, disk);
+  fseek(d->disk, lba * 512, SEEK_SET);
+  fread(&m->memory[dest], 1, 512 * count, d->disk);
 
-  cpu_set_AL(count);
-  clr_stack_cf();
+  cpu_set_AL(m, count);
+  clr_stack_cf(m);
   return true;
 }
 
-static bool disk_int13_08(void) {
+static bool disk_int13_08(machine_t *m) {
+  disk_t *d = &m->disk;
 
-  uint32_t cyl = (disk_cylinders-1);
+  uint32_t cyl = (d->disk_cylinders-1);
 
-  cpu_set_AH(0);
-  cpu_set_CH(cyl);  // cylinders - 1
-  cpu_set_CL((disk_sectors & 0x3f) | ((cyl >> 6) & 0x3));      // sectors
-  cpu_set_DH(disk_heads-1);      // heads - 1
-  cpu_set_DL(1);                 // number of drives
-  cpu_set_BX(0);
+  cpu_set_AH(m, 0);
+  cpu_set_CH(m, cyl);  // cylinders - 1
+  cpu_set_CL(m, (d->disk_sectors & 0x3f) | ((cyl >> 6) & 0x3));      // sectors
+  cpu_set_DH(m, d->disk_heads-1);      // heads - 1
+  cpu_set_DL(m, 1);                 // number of drives
+  cpu_set_BX(m, 0);
 
   // todo: pointer to drive parameter table?
 
   // note: this cant be zero or causes a hang
-  //cpu_set_ES(0x0000);
-  //cpu_set_DI(0x0000);
+  //cpu_set_ES(m, 0x0000);
+  //cpu_set_DI(m, 0x0000);
   return true;
 }
 
-static bool disk_int13_15(void) {
+static bool disk_int13_15(machine_t *m) {
+  (void)m;
   return true;
 }
 
-void disk_int13(void) {
+void disk_int13(machine_t *m) {
 
-  const uint8_t func  = cpu_get_AH();
-  const uint8_t drive = cpu_get_DL();
+  const uint8_t func  = cpu_get_AH(m);
+  const uint8_t drive = cpu_get_DL(m);
 
 //  cpu_dump_state();
 //  cpu_debug = 1;
@@ -308,8 +397,8 @@ void disk_int13(void) {
 #else
   if (drive != 0x00) {
 #endif
-    cpu_set_AH(1);
-    set_stack_cf();
+    cpu_set_AH(m, 1);
+    set_stack_cf(m);
     return;
   }
 
@@ -317,25 +406,25 @@ void disk_int13(void) {
 
   switch (func) {
   case 0x0:
-    ok = disk_int13_00();
+    ok = disk_int13_00(m);
     break;
   case 0x2:
-    ok = disk_int13_02();
+    ok = disk_int13_02(m);
     break;
   case 0x8:
-    ok = disk_int13_08();
+    ok = disk_int13_08(m);
     break;
   case 0x15:
-    ok = disk_int13_15();
+    ok = disk_int13_15(m);
     break;
   }
 
   if (ok) {
-    cpu_set_AH(0);  // success
-    clr_stack_cf();
+    cpu_set_AH(m, 0);  // success
+    clr_stack_cf(m);
   }
   else {
-    cpu_set_AH(1);  // failure
-    set_stack_cf();
+    cpu_set_AH(m, 1);  // failure
+    set_stack_cf(m);
   }
 }
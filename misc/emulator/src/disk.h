@@ -1,10 +1,47 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 
-bool disk_load(const char* path);
-void disk_int13(void);
+#include "cpu.h"
 
-void    disk_spi_ctrl (uint8_t tx);
-void    disk_spi_write(uint8_t tx);
-uint8_t disk_spi_read ();
+
+typedef struct {
+  FILE*    disk;
+  char*    path;
+  uint64_t disk_size;
+
+  // Sectors written go to the overlay instead of the image when one is set,
+  // see disk_overlay().
+  FILE*    overlay;
+  uint8_t* written;  // bitmap of the sectors held by the overlay
+  FILE*    io;       // file of the sector being transferred
+
+  uint32_t disk_heads;
+  uint32_t disk_sectors;
+  uint32_t disk_cylinders;
+
+  // SD card in SPI mode
+  int      spi_cs;
+  int      sd_idle;
+  uint64_t shift_in;
+  uint64_t shift_out;
+  uint32_t sector;
+  uint32_t read_count;
+  uint32_t write_count;
+  uint32_t write_sum;  // FNV-1a of the sector number and the data written
+  bool     wait_for_start;
+} disk_t;
+
+void disk_init (machine_t *m);
+bool disk_load (machine_t *m, const char* path);
+void disk_close(machine_t *m);
+// Leave the image untouched from now on and keep the sectors written in a
+// new overlay file at path. Call between transfers.
+bool disk_overlay(machine_t *m, const char* path);
+void disk_int13(machine_t *m);
+
+void    disk_spi_ctrl (machine_t *m, uint8_t tx);
+void    disk_spi_write(machine_t *m, uint8_t tx);
+uint8_t disk_spi_read (machine_t *m);
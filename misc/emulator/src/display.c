@@ -1,39 +1,27 @@
+#include <stdio.h>
+#include <string.h>
+
 #include "display.h"
+#include "machine.h"
 
 
 extern uint8_t font[];
 
-static uint8_t vram[1024 * 16];
-
-static uint8_t display_mode = 3;
-
-// https://www.seasip.info/VintagePC/cga.html
-
-// .......h
-//        +--- high res text
-//       +---- graphics mode
-//      +----- black and white
-//     +------ enable video output
-//    +------- high res graphics
-//   +-------- blinking
-//
-static uint8_t reg3D8 = 0;  // Mode control register
-
-// ..pBbbbb
-//     ++++--- border color
-//    +------- bright foreground
-//   +-------- palette
-//
-static uint8_t reg3D9 = 0;  // Color control register
+static void render_mode_ega_gfx(display_t *d, uint32_t* pixels, uint32_t pitch);
 
 
-static void render_mode_ega_gfx(SDL_Surface* screen);
-
+static void fill(uint32_t* pixels, uint32_t pitch, uint32_t rgb) {
+  for (uint32_t y = 0; y < DISPLAY_HEIGHT; ++y, pixels += pitch) {
+    for (uint32_t x = 0; x < DISPLAY_WIDTH; ++x) {
+      pixels[x] = rgb;
+    }
+  }
+}
 
-static void render_mode_cga_gfx(SDL_Surface* screen) {
-  SDL_FillRect(screen, NULL, 0x101010);
+static void render_mode_cga_gfx(display_t *d, uint32_t* pixels, uint32_t pitch) {
+  fill(pixels, pitch, 0x101010);
 
-  const uint32_t palette[] = {
+  const uint32_t cga_palette[] = {
 
     0x000000,   // 0
     0x00AAAA,   // 3
@@ -47,12 +35,12 @@ static void render_mode_cga_gfx(SDL_Surface* screen) {
 
   };
 
-  uint32_t* dst = screen->pixels;
+  uint32_t* dst = pixels;
 
   uint32_t rgb0 = 0;
   uint32_t rgb1 = 0;
 
-  uint32_t intensity = (reg3D9 & 0x10) ? 4 : 0;
+  uint32_t intensity = (d->reg3D9 & 0x10) ? 4 : 0;
 
   for (uint32_t y = 0; y < 400; ++y) {
     uint32_t iy = y / 2;
@@ -62,23 +50,23 @@ static void render_mode_cga_gfx(SDL_Surface* screen) {
     for (uint32_t x = 0; x < 640; ++x) {
       uint32_t ix = x / 2;
 
-      uint8_t byte  = vram[addrx + ix / 4];
+      uint8_t byte  = d->vram[addrx + ix / 4];
       uint8_t shift = (3 - ix % 4) * 2;
       uint8_t pix   = 3 & (byte >> shift);
 
       rgb1 = rgb0;
-      rgb0 = palette[intensity | pix];
+      rgb0 = cga_palette[intensity | pix];
       dst[x] = ((rgb0 >> 1) & 0x7f7f7f) + ((rgb1 >> 1) & 0x7f7f7f);
     }
 
-    dst += screen->pitch / 4;
+    dst += pitch;
   }
 }
 
-static void render_mode_cga_txt(SDL_Surface* screen) {
-  SDL_FillRect(screen, NULL, 0x101010);
+static void render_mode_cga_txt(display_t *d, uint32_t* pixels, uint32_t pitch) {
+  fill(pixels, pitch, 0x101010);
 
-  uint32_t* dst = screen->pixels;
+  uint32_t* dst = pixels;
 
   for (uint32_t y = 0; y < 400; ++y) {
     uint32_t iy = y / 2;
@@ -91,8 +79,8 @@ static void render_mode_cga_txt(SDL_Surface* screen) {
       uint32_t addr = addrx + (x / 8) * 2;
       uint32_t cx = x % 8;
 
-      uint8_t ch = vram[addr + 0];
-      uint8_t at = vram[addr + 1];
+      uint8_t ch = d->vram[addr + 0];
+      uint8_t at = d->vram[addr + 1];
 
       uint8_t font_row = font[ch * 8 + cy];
       uint8_t font_bit = font_row & (1 << cx);
@@ -100,119 +88,103 @@ static void render_mode_cga_txt(SDL_Surface* screen) {
       dst[x] = font_bit ? 0x93a1a8 : 0x101010;
     }
 
-    dst += screen->pitch / 4;
+    dst += pitch;
   }
 }
 
-void display_cga_mem_write(uint32_t addr, uint8_t data) {
-  vram[addr] = data;
+void display_init(machine_t *m) {
+  display_t *d = &m->display;
+  memset(d, 0, sizeof(*d));
+
+  static const uint8_t palette[16] = {
+    0, 1, 2, 3, 4, 5, 20, 7, 56, 57, 58, 59, 60, 61, 62, 63
+  };
+  memcpy(d->palette, palette, sizeof(palette));
+
+  d->display_mode = 3;
+  d->p3C4_2       = 0xf;
+}
+
+void display_cga_mem_write(machine_t *m, uint32_t addr, uint8_t data) {
+  m->display.vram[addr] = data;
 }
 
-uint8_t display_cga_mem_read(uint32_t addr) {
-  return vram[addr];
+uint8_t display_cga_mem_read(machine_t *m, uint32_t addr) {
+  return m->display.vram[addr];
 }
 
-void display_cga_io_write(uint32_t port, uint8_t data) {
+void display_cga_io_write(machine_t *m, uint32_t port, uint8_t data) {
+  display_t *d = &m->display;
   switch (port) {
-  case 0x3d8: reg3D8 = data; break;  // Mode control register
-  case 0x3d9: reg3D9 = data; break;  // Color control register
+  case 0x3d8: d->reg3D8 = data; break;  // Mode control register
+  case 0x3d9: d->reg3D9 = data; break;  // Color control register
   }
 }
 
-bool display_cga_io_read(uint32_t port, uint8_t *out) {
+bool display_cga_io_read(machine_t *m, uint32_t port, uint8_t *out) {
+  (void)m;
+  (void)port;
+  (void)out;
   return false;
 }
 
-void display_set_mode(uint8_t mode) {
-  display_mode = mode == 0x13 ? 0xd : mode;
+// Status register 3DA, the beam position follows the CPU clock.
+static uint8_t display_status(machine_t *m) {
+  const uint64_t pixel = cpu_get_cycles(m) * (DISPLAY_PIXEL_CLOCK / 1000) / (CPU_CLOCK / 1000);
+  const uint32_t pos   = pixel % (DISPLAY_LINE_PIXELS * DISPLAY_FRAME_LINES);
+  const uint32_t x     = pos % DISPLAY_LINE_PIXELS;
+  const uint32_t y     = pos / DISPLAY_LINE_PIXELS;
+
+  const bool active = (x < 640) && (y < 400);
+  const bool vsync  = (y >= 412) && (y < 414);
+
+  return 0xf0 | (vsync ? 0x08 : 0) | (active ? 0 : 0x01);
+}
+
+void display_set_mode(machine_t *m, uint8_t mode) {
+  m->display.display_mode = mode == 0x13 ? 0xd : mode;
   printf("Display Mode: %x\n", mode);
 }
 
-void display_draw(SDL_Surface* screen) {
+void display_draw(machine_t *m, uint32_t* pixels, uint32_t pitch) {
+  display_t *d = &m->display;
 
-  switch (display_mode) {
+  switch (d->display_mode) {
   case 4:
   case 5:
-    render_mode_cga_gfx(screen);
+    render_mode_cga_gfx(d, pixels, pitch);
     break;
   case 0xd:
-    render_mode_ega_gfx(screen);
+    render_mode_ega_gfx(d, pixels, pitch);
     break;
   default:
-    render_mode_cga_txt(screen);
+    render_mode_cga_txt(d, pixels, pitch);
     break;
   }
 }
 
 //----------------------------------------------------------------
 
-// EGA memory planes
-static uint8_t plane0[16 * 1024];
-static uint8_t plane1[16 * 1024];
-static uint8_t plane2[16 * 1024];
-static uint8_t plane3[16 * 1024];
-
-static uint8_t latch0;
-static uint8_t latch1;
-static uint8_t latch2;
-static uint8_t latch3;
-
-static uint8_t palette[16] = {
-  0,
-  1,
-  2,
-  3,
-  4,
-  5,
-  20,
-  7,
-  56,
-  57,
-  58,
-  59,
-  60,
-  61,
-  62,
-  63
-};
-
-static uint8_t p3C0_ff;         // 0-index, 1-data
-static uint8_t p3C0_index = 0;
-
-static uint8_t p3C4_index = 0;
-static uint8_t p3C4_2 = 0xf;    // Graphics: Bit Mask Register
-
-static uint8_t p3CE_index = 0;
-static uint8_t p3CE_0 = 0;      // Graphics: Set/Reset Register
-static uint8_t p3CE_1 = 0;      // Graphics: Enable Set/Reset Register
-static uint8_t p3CE_2 = 0;      // Graphics: Color Compare Register
-static uint8_t p3CE_3 = 0;      // Graphics: Data Rotate
-static uint8_t p3CE_4 = 0;      // Graphics: Read Map Select Register
-static uint8_t p3CE_5 = 0;      // Graphics: Mode Register
-static uint8_t p3CE_7 = 0;      // Graphics: Color Don't Care Register
-static uint8_t p3CE_8 = 0;      // Graphics: Bit Mask Register
-
-
-static uint8_t ega_write_mode() {
-  return p3CE_5 & 3;
+static uint8_t ega_write_mode(display_t *d) {
+  return d->p3CE_5 & 3;
 }
 
-static uint8_t ega_read_mode() {
-  return (p3CE_5 >> 3) & 1;
+static uint8_t ega_read_mode(display_t *d) {
+  return (d->p3CE_5 >> 3) & 1;
 }
 
-static uint8_t ega_read_plane() {
+static uint8_t ega_read_plane(display_t *d) {
   // Number of the plane Read Mode 0 will read from.
-  return (p3CE_4 & 3);
+  return (d->p3CE_4 & 3);
 }
 
-static uint8_t ega_rotate() {
+static uint8_t ega_rotate(display_t *d) {
   // note: only active in write mode 0
-  return (p3CE_3 & 7);
+  return (d->p3CE_3 & 7);
 }
 
-static uint8_t ega_alu_func() {
-  return (p3CE_3 >> 3) & 3;
+static uint8_t ega_alu_func(display_t *d) {
+  return (d->p3CE_3 >> 3) & 3;
 }
 
 static void dump_hex(const char *path, const uint8_t* data, size_t x) {
@@ -223,26 +195,26 @@ static void dump_hex(const char *path, const uint8_t* data, size_t x) {
   fclose(fd);
 }
 
-static void dump_ega() {
-  dump_hex("ega_plane_0.hex", plane0,  sizeof(plane0));
-  dump_hex("ega_plane_1.hex", plane1,  sizeof(plane1));
-  dump_hex("ega_plane_2.hex", plane2,  sizeof(plane2));
-  dump_hex("ega_plane_3.hex", plane3,  sizeof(plane3));
-  dump_hex("ega_palette.hex", palette, sizeof(palette));
+static void dump_ega(display_t *d) {
+  dump_hex("ega_plane_0.hex", d->plane0,  sizeof(d->plane0));
+  dump_hex("ega_plane_1.hex", d->plane1,  sizeof(d->plane1));
+  dump_hex("ega_plane_2.hex", d->plane2,  sizeof(d->plane2));
+  dump_hex("ega_plane_3.hex", d->plane3,  sizeof(d->plane3));
+  dump_hex("ega_palette.hex", d->palette, sizeof(d->palette));
 }
 
-static void render_mode_ega_gfx(SDL_Surface* screen) {
-  SDL_FillRect(screen, NULL, 0x101010);
+static void render_mode_ega_gfx(display_t *d, uint32_t* pixels, uint32_t pitch) {
+  fill(pixels, pitch, 0x101010);
 
   if (false) {
-    dump_ega();
+    dump_ega(d);
   }
 
-  uint32_t dst_pitch = (screen->pitch / 4);
+  uint32_t dst_pitch = pitch;
   uint32_t src_pitch = 320 / 8;
 
-  uint32_t* dst0 = screen->pixels;
-  uint32_t* dst1 = ((uint32_t*)screen->pixels) + dst_pitch;
+  uint32_t* dst0 = pixels;
+  uint32_t* dst1 = pixels + dst_pitch;
 
   uint8_t scanline[320] = { 0 };
 
@@ -255,10 +227,10 @@ static void render_mode_ega_gfx(SDL_Surface* screen) {
 
         const uint8_t mask = 0x80 >> i;
 
-        const uint8_t b0 = plane0[base + (x/8)] & mask;
-        const uint8_t b1 = plane1[base + (x/8)] & mask;
-        const uint8_t b2 = plane2[base + (x/8)] & mask;
-        const uint8_t b3 = plane3[base + (x/8)] & mask;
+        const uint8_t b0 = d->plane0[base + (x/8)] & mask;
+        const uint8_t b1 = d->plane1[base + (x/8)] & mask;
+        const uint8_t b2 = d->plane2[base + (x/8)] & mask;
+        const uint8_t b3 = d->plane3[base + (x/8)] & mask;
 
         scanline[x + i] =
           (b0 ? 0x1 : 0x0) |
@@ -270,7 +242,7 @@ static void render_mode_ega_gfx(SDL_Surface* screen) {
 
     for (uint32_t x = 0; x < 320; ++x) {
 
-      uint8_t index = palette[ scanline[ x ] & 0xf ];
+      uint8_t index = d->palette[ scanline[ x ] & 0xf ];
 
       // x x RL GL BL RH GH BH
 
@@ -300,8 +272,8 @@ static uint8_t blend(uint8_t mask, uint8_t a, uint8_t b) {
   return (a & mask) | (b & ~mask);
 }
 
-uint8_t alu_op(uint8_t a, uint8_t b) {
-  switch (ega_alu_func() & 3) {
+static uint8_t alu_op(display_t *d, uint8_t a, uint8_t b) {
+  switch (ega_alu_func(d) & 3) {
   case 0: return a;
   case 1: return a & b;
   case 2: return a | b;
@@ -309,49 +281,50 @@ uint8_t alu_op(uint8_t a, uint8_t b) {
   }
 }
 
-void ega_write_planes(uint32_t addr, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3) {
-  if (p3C4_2 & 1) { plane0[addr] = d0; }
-  if (p3C4_2 & 2) { plane1[addr] = d1; }
-  if (p3C4_2 & 4) { plane2[addr] = d2; }
-  if (p3C4_2 & 8) { plane3[addr] = d3; }
+static void ega_write_planes(display_t *d, uint32_t addr, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3) {
+  if (d->p3C4_2 & 1) { d->plane0[addr] = d0; }
+  if (d->p3C4_2 & 2) { d->plane1[addr] = d1; }
+  if (d->p3C4_2 & 4) { d->plane2[addr] = d2; }
+  if (d->p3C4_2 & 8) { d->plane3[addr] = d3; }
 }
 
-uint8_t as_mask(uint8_t v) {
+static uint8_t as_mask(uint8_t v) {
   return v ? 0xff : 0x00;
 }
 
-void display_ega_mem_write(uint32_t addr, uint8_t data) {
+void display_ega_mem_write(machine_t *m, uint32_t addr, uint8_t data) {
+  display_t *d = &m->display;
 
-  const uint8_t mode = ega_write_mode();
+  const uint8_t mode = ega_write_mode(d);
 
   // mode0
   if (mode == 0) {
 #if 0
-    data = rotate(ega_rotate(), data);
+    data = rotate(ega_rotate(d), data);
 
     // compute set/reset values
-    const uint8_t sr0 = as_mask(p3CE_0 & 1);
-    const uint8_t sr1 = as_mask(p3CE_0 & 2);
-    const uint8_t sr2 = as_mask(p3CE_0 & 4);
-    const uint8_t sr3 = as_mask(p3CE_0 & 8);
+    const uint8_t sr0 = as_mask(d->p3CE_0 & 1);
+    const uint8_t sr1 = as_mask(d->p3CE_0 & 2);
+    const uint8_t sr2 = as_mask(d->p3CE_0 & 4);
+    const uint8_t sr3 = as_mask(d->p3CE_0 & 8);
 
     // set/reset enable mux
-    const uint8_t in0 = (p3CE_1 & 1) ? sr0 : data;
-    const uint8_t in1 = (p3CE_1 & 2) ? sr1 : data;
-    const uint8_t in2 = (p3CE_1 & 4) ? sr2 : data;
-    const uint8_t in3 = (p3CE_1 & 8) ? sr3 : data;
+    const uint8_t in0 = (d->p3CE_1 & 1) ? sr0 : data;
+    const uint8_t in1 = (d->p3CE_1 & 2) ? sr1 : data;
+    const uint8_t in2 = (d->p3CE_1 & 4) ? sr2 : data;
+    const uint8_t in3 = (d->p3CE_1 & 8) ? sr3 : data;
 
     // ALU result
-    const uint8_t alu0 = alu_op(in0, latch0);
-    const uint8_t alu1 = alu_op(in1, latch1);
-    const uint8_t alu2 = alu_op(in2, latch2);
-    const uint8_t alu3 = alu_op(in3, latch3);
-
-    ega_write_planes(addr,
-      blend(p3CE_8, alu0, latch0),
-      blend(p3CE_8, alu1, latch1),
-      blend(p3CE_8, alu2, latch2),
-      blend(p3CE_8, alu3, latch3)
+    const uint8_t alu0 = alu_op(d, in0, d->latch0);
+    const uint8_t alu1 = alu_op(d, in1, d->latch1);
+    const uint8_t alu2 = alu_op(d, in2, d->latch2);
+    const uint8_t alu3 = alu_op(d, in3, d->latch3);
+
+    ega_write_planes(d, addr,
+      blend(d->p3CE_8, alu0, d->latch0),
+      blend(d->p3CE_8, alu1, d->latch1),
+      blend(d->p3CE_8, alu2, d->latch2),
+      blend(d->p3CE_8, alu3, d->latch3)
     );
 #endif
     return;
@@ -359,11 +332,11 @@ void display_ega_mem_write(uint32_t addr, uint8_t data) {
 
   // mode1
   if (mode == 1) {
-    ega_write_planes(addr,
-      latch0,
-      latch1,
-      latch2,
-      latch3
+    ega_write_planes(d, addr,
+      d->latch0,
+      d->latch1,
+      d->latch2,
+      d->latch3
     );
     return;
   }
@@ -377,50 +350,51 @@ void display_ega_mem_write(uint32_t addr, uint8_t data) {
     const uint8_t b3 = as_mask(data & 8);
 
     // ALU result
-    const uint8_t alu0 = alu_op(b0, latch0);
-    const uint8_t alu1 = alu_op(b1, latch1);
-    const uint8_t alu2 = alu_op(b2, latch2);
-    const uint8_t alu3 = alu_op(b3, latch3);
-
-    ega_write_planes(addr,
-      blend(p3CE_8, alu0, latch0),
-      blend(p3CE_8, alu1, latch1),
-      blend(p3CE_8, alu2, latch2),
-      blend(p3CE_8, alu3, latch3)
+    const uint8_t alu0 = alu_op(d, b0, d->latch0);
+    const uint8_t alu1 = alu_op(d, b1, d->latch1);
+    const uint8_t alu2 = alu_op(d, b2, d->latch2);
+    const uint8_t alu3 = alu_op(d, b3, d->latch3);
+
+    ega_write_planes(d, addr,
+      blend(d->p3CE_8, alu0, d->latch0),
+      blend(d->p3CE_8, alu1, d->latch1),
+      blend(d->p3CE_8, alu2, d->latch2),
+      blend(d->p3CE_8, alu3, d->latch3)
     );
     return;
   }
 }
 
-uint8_t display_ega_mem_read(uint32_t addr) {
+uint8_t display_ega_mem_read(machine_t *m, uint32_t addr) {
+  display_t *d = &m->display;
 
   // a read fills the latches
-  latch0 = plane0[addr];
-  latch1 = plane1[addr];
-  latch2 = plane2[addr];
-  latch3 = plane3[addr];
-
-  if (ega_read_mode() == 0) {
-    switch (ega_read_plane()) {
-    case 0: return latch0;
-    case 1: return latch1;
-    case 2: return latch2;
-    case 3: return latch3;
+  d->latch0 = d->plane0[addr];
+  d->latch1 = d->plane1[addr];
+  d->latch2 = d->plane2[addr];
+  d->latch3 = d->plane3[addr];
+
+  if (ega_read_mode(d) == 0) {
+    switch (ega_read_plane(d)) {
+    case 0: return d->latch0;
+    case 1: return d->latch1;
+    case 2: return d->latch2;
+    case 3: return d->latch3;
     }
   }
 
-  if (ega_read_mode() == 1) {
+  if (ega_read_mode(d) == 1) {
 #if 0
-    const uint8_t c0 = as_mask(p3CE_2 & 1);
-    const uint8_t c1 = as_mask(p3CE_2 & 2);
-    const uint8_t c2 = as_mask(p3CE_2 & 4);
-    const uint8_t c3 = as_mask(p3CE_2 & 8);
+    const uint8_t c0 = as_mask(d->p3CE_2 & 1);
+    const uint8_t c1 = as_mask(d->p3CE_2 & 2);
+    const uint8_t c2 = as_mask(d->p3CE_2 & 4);
+    const uint8_t c3 = as_mask(d->p3CE_2 & 8);
 
     // bits set for all non-matching planes
-    const uint8_t a0 = (p3CE_7 & 1) ? 0 : (c0 ^ latch0);
-    const uint8_t a1 = (p3CE_7 & 2) ? 0 : (c1 ^ latch1);
-    const uint8_t a2 = (p3CE_7 & 4) ? 0 : (c2 ^ latch2);
-    const uint8_t a3 = (p3CE_7 & 8) ? 0 : (c3 ^ latch3);
+    const uint8_t a0 = (d->p3CE_7 & 1) ? 0 : (c0 ^ d->latch0);
+    const uint8_t a1 = (d->p3CE_7 & 2) ? 0 : (c1 ^ d->latch1);
+    const uint8_t a2 = (d->p3CE_7 & 4) ? 0 : (c2 ^ d->latch2);
+    const uint8_t a3 = (d->p3CE_7 & 8) ? 0 : (c3 ^ d->latch3);
 
     // sum all the differing pixels
     const uint8_t diff = a0 | a1 | a2 | a3;
@@ -433,53 +407,54 @@ uint8_t display_ega_mem_read(uint32_t addr) {
   return 0xff;
 }
 
-void ega_write_3C0(uint8_t data) {
-  if (p3C0_ff == 0) {  // index write
-    p3C0_index = data & 0x1f;
-    p3C0_ff = 1;
+static void ega_write_3C0(display_t *d, uint8_t data) {
+  if (d->p3C0_ff == 0) {  // index write
+    d->p3C0_index = data & 0x1f;
+    d->p3C0_ff = 1;
   }
-  if (p3C0_ff == 1) {  // data write
-    if (p3C0_index < 16) {
-      palette[p3C0_index] = data;
+  if (d->p3C0_ff == 1) {  // data write
+    if (d->p3C0_index < 16) {
+      d->palette[d->p3C0_index] = data;
     }
-    p3C0_ff = 0;
+    d->p3C0_ff = 0;
   }
 }
 
-void ega_write_3C5(uint8_t index, uint8_t data) {
+static void ega_write_3C5(display_t *d, uint8_t index, uint8_t data) {
   if (index == 2) {
-    p3C4_2 = data;  // Sequencer: Map Mask Register
+    d->p3C4_2 = data;  // Sequencer: Map Mask Register
   }
 }
 
-void ega_write_3CF(uint8_t index, uint8_t data) {
+static void ega_write_3CF(display_t *d, uint8_t index, uint8_t data) {
   if (index == 0) {
-    p3CE_0 = data;  // Graphics: Set/Reset Register
+    d->p3CE_0 = data;  // Graphics: Set/Reset Register
   }
   if (index == 1) {
-    p3CE_1 = data;  // Graphics: Enable Set/Reset Register
+    d->p3CE_1 = data;  // Graphics: Enable Set/Reset Register
   }
   if (index == 2) {
-    p3CE_2 = data;  // Graphics: Color Compare Register
+    d->p3CE_2 = data;  // Graphics: Color Compare Register
   }
   if (index == 3) {
-    p3CE_3 = data;  // Graphics: Data Rotate 
+    d->p3CE_3 = data;  // Graphics: Data Rotate 
   }
   if (index == 4) {
-    p3CE_4 = data;  // Graphics: Read Map Select Register
+    d->p3CE_4 = data;  // Graphics: Read Map Select Register
   }
   if (index == 5) {
-    p3CE_5 = data;  // Graphics: Mode Register
+    d->p3CE_5 = data;  // Graphics: Mode Register
   }
   if (index == 7) {
-    p3CE_7 = data;  // Graphics: Color Don't Care Register
+    d->p3CE_7 = data;  // Graphics: Color Don't Care Register
   }
   if (index == 8) {
-    p3CE_8 = data;  // Graphics: Bit(Map) Mask Register
+    d->p3CE_8 = data;  // Graphics: Bit(Map) Mask Register
   }
 }
 
-void display_ega_io_write(uint32_t port, uint8_t data) {
+void display_ega_io_write(machine_t *m, uint32_t port, uint8_t data) {
+  display_t *d = &m->display;
 
   if (0) {
     printf("--------------------------------\n");
@@ -490,32 +465,33 @@ void display_ega_io_write(uint32_t port, uint8_t data) {
   }
 
   if (port == 0x3C0) {
-    ega_write_3C0(data);
+    ega_write_3C0(d, data);
   }
   if (port == 0x3C4) {
-    p3C4_index = data;
+    d->p3C4_index = data;
   }
   if (port == 0x3C5) {
-    ega_write_3C5(p3C4_index, data);
+    ega_write_3C5(d, d->p3C4_index, data);
   }
   if (port == 0x3CE) {
-    p3CE_index = data;
+    d->p3CE_index = data;
   }
   if (port == 0x3CF) {
-    ega_write_3CF(p3CE_index, data);
+    ega_write_3CF(d, d->p3CE_index, data);
   }
 }
 
-bool display_ega_io_read(uint32_t port, uint8_t *out) {
+bool display_ega_io_read(machine_t *m, uint32_t port, uint8_t *out) {
+  display_t *d = &m->display;
 
   if (port == 0x3DA) {
 
-    if (p3C0_ff) {
+    if (d->p3C0_ff) {
       printf("----------- reset 3C0\n");
     }
 
-    p3C0_ff = 0;  // reset FF to address
-    *out = 0xff;  // required to stop some games polling for VBLANK?
+    d->p3C0_ff = 0;  // reset FF to address
+    *out = display_status(m);
     return true;
   }
 
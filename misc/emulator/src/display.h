@@ -3,19 +3,86 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-#define _SDL_main_h
-#include <SDL.h>
+#include "cpu.h"
 
 
-void    display_set_mode(uint8_t mode);
-void    display_draw    (SDL_Surface* screen);
+// 640x400@70Hz timing of gateware/video/cga.v with a 25MHz pixel clock
+#define DISPLAY_PIXEL_CLOCK  25000000
+#define DISPLAY_LINE_PIXELS  800
+#define DISPLAY_FRAME_LINES  449
+#define DISPLAY_FRAME_CYCLES ((uint64_t)DISPLAY_LINE_PIXELS * DISPLAY_FRAME_LINES * \
+                              CPU_CLOCK / DISPLAY_PIXEL_CLOCK)
 
-void    display_cga_mem_write(uint32_t addr, uint8_t data);
-uint8_t display_cga_mem_read (uint32_t addr);
-void    display_cga_io_write (uint32_t port, uint8_t data);
-bool    display_cga_io_read  (uint32_t port, uint8_t *out);
+// size of the rendered frame in pixels
+#define DISPLAY_WIDTH  640
+#define DISPLAY_HEIGHT 400
 
-void    display_ega_mem_write(uint32_t addr, uint8_t data);
-uint8_t display_ega_mem_read (uint32_t addr);
-void    display_ega_io_write (uint32_t port, uint8_t data);
-bool    display_ega_io_read  (uint32_t port, uint8_t* out);
+typedef struct {
+  uint8_t vram[1024 * 16];
+
+  uint8_t display_mode;
+
+  // https://www.seasip.info/VintagePC/cga.html
+
+  // .......h
+  //        +--- high res text
+  //       +---- graphics mode
+  //      +----- black and white
+  //     +------ enable video output
+  //    +------- high res graphics
+  //   +-------- blinking
+  //
+  uint8_t reg3D8;  // Mode control register
+
+  // ..pBbbbb
+  //     ++++--- border color
+  //    +------- bright foreground
+  //   +-------- palette
+  //
+  uint8_t reg3D9;  // Color control register
+
+  // EGA memory planes
+  uint8_t plane0[16 * 1024];
+  uint8_t plane1[16 * 1024];
+  uint8_t plane2[16 * 1024];
+  uint8_t plane3[16 * 1024];
+
+  uint8_t latch0;
+  uint8_t latch1;
+  uint8_t latch2;
+  uint8_t latch3;
+
+  uint8_t palette[16];
+
+  uint8_t p3C0_ff;         // 0-index, 1-data
+  uint8_t p3C0_index;
+
+  uint8_t p3C4_index;
+  uint8_t p3C4_2;          // Graphics: Bit Mask Register
+
+  uint8_t p3CE_index;
+  uint8_t p3CE_0;          // Graphics: Set/Reset Register
+  uint8_t p3CE_1;          // Graphics: Enable Set/Reset Register
+  uint8_t p3CE_2;          // Graphics: Color Compare Register
+  uint8_t p3CE_3;          // Graphics: Data Rotate
+  uint8_t p3CE_4;          // Graphics: Read Map Select Register
+  uint8_t p3CE_5;          // Graphics: Mode Register
+  uint8_t p3CE_7;          // Graphics: Color Don't Care Register
+  uint8_t p3CE_8;          // Graphics: Bit Mask Register
+} display_t;
+
+void    display_init    (machine_t *m);
+void    display_set_mode(machine_t *m, uint8_t mode);
+// Render the current frame as DISPLAY_WIDTH x DISPLAY_HEIGHT 0x00RRGGBB
+// pixels, pitch is given in pixels.
+void    display_draw    (machine_t *m, uint32_t* pixels, uint32_t pitch);
+
+void    display_cga_mem_write(machine_t *m, uint32_t addr, uint8_t data);
+uint8_t display_cga_mem_read (machine_t *m, uint32_t addr);
+void    display_cga_io_write (machine_t *m, uint32_t port, uint8_t data);
+bool    display_cga_io_read  (machine_t *m, uint32_t port, uint8_t *out);
+
+void    display_ega_mem_write(machine_t *m, uint32_t addr, uint8_t data);
+uint8_t display_ega_mem_read (machine_t *m, uint32_t addr);
+void    display_ega_io_write (machine_t *m, uint32_t port, uint8_t data);
+bool    display_ega_io_read  (machine_t *m, uint32_t port, uint8_t* out);
@@ -0,0 +1,636 @@
+// Differential fuzzer of the CPU, no SDL.
+//
+//   iceXtFuzz [options]
+//
+// Generates random 8086/80186 instruction sequences and machine states and
+// runs each case through the reference interpreter, see
+// cpu_set_reference(), and through the fast paths of the build, with the
+// translator picking code up from its first execution. The final
+// registers, flags, clock, instruction count and all memory the case can
+// reach are compared. A case that differs is shrunk to the fewest
+// instructions and plainest registers that still differ, then printed with
+// the options that run it again.
+//
+// A case runs from CODE_SEG:0000 up to the HLT after its instructions.
+// Every interrupt vector points at an IRET, so INT, INTO, BOUND and divide
+// errors return into the case. DS, ES and SS point into one window of
+// random data, which is all they can write, and jumps only go forward
+// within the case. Port reads are answered by a stub device that returns
+// the same value for a port every time, and now and then a case polls one
+// with IN AL,imm8, TEST AL,imm8 and a Jcc, the sequence the interpreter
+// fuses. Instructions that reach devices otherwise (OUT, OUTS, INT 10h),
+// load a segment from data (MOV sreg, POP sreg, LDS, LES), leave the case
+// (CALL, RET, IRET, far and indirect jumps) or write to it (CS: overrides)
+// are not generated.
+//
+// The fuzzer is built with CPU_CHECK_FLAGS, so the reference interpreter
+// evaluates the flags of each operation as it goes with code of its own
+// rather than through the lazy flags of the fast core.
+//
+// Exits with 0 when the cores agree on every case, 1 when one differs.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "udis86/udis86.h"
+
+#include "machine.h"
+
+
+#define CODE_SEG    0x1000
+#define CODE_BASE   (CODE_SEG * 16)
+#define HANDLER_SEG 0x0050    // the IRET all interrupt vectors point at
+#define DATA_MIN    0x2000    // paragraphs the data window starts in
+#define DATA_MAX    0x8000
+#define DATA_SPREAD 0x100     // DS, ES and SS paragraphs past the window start
+#define DATA_SIZE   (0x10000 + DATA_SPREAD * 16)
+
+#define MAX_INSNS   32
+#define MAX_BYTES   8      // a prefix and the longest 8086 instruction
+#define MAX_SKIP    7      // instructions a jump goes over at most
+#define BUDGET      20000  // clock cycles a case may run
+#define BATCH       1024   // cases a thread takes at a time
+#define MAX_SHOWN   16     // differing memory bytes printed
+
+static const char* const reg_names[8] = {
+  "AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI",
+};
+static const char* const seg_names[4] = { "ES", "CS", "SS", "DS" };
+
+// Values the corner cases of the flags and the string, shift, BCD and
+// divide instructions turn on.
+static const uint16_t specials[] = {
+  0x0000, 0x0001, 0x0002, 0x000a, 0x000f, 0x0010, 0x001f, 0x0020, 0x007f,
+  0x0080, 0x0099, 0x00ff, 0x0100, 0x7fff, 0x8000, 0x8001, 0xfffe, 0xffff,
+};
+#define NUM_SPECIALS (sizeof(specials) / sizeof(specials[0]))
+
+typedef struct {
+  uint8_t bytes[MAX_BYTES];
+  uint8_t len;
+  uint8_t jump;  // displacement bytes at the end to point at the target
+  uint8_t skip;  // instructions the jump goes over
+} insn_t;
+
+typedef struct {
+  cpu_state_t state;
+  uint32_t    data;  // linear address of the data window
+  insn_t      insns[MAX_INSNS];
+  uint32_t    num_insns;
+} case_t;
+
+typedef struct {
+  uint64_t        seed;
+  uint64_t        cases;
+  bool            jit;
+  bool            allowed[256];  // opcodes generated
+  uint8_t*        pristine;      // memory every case starts from
+
+  pthread_mutex_t lock;
+  uint64_t        next;      // first case of the next batch
+  uint64_t        failed;    // lowest case found to differ, or UINT64_MAX
+} fuzz_t;
+
+// seeds the values the stub device reads
+static uint64_t stub_seed;
+
+typedef struct {
+  const fuzz_t* f;
+  machine_t*    ref;
+  machine_t*    fast;
+  ud_t          ud;
+  uint8_t       code[MAX_INSNS * MAX_BYTES + 1];
+  uint32_t      offsets[MAX_INSNS + 1];
+} worker_t;
+
+static uint64_t random64(uint64_t* s) {
+  uint64_t z = (*s += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static uint16_t random_value(uint64_t* s) {
+  const uint64_t r = random64(s);
+  return (r & 3) ? (uint16_t)(r >> 16) : specials[(r >> 16) % NUM_SPECIALS];
+}
+
+static uint8_t random_byte(uint64_t* s) {
+  const uint64_t r = random64(s);
+  return (r & 3) ? (uint8_t)(r >> 16) : (uint8_t)specials[(r >> 16) % NUM_SPECIALS];
+}
+
+// The stub device on every port of both machines.
+static uint8_t stub_read(uint32_t port) {
+  uint64_t s = stub_seed ^ port;
+  return random_byte(&s);
+}
+
+static bool is_string(uint8_t op) {
+  return op >= 0xa4 && op <= 0xaf && op != 0xa8 && op != 0xa9;
+}
+
+// Short and near jumps, their displacement is the last byte or word.
+static uint8_t jump_bytes(uint8_t op) {
+  if ((op >= 0x70 && op <= 0x7f) || (op >= 0xe0 && op <= 0xe3) || op == 0xeb) {
+    return 1;
+  }
+  return (op == 0xe9) ? 2 : 0;
+}
+
+static void init_allowed(fuzz_t* f) {
+  static const uint8_t left_out[] = {
+    0x0f, 0x63, 0x64, 0x65, 0x66, 0x67, 0xd6, 0xf1,  // not 8086/80186
+    0x26, 0x2e, 0x36, 0x3e, 0xf0, 0xf2, 0xf3,        // prefixes, added apart
+    0x07, 0x17, 0x1f, 0x8e, 0xc4, 0xc5,              // segment loads
+    0x9a, 0xe8, 0xea, 0xc2, 0xc3, 0xca, 0xcb, 0xcf,  // leaving the case
+    0x6e, 0x6f, 0xe6, 0xe7, 0xee, 0xef, 0xf4,        // devices
+  };
+  for (uint32_t i = 0; i < 256; ++i) {
+    f->allowed[i] = true;
+  }
+  for (uint32_t i = 0; i < sizeof(left_out); ++i) {
+    f->allowed[left_out[i]] = false;
+  }
+}
+
+static void generate_insn(worker_t* w, uint64_t* s, insn_t* in) {
+  for (;;) {
+    uint8_t  buf[16];
+    uint32_t pos = 0;
+    uint8_t  op;
+    do {
+      op = (uint8_t)random64(s);
+    } while (!w->f->allowed[op]);
+
+    const uint64_t r = random64(s);
+    if (is_string(op) && (r & 1)) {
+      buf[pos++] = (r & 2) ? 0xf3 : 0xf2;
+    }
+    if (!jump_bytes(op) && (r & 0x70) == 0) {
+      static const uint8_t overrides[] = { 0x26, 0x36, 0x3e };
+      buf[pos++] = overrides[(r >> 8) % 3];
+    }
+    const uint32_t at = pos;
+    buf[pos++] = op;
+    while (pos < sizeof(buf)) {
+      buf[pos++] = random_byte(s);
+    }
+
+    ud_set_input_buffer(&w->ud, buf, sizeof(buf));
+    const uint32_t len = ud_disassemble(&w->ud);
+    const uint8_t  reg = (buf[at + 1] >> 3) & 7;
+    // the emulator watches INT 10h for video mode changes
+    if (!len || len > MAX_BYTES || ud_insn_mnemonic(&w->ud) == UD_Iinvalid ||
+        (op == 0xff && reg >= 2 && reg <= 5) || (op == 0xcd && buf[at + 1] == 0x10)) {
+      continue;
+    }
+    memcpy(in->bytes, buf, len);
+    in->len  = (uint8_t)len;
+    in->jump = jump_bytes(op);
+    in->skip = (uint8_t)(r >> 16) % (MAX_SKIP + 1);
+    return;
+  }
+}
+
+// IN AL,imm8  TEST AL,imm8  Jcc
+static void generate_poll(uint64_t* s, insn_t* in) {
+  const uint64_t r = random64(s);
+  memset(in, 0, 3 * sizeof(insn_t));
+  in[0].bytes[0] = 0xe4;
+  in[0].bytes[1] = (uint8_t)r;
+  in[1].bytes[0] = 0xa8;
+  in[1].bytes[1] = random_byte(s);
+  in[2].bytes[0] = (uint8_t)(0x70 | ((r >> 8) & 15));
+  in[0].len = in[1].len = in[2].len = 2;
+  in[2].jump = 1;
+  in[2].skip = (uint8_t)(r >> 16) % (MAX_SKIP + 1);
+}
+
+static void generate(worker_t* w, uint64_t index, case_t* c) {
+  uint64_t s = w->f->seed ^ (index * 0xd1b54a32d192ed03ull);
+  memset(c, 0, sizeof(*c));
+
+  for (int i = 0; i < 8; ++i) {
+    c->state.regs[i] = random_value(&s);
+  }
+  if (random64(&s) & 1) {
+    c->state.regs[CX] = (uint16_t)(random64(&s) % 20);  // short repeats
+  }
+  const uint32_t window = DATA_MIN + random64(&s) % (DATA_MAX - DATA_MIN - DATA_SPREAD);
+  c->data = window * 16;
+  c->state.segs[ES] = (uint16_t)(window + random64(&s) % DATA_SPREAD);
+  c->state.segs[SS] = (uint16_t)(window + random64(&s) % DATA_SPREAD);
+  c->state.segs[DS] = (uint16_t)(window + random64(&s) % DATA_SPREAD);
+  c->state.segs[CS] = CODE_SEG;
+
+  // OF DF IF SF ZF AF PF CF, trapping now and then
+  const uint64_t r = random64(&s);
+  c->state.flags = (uint16_t)((r & 0x0ed5) | 2 | (((r >> 16) & 15) ? 0 : 0x100));
+
+  c->num_insns = 1 + random64(&s) % MAX_INSNS;
+  for (uint32_t i = 0; i < c->num_insns; ++i) {
+    if (i + 3 <= c->num_insns && (random64(&s) & 15) == 0) {
+      generate_poll(&s, &c->insns[i]);
+      i += 2;
+      continue;
+    }
+    generate_insn(w, &s, &c->insns[i]);
+  }
+}
+
+// Lay the instructions out followed by a HLT, pointing the jumps at the
+// instruction they skip to. Returns the number of bytes.
+static uint32_t assemble(worker_t* w, const case_t* c) {
+  uint32_t len = 0;
+  for (uint32_t i = 0; i < c->num_insns; ++i) {
+    w->offsets[i] = len;
+    memcpy(w->code + len, c->insns[i].bytes, c->insns[i].len);
+    len += c->insns[i].len;
+  }
+  w->offsets[c->num_insns] = len;
+  w->code[len++] = 0xf4;  // HLT
+
+  for (uint32_t i = 0; i < c->num_insns; ++i) {
+    const insn_t*  in     = &c->insns[i];
+    const uint32_t next   = w->offsets[i] + in->len;
+    uint32_t       target = i + 1 + in->skip;
+    if (!in->jump) {
+      continue;
+    }
+    target = (target > c->num_insns) ? c->num_insns : target;
+    const uint16_t disp = (uint16_t)(w->offsets[target] - next);
+    w->code[next - in->jump] = (uint8_t)disp;
+    if (in->jump == 2) {
+      w->code[next - 1] = (uint8_t)(disp >> 8);
+    }
+  }
+  return len;
+}
+
+static void run_case(machine_t* m, const case_t* c, const uint8_t* code, uint32_t len) {
+  memcpy(m->memory + CODE_BASE, code, len);
+  cpu_invalidate(m, CODE_BASE, len);
+  cpu_set_registers(m, &c->state);
+  cpu_run(m, BUDGET);
+}
+
+// Put back the memory a case could have changed.
+static void reset(worker_t* w, machine_t* m, const case_t* c) {
+  memcpy(m->memory + c->data, w->f->pristine + c->data, DATA_SIZE);
+  cpu_invalidate(m, c->data, DATA_SIZE);
+}
+
+static void print_flags(uint16_t f) {
+  printf("%c%c%c%c%c%c%c%c%c",
+    (f & 0x800) ? 'O' : '.',
+    (f & 0x400) ? 'D' : '.',
+    (f & 0x200) ? 'I' : '.',
+    (f & 0x100) ? 'T' : '.',
+    (f & 0x080) ? 'S' : '.',
+    (f & 0x040) ? 'Z' : '.',
+    (f & 0x010) ? 'A' : '.',
+    (f & 0x004) ? 'P' : '.',
+    (f & 0x001) ? 'C' : '.');
+}
+
+// Compare what a range of memory holds in the two machines.
+static bool same_memory(worker_t* w, uint32_t addr, uint32_t size, bool print) {
+  const uint8_t* x = w->ref->memory + addr;
+  const uint8_t* y = w->fast->memory + addr;
+  if (memcmp(x, y, size) == 0) {
+    return true;
+  }
+  if (print) {
+    uint32_t shown = 0, count = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      if (x[i] == y[i]) {
+        continue;
+      }
+      count += 1;
+      if (shown < MAX_SHOWN) {
+        printf("  [%05x]      %02x vs %02x\n", addr + i, x[i], y[i]);
+        shown += 1;
+      }
+    }
+    if (count > shown) {
+      printf("  and %u more bytes\n", count - shown);
+    }
+  }
+  return false;
+}
+
+// Run a case through both cores. Returns true when they end the same,
+// printing what differs otherwise when asked to.
+static bool same(worker_t* w, const case_t* c, bool print) {
+  const uint32_t len = assemble(w, c);
+  const uint64_t ref_base  = cpu_get_instructions(w->ref);
+  const uint64_t fast_base = cpu_get_instructions(w->fast);
+  run_case(w->ref, c, w->code, len);
+  run_case(w->fast, c, w->code, len);
+
+  cpu_state_t a, b;
+  cpu_get_state(w->ref, &a);
+  cpu_get_state(w->fast, &b);
+
+  bool ok = true;
+#define DIFFER(name, x, y, fmt)                                                \
+  if ((x) != (y)) {                                                            \
+    ok = false;                                                                \
+    if (print) {                                                               \
+      printf("  %-12s " fmt " vs " fmt "\n", name, x, y);                      \
+    }                                                                          \
+  }
+  for (int i = 0; i < 8; ++i) {
+    DIFFER(reg_names[i], a.regs[i], b.regs[i], "%04x");
+  }
+  for (int i = 0; i < 4; ++i) {
+    DIFFER(seg_names[i], a.segs[i], b.segs[i], "%04x");
+  }
+  DIFFER("IP", a.pc, b.pc, "%04x");
+  if (a.flags != b.flags) {
+    ok = false;
+    if (print) {
+      printf("  %-12s ", "flags");
+      print_flags(a.flags);
+      printf(" vs ");
+      print_flags(b.flags);
+      printf("\n");
+    }
+  }
+  DIFFER("halted", a.sleeping, b.sleeping, "%u");
+  DIFFER("cycles", (unsigned long long)a.clock, (unsigned long long)b.clock, "%llu");
+  DIFFER("instructions", (unsigned long long)(cpu_get_instructions(w->ref) - ref_base),
+    (unsigned long long)(cpu_get_instructions(w->fast) - fast_base), "%llu");
+#undef DIFFER
+
+  ok &= same_memory(w, c->data, DATA_SIZE, print);
+
+  reset(w, w->ref, c);
+  reset(w, w->fast, c);
+  return ok;
+}
+
+// Drop instructions and plain out registers for as long as the case still
+// differs.
+static void shrink(worker_t* w, case_t* c) {
+  bool smaller = true;
+  while (smaller) {
+    smaller = false;
+    for (uint32_t i = 0; i < c->num_insns && c->num_insns > 1;) {
+      case_t t = *c;
+      memmove(&t.insns[i], &t.insns[i + 1], (t.num_insns - i - 1) * sizeof(insn_t));
+      t.num_insns -= 1;
+      if (!same(w, &t, false)) {
+        *c = t;
+        smaller = true;
+      }
+      else {
+        ++i;
+      }
+    }
+    for (int i = 0; i < 8 + 4 + 1; ++i) {
+      case_t    t = *c;
+      uint16_t* v = (i < 8) ? &t.state.regs[i] : (i < 12) ? &t.state.segs[i - 8] :
+                                                            &t.state.flags;
+      const uint16_t plain = (i < 8) ? 0 : (i < 12) ? (uint16_t)(c->data >> 4) : 2;
+      if (i == 8 + CS || *v == plain) {
+        continue;
+      }
+      *v = plain;
+      if (!same(w, &t, false)) {
+        *c = t;
+        smaller = true;
+      }
+    }
+  }
+}
+
+static void print_case(worker_t* w, const case_t* c) {
+  const cpu_state_t* s = &c->state;
+  printf("  ");
+  for (int i = 0; i < 8; ++i) {
+    printf("%s=%04x ", reg_names[i], s->regs[i]);
+  }
+  for (int i = 0; i < 4; ++i) {
+    printf("%s=%04x ", seg_names[i], s->segs[i]);
+  }
+  print_flags(s->flags);
+  printf("\n");
+
+  const uint32_t len = assemble(w, c);
+  ud_set_input_buffer(&w->ud, w->code, len);
+  ud_set_pc(&w->ud, 0);
+  for (uint32_t i = 0; i <= c->num_insns; ++i) {
+    ud_disassemble(&w->ud);
+    printf("  %04x: %-16s %s\n", w->offsets[i], ud_insn_hex(&w->ud), ud_insn_asm(&w->ud));
+  }
+  ud_set_pc(&w->ud, 0);
+}
+
+static bool worker_init(worker_t* w, const fuzz_t* f) {
+  memset(w, 0, sizeof(*w));
+  w->f    = f;
+  w->ref  = machine_create();
+  w->fast = machine_create();
+  if (!w->ref || !w->fast) {
+    return false;
+  }
+  cpu_set_reference(w->ref, true);
+  cpu_set_jit(w->fast, f->jit);
+  machine_set_port_stub(w->ref, stub_read);
+  machine_set_port_stub(w->fast, stub_read);
+  memcpy(w->ref->memory, f->pristine, sizeof(w->ref->memory));
+  memcpy(w->fast->memory, f->pristine, sizeof(w->fast->memory));
+  ud_init(&w->ud);
+  ud_set_mode(&w->ud, 16);
+  ud_set_syntax(&w->ud, UD_SYN_INTEL);
+  return true;
+}
+
+static void worker_free(worker_t* w) {
+  if (w->ref) {
+    machine_destroy(w->ref);
+  }
+  if (w->fast) {
+    machine_destroy(w->fast);
+  }
+}
+
+static void* worker(void* arg) {
+  fuzz_t*  f = arg;
+  worker_t w;
+  if (!worker_init(&w, f)) {
+    worker_free(&w);
+    return NULL;
+  }
+  for (;;) {
+    pthread_mutex_lock(&f->lock);
+    const uint64_t first = f->next;
+    const bool     stop  = first >= f->cases || f->failed != UINT64_MAX;
+    f->next += BATCH;
+    pthread_mutex_unlock(&f->lock);
+    if (stop) {
+      break;
+    }
+    const uint64_t last = (first + BATCH < f->cases) ? first + BATCH : f->cases;
+    for (uint64_t i = first; i < last; ++i) {
+      case_t c;
+      generate(&w, i, &c);
+      if (!same(&w, &c, false)) {
+        pthread_mutex_lock(&f->lock);
+        f->failed = (i < f->failed) ? i : f->failed;
+        pthread_mutex_unlock(&f->lock);
+        break;
+      }
+    }
+  }
+  worker_free(&w);
+  return NULL;
+}
+
+// Shrink the case and print it, with what the cores leave different.
+static int report(fuzz_t* f, uint64_t index) {
+  worker_t w;
+  if (!worker_init(&w, f)) {
+    worker_free(&w);
+    return 1;
+  }
+  case_t c;
+  generate(&w, index, &c);
+  if (same(&w, &c, false)) {
+    printf("case %llu: the cores agree\n", (unsigned long long)index);
+    worker_free(&w);
+    return 0;
+  }
+  printf("case %llu differs, as found:\n", (unsigned long long)index);
+  print_case(&w, &c);
+  shrink(&w, &c);
+  printf("shrunk to:\n");
+  print_case(&w, &c);
+  printf("reference vs fast:\n");
+  same(&w, &c, true);
+  printf("run it again with --seed %llu --case %llu%s\n", (unsigned long long)f->seed,
+    (unsigned long long)index, f->jit ? "" : " --no-jit");
+  worker_free(&w);
+  return 1;
+}
+
+static double now_seconds(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: iceXtFuzz [options]\n"
+    "  --cases N     cases to run (default 1000000)\n"
+    "  --threads N   threads to run them on (default one per core)\n"
+    "  --seed N      seed of the cases (default from the time)\n"
+    "  --case N      run, shrink and print only case N of the seed\n"
+    "  --no-jit      leave the translator out of the fast core\n");
+}
+
+int main(int argc, char** args) {
+
+  fuzz_t f;
+  memset(&f, 0, sizeof(f));
+  f.seed   = (uint64_t)time(NULL);
+  f.cases  = 1000000;
+  f.jit    = true;
+  f.failed = UINT64_MAX;
+
+  long     cores   = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t threads = (cores > 0) ? (uint32_t)cores : 1;
+  bool     single  = false;
+  uint64_t index   = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(args[i], "--cases") == 0 && has_value) {
+      f.cases = strtoull(args[++i], NULL, 0);
+      continue;
+    }
+    if (strcmp(args[i], "--threads") == 0 && has_value) {
+      threads = (uint32_t)atoi(args[++i]);
+      threads = threads ? threads : 1;
+      continue;
+    }
+    if (strcmp(args[i], "--seed") == 0 && has_value) {
+      f.seed = strtoull(args[++i], NULL, 0);
+      continue;
+    }
+    if (strcmp(args[i], "--case") == 0 && has_value) {
+      index  = strtoull(args[++i], NULL, 0);
+      single = true;
+      continue;
+    }
+    if (strcmp(args[i], "--no-jit") == 0) {
+      f.jit = false;
+      continue;
+    }
+    usage();
+    return 1;
+  }
+
+  // random memory, every interrupt vector pointing at an IRET
+  f.pristine = malloc(1024 * 1024);
+  if (!f.pristine) {
+    return 1;
+  }
+  uint64_t s = f.seed;
+  for (uint32_t i = 0; i < 1024 * 1024; i += 8) {
+    const uint64_t r = random64(&s);
+    memcpy(f.pristine + i, &r, 8);
+  }
+  for (uint32_t i = 0; i < 256; ++i) {
+    f.pristine[i * 4 + 0] = 0;
+    f.pristine[i * 4 + 1] = 0;
+    f.pristine[i * 4 + 2] = HANDLER_SEG & 0xff;
+    f.pristine[i * 4 + 3] = HANDLER_SEG >> 8;
+  }
+  f.pristine[HANDLER_SEG * 16] = 0xcf;  // IRET
+  stub_seed = f.seed;
+  init_allowed(&f);
+
+  if (single) {
+    const int ret = report(&f, index);
+    free(f.pristine);
+    return ret;
+  }
+
+  printf("seed %llu, %u threads\n", (unsigned long long)f.seed, threads);
+  fflush(stdout);
+
+  pthread_mutex_init(&f.lock, NULL);
+  const double start = now_seconds();
+  pthread_t*   pool  = calloc(threads, sizeof(pthread_t));
+  for (uint32_t i = 0; i < threads; ++i) {
+    pthread_create(&pool[i], NULL, worker, &f);
+  }
+  for (uint32_t i = 0; i < threads; ++i) {
+    pthread_join(pool[i], NULL);
+  }
+  const double seconds = now_seconds() - start;
+  pthread_mutex_destroy(&f.lock);
+  free(pool);
+
+  int ret = 0;
+  if (f.failed != UINT64_MAX) {
+    ret = report(&f, f.failed);
+  }
+  else {
+    printf("%llu cases in %.1fs, %.0f per second, the cores agree\n",
+      (unsigned long long)f.cases, seconds, f.cases / seconds);
+  }
+  free(f.pristine);
+  return ret;
+}
@@ -0,0 +1,266 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "journal.h"
+#include "machine.h"
+
+
+#define JOURNAL_MAGIC "iceXtJnl"
+
+struct journal_t {
+  FILE*    file;
+  bool     replay;
+  bool     diverged;
+  uint64_t last;   // clock cycle of the previous event
+
+  // next event of a replay, type is JOURNAL_END once the journal runs out
+  uint8_t  type;
+  uint64_t cycle;
+  uint32_t value;
+};
+
+static void put_varint(FILE* fd, uint64_t v) {
+  while (v >= 0x80) {
+    fputc(0x80 | (v & 0x7f), fd);
+    v >>= 7;
+  }
+  fputc((int)v, fd);
+}
+
+static bool get_varint(FILE* fd, uint64_t* v) {
+  *v = 0;
+  for (uint32_t shift = 0; shift < 64; shift += 7) {
+    const int c = fgetc(fd);
+    if (c == EOF) {
+      return false;
+    }
+    *v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void put64(FILE* fd, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    fputc((v >> (i * 8)) & 0xff, fd);
+  }
+}
+
+static bool get64(FILE* fd, uint64_t* v) {
+  uint8_t b[8];
+  if (fread(b, 1, sizeof(b), fd) != sizeof(b)) {
+    return false;
+  }
+  *v = 0;
+  for (int i = 0; i < 8; ++i) {
+    *v |= (uint64_t)b[i] << (i * 8);
+  }
+  return true;
+}
+
+// Read the next event of a replay. A truncated journal, from a recording
+// that was killed, just ends early.
+static void read_event(journal_t* j) {
+  uint64_t delta = 0;
+  uint64_t value = 0;
+  const int type = fgetc(j->file);
+  if (type == EOF || type == JOURNAL_END ||
+      !get_varint(j->file, &delta) || !get_varint(j->file, &value)) {
+    j->type = JOURNAL_END;
+    fprintf(stderr, "journal: replay finished\n");
+    return;
+  }
+  j->type  = (uint8_t)type;
+  j->cycle = j->last + delta;
+  j->value = (uint32_t)value;
+  j->last  = j->cycle;
+}
+
+static void write_event(machine_t *m, uint8_t type, uint32_t value) {
+  journal_t* j = m->journal;
+  const uint64_t now = cpu_get_cycles(m);
+  fputc(type, j->file);
+  put_varint(j->file, now - j->last);
+  put_varint(j->file, value);
+  j->last = now;
+}
+
+static void diverged(machine_t *m, uint8_t type, uint32_t value) {
+  journal_t* j = m->journal;
+  if (!j->diverged) {
+    fprintf(stderr, "journal: diverged at cycle %llu, got event %u value %x, "
+                    "recorded event %u value %x at cycle %llu\n",
+            (unsigned long long)cpu_get_cycles(m), type, value,
+            j->type, j->value, (unsigned long long)j->cycle);
+  }
+  j->diverged = true;
+}
+
+static journal_t* journal_open(machine_t *m, const char* path, bool replay) {
+  if (m->journal) {
+    return NULL;
+  }
+  FILE* fd = fopen(path, replay ? "rb" : "wb");
+  if (!fd) {
+    return NULL;
+  }
+  journal_t* j = calloc(1, sizeof(journal_t));
+  if (!j) {
+    fclose(fd);
+    return NULL;
+  }
+  j->file   = fd;
+  j->replay = replay;
+  j->last   = cpu_get_cycles(m);
+  m->journal = j;
+  return j;
+}
+
+bool journal_record(machine_t *m, const char* path) {
+  journal_t* j = journal_open(m, path, false);
+  if (!j) {
+    return false;
+  }
+  fwrite(JOURNAL_MAGIC, 1, 8, j->file);
+  const uint32_t version = JOURNAL_VERSION;
+  for (int i = 0; i < 4; ++i) {
+    fputc((version >> (i * 8)) & 0xff, j->file);
+  }
+  put64(j->file, j->last);
+  return true;
+}
+
+bool journal_replay(machine_t *m, const char* path) {
+  journal_t* j = journal_open(m, path, true);
+  if (!j) {
+    return false;
+  }
+  uint8_t  magic[8];
+  uint8_t  version[4];
+  uint64_t start = 0;
+  if (fread(magic, 1, 8, j->file) != 8 || memcmp(magic, JOURNAL_MAGIC, 8) ||
+      fread(version, 1, 4, j->file) != 4 ||
+      (version[0] | (version[1] << 8) | (version[2] << 16) | ((uint32_t)version[3] << 24)) != JOURNAL_VERSION ||
+      !get64(j->file, &start)) {
+    fprintf(stderr, "journal: '%s' is not a journal\n", path);
+    journal_close(m);
+    return false;
+  }
+  if (start != j->last) {
+    fprintf(stderr, "journal: recorded from cycle %llu, the machine is at %llu\n",
+            (unsigned long long)start, (unsigned long long)j->last);
+    journal_close(m);
+    return false;
+  }
+  read_event(j);
+  return true;
+}
+
+bool journal_close(machine_t *m) {
+  journal_t* j = m->journal;
+  if (!j) {
+    return true;
+  }
+  if (!j->replay) {
+    fputc(JOURNAL_END, j->file);
+  }
+  fclose(j->file);
+  const bool ok = !j->diverged;
+  free(j);
+  m->journal = NULL;
+  return ok;
+}
+
+bool journal_replaying(machine_t *m) {
+  return m->journal && m->journal->replay && m->journal->type != JOURNAL_END;
+}
+
+bool journal_input(machine_t *m, uint8_t type, uint8_t data) {
+  journal_t* j = m->journal;
+  if (!j) {
+    return true;
+  }
+  if (j->replay) {
+    return j->type == JOURNAL_END;
+  }
+  write_event(m, type, data);
+  return true;
+}
+
+uint64_t journal_next(machine_t *m) {
+  journal_t* j = m->journal;
+  if (!j || !j->replay || j->type == JOURNAL_END) {
+    return UINT64_MAX;
+  }
+  return j->cycle;
+}
+
+void journal_deliver(machine_t *m) {
+  journal_t* j = m->journal;
+  if (!j || !j->replay) {
+    return;
+  }
+  const uint64_t now = cpu_get_cycles(m);
+  while (j->type != JOURNAL_END && j->cycle <= now) {
+    switch (j->type) {
+    case JOURNAL_KEY:
+      keyboard_latch(m, (uint8_t)j->value);
+      break;
+    case JOURNAL_SERIAL:
+      serial_latch(m, (uint8_t)j->value);
+      break;
+    default:
+      if (j->cycle == now) {
+        return;  // the next instruction may ask for it
+      }
+      diverged(m, JOURNAL_END, 0);  // should have been asked for by now
+      break;
+    }
+    read_event(j);
+  }
+}
+
+void journal_put(machine_t *m, uint8_t type, uint32_t value) {
+  journal_t* j = m->journal;
+  if (j && !j->replay) {
+    write_event(m, type, value);
+  }
+}
+
+uint32_t journal_take(machine_t *m, uint8_t type) {
+  journal_t* j = m->journal;
+  if (!j || !j->replay || j->type == JOURNAL_END) {
+    return 0;
+  }
+  const uint32_t value = j->value;
+  if (j->type != type || j->cycle != cpu_get_cycles(m)) {
+    diverged(m, type, 0);
+    return value;
+  }
+  read_event(j);
+  return value;
+}
+
+void journal_check(machine_t *m, uint8_t type, uint32_t value) {
+  journal_t* j = m->journal;
+  if (!j) {
+    return;
+  }
+  if (!j->replay) {
+    write_event(m, type, value);
+    return;
+  }
+  if (j->type == JOURNAL_END) {
+    return;
+  }
+  if (j->type != type || j->value != value || j->cycle != cpu_get_cycles(m)) {
+    diverged(m, type, value);
+    return;
+  }
+  read_event(j);
+}
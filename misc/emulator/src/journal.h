@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+
+
+typedef struct journal_t journal_t;
+
+// Journal file layout, all values little endian:
+//
+//   "iceXtJnl"  magic
+//   u32         JOURNAL_VERSION
+//   u64         clock cycle the recording started at
+//   events      u8 type, varint cycles since the previous event, varint value
+//   u8          JOURNAL_END
+//
+// Varints are 7 bits per byte, low bits first, bit 7 set when more follow.
+#define JOURNAL_VERSION 1
+
+enum {
+  JOURNAL_END        = 0,
+  JOURNAL_KEY        = 1,  // scancode, see keyboard_scancode()
+  JOURNAL_SERIAL     = 2,  // byte received by COM1, see serial_receive()
+  JOURNAL_SD_REPLY   = 3,  // byte from the real SD card (USE_SERIAL_SD)
+  JOURNAL_DISK_WRITE = 4,  // checksum of a sector written to the SD card
+};
+
+// Journal every input the machine gets from now on to a new file at path.
+bool journal_record(machine_t *m, const char* path);
+
+// Replay a journal. The machine must be in the state the recording started
+// from, either freshly loaded or restored from the same snapshot, with the
+// same disk image. Live input is ignored until the journal runs out.
+bool journal_replay(machine_t *m, const char* path);
+
+// Finish recording or replaying. Returns false when a replay has diverged
+// from the recording.
+bool journal_close(machine_t *m);
+
+bool journal_replaying(machine_t *m);
+
+// Input arriving from outside the machine at any time. Returns true when it
+// should be applied now, false while replaying where journal_deliver()
+// applies the recorded input instead.
+bool journal_input(machine_t *m, uint8_t type, uint8_t data);
+
+// Clock cycle of the next recorded input, UINT64_MAX when there is none.
+uint64_t journal_next(machine_t *m);
+
+// Apply the recorded inputs that are due. Called between cpu_run() chunks
+// which end at journal_next().
+void journal_deliver(machine_t *m);
+
+// A value the machine asked the outside world for, such as an SD card
+// reply. journal_put() records it, journal_take() returns the recorded one.
+void     journal_put (machine_t *m, uint8_t type, uint32_t value);
+uint32_t journal_take(machine_t *m, uint8_t type);
+
+// A value the machine produced. Recorded, and checked against the recording
+// when replaying to catch a divergence where it happens.
+void journal_check(machine_t *m, uint8_t type, uint32_t value);
@@ -2,11 +2,31 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#define _SDL_main_h
-#include <SDL.h>
+#include "cpu.h"
 
 
-void keyboard_io_write(uint16_t port, uint8_t data);
-bool keyboard_io_read (uint16_t port, uint8_t *out);
+typedef struct {
+  uint8_t buffer_recv;
 
-void keyboard_key_event(SDL_Event* event);
+  // scancodes waiting to be sent by keyboard_poll()
+  uint8_t queue[256];
+  uint8_t queue_head;
+  uint8_t queue_tail;
+} keyboard_t;
+
+void keyboard_io_write(machine_t *m, uint16_t port, uint8_t data);
+bool keyboard_io_read (machine_t *m, uint16_t port, uint8_t *out);
+
+// Latch a make (bit 7 clear) or break code and raise IRQ1. This is input
+// to the machine and goes through the journal, see journal_input().
+void keyboard_scancode(machine_t *m, uint8_t code);
+// Latch a scancode as is, for replaying a journal.
+void keyboard_latch   (machine_t *m, uint8_t code);
+
+// Queue the key presses that type an ASCII character, '\n' is Enter.
+// Returns false when the queue is full, characters without a key are
+// dropped.
+bool keyboard_type(machine_t *m, char ch);
+// Send the next queued scancode, if any. Called once per video frame so the
+// BIOS gets time to take each one.
+bool keyboard_poll(machine_t *m);
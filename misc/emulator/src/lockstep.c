@@ -0,0 +1,363 @@
+// Runs the fast CPU paths in lockstep with the reference interpreter, no
+// SDL.
+//
+//   iceXtLockstep [options] <bios.hex> <diskrom.hex> <disk.img>
+//
+// Boots two machines from the same ROMs and image, each on its own copy of
+// memory. One runs the reference interpreter, see cpu_set_reference(), the
+// other everything the build has: decode cache, lazy flags, bulk string
+// instructions, threaded dispatch and the translator. After every video
+// frame their registers, flags as CompressFlags() packs them, clock,
+// instruction count, memory and disk writes are compared.
+//
+// Every --checkpoint frames the state is saved to <out>.snap. On the first
+// difference both machines go back to it and the clock cycle they part at
+// is searched for, down to the single instruction. The snapshot is then
+// replaced by the state before that instruction, to reproduce it with
+// iceXtRunner --restore, and the instruction is printed along with what it
+// left different.
+//
+// The reference machine writes to the image as a normal run would, the
+// disk writes of the fast one go to <out>.overlay. Neither is rolled back
+// when going back to a checkpoint.
+//
+// Exits with 0 when the cores agree, 1 when they differ and 2 when the
+// machines could not be started.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "udis86/udis86.h"
+
+#include "machine.h"
+#include "snapshot.h"
+
+
+#define MAX_SHOWN 16  // differing memory bytes printed
+
+static const char* const reg_names[8] = {
+  "AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI",
+};
+static const char* const seg_names[4] = { "ES", "CS", "SS", "DS" };
+
+typedef struct {
+  machine_t*  ref;
+  machine_t*  fast;
+  const char* snap;  // last checkpoint
+
+  // Instruction counts when the machines were last set to the same state,
+  // the count is not part of a snapshot.
+  uint64_t    ref_base;
+  uint64_t    fast_base;
+} lockstep_t;
+
+// Run a machine up to the first instruction boundary at or after cycle.
+static void run_to(machine_t* m, uint64_t cycle) {
+  machine_stop_at_cycle(m, cycle);
+  while (cpu_get_cycles(m) < cycle) {
+    cpu_set_debug(m, false);
+    machine_run_frame(m);
+  }
+  machine_stop_at_cycle(m, 0);
+}
+
+static void print_flags(uint16_t f) {
+  printf("%c%c%c%c%c%c%c%c",
+    (f & 0x800) ? 'O' : '.',
+    (f & 0x400) ? 'D' : '.',
+    (f & 0x200) ? 'I' : '.',
+    (f & 0x080) ? 'S' : '.',
+    (f & 0x040) ? 'Z' : '.',
+    (f & 0x010) ? 'A' : '.',
+    (f & 0x004) ? 'P' : '.',
+    (f & 0x001) ? 'C' : '.');
+}
+
+// Compare the two machines, printing what differs when asked to. Returns
+// true when they are the same.
+static bool same(lockstep_t* l, bool print) {
+  cpu_state_t a, b;
+  cpu_get_state(l->ref, &a);
+  cpu_get_state(l->fast, &b);
+
+  bool ok = true;
+#define DIFFER(name, x, y, fmt)                                                \
+  if ((x) != (y)) {                                                            \
+    ok = false;                                                                \
+    if (print) {                                                               \
+      printf("  %-12s " fmt " vs " fmt "\n", name, x, y);                      \
+    }                                                                          \
+  }
+  for (int i = 0; i < 8; ++i) {
+    DIFFER(reg_names[i], a.regs[i], b.regs[i], "%04x");
+  }
+  for (int i = 0; i < 4; ++i) {
+    DIFFER(seg_names[i], a.segs[i], b.segs[i], "%04x");
+  }
+  DIFFER("IP", a.pc, b.pc, "%04x");
+  if (a.flags != b.flags) {
+    ok = false;
+    if (print) {
+      printf("  %-12s ", "flags");
+      print_flags(a.flags);
+      printf(" vs ");
+      print_flags(b.flags);
+      printf("\n");
+    }
+  }
+  DIFFER("IRQs", a.irqs, b.irqs, "%04x");
+  DIFFER("halted", a.sleeping, b.sleeping, "%u");
+  DIFFER("cycles", (unsigned long long)a.clock, (unsigned long long)b.clock, "%llu");
+  DIFFER("instructions", (unsigned long long)(cpu_get_instructions(l->ref) - l->ref_base),
+    (unsigned long long)(cpu_get_instructions(l->fast) - l->fast_base), "%llu");
+  DIFFER("disk writes", l->ref->disk.write_count, l->fast->disk.write_count, "%u");
+  DIFFER("disk sum", l->ref->disk.write_sum, l->fast->disk.write_sum, "%08x");
+#undef DIFFER
+
+  const uint8_t* x = l->ref->memory;
+  const uint8_t* y = l->fast->memory;
+  if (memcmp(x, y, sizeof(l->ref->memory)) == 0) {
+    return ok;
+  }
+  if (print) {
+    uint32_t shown = 0, count = 0;
+    for (uint32_t i = 0; i < sizeof(l->ref->memory); ++i) {
+      if (x[i] == y[i]) {
+        continue;
+      }
+      count += 1;
+      if (shown < MAX_SHOWN) {
+        printf("  [%05x]      %02x vs %02x\n", i, x[i], y[i]);
+        shown += 1;
+      }
+    }
+    if (count > shown) {
+      printf("  and %u more bytes\n", count - shown);
+    }
+  }
+  return false;
+}
+
+static bool checkpoint(lockstep_t* l) {
+  return snapshot_save(l->ref, l->snap);
+}
+
+// Set both machines to the state of the checkpoint.
+static bool restore(lockstep_t* l) {
+  if (!snapshot_restore(l->ref, l->snap) || !snapshot_restore(l->fast, l->snap)) {
+    return false;
+  }
+  l->ref_base  = cpu_get_instructions(l->ref);
+  l->fast_base = cpu_get_instructions(l->fast);
+  return true;
+}
+
+// Restore both machines from the checkpoint and run them up to cycle.
+// Returns true when they are the same there.
+static bool same_at(lockstep_t* l, uint64_t cycle, bool* error) {
+  if (!restore(l)) {
+    *error = true;
+    return false;
+  }
+  run_to(l->ref, cycle);
+  run_to(l->fast, cycle);
+  return same(l, false);
+}
+
+// Print the instruction about to be executed by the reference.
+static void print_next(machine_t* m) {
+  const uint16_t cs   = cpu_get_CS(m);
+  const uint16_t ip   = cpu_get_IP(m);
+  const uint32_t addr = cpu_get_address(cs, ip);
+  uint8_t bytes[16];
+  for (uint32_t i = 0; i < sizeof(bytes); ++i) {
+    bytes[i] = mem_read(m, (addr + i) & 0xfffff);
+  }
+  ud_t ud;
+  ud_init(&ud);
+  ud_set_mode(&ud, 16);
+  ud_set_syntax(&ud, UD_SYN_INTEL);
+  ud_set_input_buffer(&ud, bytes, sizeof(bytes));
+  ud_set_pc(&ud, ip);
+  const bool known = ud_disassemble(&ud) != 0;
+  printf("  %04x:%04x %05x: %s\n", cs, ip, addr, known ? ud_insn_asm(&ud) : "?");
+}
+
+// The machines differ at cycle bad and were the same at good, the last
+// checkpoint. Find the instruction they part at and save the state before
+// it. Returns false when it can not be found.
+static bool find_difference(lockstep_t* l, uint64_t good, uint64_t bad) {
+  bool error = false;
+  if (same_at(l, bad, &error)) {
+    printf("the difference does not show again from the checkpoint at cycle %llu, "
+           "it depends on code cached before\n", (unsigned long long)good);
+    return false;
+  }
+  while (bad - good > 1 && !error) {
+    const uint64_t mid = good + (bad - good) / 2;
+    if (same_at(l, mid, &error)) {
+      good = mid;
+    }
+    else {
+      bad = mid;
+    }
+  }
+  if (error || !same_at(l, good, &error) || !snapshot_save(l->ref, l->snap)) {
+    fprintf(stderr, "Unable to go back to '%s'!\n", l->snap);
+    return false;
+  }
+
+  cpu_state_t s;
+  cpu_get_state(l->ref, &s);
+  printf("the cores part at cycle %llu:\n", (unsigned long long)s.clock);
+  print_next(l->ref);
+  printf("  ");
+  for (int i = 0; i < 8; ++i) {
+    printf("%s=%04x ", reg_names[i], s.regs[i]);
+  }
+  for (int i = 0; i < 4; ++i) {
+    printf("%s=%04x ", seg_names[i], s.segs[i]);
+  }
+  print_flags(s.flags);
+  printf("\nreference vs fast after it:\n");
+
+  run_to(l->ref, bad);
+  run_to(l->fast, bad);
+  same(l, true);
+  printf("the state before it is saved to '%s'\n", l->snap);
+  return true;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: iceXtLockstep [options] <bios.hex> <diskrom.hex> <disk.img>\n"
+    "  --frames N       video frames to run (default 1500)\n"
+    "  --checkpoint N   frames between the checkpoints (default 10)\n"
+    "  --out NAME       write <NAME>.snap and <NAME>.overlay (default\n"
+    "                   <disk.img>.lockstep)\n"
+    "  --restore FILE   start from a snapshot, the BIOS and ROM are unused\n"
+    "  --no-jit         leave the translator out of the fast core\n"
+    "  --v20            run both machines as a V20 rather than an 80186\n");
+}
+
+int main(int argc, char** args) {
+
+  uint32_t    frames = 1500;
+  uint32_t    every  = 10;
+  const char* out    = NULL;
+  const char* from   = NULL;
+  bool        jit    = true;
+  cpu_model_t model  = CPU_80186;
+
+  const char* paths[3];
+  uint32_t    numPaths = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(args[i], "--frames") == 0 && has_value) {
+      frames = (uint32_t)atoi(args[++i]);
+      continue;
+    }
+    if (strcmp(args[i], "--checkpoint") == 0 && has_value) {
+      every = (uint32_t)atoi(args[++i]);
+      every = every ? every : 1;
+      continue;
+    }
+    if (strcmp(args[i], "--out") == 0 && has_value) {
+      out = args[++i];
+      continue;
+    }
+    if (strcmp(args[i], "--restore") == 0 && has_value) {
+      from = args[++i];
+      continue;
+    }
+    if (strcmp(args[i], "--no-jit") == 0) {
+      jit = false;
+      continue;
+    }
+    if (strcmp(args[i], "--v20") == 0) {
+      model = CPU_V20;
+      continue;
+    }
+    if (strncmp(args[i], "--", 2) == 0 || numPaths == 3) {
+      usage();
+      return 2;
+    }
+    paths[numPaths++] = args[i];
+  }
+  if (numPaths != 3) {
+    usage();
+    return 2;
+  }
+
+  char name[1024], snap[1040], overlay[1040];
+  if (out) {
+    snprintf(name, sizeof(name), "%s", out);
+  }
+  else {
+    snprintf(name, sizeof(name), "%s.lockstep", paths[2]);
+  }
+  snprintf(snap, sizeof(snap), "%s.snap", name);
+  snprintf(overlay, sizeof(overlay), "%s.overlay", name);
+
+  lockstep_t l;
+  memset(&l, 0, sizeof(l));
+  l.ref  = machine_create();
+  l.fast = machine_create();
+  l.snap = snap;
+  if (!l.ref || !l.fast) {
+    return 2;
+  }
+  cpu_set_reference(l.ref, true);
+  cpu_set_jit(l.fast, jit);
+  cpu_set_model(l.ref, model);
+  cpu_set_model(l.fast, model);
+
+  bool ok = from ? (disk_load(l.ref, paths[2]) && snapshot_restore(l.ref, from))
+                 : machine_load(l.ref, paths[0], paths[1], paths[2]);
+  ok = ok && disk_load(l.fast, paths[2]) && disk_overlay(l.fast, overlay);
+  if (!ok || !checkpoint(&l) || !restore(&l)) {
+    fprintf(stderr, "Unable to start the machines!\n");
+    return 2;
+  }
+
+  uint64_t good  = cpu_get_cycles(l.ref);
+  bool     agree = true;
+  uint32_t frame = 0;
+  for (; frame < frames && agree; ++frame) {
+    if (frame && frame % every == 0) {
+      if (!checkpoint(&l)) {
+        fprintf(stderr, "Unable to write '%s'!\n", snap);
+        return 2;
+      }
+      good = cpu_get_cycles(l.ref);
+    }
+    cpu_set_debug(l.ref, false);
+    cpu_set_debug(l.fast, false);
+    machine_run_frame(l.ref);
+    machine_run_frame(l.fast);
+    agree = same(&l, false);
+  }
+
+  if (agree) {
+    printf("%u frames, %llu instructions, %llu cycles, the cores agree\n", frame,
+      (unsigned long long)(cpu_get_instructions(l.ref) - l.ref_base),
+      (unsigned long long)cpu_get_cycles(l.ref));
+    remove(snap);
+  }
+  else {
+    const uint64_t a = cpu_get_cycles(l.ref);
+    const uint64_t b = cpu_get_cycles(l.fast);
+    printf("the cores differ after frame %u\n", frame);
+    same(&l, true);
+    find_difference(&l, good, (a > b) ? a : b);
+  }
+
+  machine_destroy(l.ref);
+  machine_destroy(l.fast);
+  remove(overlay);
+  return agree ? 0 : 1;
+}
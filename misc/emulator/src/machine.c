@@ -0,0 +1,428 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "machine.h"
+
+
+void int_notify(machine_t *m, uint8_t num) {
+
+  if (num == m->stop_int) {
+    m->stop_hit = true;
+    cpu_stop(m);
+  }
+
+  if (num == 0x13) {
+
+    uint8_t ah = cpu_get_AH(m);
+    switch (ah) {
+    case 2:
+      break;
+    default:
+      break;
+      //printf("13h\n", ah);
+      //cpu_dump_state(m);
+    }
+  }
+
+  if (num == 0x10) {
+    if (cpu_get_AH(m) == 0) {
+      // video change mode
+      uint8_t mode = cpu_get_AL(m);
+      display_set_mode(m, mode);
+    }
+  }
+}
+
+uint8_t port_read(machine_t *m, uint32_t port) {
+  port &= 0xfff;
+
+  if (m->port_stub) {
+    return m->port_stub(port);
+  }
+
+  if (port == 0xb8) {
+    return disk_spi_read(m);
+  }
+
+  if (port == 0xb9) {
+    return 0;  // SPI not busy
+  }
+
+  uint8_t out = 0;
+
+  if (serial_io_read(m, port, &out)) {
+    return out;
+  }
+  if (keyboard_io_read(m, port, &out)) {
+    return out;
+  }
+  if (pit_io_read(m, port, &out)) {
+    return out;
+  }
+  if (display_cga_io_read(m, port, &out)) {
+    return out;
+  }
+  if (display_ega_io_read(m, port, &out)) {
+    return out;
+  }
+  return 0;
+}
+
+void port_write(machine_t *m, uint32_t port, uint8_t value) {
+  port &= 0xfff;
+
+  if (port == 0xb0) {
+    if (trace_gated(m)) {
+      trace_enable(m, true);
+    }
+    else {
+      printf("----------------------------------------------------\n");
+      cpu_set_debug(m, true);
+    }
+  }
+  if (port == 0xb2) {
+    if (trace_gated(m)) {
+      trace_enable(m, false);
+    }
+    else {
+      cpu_set_debug(m, false);
+    }
+  }
+  if (port == 0xb8) {
+    disk_spi_write(m, value);
+  }
+  if (port == 0xb9) {
+    disk_spi_ctrl(m, value);
+  }
+  if (port == 0xbc) {
+    // legacy
+    //disk_int13(m);
+  }
+  if (port == 0xbe) {
+    //cpu_dump_state(m);
+    //dump_sector();
+  }
+
+  serial_io_write     (m, port, value);
+  keyboard_io_write   (m, port, value);
+  pit_io_write        (m, port, value);
+  display_cga_io_write(m, port, value);
+  display_ega_io_write(m, port, value);
+
+  if ((int32_t)port == m->stop_port) {
+    m->stop_hit = true;
+    cpu_stop(m);
+  }
+}
+
+static uint8_t ega_mem_read(machine_t *m, uint32_t addr) {
+  return display_ega_mem_read(m, addr & 0x3fff);
+}
+
+static void ega_mem_write(machine_t *m, uint32_t addr, uint8_t data) {
+  display_ega_mem_write(m, addr & 0x3fff, data);
+}
+
+static uint8_t cga_mem_read(machine_t *m, uint32_t addr) {
+  return display_cga_mem_read(m, addr & 0x3fff);
+}
+
+static void cga_mem_write(machine_t *m, uint32_t addr, uint8_t data) {
+  display_cga_mem_write(m, addr & 0x3fff, data);
+}
+
+static void mem_map_ram(machine_t *m, uint32_t start, uint32_t size) {
+  for (uint32_t addr = start; addr < start + size; addr += MEM_PAGE_SIZE) {
+    mem_page_t* page = &m->mem_map[addr >> MEM_PAGE_BITS];
+    page->read     = m->memory + addr;
+    page->write    = m->memory + addr;
+    page->read_fn  = NULL;
+    page->write_fn = NULL;
+  }
+}
+
+static void mem_map_rom(machine_t *m, uint32_t start, uint32_t size) {
+  mem_map_ram(m, start, size);
+  for (uint32_t addr = start; addr < start + size; addr += MEM_PAGE_SIZE) {
+    m->mem_map[addr >> MEM_PAGE_BITS].write = NULL;
+  }
+}
+
+static void mem_map_device(machine_t *m, uint32_t start, uint32_t size,
+                           uint8_t (*read_fn)(machine_t*, uint32_t),
+                           void (*write_fn)(machine_t*, uint32_t, uint8_t)) {
+  for (uint32_t addr = start; addr < start + size; addr += MEM_PAGE_SIZE) {
+    mem_page_t* page = &m->mem_map[addr >> MEM_PAGE_BITS];
+    page->read     = NULL;
+    page->write    = NULL;
+    page->read_fn  = read_fn;
+    page->write_fn = write_fn;
+  }
+}
+
+static void mem_map_init(machine_t *m) {
+  mem_map_ram   (m, 0x00000, 0x100000);
+  mem_map_device(m, 0xA0000, 0x4000, ega_mem_read, ega_mem_write);
+  mem_map_device(m, 0xB8000, 0x8000, cga_mem_read, cga_mem_write);
+  mem_map_rom   (m, 0xC8000, 0x1000);  // disk rom
+  mem_map_rom   (m, 0xFE000, 0x2000);  // bios
+}
+
+uint8_t mem_read(machine_t *m, uint32_t addr) {
+  addr &= 0xfffff;
+  const mem_page_t* page = &m->mem_map[addr >> MEM_PAGE_BITS];
+
+  if (page->read) {
+    return page->read[addr & MEM_PAGE_MASK];
+  }
+  return page->read_fn(m, addr);
+}
+
+void mem_write(machine_t *m, uint32_t addr, uint8_t data) {
+  addr &= 0xfffff;
+  const mem_page_t* page = &m->mem_map[addr >> MEM_PAGE_BITS];
+
+  if (page->write) {
+    page->write[addr & MEM_PAGE_MASK] = data;
+  }
+  else if (page->write_fn) {
+    page->write_fn(m, addr, data);
+  }
+  // writes to rom are ignored
+}
+
+static bool load_hex(uint8_t *dst, uint32_t addr, const char* path, uint32_t max) {
+
+  FILE* fd = fopen(path, "r");
+  if (!fd) {
+    return false;
+  }
+
+  const uint32_t start = addr;
+
+  while (!feof(fd)) {
+
+    uint32_t value = 0;
+    if (!fscanf(fd, "%02x ", &value)) {
+      break;
+    }
+
+    dst[addr] = value & 0xff;
+    addr += 1;
+
+    if (0 == --max) {
+      break;
+    }
+  }
+
+  printf("'%s' loaded (%05xh..%05xh)\n", path, start, addr);
+
+  fclose(fd);
+  return true;
+}
+
+static bool load_bin(uint8_t* dst, uint32_t addr, const char* path, uint32_t max) {
+
+  const uint32_t top = 0x100000;
+
+  assert(addr < top);
+
+  FILE* fd = fopen(path, "rb");
+  if (!fd) {
+    return false;
+  }
+
+  fseek(fd, 0, SEEK_END);
+  const uint32_t size = ftell(fd);
+  fseek(fd, 0, SEEK_SET);
+
+  uint32_t end = addr + size;
+  if (end > top) {
+    end = top;
+  }
+  uint32_t todo = end - addr;
+  if (todo > max) todo = max;
+
+  fread(dst + addr, 1, todo, fd);
+
+  printf("'%s' loaded (%05xh..%05xh)\n", path, addr, end);
+
+  fclose(fd);
+  return true;
+}
+
+machine_t* machine_create(void) {
+
+  machine_t* m = calloc(1, sizeof(machine_t));
+  if (!m) {
+    return NULL;
+  }
+
+#if 0
+  for (uint32_t i = 0; i < 1024 * 1024; ++i) {
+    m->memory[i] = 0x90;
+  }
+#endif
+
+  m->cpu = cpu_create(m);
+  if (!m->cpu) {
+    free(m);
+    return NULL;
+  }
+
+  m->stop_port = -1;
+  m->stop_int  = -1;
+
+  cpu_init(m);
+  mem_map_init(m);
+  display_init(m);
+  disk_init(m);
+  serial_init(m);
+  pit_init(m);
+  return m;
+}
+
+void machine_destroy(machine_t *m) {
+  if (!m) {
+    return;
+  }
+  journal_close(m);
+  profiler_stop(m);
+  trace_close(m);
+  disk_close(m);
+  cpu_destroy(m->cpu);
+  free(m);
+}
+
+bool machine_load(machine_t *m, const char *bios, const char *rom, const char *disk) {
+
+  if (!load_hex(m->memory, 0xfe000, bios, 1024 * 8)) {
+    fprintf(stderr, "Unable to load BIOS!\n");
+    return false;
+  }
+
+  if (!load_hex(m->memory, 0xc8000, rom, 1024 * 4)) {
+    fprintf(stderr, "Unable to load ROM!\n");
+    return false;
+  }
+
+  if (!disk_load(m, disk)) {
+    fprintf(stderr, "Unable to load disk!\n");
+    return false;
+  }
+
+  m->memory[0x410] = 0b00101100;
+  m->memory[0x410] = 0b00000000;
+  return true;
+}
+
+bool machine_load_hex(machine_t *m, uint32_t addr, const char *path, uint32_t size) {
+  if (!load_hex(m->memory, addr, path, size)) {
+    return false;
+  }
+  cpu_invalidate(m, addr, size);  // may replace code the CPU has run
+  return true;
+}
+
+void machine_stop_at_ip(machine_t *m, uint16_t cs, uint16_t ip) {
+  m->stop_at_ip = true;
+  m->stop_cs    = cs;
+  m->stop_ip    = ip;
+}
+
+void machine_stop_at_port(machine_t *m, int32_t port) {
+  m->stop_port = port;
+}
+
+void machine_stop_at_int(machine_t *m, int32_t num) {
+  m->stop_int = num;
+}
+
+void machine_stop_at_cycle(machine_t *m, uint64_t cycle) {
+  m->stop_cycle = cycle;
+}
+
+void machine_stop_clear(machine_t *m) {
+  m->stop_at_ip = false;
+  m->stop_port  = -1;
+  m->stop_int   = -1;
+  m->stop_cycle = 0;
+  m->stop_hit   = false;
+}
+
+void machine_set_port_stub(machine_t *m, uint8_t (*read)(uint32_t port)) {
+  m->port_stub = read;
+}
+
+// Single step up to the cycle until, checking for the stop address and
+// counting every instruction of an exact profile.
+static void run_stepped(machine_t *m, uint64_t until) {
+  for (uint64_t now = cpu_get_cycles(m); now < until; now = cpu_get_cycles(m)) {
+    const uint16_t cs = cpu_get_CS(m);
+    const uint16_t ip = cpu_get_IP(m);
+    if (m->stop_at_ip && cs == m->stop_cs && ip == m->stop_ip) {
+      m->stop_hit = true;
+      return;
+    }
+    uint32_t cycles = cpu_step(m);
+    if (!cycles && cpu_halted(m)) {
+      cycles = cpu_run(m, (uint32_t)(until - now));  // sleep in HLT
+    }
+    profiler_count(m, cs, ip, cycles);
+    if (m->stop_hit) {
+      return;  // port write
+    }
+  }
+}
+
+bool machine_run_frame(machine_t *m) {
+
+  m->stop_hit = false;
+
+  // a frame cut short by a stop condition is finished first
+  if (cpu_get_cycles(m) >= m->frame_end) {
+    m->frame_end += DISPLAY_FRAME_CYCLES;
+    keyboard_poll(m);
+  }
+
+  // run one video frame of clock cycles, in chunks up to the next timer
+  // interrupt or replayed input
+  for (uint64_t now = cpu_get_cycles(m); now < m->frame_end; now = cpu_get_cycles(m)) {
+    if (m->stop_cycle && now >= m->stop_cycle) {
+      m->stop_hit = true;
+      return true;
+    }
+    journal_deliver(m);
+    profiler_sample(m);
+    if (pit_irq0(m, now)) {
+      cpu_interrupt(m, 0);
+    }
+    const uint64_t irq0   = pit_next_irq0(m);
+    const uint64_t next   = journal_next(m);
+    const uint64_t sample = profiler_next(m);
+    uint64_t       until  = (irq0 < m->frame_end) ? irq0 : m->frame_end;
+    if (next > now && next < until) {
+      until = next;
+    }
+    if (sample < until) {
+      until = sample;
+    }
+    if (m->stop_cycle && m->stop_cycle < until) {
+      until = m->stop_cycle;
+    }
+    if (m->stop_at_ip || profiler_exact(m)) {
+      run_stepped(m, until);
+    }
+    else {
+      cpu_run(m, (uint32_t)(until - now));
+    }
+    if (m->stop_hit) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "disk.h"
+#include "display.h"
+#include "journal.h"
+#include "keyboard.h"
+#include "pit.h"
+#include "profiler.h"
+#include "serial.h"
+#include "trace.h"
+
+
+// One emulated PC and everything it owns. Any number of machines can exist
+// in a process, each one must only be run by a single thread at a time.
+struct machine_t {
+  uint8_t    memory[1024 * 1024];
+  mem_page_t mem_map[MEM_PAGES];
+
+  cpu_t*     cpu;
+  display_t  display;
+  disk_t     disk;
+  uart_t     serial;
+  keyboard_t keyboard;
+  pit_t      pit;
+
+  uint64_t   frame_end;  // CPU clock cycle the current video frame ends at
+
+  journal_t* journal;    // inputs being recorded or replayed, see journal.h
+  profiler_t* profiler;  // guest code profile being taken, see profiler.h
+  trace_t*   trace;      // binary instruction trace, see trace.h
+
+  // machine_run_frame() returns early once one of these is hit, see
+  // machine_stop_at_ip(), machine_stop_at_port(), machine_stop_at_int() and
+  // machine_stop_at_cycle()
+  bool       stop_at_ip;
+  uint16_t   stop_cs;
+  uint16_t   stop_ip;
+  int32_t    stop_port;  // -1 for none
+  int32_t    stop_int;   // -1 for none
+  uint64_t   stop_cycle; // 0 for none
+  bool       stop_hit;
+
+  // answers every port read in place of the devices when set, see
+  // machine_set_port_stub()
+  uint8_t  (*port_stub)(uint32_t port);
+};
+
+// Returns a machine in its reset state, or NULL when out of memory.
+machine_t* machine_create (void);
+void       machine_destroy(machine_t *m);
+
+// Load the BIOS and disk ROM hex files and open the SD card image.
+bool machine_load(machine_t *m, const char *bios, const char *rom, const char *disk);
+// Load up to size bytes of a hex file, two digits per byte, into memory at
+// addr. ROM is written as well.
+bool machine_load_hex(machine_t *m, uint32_t addr, const char *path, uint32_t size);
+
+// Run one video frame worth of clock cycles, see DISPLAY_FRAME_CYCLES.
+// Returns true when it stopped early at a stop condition, the next call
+// then finishes the frame.
+bool machine_run_frame(machine_t *m);
+
+// Stop before the instruction at cs:ip is executed. The CPU is single
+// stepped while this is set.
+void machine_stop_at_ip   (machine_t *m, uint16_t cs, uint16_t ip);
+// Stop after a write to an I/O port, -1 to clear.
+void machine_stop_at_port (machine_t *m, int32_t port);
+// Stop once the CPU enters an interrupt, hardware or software, -1 to clear.
+void machine_stop_at_int  (machine_t *m, int32_t num);
+// Stop at the first instruction boundary at or after a clock cycle, 0 to
+// clear.
+void machine_stop_at_cycle(machine_t *m, uint64_t cycle);
+// Clear all stop conditions.
+void machine_stop_clear   (machine_t *m);
+
+// Answer port reads with read() instead of the devices, NULL to put them
+// back. For tests that need port input repeatable without device state.
+void machine_set_port_stub(machine_t *m, uint8_t (*read)(uint32_t port));
@@ -2,227 +2,308 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
-#include <assert.h>
+#include <string.h>
 
 #define _SDL_main_h
 #include <SDL.h>
 
-#include "cpu.h"
-#include "disk.h"
-#include "display.h"
-#include "keyboard.h"
-#include "serial.h"
-
-
-uint8_t memory[1024 * 1024];
-
-
-void int_notify(uint8_t num) {
-
-  if (num == 0x13) {
-
-    uint8_t ah = cpu_get_AH();
-    switch (ah) {
-    case 2:
-      break;
-    default:
-      break;
-      //printf("13h\n", ah);
-      //cpu_dump_state();
-    }
-  }
-
-  if (num == 0x10) {
-    if (cpu_get_AH() == 0) {
-      // video change mode
-      uint8_t mode = cpu_get_AL();
-      display_set_mode(mode);
-    }
-  }
-}
-
-uint8_t port_read(uint32_t port) {
-  port &= 0xfff;
-
-  if (port == 0xb8) {
-    return disk_spi_read();
-  }
-
-  if (port == 0xb9) {
-    return 0;  // SPI not busy
-  }
-
-  uint8_t out = 0;
-
-  if (serial_io_read(port, &out)) {
-    return out;
-  }
-  if (keyboard_io_read(port, &out)) {
-    return out;
-  }
-  if (display_cga_io_read(port, &out)) {
-    return out;
-  }
-  if (display_ega_io_read(port, &out)) {
-    return out;
+#include "machine.h"
+#include "snapshot.h"
+
+
+static uint8_t keyScanCode(int in) {
+  switch (in) {
+  case SDLK_ESCAPE:          return 0x01;
+  case SDLK_1:               return 0x02;
+  case SDLK_2:               return 0x03;
+  case SDLK_3:               return 0x04;
+  case SDLK_4:               return 0x05;
+  case SDLK_5:               return 0x06;
+  case SDLK_6:               return 0x07;
+  case SDLK_7:               return 0x08;
+  case SDLK_8:               return 0x09;
+  case SDLK_9:               return 0x0A;
+  case SDLK_0:               return 0x0B;
+  case SDLK_MINUS:           return 0x0C;
+  case SDLK_EQUALS:          return 0x0D;
+  case SDLK_BACKSPACE:       return 0x0E;
+  case SDLK_TAB:             return 0x0F;
+  case SDLK_q:               return 0x10;
+  case SDLK_w:               return 0x11;
+  case SDLK_e:               return 0x12;
+  case SDLK_r:               return 0x13;
+  case SDLK_t:               return 0x14;
+  case SDLK_y:               return 0x15;
+  case SDLK_u:               return 0x16;
+  case SDLK_i:               return 0x17;
+  case SDLK_o:               return 0x18;
+  case SDLK_p:               return 0x19;
+  case SDLK_LEFTBRACKET:     return 0x1A;
+  case SDLK_RIGHTBRACKET:    return 0x1B;
+  case SDLK_RETURN:          return 0x1C;
+  case SDLK_LCTRL:           return 0x1D;
+  case SDLK_a:               return 0x1E;
+  case SDLK_s:               return 0x1F;
+  case SDLK_d:               return 0x20;
+  case SDLK_f:               return 0x21;
+  case SDLK_g:               return 0x22;
+  case SDLK_h:               return 0x23;
+  case SDLK_j:               return 0x24;
+  case SDLK_k:               return 0x25;
+  case SDLK_l:               return 0x26;
+  case SDLK_SEMICOLON:       return 0x27;
+  case SDLK_AT:              return 0x28;
+  case SDLK_HASH:            return 0x29;
+  case SDLK_LSHIFT:          return 0x2A;
+  case SDLK_BACKSLASH:       return 0x2B;
+  case SDLK_z:               return 0x2C;
+  case SDLK_x:               return 0x2D;
+  case SDLK_c:               return 0x2E;
+  case SDLK_v:               return 0x2F;
+  case SDLK_b:               return 0x30;
+  case SDLK_n:               return 0x31;
+  case SDLK_m:               return 0x32;
+  case SDLK_COMMA:           return 0x33;
+  case SDLK_PERIOD:          return 0x34;
+  case SDLK_SLASH:           return 0x35;
+  case SDLK_RSHIFT:          return 0x36;
+  case SDLK_KP_MULTIPLY:     return 0x37;
+  case SDLK_LALT:            return 0x38;
+  case SDLK_SPACE:           return 0x39;
+  case SDLK_CAPSLOCK:        return 0x3A;
+  case SDLK_F1:              return 0x3B;
+  case SDLK_F2:              return 0x3C;
+  case SDLK_F3:              return 0x3D;
+  case SDLK_F4:              return 0x3E;
+  case SDLK_F5:              return 0x3F;
+  case SDLK_F6:              return 0x40;
+  case SDLK_F7:              return 0x41;
+  case SDLK_F8:              return 0x42;
+  case SDLK_F9:              return 0x43;
+  case SDLK_F10:             return 0x44;
+  case SDLK_NUMLOCK:         return 0x45;
+  case SDLK_SCROLLOCK:       return 0x46;
+  case SDLK_KP7:             return 0x47;
+  case SDLK_KP8:             return 0x48;
+  case SDLK_KP9:             return 0x49;
+  case SDLK_KP_MINUS:        return 0x4A;
+  case SDLK_KP4:             return 0x4B;
+  case SDLK_KP5:             return 0x4C;
+  case SDLK_KP6:             return 0x4D;
+  case SDLK_KP_PLUS:         return 0x4E;
+  case SDLK_KP1:             return 0x4F;
+  case SDLK_KP2:             return 0x50;
+  case SDLK_KP3:             return 0x51;
+  case SDLK_KP0:             return 0x52;
+  case SDLK_KP_PERIOD:       return 0x53;
+  case SDLK_PRINT:           return 0x54;
+    //  case SDLK_SLASH:           return 0x56;
+  case SDLK_F11:             return 0x57;
+  case SDLK_F12:             return 0x58;
+
+  case SDLK_LEFT:            return 0x4b;
+  case SDLK_RIGHT:           return 0x4d;
+  case SDLK_UP:              return 0x48;
+  case SDLK_DOWN:            return 0x50;
   }
   return 0;
 }
 
-void port_write(uint32_t port, uint8_t value) {
-  port &= 0xfff;
-
-  if (port == 0xb0) {
-    printf("----------------------------------------------------\n");
-    cpu_debug = 1;
-  }
-  if (port == 0xb2) {
-    cpu_debug = 0;
-  }
-  if (port == 0xb8) {
-    disk_spi_write(value);
-  }
-  if (port == 0xb9) {
-    disk_spi_ctrl(value);
-  }
-  if (port == 0xbc) {
-    // legacy
-    //disk_int13();
-  }
-  if (port == 0xbe) {
-    //cpu_dump_state();
-    //dump_sector();
-  }
-
-  serial_io_write     (port, value);
-  keyboard_io_write   (port, value);
-  display_cga_io_write(port, value);
-  display_ega_io_write(port, value);
-}
-
-uint8_t mem_read(uint32_t addr) {
-  addr &= 0xfffff;
-
-  if (addr >= 0xA0000 && addr < 0xA4000) {
-    return display_ega_mem_read(addr & 0x3fff);
+static void key_event(machine_t *m, SDL_Event* event) {
+  if (event->type == SDL_KEYDOWN) {
+    keyboard_scancode(m, 0x00 | keyScanCode(event->key.keysym.sym));
   }
-  if ((addr & 0xF8000) == 0xB8000) {
-    return display_cga_mem_read(addr & 0x3fff);
+  if (event->type == SDL_KEYUP) {
+    keyboard_scancode(m, 0x80 | keyScanCode(event->key.keysym.sym));
   }
-
-  return memory[addr];
 }
 
-void mem_write(uint32_t addr, uint8_t data) {
-  addr &= 0xfffff;
-  memory[addr] = data;
-
-  if (addr >= 0xA0000 && addr < 0xA4000) {
-    display_ega_mem_write(addr & 0x3fff, data);
-  }
-  if ((addr & 0xF8000) == 0xB8000) {
-    display_cga_mem_write(addr & 0x3fff, data);
-  }
-}
+int main(int argc, char** args) {
 
-static bool load_hex(uint8_t *dst, uint32_t addr, const char* path, uint32_t max) {
+  SDL_Init(SDL_INIT_VIDEO);
 
-  FILE* fd = fopen(path, "r");
-  if (!fd) {
-    return false;
+  machine_t* m = machine_create();
+  if (!m) {
+    return 1;
   }
 
-  const uint32_t start = addr;
-
-  while (!feof(fd)) {
+  const char* paths[] = {
+    "C:\\riscv\\iceXt\\misc\\BIOS\\pcxtbios.bin",
+    "C:\\riscv\\iceXt\\misc\\diskrom\\bin\\diskrom.hex",
+    "C:\\riscv\\iceXt\\misc\\dos-boot-2.img",
+  };
+  uint32_t numPaths = 0;
+
+  // run at the speed of the real machine when --realtime is given, sleeping
+  // while the guest waits in HLT, rather than as fast as the host can
+  bool realtime = false;
+
+  // snapshot to start from instead of booting, and to save on exit
+  const char* restorePath = NULL;
+  const char* savePath    = NULL;
+
+  // journal of the input to record, or to replay instead of taking input
+  const char* recordPath  = NULL;
+  const char* replayPath  = NULL;
+
+  // guest code profile to write on exit, to the file and <file>.folded,
+  // named after the labels of the listings given as FILE@ADDR
+  const char*  guestPath   = NULL;
+  uint32_t     guestPeriod = 1000;
+  const char** listings    = calloc(argc, sizeof(const char*));
+  uint32_t     numListings = 0;
+
+  // binary instruction trace, of everything or only while the guest has
+  // selected it with the debug ports
+  const char* tracePath  = NULL;
+  bool        traceGated = false;
+
+#ifdef CPU_PROFILE
+  // interpreter profile to write on exit, as a report or folded stacks
+  const char* profilePath = NULL;
+  bool        profileFolded = false;
+#endif
 
-    uint32_t value = 0;
-    if (!fscanf(fd, "%02x ", &value)) {
-      break;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(args[i], "--realtime") == 0) {
+      realtime = true;
+      continue;
     }
-
-    dst[addr] = value & 0xff;
-    addr += 1;
-
-    if (0 == --max) {
-      break;
+    // interpret everything, when the build has the translator
+    if (strcmp(args[i], "--no-jit") == 0) {
+      cpu_set_jit(m, false);
+      continue;
+    }
+    // CPU model, 80186 (the default) or v20
+    if (strcmp(args[i], "--cpu") == 0 && i + 1 < argc) {
+      const char* model = args[++i];
+      if (strcmp(model, "80186") == 0) {
+        cpu_set_model(m, CPU_80186);
+      }
+      else if (strcmp(model, "v20") == 0) {
+        cpu_set_model(m, CPU_V20);
+      }
+      else {
+        fprintf(stderr, "Unknown CPU model '%s'!\n", model);
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(args[i], "--restore") == 0 && i + 1 < argc) {
+      restorePath = args[++i];
+      continue;
+    }
+    if (strcmp(args[i], "--save") == 0 && i + 1 < argc) {
+      savePath = args[++i];
+      continue;
+    }
+    if (strcmp(args[i], "--record") == 0 && i + 1 < argc) {
+      recordPath = args[++i];
+      continue;
+    }
+    if (strcmp(args[i], "--replay") == 0 && i + 1 < argc) {
+      replayPath = args[++i];
+      continue;
+    }
+    if (strcmp(args[i], "--guest-profile") == 0 && i + 1 < argc) {
+      guestPath = args[++i];
+      continue;
+    }
+    if (strcmp(args[i], "--guest-period") == 0 && i + 1 < argc) {
+      guestPeriod = (uint32_t)strtoul(args[++i], NULL, 0);
+      continue;
+    }
+    if (strcmp(args[i], "--trace") == 0 && i + 1 < argc) {
+      tracePath = args[++i];
+      traceGated = false;
+      continue;
+    }
+    if (strcmp(args[i], "--trace-ports") == 0 && i + 1 < argc) {
+      tracePath = args[++i];
+      traceGated = true;
+      continue;
+    }
+    if (strcmp(args[i], "--symbols") == 0 && i + 1 < argc && strrchr(args[i + 1], '@')) {
+      listings[numListings++] = args[++i];
+      continue;
+    }
+#ifdef CPU_PROFILE
+    if (strcmp(args[i], "--profile") == 0 && i + 1 < argc) {
+      profilePath = args[++i];
+      profileFolded = false;
+      continue;
+    }
+    if (strcmp(args[i], "--profile-folded") == 0 && i + 1 < argc) {
+      profilePath = args[++i];
+      profileFolded = true;
+      continue;
+    }
+#endif
+    if (strncmp(args[i], "--", 2) == 0) {
+      fprintf(stderr, "Unknown option '%s'!\n", args[i]);
+      return 1;
+    }
+    if (numPaths < 3) {
+      paths[numPaths++] = args[i];
     }
   }
 
-  printf("'%s' loaded (%05xh..%05xh)\n", path, start, addr);
-
-  fclose(fd);
-  return true;
-}
-
-static bool load_bin(uint8_t* dst, uint32_t addr, const char* path, uint32_t max) {
-
-  const uint32_t top = 0x100000;
-
-  assert(addr < top);
-
-  FILE* fd = fopen(path, "rb");
-  if (!fd) {
-    return false;
+  if (replayPath && recordPath) {
+    fprintf(stderr, "--record and --replay can't be used together!\n");
+    return 1;
   }
 
-  fseek(fd, 0, SEEK_END);
-  const uint32_t size = ftell(fd);
-  fseek(fd, 0, SEEK_SET);
+  const char* biosPath = paths[0];
+  const char* romPath  = paths[1];
+  const char* diskPath = paths[2];
 
-  uint32_t end = addr + size;
-  if (end > top) {
-    end = top;
+  if (restorePath) {
+    // the BIOS and ROM come from the snapshot
+    if (!disk_load(m, diskPath)) {
+      fprintf(stderr, "Unable to load disk!\n");
+      return 1;
+    }
+    if (!snapshot_restore(m, restorePath)) {
+      fprintf(stderr, "Unable to restore '%s'!\n", restorePath);
+      return 1;
+    }
   }
-  uint32_t todo = end - addr;
-  if (todo > max) todo = max;
-
-  fread(dst + addr, 1, todo, fd);
-
-  printf("'%s' loaded (%05xh..%05xh)\n", path, addr, end);
-
-  fclose(fd);
-  return true;
-}
-
-int main(int argc, char** args) {
-
-  SDL_Init(SDL_INIT_VIDEO);
-
-#if 0
-  for (uint32_t i = 0; i < 1024 * 1024; ++i) {
-    memory[i] = 0x90;
+  else if (!machine_load(m, biosPath, romPath, diskPath)) {
+    return 1;
   }
-#endif
-
-  cpu_init();
-
-  const char* biosPath = argc >= 2 ? args[1] : "C:\\riscv\\iceXt\\misc\\BIOS\\pcxtbios.bin";
-  const char* romPath  = argc >= 3 ? args[2] : "C:\\riscv\\iceXt\\misc\\diskrom\\bin\\diskrom.hex";
-  const char* diskPath = argc >= 4 ? args[3] : "C:\\riscv\\iceXt\\misc\\dos-boot-2.img";
 
-  if (!load_hex(memory, 0xfe000, biosPath, 1024 * 8)) {
-    fprintf(stderr, "Unable to load BIOS!\n");
+  if (replayPath && !journal_replay(m, replayPath)) {
+    fprintf(stderr, "Unable to replay '%s'!\n", replayPath);
     return 1;
   }
-
-  if (!load_hex(memory, 0xc8000, romPath, 1024 * 4)) {
-    fprintf(stderr, "Unable to load ROM!\n");
+  if (recordPath && !journal_record(m, recordPath)) {
+    fprintf(stderr, "Unable to record '%s'!\n", recordPath);
     return 1;
   }
 
-  if (!disk_load(diskPath)) {
-    fprintf(stderr, "Unable to load disk!\n");
-    return 1;
+  if (guestPath && profiler_start(m, guestPeriod)) {
+    if (!numListings) {
+      profiler_default_symbols(m, biosPath, romPath);
+    }
+    for (uint32_t i = 0; i < numListings; ++i) {
+      const char* at = strrchr(listings[i], '@');
+      char path[1024];
+      snprintf(path, sizeof(path), "%.*s", (int)(at - listings[i]), listings[i]);
+      if (!profiler_symbols(m, path, (uint32_t)strtoul(at + 1, NULL, 16))) {
+        fprintf(stderr, "No labels in '%s'!\n", path);
+      }
+    }
   }
 
-  memory[0x410] = 0b00101100;
-  memory[0x410] = 0b00000000;
+  if (tracePath && !trace_open(m, tracePath, traceGated)) {
+    fprintf(stderr, "Unable to trace to '%s'!\n", tracePath);
+    return 1;
+  }
 
-  const uint32_t steps = 100000;
-  uint32_t irq0 = 0;
+  // host time in ms at which cycle 0 would have run
+  uint32_t realtime_base = SDL_GetTicks() - (uint32_t)(cpu_get_cycles(m) * 1000 / CPU_CLOCK);
 
-  SDL_Surface* screen = SDL_SetVideoMode(640, 400, 32, 0);
+  SDL_Surface* screen = SDL_SetVideoMode(DISPLAY_WIDTH, DISPLAY_HEIGHT, 32, 0);
   if (!screen) {
     return 1;
   }
@@ -236,29 +317,63 @@ int main(int argc, char** args) {
         active = false;
       }
       if (event.type == SDL_KEYDOWN) {
-        keyboard_key_event(&event);
+        key_event(m, &event);
       }
       if (event.type == SDL_KEYUP) {
-        keyboard_key_event(&event);
+        key_event(m, &event);
       }
     }
   
-    cpu_debug = false;
+    cpu_set_debug(m, false);
 
-    for (uint32_t i = 0; i < steps; ++i) {
+    machine_run_frame(m);
 
-      cpu_step();
+    display_draw(m, screen->pixels, screen->pitch / 4);
+    SDL_Flip(screen);
 
-      if (irq0++ >= 100000) {
-        cpu_interrupt(0);
-        irq0 = 0;
+    if (realtime) {
+      // sleep off the rest of the frame, which is nearly all of it when the
+      // guest is idle in HLT
+      const uint32_t due = realtime_base + (uint32_t)(cpu_get_cycles(m) * 1000 / CPU_CLOCK);
+      const int32_t  ahead = (int32_t)(due - SDL_GetTicks());
+      if (ahead > 0) {
+        SDL_Delay(ahead);
+      }
+      else if (ahead < -100) {
+        realtime_base -= ahead;  // fell behind, don't try to catch up
       }
     }
+  }
 
-    display_draw(screen);
-    SDL_Flip(screen);
+  if (savePath && !snapshot_save(m, savePath)) {
+    fprintf(stderr, "Unable to save '%s'!\n", savePath);
   }
 
+  if (guestPath) {
+    char folded[1024];
+    snprintf(folded, sizeof(folded), "%s.folded", guestPath);
+    if (!profiler_write(m, guestPath, false) || !profiler_write(m, folded, true)) {
+      fprintf(stderr, "Unable to write '%s'!\n", guestPath);
+    }
+  }
+  free(listings);
+
+#ifdef CPU_PROFILE
+  if (profilePath && !cpu_profile_write(m, profilePath, profileFolded)) {
+    fprintf(stderr, "Unable to write '%s'!\n", profilePath);
+  }
+#endif
+
+  if (!trace_close(m)) {
+    fprintf(stderr, "Unable to write '%s'!\n", tracePath);
+  }
+
+  const bool replayed = journal_close(m);
+  if (!replayed) {
+    fprintf(stderr, "The replay diverged from '%s'!\n", replayPath);
+  }
+
+  machine_destroy(m);
   SDL_Quit();
-  return 0;
+  return replayed ? 0 : 1;
 }
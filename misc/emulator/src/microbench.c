@@ -0,0 +1,522 @@
+// Microbenchmarks of single instruction classes and device paths, no SDL.
+//
+//   iceXtMicrobench [options] [case...]
+//
+// Instruction cases run a stream of one instruction sequence, repeated
+// and closed into a loop with a JMP, through cpu_run(). Device cases call
+// the device functions directly. Every case is calibrated to take about
+// BATCH_NS per batch, and the time per operation is reported as the mean
+// and standard deviation over BATCHES batches. A stream found outside its
+// loop after a batch, sent off by a trap say, fails with exit code 1.
+//
+// --save FILE stores the results as a baseline, --baseline FILE compares
+// against one and exits with 1 when a case got slower by more than the
+// threshold. Cases can be selected by giving a prefix of their names.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "machine.h"
+
+
+#define BATCHES   7
+#define BATCH_NS  20000000.0
+
+// times a sequence is repeated in the loop of an instruction stream
+#define STREAM_REPEAT 64
+
+#define STREAM_CS 0x1000
+#define INT_IRET  0x0500  // IRET the INT 80h vector points at
+
+#define MAX_CASES 128
+
+typedef struct case_t case_t;
+
+struct case_t {
+  char     name[32];
+  // Run about n operations, returns the number run.
+  uint64_t (*run)(machine_t *m, const case_t* c, uint64_t n);
+
+  // instruction sequence of a stream
+  uint8_t  code[8];
+  uint8_t  len;
+  uint8_t  insns;    // instructions it executes
+  uint16_t flags;
+
+  uint32_t arg;      // of a device case
+};
+
+typedef struct {
+  double mean;   // ns per operation
+  double stddev;
+  bool   failed; // an instruction stream left its loop
+} result_t;
+
+static double now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+//----------------------------------------------------------------
+// instruction streams
+
+// Registers point at scratch memory, SS:SP has room both ways and BX is
+// a non zero divisor.
+static void stream_reset(machine_t *m, const case_t* c) {
+  cpu_state_t s;
+  memset(&s, 0, sizeof(s));
+  s.regs[0] = 0x1234;  // AX
+  s.regs[3] = 0x0100;  // BX
+  s.regs[4] = 0x8000;  // SP
+  s.regs[5] = 0x0200;  // BP
+  s.regs[6] = 0x0010;  // SI
+  s.regs[7] = 0x0020;  // DI
+  s.segs[0] = 0x4000;  // ES
+  s.segs[1] = STREAM_CS;
+  s.segs[2] = 0x2000;  // SS
+  s.segs[3] = 0x3000;  // DS
+  s.pc      = 0;
+  s.flags   = 0x0002 | c->flags;
+  s.clock   = cpu_get_cycles(m);
+  cpu_set_state(m, &s);
+}
+
+static void stream_load(machine_t *m, const case_t* c) {
+  uint8_t* code = m->memory + STREAM_CS * 16;
+  uint32_t pos  = 0;
+  for (uint32_t i = 0; i < STREAM_REPEAT; ++i) {
+    memcpy(code + pos, c->code, c->len);
+    pos += c->len;
+  }
+  const uint16_t rel = (uint16_t)(0 - (pos + 3));
+  code[pos++] = 0xE9;  // JMP back to the start
+  code[pos++] = rel & 0xff;
+  code[pos++] = rel >> 8;
+
+  // INT 80h
+  m->memory[0x80 * 4 + 0] = INT_IRET & 0xff;
+  m->memory[0x80 * 4 + 1] = INT_IRET >> 8;
+  m->memory[0x80 * 4 + 2] = 0;
+  m->memory[0x80 * 4 + 3] = 0;
+  m->memory[INT_IRET]     = 0xCF;
+
+  stream_reset(m, c);
+}
+
+// Whether the CPU is still in the loop of a stream, or in the IRET of
+// INT 80h it calls.
+static bool in_stream(machine_t *m, const case_t* c) {
+  const uint16_t cs = cpu_get_CS(m);
+  const uint16_t ip = cpu_get_IP(m);
+  return (cs == STREAM_CS && ip < STREAM_REPEAT * c->len + 3) ||
+         (cs == 0 && ip == INT_IRET);
+}
+
+static uint64_t run_stream(machine_t *m, const case_t* c, uint64_t n) {
+  stream_reset(m, c);
+  const uint64_t start = cpu_get_instructions(m);
+  uint64_t budget = n * 4;  // clock cycles, any rough guess does
+  while (budget) {
+    const uint32_t chunk = budget < (1u << 30) ? (uint32_t)budget : (1u << 30);
+    cpu_run(m, chunk);
+    budget -= chunk;
+  }
+  const uint64_t insns = cpu_get_instructions(m) - start;
+  const uint64_t loop  = STREAM_REPEAT * c->insns + 1;
+  return insns * STREAM_REPEAT / loop;
+}
+
+//----------------------------------------------------------------
+// device paths
+
+static uint64_t run_ega_write(machine_t *m, const case_t* c, uint64_t n) {
+  display_t* d = &m->display;
+  d->p3CE_5 = (uint8_t)c->arg;  // write mode
+  d->p3CE_8 = 0xff;             // bit mask
+  d->p3C4_2 = 0x0f;             // map mask
+  for (uint64_t i = 0; i < n; ++i) {
+    display_ega_mem_write(m, (uint32_t)i & 0x3fff, (uint8_t)i);
+  }
+  return n;
+}
+
+// Bytes of a SPI transfer, CMD17 reads of sector arg back to back.
+static uint64_t run_spi_read(machine_t *m, const case_t* c, uint64_t n) {
+  const uint8_t cmd17[] = {
+    0x51, c->arg >> 24, (c->arg >> 16) & 0xff, (c->arg >> 8) & 0xff, c->arg & 0xff, 0xff
+  };
+  disk_spi_ctrl(m, 0);
+  uint64_t i = 0;
+  while (i < n) {
+    for (uint32_t j = 0; j < sizeof(cmd17); ++j, ++i) {
+      disk_spi_write(m, cmd17[j]);
+    }
+    for (uint32_t j = 0; j < 512 + 8; ++j, ++i) {
+      disk_spi_write(m, 0xff);
+    }
+  }
+  return i;
+}
+
+// Bytes of arg sent with no command going on.
+static uint64_t run_spi_idle(machine_t *m, const case_t* c, uint64_t n) {
+  disk_spi_ctrl(m, 0);
+  for (uint64_t i = 0; i < n; ++i) {
+    disk_spi_write(m, (uint8_t)c->arg);
+  }
+  return n;
+}
+
+static uint64_t run_port_read(machine_t *m, const case_t* c, uint64_t n) {
+  volatile uint8_t sink = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    sink += port_read(m, c->arg);
+  }
+  (void)sink;
+  return n;
+}
+
+static uint64_t run_draw(machine_t *m, const case_t* c, uint64_t n) {
+  static uint32_t pixels[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+  m->display.display_mode = (uint8_t)c->arg;
+  for (uint64_t i = 0; i < n; ++i) {
+    display_draw(m, pixels, DISPLAY_WIDTH);
+  }
+  return n;
+}
+
+//----------------------------------------------------------------
+// cases
+
+static case_t   cases[MAX_CASES];
+static uint32_t num_cases;
+
+static case_t* add_case(const char* name, uint64_t (*run)(machine_t*, const case_t*, uint64_t)) {
+  case_t* c = &cases[num_cases++];
+  memset(c, 0, sizeof(*c));
+  snprintf(c->name, sizeof(c->name), "%s", name);
+  c->run = run;
+  return c;
+}
+
+// An instruction stream of the given bytes, insns instructions long.
+static void add_stream(const char* name, uint8_t insns, uint16_t flags,
+                       const uint8_t* code, uint8_t len) {
+  case_t* c = add_case(name, run_stream);
+  memcpy(c->code, code, len);
+  c->len   = len;
+  c->insns = insns;
+  c->flags = flags;
+}
+
+#define STREAM(name, insns, flags, ...)                                       \
+  do {                                                                        \
+    static const uint8_t code[] = { __VA_ARGS__ };                            \
+    add_stream(name, insns, flags, code, sizeof(code));                       \
+  } while (0)
+
+#define FLAG_ZF 0x0040
+
+static void add_cases(void) {
+  STREAM("alu_rr_add",       1, 0,       0x01, 0xD8);        // ADD AX, BX
+  STREAM("alu_rr_adc",       1, 0,       0x11, 0xD8);        // ADC AX, BX
+  STREAM("alu_rr_cmp",       1, 0,       0x39, 0xD8);        // CMP AX, BX
+  STREAM("alu_ri_and",       1, 0,       0x25, 0xFF, 0x0F);  // AND AX, 0FFFh
+  STREAM("alu_mr_add",       1, 0,       0x01, 0x07);        // ADD [BX], AX
+  STREAM("inc_r",            1, 0,       0x40);              // INC AX
+  STREAM("mov_rr",           1, 0,       0x89, 0xD8);        // MOV AX, BX
+
+  // MOV AX, r/m for each addressing mode
+  static const char* const rm_names[8] = {
+    "bx_si", "bx_di", "bp_si", "bp_di", "si", "di", "bp", "bx",
+  };
+  for (uint8_t mod = 0; mod < 3; ++mod) {
+    for (uint8_t rm = 0; rm < 8; ++rm) {
+      char name[32];
+      uint8_t code[4] = { 0x8B, (uint8_t)((mod << 6) | rm), 0x04, 0x00 };
+      uint8_t len = 2 + mod;
+      if (mod == 0 && rm == 6) {
+        snprintf(name, sizeof(name), "modrm_disp16");
+        len = 4;
+      }
+      else {
+        snprintf(name, sizeof(name), "modrm_%s%s", rm_names[rm],
+                 mod == 1 ? "_d8" : mod == 2 ? "_d16" : "");
+      }
+      add_stream(name, 1, 0, code, len);
+    }
+  }
+
+  STREAM("push_pop",         2, 0,       0x50, 0x58);        // PUSH AX, POP AX
+  STREAM("push_pop_sreg",    2, 0,       0x1E, 0x1F);        // PUSH DS, POP DS
+  STREAM("jcc_taken",        1, FLAG_ZF, 0x74, 0x00);        // JZ $+2
+  STREAM("jcc_not_taken",    1, 0,       0x74, 0x00);
+  STREAM("loop",             2, 0,       0xB9, 0x02, 0x00,   // MOV CX, 2
+                                         0xE2, 0x00);        // LOOP $+2
+
+  STREAM("movsb",            1, 0,       0xA4);
+  STREAM("movsw",            1, 0,       0xA5);
+  STREAM("stosw",            1, 0,       0xAB);
+  STREAM("lodsw",            1, 0,       0xAD);
+  STREAM("cmpsw",            1, 0,       0xA7);
+  STREAM("scasw",            1, 0,       0xAF);
+  STREAM("rep_movsw_64",     2, 0,       0xB9, 0x40, 0x00,   // MOV CX, 64
+                                         0xF3, 0xA5);        // REP MOVSW
+  STREAM("rep_stosw_64",     2, 0,       0xB9, 0x40, 0x00,
+                                         0xF3, 0xAB);        // REP STOSW
+  STREAM("repe_cmpsw_64",    2, 0,       0xB9, 0x40, 0x00,
+                                         0xF3, 0xA7);        // REPE CMPSW
+  STREAM("repne_scasw_64",   2, 0,       0xB9, 0x40, 0x00,
+                                         0xF2, 0xAF);        // REPNE SCASW
+
+  STREAM("mul16",            1, 0,       0xF7, 0xE3);        // MUL BX
+  STREAM("imul16",           1, 0,       0xF7, 0xEB);        // IMUL BX
+  STREAM("div16",            2, 0,       0x31, 0xD2,         // XOR DX, DX
+                                         0xF7, 0xF3);        // DIV BX
+  STREAM("div8",             2, 0,       0xB8, 0xFF, 0x00,   // MOV AX, 255
+                                         0xF6, 0xF7);        // DIV BH
+  STREAM("int_iret",         2, 0,       0xCD, 0x80);        // INT 80h, IRET
+
+  for (uint32_t mode = 0; mode < 4; ++mode) {
+    char name[32];
+    snprintf(name, sizeof(name), "ega_write_mode%u", mode);
+    add_case(name, run_ega_write)->arg = mode;
+  }
+  add_case("spi_write_read", run_spi_read)->arg = 0;
+  add_case("spi_write_idle", run_spi_idle)->arg = 0xff;
+  add_case("port_read_kbd",  run_port_read)->arg = 0x60;
+  add_case("port_read_pit",  run_port_read)->arg = 0x40;
+  add_case("port_read_cga",  run_port_read)->arg = 0x3DA;
+  add_case("port_read_none", run_port_read)->arg = 0x300;
+  add_case("draw_cga_txt",   run_draw)->arg = 3;
+  add_case("draw_ega_gfx",   run_draw)->arg = 0xd;
+}
+
+//----------------------------------------------------------------
+
+static result_t measure(machine_t *m, const case_t* c) {
+  if (c->run == run_stream) {
+    stream_load(m, c);
+  }
+
+  result_t r;
+  memset(&r, 0, sizeof(r));
+
+  // double n until a batch takes long enough
+  uint64_t n = 16;
+  for (;;) {
+    const double   start = now_ns();
+    const uint64_t ops   = c->run(m, c, n);
+    const double   ns    = now_ns() - start;
+    if (c->run == run_stream && !in_stream(m, c)) {
+      r.failed = true;
+      return r;
+    }
+    if (ns >= BATCH_NS / 4 || n >= (1ull << 40)) {
+      n = (uint64_t)(n * (BATCH_NS / (ns > 1 ? ns : 1)));
+      n = n ? n : 1;
+      (void)ops;
+      break;
+    }
+    n *= 2;
+  }
+
+  double samples[BATCHES];
+  double sum = 0;
+  for (uint32_t i = 0; i < BATCHES; ++i) {
+    const double   start = now_ns();
+    const uint64_t ops   = c->run(m, c, n);
+    samples[i] = (now_ns() - start) / (ops ? ops : 1);
+    if (c->run == run_stream && !in_stream(m, c)) {
+      r.failed = true;
+      return r;
+    }
+    sum += samples[i];
+  }
+  r.mean = sum / BATCHES;
+  double var = 0;
+  for (uint32_t i = 0; i < BATCHES; ++i) {
+    var += (samples[i] - r.mean) * (samples[i] - r.mean);
+  }
+  r.stddev = sqrt(var / (BATCHES - 1));
+  return r;
+}
+
+// Returns the baseline of a case, or a negative value when there is none.
+static double baseline_of(FILE* fd, const char* name) {
+  if (!fd) {
+    return -1;
+  }
+  rewind(fd);
+  char   line[256];
+  char   key[64];
+  double ns = 0;
+  while (fgets(line, sizeof(line), fd)) {
+    if (sscanf(line, "%63s %lf", key, &ns) == 2 && strcmp(key, name) == 0) {
+      return ns;
+    }
+  }
+  return -1;
+}
+
+// A scratch disk image of 64 sectors for the SPI cases.
+static bool make_disk(machine_t *m, char* path, size_t size) {
+  snprintf(path, size, "/tmp/iceXtMicrobench.XXXXXX");
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    return false;
+  }
+  uint8_t sector[512];
+  for (uint32_t i = 0; i < sizeof(sector); ++i) {
+    sector[i] = (uint8_t)i;
+  }
+  bool ok = true;
+  for (uint32_t i = 0; i < 64; ++i) {
+    ok &= write(fd, sector, sizeof(sector)) == sizeof(sector);
+  }
+  close(fd);
+  return ok && disk_load(m, path);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: iceXtMicrobench [options] [case...]\n"
+    "  --no-jit          interpret everything\n"
+    "  --save FILE       store the results as a baseline\n"
+    "  --baseline FILE   compare against a baseline\n"
+    "  --threshold PCT   slowdown reported as a regression (default 10)\n"
+    "  --list            list the cases\n");
+}
+
+int main(int argc, char** args) {
+
+  add_cases();
+
+  bool        jit       = true;
+  const char* save      = NULL;
+  const char* base      = NULL;
+  double      threshold = 10.0;
+
+  const char** prefixes = calloc(argc, sizeof(const char*));
+  uint32_t numPrefixes = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(args[i], "--no-jit") == 0) {
+      jit = false;
+      continue;
+    }
+    if (strcmp(args[i], "--save") == 0 && has_value) {
+      save = args[++i];
+      continue;
+    }
+    if (strcmp(args[i], "--baseline") == 0 && has_value) {
+      base = args[++i];
+      continue;
+    }
+    if (strcmp(args[i], "--threshold") == 0 && has_value) {
+      threshold = atof(args[++i]);
+      continue;
+    }
+    if (strcmp(args[i], "--list") == 0) {
+      for (uint32_t c = 0; c < num_cases; ++c) {
+        printf("%s\n", cases[c].name);
+      }
+      return 0;
+    }
+    if (strncmp(args[i], "--", 2) == 0) {
+      fprintf(stderr, "Unknown option '%s'!\n", args[i]);
+      usage();
+      return 1;
+    }
+    prefixes[numPrefixes++] = args[i];
+  }
+
+  machine_t* m = machine_create();
+  if (!m) {
+    return 1;
+  }
+  cpu_set_jit(m, jit);
+
+  char disk[64];
+  if (!make_disk(m, disk, sizeof(disk))) {
+    fprintf(stderr, "Unable to create a scratch disk!\n");
+    return 1;
+  }
+
+  FILE* baseline = NULL;
+  if (base && !(baseline = fopen(base, "r"))) {
+    fprintf(stderr, "Unable to open '%s'!\n", base);
+    return 1;
+  }
+  FILE* out = NULL;
+  if (save && !(out = fopen(save, "w"))) {
+    fprintf(stderr, "Unable to create '%s'!\n", save);
+    return 1;
+  }
+
+  printf("%-20s %10s %8s %10s %8s\n", "case", "ns/op", "stddev", "baseline", "change");
+
+  uint32_t regressed = 0;
+  uint32_t failed    = 0;
+  for (uint32_t i = 0; i < num_cases; ++i) {
+    const case_t* c = &cases[i];
+
+    bool selected = numPrefixes == 0;
+    for (uint32_t p = 0; p < numPrefixes; ++p) {
+      selected |= strncmp(c->name, prefixes[p], strlen(prefixes[p])) == 0;
+    }
+    if (!selected) {
+      continue;
+    }
+
+    const result_t r = measure(m, c);
+    if (r.failed) {
+      printf("%-20s FAILED, left its loop\n", c->name);
+      fflush(stdout);
+      failed += 1;
+      continue;
+    }
+    printf("%-20s %10.2f %8.2f", c->name, r.mean, r.stddev);
+
+    const double b = baseline_of(baseline, c->name);
+    if (b > 0) {
+      const double change = (r.mean - b) * 100.0 / b;
+      const bool   slower = change > threshold;
+      printf(" %10.2f %+7.1f%%%s", b, change, slower ? "  REGRESSED" : "");
+      regressed += slower;
+    }
+    printf("\n");
+    fflush(stdout);
+
+    if (out) {
+      fprintf(out, "%s %.3f %.3f\n", c->name, r.mean, r.stddev);
+    }
+  }
+
+  if (out) {
+    fclose(out);
+  }
+  if (baseline) {
+    fclose(baseline);
+  }
+  machine_destroy(m);
+  remove(disk);
+  free(prefixes);
+
+  if (regressed) {
+    printf("%u cases regressed by more than %.0f%%\n", regressed, threshold);
+  }
+  if (failed) {
+    printf("%u cases failed\n", failed);
+  }
+  return (regressed || failed) ? 1 : 0;
+}
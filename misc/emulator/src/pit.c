@@ -0,0 +1,167 @@
+#include "pit.h"
+#include "machine.h"
+
+
+// 8253 timer channels 0 and 2 as in gateware/chipset/pit.v, channel 0
+// drives IRQ0. The counters are not stepped one tick at a time, their value
+// is worked out from the CPU clock cycles passed since they were loaded.
+
+// reset state of the gateware, mode 0 counting down from 0x20
+static const pit_t pit_reset = {
+  {
+    { 0x20, 0, 3, false, 0, false, 0, true, 0 },
+    { 0x20, 0, 3, false, 0, false, 0, false, 0 },
+    { 0x20, 0, 3, false, 0, false, 0, true, 0 },
+  },
+  0x20,
+};
+
+void pit_init(machine_t *m) {
+  m->pit = pit_reset;
+}
+
+
+static uint64_t cycles_to_ticks(uint64_t cycles) {
+  return (cycles / CPU_CLOCK) * PIT_CLOCK +
+         (cycles % CPU_CLOCK) * PIT_CLOCK / CPU_CLOCK;
+}
+
+// first CPU clock cycle at or after a timer tick
+static uint64_t ticks_to_cycles(uint64_t ticks) {
+  return (ticks / PIT_CLOCK) * CPU_CLOCK +
+         ((ticks % PIT_CLOCK) * CPU_CLOCK + PIT_CLOCK - 1) / PIT_CLOCK;
+}
+
+static uint16_t pit_value(machine_t *m, const pit_counter_t* c) {
+  if (!c->running) {
+    return c->reload;
+  }
+  const uint64_t elapsed = cycles_to_ticks(cpu_get_cycles(m)) - c->start;
+  switch (c->mode) {
+  case 2:
+    return c->reload - (elapsed % c->reload);
+  case 3: {
+    // counts down by two, twice per period
+    const uint32_t half = (c->reload + 1) / 2;
+    return c->reload - 2 * ((elapsed % c->reload) % half);
+  }
+  default:
+    return c->reload - elapsed;  // wraps around after reaching 0
+  }
+}
+
+static void pit_load(machine_t *m, uint8_t index, uint16_t value) {
+  pit_counter_t* c = &m->pit.counter[index];
+  c->reload  = value ? value : 0x10000;
+  c->running = true;
+  c->start   = cycles_to_ticks(cpu_get_cycles(m));
+  if (index == 0) {
+    m->pit.irq0_tick = c->start + c->reload;
+  }
+}
+
+static void pit_control(machine_t *m, uint8_t data) {
+  const uint8_t index = data >> 6;
+  if (index == 3) {
+    return;  // 8254 read back command
+  }
+  pit_counter_t* c = &m->pit.counter[index];
+  const uint8_t access = (data >> 4) & 3;
+  if (access == 0) {
+    // counter latch command
+    if (!c->latched) {
+      c->latch   = pit_value(m, c);
+      c->latched = true;
+    }
+    return;
+  }
+  c->access  = access;
+  c->mode    = (data >> 1) & 7;
+  if (c->mode >= 6) {
+    c->mode -= 4;  // modes 6 and 7 are 2 and 3
+  }
+  c->msb     = (access == 2);
+  c->latched = false;
+  c->running = false;  // until the new count is written
+  if (index == 0) {
+    m->pit.irq0_tick = UINT64_MAX;
+  }
+}
+
+void pit_io_write(machine_t *m, uint16_t port, uint8_t data) {
+  if (port < 0x40 || port > 0x43) {
+    return;
+  }
+  if (port == 0x43) {
+    pit_control(m, data);
+    return;
+  }
+  const uint8_t index = port - 0x40;
+  pit_counter_t* c = &m->pit.counter[index];
+  switch (c->access) {
+  case 1:
+    pit_load(m, index, data);
+    break;
+  case 2:
+    pit_load(m, index, data << 8);
+    break;
+  case 3:
+    if (!c->msb) {
+      c->low = data;
+      c->msb = true;
+    } else {
+      c->msb = false;
+      pit_load(m, index, c->low | (data << 8));
+    }
+    break;
+  }
+}
+
+bool pit_io_read(machine_t *m, uint16_t port, uint8_t *out) {
+  if (port < 0x40 || port > 0x43) {
+    return false;
+  }
+  if (port == 0x43) {
+    *out = 0;
+    return true;
+  }
+  pit_counter_t* c = &m->pit.counter[port - 0x40];
+  const uint16_t value = c->latched ? c->latch : pit_value(m, c);
+  switch (c->access) {
+  case 1:
+    *out = value & 0xff;
+    c->latched = false;
+    break;
+  case 2:
+    *out = value >> 8;
+    c->latched = false;
+    break;
+  case 3:
+    *out = c->msb ? (value >> 8) : (value & 0xff);
+    c->latched &= !c->msb;
+    c->msb = !c->msb;
+    break;
+  }
+  return true;
+}
+
+bool pit_irq0(machine_t *m, uint64_t cycles) {
+  pit_t* pit = &m->pit;
+  const uint64_t now = cycles_to_ticks(cycles);
+  if (now < pit->irq0_tick) {
+    return false;
+  }
+  const pit_counter_t* c = &pit->counter[0];
+  if (c->mode == 2 || c->mode == 3) {
+    // edges missed in between are lost, as with the edge triggered PIC
+    pit->irq0_tick += c->reload * ((now - pit->irq0_tick) / c->reload + 1);
+  } else {
+    pit->irq0_tick = UINT64_MAX;  // one shot
+  }
+  return true;
+}
+
+uint64_t pit_next_irq0(machine_t *m) {
+  const uint64_t tick = m->pit.irq0_tick;
+  return (tick == UINT64_MAX) ? UINT64_MAX : ticks_to_cycles(tick);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+
+
+#define PIT_CLOCK 1193182
+
+typedef struct {
+  uint32_t reload;   // period in timer ticks, a reload of 0 is 65536
+  uint8_t  mode;     // counter mode 0, 2 or 3
+  uint8_t  access;   // 1 LSB, 2 MSB, 3 LSB then MSB
+  bool     msb;      // next byte accessed is the MSB
+  uint8_t  low;      // LSB written, waiting for the MSB
+  bool     latched;
+  uint16_t latch;
+  bool     running;
+  uint64_t start;    // timer tick the counter was loaded at
+} pit_counter_t;
+
+typedef struct {
+  pit_counter_t counter[3];
+  uint64_t      irq0_tick;  // timer tick of the next channel 0 edge
+} pit_t;
+
+void pit_init(machine_t *m);
+
+void pit_io_write(machine_t *m, uint16_t port, uint8_t data);
+bool pit_io_read (machine_t *m, uint16_t port, uint8_t *out);
+
+// Returns true when the channel 0 output has risen since the last call,
+// given the current CPU clock cycle count.
+bool     pit_irq0     (machine_t *m, uint64_t cycles);
+// CPU clock cycle the next channel 0 rising edge is due at, or UINT64_MAX.
+uint64_t pit_next_irq0(machine_t *m);
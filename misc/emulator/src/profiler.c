@@ -0,0 +1,761 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "machine.h"
+
+
+#define MAX_DEPTH   16  // frames of a call stack
+#define SCAN_WORDS  64  // stack words scanned for return addresses
+#define MAX_PENDING 8   // labels of a listing waiting for their address
+#define MAX_LABEL   48  // label of a listing, longer ones are shortened
+#define MAX_NAME    (2 * MAX_LABEL)  // a NASM .local label with its global one
+
+typedef struct {
+  uint32_t addr;    // linear
+  uint32_t end;     // end of the code of its listing
+  bool     global;  // not a NASM .local label
+  char     name[MAX_NAME];
+} symbol_t;
+
+typedef struct {
+  uint32_t frames[MAX_DEPTH];  // cs << 16 | ip, the innermost first
+  uint32_t depth;              // 0 when the slot is free
+  uint64_t count;              // samples or block executions
+  uint64_t cycles;
+} call_stack_t;
+
+typedef struct {
+  uint32_t start;  // cs << 16 | ip of its first instruction
+  bool     used;
+  uint64_t executions;
+  uint64_t instructions;
+  uint64_t cycles;
+} block_t;
+
+struct profiler_t {
+  uint32_t      period;  // clock cycles between samples, 0 when exact
+  uint64_t      next;    // clock cycle of the next sample
+  uint64_t      last;    // clock cycle of the previous sample
+  uint64_t      samples;
+  uint64_t      cycles;  // profiled
+
+  symbol_t*     symbols;
+  uint32_t      num_symbols;
+  uint32_t      max_symbols;
+  bool          sorted;
+
+  call_stack_t* stacks;  // open addressing, a power of two slots
+  uint32_t      stacks_size;
+  uint32_t      stacks_used;
+
+  block_t*      blocks;
+  uint32_t      blocks_size;
+  uint32_t      blocks_used;
+
+  // basic block being executed when exact
+  bool          in_block;
+  bool          transfer;  // the last instruction may not have fallen through
+  call_stack_t  block;     // its call stack, frames[0] is its start
+  uint64_t      block_instructions;
+  uint64_t      block_cycles;
+};
+
+static inline uint32_t linear(uint32_t frame) {
+  return cpu_get_address(frame >> 16, frame & 0xffff);
+}
+
+//----------------------------------------------------------------
+// guest memory, without touching memory mapped devices
+
+static uint8_t peek(machine_t *m, uint16_t seg, uint16_t off) {
+  const uint32_t    addr = cpu_get_address(seg, off);
+  const mem_page_t* page = &m->mem_map[addr >> MEM_PAGE_BITS];
+  return page->read ? page->read[addr & MEM_PAGE_MASK] : 0;
+}
+
+static uint16_t peekw(machine_t *m, uint16_t seg, uint16_t off) {
+  return peek(m, seg, off) | (peek(m, seg, (uint16_t)(off + 1)) << 8);
+}
+
+// True when an FF /reg instruction, CALL or CALL FAR, ends at seg:off.
+static bool ff_call_before(machine_t *m, uint16_t seg, uint16_t off, uint8_t reg) {
+  for (uint16_t len = 2; len <= 4; ++len) {
+    if (peek(m, seg, (uint16_t)(off - len)) != 0xFF) {
+      continue;
+    }
+    const uint8_t modrm = peek(m, seg, (uint16_t)(off - len + 1));
+    const uint8_t mod   = modrm >> 6;
+    if (((modrm >> 3) & 7) != reg) {
+      continue;
+    }
+    const uint16_t disp = (mod == 1) ? 1 :
+                          (mod == 2 || (mod == 0 && (modrm & 7) == 6)) ? 2 : 0;
+    if (mod == 3 ? (len == 2) : (len == 2 + disp)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// True when seg:off is where a near call, or a far call or INT when far,
+// returns to.
+static bool call_before(machine_t *m, uint16_t seg, uint16_t off, bool far) {
+  if (!far) {
+    return peek(m, seg, (uint16_t)(off - 3)) == 0xE8 || ff_call_before(m, seg, off, 2);
+  }
+  return peek(m, seg, (uint16_t)(off - 5)) == 0x9A ||
+         peek(m, seg, (uint16_t)(off - 2)) == 0xCD ||
+         peek(m, seg, (uint16_t)(off - 1)) == 0xCC ||
+         ff_call_before(m, seg, off, 3);
+}
+
+// Call stack of the code at cs:ip into frames, returns its depth.
+static uint32_t walk(machine_t *m, uint16_t cs, uint16_t ip, uint32_t* frames) {
+  uint32_t depth = 0;
+  frames[depth++] = (cs << 16) | ip;
+
+  const uint16_t ss = cpu_get_SS(m);
+  const uint16_t sp = cpu_get_SP(m);
+
+  // BP chain of near frames set up by push bp; mov bp, sp
+  uint16_t bp = cpu_get_BP(m);
+  while (depth < MAX_DEPTH && bp >= sp && !(bp & 1) && bp <= 0xfffc) {
+    const uint16_t ret = peekw(m, ss, bp + 2);
+    const uint16_t up  = peekw(m, ss, bp);
+    if (!call_before(m, cs, ret, false)) {
+      break;
+    }
+    frames[depth++] = (cs << 16) | ret;
+    if (up <= bp) {
+      break;
+    }
+    bp = up;
+  }
+  if (depth > 1) {
+    return depth;
+  }
+
+  // no frames, scan the stack for return addresses
+  uint32_t off = sp;
+  for (uint32_t i = 0; i < SCAN_WORDS && depth < MAX_DEPTH && off <= 0xfffe; ++i, off += 2) {
+    const uint16_t ret = peekw(m, ss, (uint16_t)off);
+    const uint16_t seg = peekw(m, ss, (uint16_t)(off + 2));
+    if (off <= 0xfffc && call_before(m, seg, ret, true)) {
+      frames[depth++] = (seg << 16) | ret;
+      cs   = seg;
+      off += 2;
+      continue;
+    }
+    if (call_before(m, cs, ret, false)) {
+      frames[depth++] = (cs << 16) | ret;
+    }
+  }
+  return depth;
+}
+
+//----------------------------------------------------------------
+// tables
+
+static uint32_t hash32(uint32_t h, uint32_t v) {
+  return (h ^ v) * 0x01000193u;
+}
+
+static uint32_t stack_hash(const call_stack_t* s) {
+  uint32_t h = 0x811c9dc5u;
+  for (uint32_t i = 0; i < s->depth; ++i) {
+    h = hash32(h, s->frames[i]);
+  }
+  return h;
+}
+
+static call_stack_t* stack_slot(call_stack_t* table, uint32_t size, const call_stack_t* s) {
+  uint32_t i = stack_hash(s) & (size - 1);
+  while (table[i].depth &&
+         (table[i].depth != s->depth ||
+          memcmp(table[i].frames, s->frames, s->depth * sizeof(uint32_t)))) {
+    i = (i + 1) & (size - 1);
+  }
+  return &table[i];
+}
+
+static bool add_stack(profiler_t* p, const call_stack_t* s, uint64_t count, uint64_t cycles) {
+  if ((p->stacks_used + 1) * 2 > p->stacks_size) {
+    const uint32_t size  = p->stacks_size ? p->stacks_size * 2 : 1024;
+    call_stack_t*  table = calloc(size, sizeof(call_stack_t));
+    if (!table) {
+      return false;
+    }
+    for (uint32_t i = 0; i < p->stacks_size; ++i) {
+      if (p->stacks[i].depth) {
+        *stack_slot(table, size, &p->stacks[i]) = p->stacks[i];
+      }
+    }
+    free(p->stacks);
+    p->stacks      = table;
+    p->stacks_size = size;
+  }
+  call_stack_t* slot = stack_slot(p->stacks, p->stacks_size, s);
+  if (!slot->depth) {
+    memcpy(slot->frames, s->frames, s->depth * sizeof(uint32_t));
+    slot->depth = s->depth;
+    p->stacks_used += 1;
+  }
+  slot->count  += count;
+  slot->cycles += cycles;
+  return true;
+}
+
+static block_t* block_slot(block_t* table, uint32_t size, uint32_t start) {
+  uint32_t i = hash32(0x811c9dc5u, start) & (size - 1);
+  while (table[i].used && table[i].start != start) {
+    i = (i + 1) & (size - 1);
+  }
+  return &table[i];
+}
+
+static bool add_block(profiler_t* p, uint32_t start, uint64_t instructions, uint64_t cycles) {
+  if ((p->blocks_used + 1) * 2 > p->blocks_size) {
+    const uint32_t size  = p->blocks_size ? p->blocks_size * 2 : 1024;
+    block_t*       table = calloc(size, sizeof(block_t));
+    if (!table) {
+      return false;
+    }
+    for (uint32_t i = 0; i < p->blocks_size; ++i) {
+      if (p->blocks[i].used) {
+        *block_slot(table, size, p->blocks[i].start) = p->blocks[i];
+      }
+    }
+    free(p->blocks);
+    p->blocks      = table;
+    p->blocks_size = size;
+  }
+  block_t* slot = block_slot(p->blocks, p->blocks_size, start);
+  if (!slot->used) {
+    slot->used  = true;
+    slot->start = start;
+    p->blocks_used += 1;
+  }
+  slot->executions   += 1;
+  slot->instructions += instructions;
+  slot->cycles       += cycles;
+  return true;
+}
+
+//----------------------------------------------------------------
+// profiling
+
+bool profiler_start(machine_t *m, uint32_t period) {
+  if (m->profiler) {
+    return false;
+  }
+  profiler_t* p = calloc(1, sizeof(profiler_t));
+  if (!p) {
+    return false;
+  }
+  p->period = period;
+  p->last   = cpu_get_cycles(m);
+  p->next   = period ? p->last + period : UINT64_MAX;
+  m->profiler = p;
+  return true;
+}
+
+void profiler_stop(machine_t *m) {
+  profiler_t* p = m->profiler;
+  if (!p) {
+    return;
+  }
+  free(p->symbols);
+  free(p->stacks);
+  free(p->blocks);
+  free(p);
+  m->profiler = NULL;
+}
+
+uint64_t profiler_next(machine_t *m) {
+  return m->profiler ? m->profiler->next : UINT64_MAX;
+}
+
+void profiler_sample(machine_t *m) {
+  profiler_t* p = m->profiler;
+  const uint64_t now = cpu_get_cycles(m);
+  if (!p || !p->period || now < p->next) {
+    return;
+  }
+  call_stack_t s;
+  s.depth = walk(m, cpu_get_CS(m), cpu_get_IP(m), s.frames);
+  add_stack(p, &s, 1, now - p->last);
+  p->samples += 1;
+  p->cycles  += now - p->last;
+  p->last     = now;
+  while (p->next <= now) {
+    p->next += p->period;
+  }
+}
+
+bool profiler_exact(machine_t *m) {
+  return m->profiler && !m->profiler->period;
+}
+
+static void end_block(profiler_t* p) {
+  if (p->in_block) {
+    add_block(p, p->block.frames[0], p->block_instructions, p->block_cycles);
+    add_stack(p, &p->block, 1, p->block_cycles);
+    p->in_block = false;
+  }
+}
+
+// True when the instruction at cs:ip may transfer control.
+static bool is_transfer(machine_t *m, uint16_t cs, uint16_t ip) {
+  uint8_t op = peek(m, cs, ip);
+  for (uint32_t i = 0; i < 4; ++i) {  // prefixes
+    if (op != 0x26 && op != 0x2E && op != 0x36 && op != 0x3E &&
+        op != 0xF0 && op != 0xF2 && op != 0xF3) {
+      break;
+    }
+    ip += 1;
+    op  = peek(m, cs, ip);
+  }
+  if ((op >= 0x70 && op <= 0x7F) || (op >= 0xE0 && op <= 0xE3) ||
+      (op >= 0xE8 && op <= 0xEB) || (op >= 0xC2 && op <= 0xC3) ||
+      (op >= 0xCA && op <= 0xCF) || op == 0x9A || op == 0xF4) {
+    return true;
+  }
+  if (op == 0xFF) {
+    const uint8_t reg = (peek(m, cs, (uint16_t)(ip + 1)) >> 3) & 7;
+    return reg >= 2 && reg <= 5;
+  }
+  return false;
+}
+
+// A basic block ends after an instruction which may jump, and when the
+// next instruction is not right behind the last, which is how a hardware
+// interrupt taken by cpu_step() shows. The first instruction of the
+// interrupt handler then counts to the interrupted block.
+void profiler_count(machine_t *m, uint16_t cs, uint16_t ip, uint32_t cycles) {
+  profiler_t* p = m->profiler;
+  if (!p) {
+    return;
+  }
+  if (!p->in_block || p->transfer) {
+    end_block(p);
+    p->block.depth        = walk(m, cs, ip, p->block.frames);
+    p->block_instructions = 0;
+    p->block_cycles       = 0;
+    p->in_block           = true;
+  }
+  p->block_instructions += 1;
+  p->block_cycles       += cycles;
+  p->cycles             += cycles;
+
+  const uint32_t from = cpu_get_address(cs, ip);
+  const uint32_t to   = cpu_get_address(cpu_get_CS(m), cpu_get_IP(m));
+  p->transfer = is_transfer(m, cs, ip) || to <= from || to - from > 16;
+}
+
+//----------------------------------------------------------------
+// symbols
+
+static int symbol_cmp(const void* a, const void* b) {
+  const symbol_t* x = a;
+  const symbol_t* y = b;
+  if (x->addr != y->addr) {
+    return x->addr < y->addr ? -1 : 1;
+  }
+  return (int)y->global - (int)x->global;  // globals first
+}
+
+static bool add_symbol(profiler_t* p, uint32_t addr, const char* name, bool global) {
+  if (p->num_symbols == p->max_symbols) {
+    const uint32_t max     = p->max_symbols ? p->max_symbols * 2 : 256;
+    symbol_t*      symbols = realloc(p->symbols, max * sizeof(symbol_t));
+    if (!symbols) {
+      return false;
+    }
+    p->symbols     = symbols;
+    p->max_symbols = max;
+  }
+  symbol_t* s = &p->symbols[p->num_symbols++];
+  s->addr   = addr;
+  s->end    = UINT32_MAX;
+  s->global = global;
+  memcpy(s->name, name, strlen(name) + 1);
+  p->sorted = false;
+  return true;
+}
+
+// Copy the label of n characters at text to dst, which holds MAX_LABEL. A
+// longer one is cut short and ends in '~' to tell.
+static void copy_label(char* dst, const char* text, size_t n) {
+  if (n < MAX_LABEL) {
+    memcpy(dst, text, n);
+    dst[n] = 0;
+  }
+  else {
+    memcpy(dst, text, MAX_LABEL - 2);
+    dst[MAX_LABEL - 2] = '~';
+    dst[MAX_LABEL - 1] = 0;
+  }
+}
+
+// Label at the start of text, an identifier followed by a colon. Returns
+// its length, 0 when there is none.
+static size_t label_at(const char* text) {
+  size_t len = 0;
+  while (isalnum((unsigned char)text[len]) || (text[len] && strchr("_.$?@", text[len]))) {
+    ++len;
+  }
+  return (len && text[len] == ':') ? len : 0;
+}
+
+static bool is_hex(const char* text, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (!isxdigit((unsigned char)text[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// NASM listing lines: line number in 6 columns, the address in 8 hex
+// digits, the code bytes, the macro level as <n> at column 36 and the
+// source from column 40. A label on a line of its own takes the address
+// of the next line with code.
+static void load_nasm(profiler_t* p, FILE* fd, uint32_t base, uint32_t* end) {
+  char     line[1024];
+  char     global[MAX_LABEL] = "";
+  char     pending[MAX_PENDING][MAX_NAME];
+  bool     pending_global[MAX_PENDING];
+  uint32_t num_pending = 0;
+
+  while (fgets(line, sizeof(line), fd)) {
+    line[strcspn(line, "\r\n")] = 0;
+    const size_t len = strlen(line);
+    if (len < 7 || !isdigit((unsigned char)line[5])) {
+      continue;
+    }
+    const bool has_addr = len >= 16 && is_hex(line + 7, 8) && line[15] == ' ';
+    const uint32_t addr = has_addr ? (uint32_t)strtoul(line + 7, NULL, 16) : 0;
+    if (has_addr) {
+      for (uint32_t i = 0; i < num_pending; ++i) {
+        add_symbol(p, base + addr, pending[i], pending_global[i]);
+      }
+      num_pending = 0;
+      if (base + addr + 1 > *end) {
+        *end = base + addr + 1;
+      }
+    }
+    if (len <= 40 || line[36] == '<') {
+      continue;  // no source, or a macro expansion
+    }
+    const char* source = line + 40;
+    while (*source == ' ' || *source == '\t') {
+      ++source;
+    }
+    const size_t n = label_at(source);
+    if (!n || strncmp(source, "..@", 3) == 0) {
+      continue;
+    }
+    char name[MAX_NAME];
+    if (source[0] == '.') {
+      const size_t at = strlen(global);
+      memcpy(name, global, at);
+      copy_label(name + at, source, n);
+    }
+    else {
+      copy_label(global, source, n);
+      memcpy(name, global, strlen(global) + 1);
+    }
+    if (has_addr) {
+      add_symbol(p, base + addr, name, source[0] != '.');
+    }
+    else if (num_pending < MAX_PENDING) {
+      pending_global[num_pending] = source[0] != '.';
+      memcpy(pending[num_pending++], name, strlen(name) + 1);
+    }
+  }
+}
+
+// wdis listing lines of the segment named "code": "E05B<tabs>post:" for a
+// label, generated L$n labels are skipped.
+static void load_wdis(profiler_t* p, FILE* fd, uint32_t base, uint32_t* end) {
+  char line[1024];
+  bool code = false;
+
+  while (fgets(line, sizeof(line), fd)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (strncmp(line, "Segment:", 8) == 0) {
+      char name[64] = "";
+      sscanf(line + 8, "%63s", name);
+      code = strcmp(name, "code") == 0;
+      continue;
+    }
+    if (!code || !is_hex(line, 4) || (line[4] != '\t' && line[4] != ' ')) {
+      continue;
+    }
+    const uint32_t addr = (uint32_t)strtoul(line, NULL, 16);
+    if (base + addr + 1 > *end) {
+      *end = base + addr + 1;
+    }
+    const char* text = line + 4;
+    while (*text == '\t' || *text == ' ') {
+      ++text;
+    }
+    const size_t n = label_at(text);
+    if (n && strncmp(text, "L$", 2) != 0) {
+      char name[MAX_LABEL];
+      copy_label(name, text, n);
+      add_symbol(p, base + addr, name, true);
+    }
+  }
+}
+
+bool profiler_symbols(machine_t *m, const char* path, uint32_t base) {
+  profiler_t* p = m->profiler;
+  if (!p) {
+    return false;
+  }
+  FILE* fd = fopen(path, "r");
+  if (!fd) {
+    return false;
+  }
+  const uint32_t first = p->num_symbols;
+  uint32_t       end   = base;
+
+  char head[16] = "";
+  if (fgets(head, sizeof(head), fd) && strncmp(head, "Module:", 7) == 0) {
+    load_wdis(p, fd, base, &end);
+  }
+  else {
+    rewind(fd);
+    load_nasm(p, fd, base, &end);
+  }
+  fclose(fd);
+
+  for (uint32_t i = first; i < p->num_symbols; ++i) {
+    p->symbols[i].end = end;
+  }
+  return p->num_symbols > first;
+}
+
+void profiler_default_symbols(machine_t *m, const char* bios, const char* rom) {
+  static const struct {
+    const char* file;
+    uint32_t    base;
+  } listings[2] = {
+    { "bios/pcxtbios.lst",       0xF0000 },
+    { "diskrom/bin/diskrom.lst", 0xC8000 },
+  };
+  const char* hex[2] = { bios, rom };
+  for (uint32_t i = 0; i < 2; ++i) {
+    const char*  slash = strrchr(hex[i], '/');
+    const size_t dir   = slash ? (size_t)(slash - hex[i] + 1) : 0;
+    char path[1024];
+    snprintf(path, sizeof(path), "%.*s%s", (int)dir, hex[i], listings[i].file);
+    profiler_symbols(m, path, listings[i].base);
+  }
+}
+
+// Nearest symbol at or before addr within its listing, a global one only
+// when global.
+static const symbol_t* lookup(profiler_t* p, uint32_t addr, bool global) {
+  if (!p->sorted) {
+    qsort(p->symbols, p->num_symbols, sizeof(symbol_t), symbol_cmp);
+    p->sorted = true;
+  }
+  uint32_t lo = 0;
+  uint32_t hi = p->num_symbols;
+  while (lo < hi) {
+    const uint32_t mid = (lo + hi) / 2;
+    if (p->symbols[mid].addr <= addr) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  while (lo--) {
+    const symbol_t* s = &p->symbols[lo];
+    if (addr >= s->end) {
+      return NULL;
+    }
+    if (s->global || !global) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+// Routine of a frame, its global label or else its code segment.
+static void routine_name(profiler_t* p, uint32_t frame, char* buf, size_t size) {
+  const symbol_t* s = lookup(p, linear(frame), true);
+  if (s) {
+    snprintf(buf, size, "%s", s->name);
+  }
+  else {
+    snprintf(buf, size, "seg_%04X", frame >> 16);
+  }
+}
+
+// Closest label of an address, with the offset from it.
+static void address_name(profiler_t* p, uint32_t frame, char* buf, size_t size) {
+  const uint32_t  addr = linear(frame);
+  const symbol_t* s    = lookup(p, addr, false);
+  if (!s) {
+    buf[0] = 0;
+  }
+  else if (addr == s->addr) {
+    snprintf(buf, size, "%s", s->name);
+  }
+  else {
+    snprintf(buf, size, "%s+%x", s->name, addr - s->addr);
+  }
+}
+
+//----------------------------------------------------------------
+// output
+
+typedef struct {
+  char     name[MAX_NAME];
+  uint64_t self;
+  uint64_t total;
+} routine_t;
+
+static int routine_cmp(const void* a, const void* b) {
+  const routine_t* x = a;
+  const routine_t* y = b;
+  if (x->self != y->self) {
+    return x->self < y->self ? 1 : -1;
+  }
+  return x->total < y->total ? 1 : (x->total > y->total ? -1 : 0);
+}
+
+static int block_cmp(const void* a, const void* b) {
+  const block_t* x = a;
+  const block_t* y = b;
+  return x->cycles < y->cycles ? 1 : (x->cycles > y->cycles ? -1 : 0);
+}
+
+static bool write_folded(profiler_t* p, FILE* fd) {
+  for (uint32_t i = 0; i < p->stacks_size; ++i) {
+    const call_stack_t* s = &p->stacks[i];
+    if (!s->depth) {
+      continue;
+    }
+    for (uint32_t d = s->depth; d-- > 0; ) {
+      char name[MAX_NAME];
+      routine_name(p, s->frames[d], name, sizeof(name));
+      fprintf(fd, "%s%s", name, d ? ";" : "");
+    }
+    fprintf(fd, " %llu\n", (unsigned long long)s->cycles);
+  }
+  return true;
+}
+
+static bool write_report(profiler_t* p, FILE* fd) {
+  if (p->period) {
+    fprintf(fd, "%llu samples every %u clock cycles, %llu cycles\n",
+            (unsigned long long)p->samples, p->period, (unsigned long long)p->cycles);
+  }
+  else {
+    fprintf(fd, "exact, %llu clock cycles\n", (unsigned long long)p->cycles);
+  }
+  const double total = p->cycles ? (double)p->cycles : 1.0;
+
+  // routines, self from the innermost frame and total from anywhere in
+  // the stack, counted once per stack
+  uint32_t frames = 1;
+  for (uint32_t i = 0; i < p->stacks_size; ++i) {
+    frames += p->stacks[i].depth;
+  }
+  routine_t* routines = calloc(frames, sizeof(routine_t));
+  if (!routines) {
+    return false;
+  }
+  uint32_t num = 0;
+  for (uint32_t i = 0; i < p->stacks_size; ++i) {
+    const call_stack_t* s = &p->stacks[i];
+    uint32_t seen[MAX_DEPTH];
+    uint32_t num_seen = 0;
+    for (uint32_t d = 0; d < s->depth; ++d) {
+      char name[MAX_NAME];
+      routine_name(p, s->frames[d], name, sizeof(name));
+      uint32_t r = 0;
+      while (r < num && strcmp(routines[r].name, name)) {
+        ++r;
+      }
+      if (r == num) {
+        memcpy(routines[num++].name, name, strlen(name) + 1);
+      }
+      bool dup = false;
+      for (uint32_t k = 0; k < num_seen; ++k) {
+        dup |= seen[k] == r;
+      }
+      if (!dup) {
+        routines[r].total += s->cycles;
+        seen[num_seen++] = r;
+      }
+      if (d == 0) {
+        routines[r].self += s->cycles;
+      }
+    }
+  }
+  qsort(routines, num, sizeof(routine_t), routine_cmp);
+
+  fprintf(fd, "\n%-32s %14s %7s %14s %7s\n", "routine", "self", "%", "total", "%");
+  for (uint32_t i = 0; i < num; ++i) {
+    fprintf(fd, "%-32s %14llu %6.2f%% %14llu %6.2f%%\n", routines[i].name,
+            (unsigned long long)routines[i].self, routines[i].self * 100.0 / total,
+            (unsigned long long)routines[i].total, routines[i].total * 100.0 / total);
+  }
+  free(routines);
+
+  if (!p->blocks_used) {
+    return true;
+  }
+  block_t* blocks = malloc(p->blocks_used * sizeof(block_t));
+  if (!blocks) {
+    return false;
+  }
+  num = 0;
+  for (uint32_t i = 0; i < p->blocks_size; ++i) {
+    if (p->blocks[i].used) {
+      blocks[num++] = p->blocks[i];
+    }
+  }
+  qsort(blocks, num, sizeof(block_t), block_cmp);
+
+  fprintf(fd, "\n%-9s %-32s %12s %12s %14s %7s %9s\n", "block", "label", "executions",
+          "instructions", "cycles", "%", "cyc/exec");
+  for (uint32_t i = 0; i < num; ++i) {
+    const block_t* b = &blocks[i];
+    char name[MAX_NAME + 9];  // with +offset
+    address_name(p, b->start, name, sizeof(name));
+    fprintf(fd, "%04X:%04X %-32s %12llu %12llu %14llu %6.2f%% %9.1f\n",
+            b->start >> 16, b->start & 0xffff, name,
+            (unsigned long long)b->executions, (unsigned long long)b->instructions,
+            (unsigned long long)b->cycles, b->cycles * 100.0 / total,
+            (double)b->cycles / b->executions);
+  }
+  free(blocks);
+  return true;
+}
+
+bool profiler_write(machine_t *m, const char* path, bool folded) {
+  profiler_t* p = m->profiler;
+  if (!p) {
+    return false;
+  }
+  end_block(p);
+
+  FILE* fd = fopen(path, "w");
+  if (!fd) {
+    return false;
+  }
+  const bool ok = folded ? write_folded(p, fd) : write_report(p, fd);
+  return (fclose(fd) == 0) && ok;
+}
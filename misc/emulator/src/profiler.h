@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+
+
+typedef struct profiler_t profiler_t;
+
+// Guest code profiler, where the emulated clock cycles go.
+//
+// With a period the CPU is sampled every period clock cycles, at the next
+// instruction boundary, and a sample weighs the cycles since the previous
+// one. With period 0 the CPU is single stepped and every instruction is
+// counted exactly, by the basic block it belongs to.
+//
+// Call stacks come from the BP chain of the guest. Where there is none, as
+// in the hand written ROMs, the stack is scanned for words that return
+// right behind a CALL or INT instruction. A scan can pick up stale return
+// addresses, the stacks are a guide rather than the truth.
+bool profiler_start(machine_t *m, uint32_t period);
+void profiler_stop (machine_t *m);
+
+// Name addresses after the labels of an assembler listing, a NASM -l
+// listing or an Open Watcom wdis listing (of its segment named "code"),
+// whose offsets are relative to the linear address base.
+bool profiler_symbols(machine_t *m, const char* path, uint32_t base);
+// Load roms/bios/pcxtbios.lst and roms/diskrom/bin/diskrom.lst when they
+// are found next to the BIOS and disk ROM hex files.
+void profiler_default_symbols(machine_t *m, const char* bios, const char* rom);
+
+// Write a report of the cycles by routine, and by basic block when exact,
+// or folded stacks, "caller;...;routine cycles" lines for flame graph tools.
+bool profiler_write(machine_t *m, const char* path, bool folded);
+
+// Used by machine_run_frame(). The clock cycle the next sample is due at,
+// UINT64_MAX when there is none, and taking it.
+uint64_t profiler_next  (machine_t *m);
+void     profiler_sample(machine_t *m);
+// True when profiling exactly, the CPU has to be single stepped and every
+// instruction passed to profiler_count() with its address and clock cycles.
+bool     profiler_exact (machine_t *m);
+void     profiler_count (machine_t *m, uint16_t cs, uint16_t ip, uint32_t cycles);
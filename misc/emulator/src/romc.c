@@ -0,0 +1,529 @@
+// Compiles the BIOS and disk ROM to C, no SDL.
+//
+//   iceXtRomC [--entry SEG:OFF]... <bios.hex> <diskrom.hex> <out.h>
+//
+// Walks the control flow of the ROMs from their entry points and writes a C
+// function for each basic block found, which cpu.c includes when built with
+// CPU_AOT (ICEXT_AOT), see cpu_aot.h. The entry points are the reset vector,
+// the IBM interrupt vector table at F000:FEF3, the entry at offset 3 of an
+// option ROM and the interrupt handlers the code installs with a constant
+// offset, followed through direct jumps and calls. --entry adds more.
+//
+// Each instruction of a block runs the body of its opcode from
+// cpu_opcodes.h on a decode cache entry filled in here, which is what the
+// interpreter runs for it, so the compiled code behaves exactly as
+// interpreted. The output also holds a hash of each ROM, the blocks are
+// only used on the ROM they were compiled from.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "udis86/udis86.h"
+
+#include "cpu_decode.h"
+
+
+#define MAX_LEN     15    // longest instruction the decode cache holds
+#define MAX_INSNS   64    // per block
+#define MAX_ENTRIES 4096
+
+typedef struct {
+  const char* path;
+  uint32_t    base;
+  uint32_t    size;
+} rom_t;
+
+static rom_t roms[2] = {
+  { NULL, 0xFE000, 0x2000 },  // BIOS
+  { NULL, 0xC8000, 0x1000 },  // disk ROM
+};
+#define NUM_ROMS 2
+
+// Opcode bodies as the interpreter runs them.
+static const char* const bodies[256] = {
+#define OPCODE(n, body) [n] = #body,
+#include "cpu_opcodes.h"
+#undef OPCODE
+};
+
+static const char* const reg_names[9] = {
+  "AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI", "NoReg"
+};
+static const char* const seg_names[4] = { "ES", "CS", "SS", "DS" };
+
+typedef struct {
+  uint32_t addr;
+  uint16_t ip;
+  uint8_t  bytes[MAX_LEN + 1];
+  uint8_t  len;
+  uint8_t  op;        // opcode following the prefixes
+  uint8_t  skip;      // bytes up to and including op
+  uint8_t  modrm;
+  bool     ea_valid;
+  uint8_t  ea_base;
+  uint8_t  ea_index;
+  uint8_t  ea_seg;
+  uint8_t  ea_disp_len;
+  uint16_t ea_disp;
+} insn_t;
+
+typedef struct {
+  uint16_t cs;
+  uint16_t ip;
+} entry_t;
+
+typedef struct {
+  uint16_t cs;
+  uint16_t ip;
+  uint32_t addr;
+  uint32_t first;  // index of its first instruction
+  uint32_t count;
+  bool     loops;  // the last instruction may jump back to the start
+} block_t;
+
+typedef struct {
+  uint8_t  image[1024 * 1024];
+  entry_t  entries[MAX_ENTRIES];
+  uint32_t num_entries;
+  block_t* blocks;
+  uint32_t num_blocks;
+  insn_t*  insns;
+  uint32_t num_insns;
+  uint32_t max_blocks;
+  uint32_t max_insns;
+  ud_t     ud;
+} romc_t;
+
+static bool load_hex(romc_t* c, const rom_t* rom) {
+  FILE* fd = fopen(rom->path, "r");
+  if (!fd) {
+    return false;
+  }
+  uint32_t addr = rom->base;
+  while (addr < rom->base + rom->size && !feof(fd)) {
+    uint32_t value = 0;
+    if (!fscanf(fd, "%02x ", &value)) {
+      break;
+    }
+    c->image[addr++] = value & 0xff;
+  }
+  fclose(fd);
+  return true;
+}
+
+// FNV-1a, the same as aot_hash() in cpu_aot.h.
+static uint64_t hash(const uint8_t* p, uint32_t n) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (uint32_t i = 0; i < n; ++i) {
+    h = (h ^ p[i]) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+static const rom_t* rom_at(uint32_t addr) {
+  for (uint32_t i = 0; i < NUM_ROMS; ++i) {
+    if (addr - roms[i].base < roms[i].size) {
+      return &roms[i];
+    }
+  }
+  return NULL;
+}
+
+static void add_entry(romc_t* c, uint16_t cs, uint16_t ip) {
+  if (!rom_at((cs * 16 + ip) & 0xFFFFF)) {
+    return;
+  }
+  for (uint32_t i = 0; i < c->num_entries; ++i) {
+    if (c->entries[i].cs == cs && c->entries[i].ip == ip) {
+      return;
+    }
+  }
+  if (c->num_entries == MAX_ENTRIES) {
+    fprintf(stderr, "Too many entry points, %04x:%04x left out\n", cs, ip);
+    return;
+  }
+  c->entries[c->num_entries].cs = cs;
+  c->entries[c->num_entries].ip = ip;
+  c->num_entries += 1;
+}
+
+// Decode the instruction at cs:ip like dcache_fill() does. Fails when it
+// does not fit into one ROM or wraps around the segment.
+static bool decode(const romc_t* c, uint16_t cs, uint16_t ip, insn_t* in) {
+  const uint32_t base = cs * 16;
+  const rom_t* rom = rom_at((base + ip) & 0xFFFFF);
+  uint32_t len = 0, disp_pos = 0;
+  uint8_t  op, info;
+
+  memset(in, 0, sizeof(*in));
+  in->addr = (base + ip) & 0xFFFFF;
+  in->ip   = ip;
+  do {
+    if (len >= MAX_LEN) {
+      return false;
+    }
+    op   = c->image[(base + ip + len) & 0xFFFFF];
+    info = decode_table[op];
+    len += 1;
+  } while (info & D_PREFIX);
+  in->op   = op;
+  in->skip = (uint8_t)len;
+
+  if (info & D_MODRM) {
+    const uint8_t modrm = c->image[(base + ip + len++) & 0xFFFFF];
+    in->modrm = modrm;
+    if ((info & D_GRP3) && (modrm & 0x30)) {
+      info &= ~(D_IMM8 | D_IMM16);
+    }
+    if (modrm < 0xc0) {
+      const uint8_t* form = modrm_ea[modrm & 7];
+      in->ea_valid    = true;
+      in->ea_base     = form[0];
+      in->ea_index    = form[1];
+      in->ea_seg      = form[2];
+      in->ea_disp_len = modrm >> 6;
+      if ((modrm & 0xC7) == 0x06) {
+        in->ea_base     = NoReg;
+        in->ea_seg      = DS;
+        in->ea_disp_len = 2;
+      }
+      disp_pos = len;
+      len += in->ea_disp_len;
+    }
+  }
+  len += (info & D_IMM8) ? 1 : 0;
+  len += (info & D_IMM16) ? 2 : 0;
+  len += (info & D_FAR) ? 4 : 0;
+
+  if (len > MAX_LEN || ip + len > 0x10000 ||
+      rom_at((base + ip + len - 1) & 0xFFFFF) != rom) {
+    return false;
+  }
+  for (uint32_t i = 0; i < len; ++i) {
+    in->bytes[i] = c->image[(base + ip + i) & 0xFFFFF];
+  }
+  in->len = (uint8_t)len;
+  if (in->ea_disp_len == 1) {
+    in->ea_disp = (uint16_t)(int8_t)in->bytes[disp_pos];
+  }
+  else if (in->ea_disp_len == 2) {
+    in->ea_disp = in->bytes[disp_pos] | (in->bytes[disp_pos + 1] << 8);
+  }
+  return true;
+}
+
+static uint16_t imm16(const insn_t* in, uint32_t at) {
+  return in->bytes[at] | (in->bytes[at + 1] << 8);
+}
+
+// Interrupt handler installed by MOV [vector * 4],imm16, or by MOV r16,imm16
+// followed by MOV [vector * 4],r16.
+static void find_handler(romc_t* c, uint16_t cs, const insn_t* prev, const insn_t* in) {
+  const uint32_t at = in->skip;
+  if (in->op == 0xC7 && in->modrm == 0x06) {
+    const uint16_t disp = imm16(in, at + 1);
+    if (disp < 0x400 && !(disp & 3)) {
+      add_entry(c, cs, imm16(in, at + 3));
+    }
+  }
+  if (prev && prev->op >= 0xB8 && prev->op <= 0xBF && prev->len == 3 &&
+      in->op == 0x89 && (in->modrm & 0xC7) == 0x06 &&
+      ((in->modrm >> 3) & 7) == (prev->op & 7)) {
+    const uint16_t disp = imm16(in, at + 1);
+    if (disp < 0x400 && !(disp & 3)) {
+      add_entry(c, cs, imm16(prev, 1));
+    }
+  }
+}
+
+// Follows the instruction, adding the addresses it continues at. Returns
+// true when it ends the block, with the offset of a jump within the segment
+// in *target or -1.
+static bool follow(romc_t* c, uint16_t cs, const insn_t* in, int32_t* target) {
+  const uint16_t next = in->ip + in->len;
+  const uint32_t at   = in->skip;
+  const uint8_t  op   = in->op;
+
+  *target = -1;
+  if ((op >= 0x70 && op <= 0x7F) || (op >= 0xE0 && op <= 0xE3)) {
+    *target = (uint16_t)(next + (int8_t)in->bytes[at]);
+    add_entry(c, cs, (uint16_t)*target);
+    add_entry(c, cs, next);
+    return true;
+  }
+  switch (op) {
+  case 0xEB:
+    *target = (uint16_t)(next + (int8_t)in->bytes[at]);
+    add_entry(c, cs, (uint16_t)*target);
+    return true;
+  case 0xE9:
+    *target = (uint16_t)(next + imm16(in, at));
+    add_entry(c, cs, (uint16_t)*target);
+    return true;
+  case 0xE8:
+    add_entry(c, cs, next + imm16(in, at));
+    add_entry(c, cs, next);
+    return true;
+  case 0xEA:
+    add_entry(c, imm16(in, at + 2), imm16(in, at));
+    return true;
+  case 0x9A:
+    add_entry(c, imm16(in, at + 2), imm16(in, at));
+    add_entry(c, cs, next);
+    return true;
+  case 0xC2: case 0xC3: case 0xCA: case 0xCB: case 0xCF:
+    return true;
+  case 0xCC: case 0xCD: case 0xCE: case 0xF4:
+    add_entry(c, cs, next);
+    return true;
+  case 0xFF:
+    switch ((in->modrm >> 3) & 7) {
+    case 2: case 3:
+      add_entry(c, cs, next);
+      return true;
+    case 4: case 5:
+      return true;
+    }
+    break;
+  }
+  return false;
+}
+
+static bool is_block(const romc_t* c, uint16_t cs, uint16_t ip) {
+  for (uint32_t i = 0; i < c->num_blocks; ++i) {
+    if (c->blocks[i].cs == cs && c->blocks[i].ip == ip) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Decode the block at the entry, up to the instruction that ends it or to
+// the start of a block already found.
+static void walk(romc_t* c, entry_t e) {
+  if (is_block(c, e.cs, e.ip)) {
+    return;
+  }
+  if (c->num_blocks == c->max_blocks) {
+    c->max_blocks = c->max_blocks ? c->max_blocks * 2 : 1024;
+    c->blocks = realloc(c->blocks, c->max_blocks * sizeof(block_t));
+  }
+  block_t* b = &c->blocks[c->num_blocks];
+  b->cs    = e.cs;
+  b->ip    = e.ip;
+  b->addr  = (e.cs * 16 + e.ip) & 0xFFFFF;
+  b->first = c->num_insns;
+  b->count = 0;
+  b->loops = false;
+
+  uint16_t ip = e.ip;
+  for (;;) {
+    if (b->count == MAX_INSNS) {
+      add_entry(c, e.cs, ip);  // continued by another block
+      break;
+    }
+    if (b->count && is_block(c, e.cs, ip)) {
+      break;
+    }
+    if (c->num_insns == c->max_insns) {
+      c->max_insns = c->max_insns ? c->max_insns * 2 : 8192;
+      c->insns = realloc(c->insns, c->max_insns * sizeof(insn_t));
+    }
+    insn_t* in = &c->insns[c->num_insns];
+    if (!decode(c, e.cs, ip, in)) {
+      break;  // left to the interpreter
+    }
+    c->num_insns += 1;
+    b->count += 1;
+    find_handler(c, e.cs, b->count > 1 ? in - 1 : NULL, in);
+    int32_t target;
+    if (follow(c, e.cs, in, &target)) {
+      b->loops = target == e.ip;
+      break;
+    }
+    ip = in->ip + in->len;
+  }
+  if (b->count) {
+    c->num_blocks += 1;
+  }
+}
+
+static int block_cmp(const void* a, const void* b) {
+  const block_t* x = a;
+  const block_t* y = b;
+  if (x->addr != y->addr) {
+    return x->addr < y->addr ? -1 : 1;
+  }
+  return x->cs < y->cs ? -1 : x->cs > y->cs;
+}
+
+static void emit_insn(romc_t* c, FILE* fd, const block_t* b, uint32_t k) {
+  const insn_t* in = &c->insns[k];
+  const uint16_t next = in->ip + in->len;
+
+  ud_set_input_buffer(&c->ud, in->bytes, in->len);
+  ud_set_pc(&c->ud, in->ip);
+  fprintf(fd, "    /* %04x: %s */\n",
+    in->ip, ud_disassemble(&c->ud) ? ud_insn_asm(&c->ud) : "?");
+  // A prefix runs the rest of the instruction as the interpreter does.
+  fprintf(fd, "    AOT_INSN(%u);\n", k);
+  fprintf(fd, "    cpu->cycles += op_cycles[0x%02x];\n", in->bytes[0]);
+  fprintf(fd, "    do { %s; } while(0);\n", bodies[in->bytes[0]]);
+  if (k + 1 == b->first + b->count && b->loops) {
+    fprintf(fd, "    if(AOT_MORE(0x%04x, 0x%04x))\n", b->ip, b->cs);
+    fprintf(fd, "        goto start;\n");
+  }
+  else if (k + 1 != b->first + b->count) {
+    fprintf(fd, "    if(!AOT_MORE(0x%04x, 0x%04x))\n", next, b->cs);
+    fprintf(fd, "        return;\n");
+  }
+}
+
+static const char* file_name(const char* path) {
+  const char* name = strrchr(path, '/');
+  return name ? name + 1 : path;
+}
+
+static void emit(romc_t* c, FILE* fd) {
+  fprintf(fd, "// Generated by iceXtRomC from %s and %s, do not edit.\n\n",
+    file_name(roms[0].path), file_name(roms[1].path));
+
+  fprintf(fd, "#define AOT_ROMS %u\n\n", NUM_ROMS);
+  for (uint32_t r = 0; r < NUM_ROMS; ++r) {
+    uint16_t* index = calloc(roms[r].size, sizeof(uint16_t));
+    for (uint32_t i = c->num_blocks; i-- > 0;) {
+      if (c->blocks[i].addr - roms[r].base < roms[r].size) {
+        index[c->blocks[i].addr - roms[r].base] = (uint16_t)(i + 1);
+      }
+    }
+    fprintf(fd, "static const uint16_t aot_index_%u[0x%x] = {", r, roms[r].size);
+    for (uint32_t i = 0; i < roms[r].size; ++i) {
+      fprintf(fd, "%s%u,", (i % 16) ? " " : "\n    ", index[i]);
+    }
+    fprintf(fd, "\n};\n\n");
+    free(index);
+  }
+  fprintf(fd, "static const aot_rom_t aot_roms[AOT_ROMS] = {\n");
+  for (uint32_t r = 0; r < NUM_ROMS; ++r) {
+    fprintf(fd, "    { 0x%05x, 0x%04x, 0x%016llxull, aot_index_%u },\n",
+      roms[r].base, roms[r].size,
+      (unsigned long long)hash(c->image + roms[r].base, roms[r].size), r);
+  }
+  fprintf(fd, "};\n\n");
+
+  fprintf(fd, "static const decode_t aot_insns[%u] = {\n", c->num_insns);
+  for (uint32_t k = 0; k < c->num_insns; ++k) {
+    const insn_t* in = &c->insns[k];
+    fprintf(fd, "    { .addr = 0x%05x, .len = %u, .span = %u", in->addr, in->len, in->len);
+    if (in->ea_valid) {
+      fprintf(fd, ", .ea_valid = 1, .ea_base = %s, .ea_index = %s, .ea_seg = %s, "
+        ".ea_disp_len = %u, .ea_disp = 0x%04x",
+        reg_names[in->ea_base], reg_names[in->ea_index], seg_names[in->ea_seg],
+        in->ea_disp_len, in->ea_disp);
+    }
+    fprintf(fd, ", .bytes = {");
+    for (uint32_t i = 0; i < in->len; ++i) {
+      fprintf(fd, "%s0x%02x", i ? ", " : " ", in->bytes[i]);
+    }
+    fprintf(fd, " } },\n");
+  }
+  fprintf(fd, "};\n");
+
+  for (uint32_t i = 0; i < c->num_blocks; ++i) {
+    const block_t* b = &c->blocks[i];
+    fprintf(fd, "\nstatic void aot_%04x_%04x(void)\n{\n", b->cs, b->ip);
+    if (b->loops) {
+      fprintf(fd, "start:\n");
+    }
+    for (uint32_t k = b->first; k < b->first + b->count; ++k) {
+      emit_insn(c, fd, b, k);
+    }
+    fprintf(fd, "}\n");
+  }
+
+  fprintf(fd, "\nstatic const aot_block_t aot_blocks[%u] = {\n", c->num_blocks + 2);
+  fprintf(fd, "    { 0, 0, NULL },\n");
+  for (uint32_t i = 0; i < c->num_blocks; ++i) {
+    const block_t* b = &c->blocks[i];
+    fprintf(fd, "    { 0x%05x, 0x%04x, aot_%04x_%04x },\n", b->addr, b->cs, b->cs, b->ip);
+  }
+  fprintf(fd, "    { 0xfffff, 0, NULL },\n");
+  fprintf(fd, "};\n");
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: iceXtRomC [options] <bios.hex> <diskrom.hex> <out.h>\n"
+    "  --entry SEG:OFF  also compile the code at SEG:OFF, in hex\n");
+}
+
+int main(int argc, char** args) {
+
+  static romc_t c;
+  const char* paths[3];
+  uint32_t num_paths = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    unsigned seg, off;
+    if (strcmp(args[i], "--entry") == 0 && i + 1 < argc &&
+        sscanf(args[i + 1], "%x:%x", &seg, &off) == 2) {
+      add_entry(&c, (uint16_t)seg, (uint16_t)off);
+      i += 1;
+      continue;
+    }
+    if (strncmp(args[i], "--", 2) == 0 || num_paths == 3) {
+      usage();
+      return 1;
+    }
+    paths[num_paths++] = args[i];
+  }
+  if (num_paths != 3) {
+    usage();
+    return 1;
+  }
+  roms[0].path = paths[0];
+  roms[1].path = paths[1];
+  for (uint32_t r = 0; r < NUM_ROMS; ++r) {
+    if (!load_hex(&c, &roms[r])) {
+      fprintf(stderr, "Unable to load '%s'!\n", roms[r].path);
+      return 1;
+    }
+  }
+
+  add_entry(&c, 0xFFFF, 0x0000);  // reset
+  for (uint32_t v = 0x08; v < 0x1D; ++v) {  // 1Dh to 1Fh point at tables
+    const uint32_t at = 0xFFEF3 + (v - 8) * 2;
+    add_entry(&c, 0xF000, c.image[at] | (c.image[at + 1] << 8));
+  }
+  for (uint32_t r = 0; r < NUM_ROMS; ++r) {
+    const uint8_t* p = c.image + roms[r].base;
+    if (p[0] == 0x55 && p[1] == 0xAA) {
+      add_entry(&c, (uint16_t)(roms[r].base >> 4), 3);  // option ROM
+    }
+  }
+
+  for (uint32_t i = 0; i < c.num_entries; ++i) {
+    walk(&c, c.entries[i]);
+  }
+  qsort(c.blocks, c.num_blocks, sizeof(block_t), block_cmp);
+
+  FILE* fd = fopen(paths[2], "w");
+  if (!fd) {
+    fprintf(stderr, "Unable to write '%s'!\n", paths[2]);
+    return 1;
+  }
+  ud_init(&c.ud);
+  ud_set_mode(&c.ud, 16);
+  ud_set_syntax(&c.ud, UD_SYN_INTEL);
+  emit(&c, fd);
+  if (fclose(fd) != 0) {
+    fprintf(stderr, "Unable to write '%s'!\n", paths[2]);
+    return 1;
+  }
+  printf("%u blocks, %u instructions from %u entry points\n",
+    c.num_blocks, c.num_insns, c.num_entries);
+  return 0;
+}
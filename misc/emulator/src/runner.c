@@ -0,0 +1,684 @@
+// Headless batch runner for test farms, no SDL.
+//
+//   iceXtRunner [options] <bios.hex> <diskrom.hex> <disk.img>...
+//
+// Boots one machine per disk image on a pool of worker threads and prints
+// a summary of each run. Every image is opened read/write by its machine,
+// jobs must not share an image file.
+//
+//   iceXtRunner --fork-at-* ... [options] <bios.hex> <diskrom.hex>
+//               <disk.img> <script>...
+//
+// Boots a single machine from the image up to the fork point, then forks
+// one child process per command script. The children share the booted
+// machine copy-on-write, type their script into it and keep their disk
+// writes in <script>.overlay, the image itself is left untouched.
+//
+// With --record each machine journals its input to <disk.img>.journal, or
+// <script>.journal for a child, so a run can be replayed with iceXtEmu.
+// A child's journal starts at the fork point, take a snapshot there with
+// --save to replay it from.
+//
+// Nothing is drawn while the machines run. --dump-screen and --dump-text
+// render the final screen to <name>.ppm or <name>.png and <name>.txt.
+//
+// --guest-profile profiles the guest code of each machine, a child from
+// the fork point on, into a report <name>.guest and folded stacks
+// <name>.guest.folded.
+//
+// --trace records every instruction of each machine, a child from the fork
+// point on, to the binary trace <name>.trace, see trace.h and
+// iceXtTraceDump.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "machine.h"
+#include "profiler.h"
+#include "screenshot.h"
+#include "snapshot.h"
+
+
+typedef struct {
+  const char*  bios;
+  const char*  rom;
+  const char** disks;
+  uint32_t     num_disks;
+  uint32_t     frames;
+  uint64_t     cycles;   // clock cycles to run each machine for, 0 for any
+  bool         jit;
+  bool         text;
+  const char*  screen;     // "ppm" or "png" to save the final screen
+  bool         dump_text;  // save the final text page
+  const char*  restore;  // snapshot to start from instead of booting
+  const char*  save;     // snapshot to take at the fork point
+  bool         record;   // journal the input of each machine
+  bool         trace;    // write the instruction trace of each machine
+  bool         guest;          // profile the guest code of each machine
+  uint32_t     guest_period;   // clock cycles between samples, 0 for exact
+  const char** listings;       // FILE@ADDR to name the code after
+  uint32_t     num_listings;
+#ifdef CPU_PROFILE
+  bool         profile;         // write the interpreter profile of each machine
+  bool         profile_folded;  // as folded stacks
+#endif
+
+  // fork point, any of them selects the fork mode
+  bool         fork_at_ip;
+  uint16_t     fork_cs;
+  uint16_t     fork_ip;
+  int32_t      fork_port;
+  uint32_t     fork_frames;
+
+  // condition to stop each machine at, before its frames are run
+  bool         until_at_ip;
+  uint16_t     until_cs;
+  uint16_t     until_ip;
+  int32_t      until_port;
+
+  pthread_mutex_t lock;
+  uint32_t        next;    // index of the next disk image to run
+  uint32_t        failed;
+} runner_t;
+
+// frames to look for the fork point when it is a CS:IP or port write
+#define FORK_SEARCH_FRAMES 20000
+
+// Append the summary of a run to out, which has room for size bytes.
+static void report(machine_t* m, const runner_t* r, uint32_t index,
+                   const char* name, uint32_t frames, char* out, size_t size) {
+  size_t len = snprintf(out, size, "[%u] %s: %u frames, %llu cycles, %04x:%04x%s%s\n",
+    index, name, frames, (unsigned long long)cpu_get_cycles(m),
+    cpu_get_CS(m), cpu_get_IP(m), cpu_halted(m) ? " (halted)" : "",
+    m->stop_hit ? " (stopped)" : "");
+
+  if (!r->text) {
+    return;
+  }
+  // 80x25 text page at B800:0000
+  for (uint32_t y = 0; y < 25 && len < size; ++y) {
+    char line[81];
+    for (uint32_t x = 0; x < 80; ++x) {
+      const uint8_t ch = mem_read(m, 0xB8000 + (y * 80 + x) * 2);
+      line[x] = (ch >= 0x20 && ch < 0x7f) ? ch : ' ';
+    }
+    uint32_t end = 80;
+    while (end && line[end - 1] == ' ') {
+      --end;
+    }
+    line[end] = '\0';
+    len += snprintf(out + len, size - len, "  | %s\n", line);
+  }
+}
+
+// Boot the machine, or restore it from the snapshot.
+static bool start(runner_t* r, machine_t* m, const char* disk) {
+  if (!r->restore) {
+    return machine_load(m, r->bios, r->rom, disk);
+  }
+  return disk_load(m, disk) && snapshot_restore(m, r->restore);
+}
+
+// Run the frames of a machine, or until its cycles are spent or the until
+// condition is hit, typing text as fast as the keyboard queue takes it.
+// Returns the number of frames run.
+static uint32_t run(runner_t* r, machine_t* m, const char* text, size_t size) {
+  if (r->until_at_ip) {
+    machine_stop_at_ip(m, r->until_cs, r->until_ip);
+  }
+  machine_stop_at_port(m, r->until_port);
+  if (r->cycles) {
+    machine_stop_at_cycle(m, cpu_get_cycles(m) + r->cycles);
+  }
+
+  size_t   pos    = 0;
+  uint32_t frames = 0;
+  bool     hit    = false;
+  while (frames < r->frames && !hit) {
+    while (pos < size && keyboard_type(m, text[pos])) {
+      ++pos;
+    }
+    cpu_set_debug(m, false);
+    hit = machine_run_frame(m);
+    frames += 1;
+  }
+  return frames;
+}
+
+// Save the final screen of a machine to <name>.ppm or .png, and its text
+// page to <name>.txt, when asked to.
+static bool dump(runner_t* r, machine_t* m, const char* name) {
+  char path[1024];
+  bool ok = true;
+  if (r->screen) {
+    snprintf(path, sizeof(path), "%s.%s", name, r->screen);
+    ok &= (strcmp(r->screen, "png") == 0) ? screenshot_png(m, path) :
+                                            screenshot_ppm(m, path);
+  }
+  if (r->dump_text) {
+    snprintf(path, sizeof(path), "%s.txt", name);
+    ok &= screenshot_text(m, path);
+  }
+  return ok;
+}
+
+// Journal the input of a machine to <name>.journal when recording.
+static bool record(runner_t* r, machine_t* m, const char* name) {
+  if (!r->record) {
+    return true;
+  }
+  char path[1024];
+  snprintf(path, sizeof(path), "%s.journal", name);
+  return journal_record(m, path);
+}
+
+// Trace the instructions of a machine to <name>.trace when asked to.
+static bool start_trace(runner_t* r, machine_t* m, const char* name) {
+  if (!r->trace) {
+    return true;
+  }
+  char path[1024];
+  snprintf(path, sizeof(path), "%s.trace", name);
+  return trace_open(m, path, false);
+}
+
+#ifdef CPU_PROFILE
+// Write the interpreter profile to <name>.profile or <name>.folded.
+static void write_profile(runner_t* r, machine_t* m, uint32_t index, const char* name) {
+  if (!r->profile) {
+    return;
+  }
+  char path[1024];
+  snprintf(path, sizeof(path), "%s.%s", name, r->profile_folded ? "folded" : "profile");
+  if (!cpu_profile_write(m, path, r->profile_folded)) {
+    fprintf(stderr, "[%u] %s: unable to write '%s'\n", index, name, path);
+  }
+}
+#endif
+
+// Start profiling the guest code with the listings given, or else with the
+// ones found next to the BIOS and disk ROM.
+static bool guest_start(runner_t* r, machine_t* m) {
+  if (!r->guest) {
+    return true;
+  }
+  if (!profiler_start(m, r->guest_period)) {
+    return false;
+  }
+  if (!r->num_listings) {
+    profiler_default_symbols(m, r->bios, r->rom);
+  }
+  for (uint32_t i = 0; i < r->num_listings; ++i) {
+    const char* at = strrchr(r->listings[i], '@');
+    char path[1024];
+    snprintf(path, sizeof(path), "%.*s", (int)(at - r->listings[i]), r->listings[i]);
+    if (!profiler_symbols(m, path, (uint32_t)strtoul(at + 1, NULL, 16))) {
+      fprintf(stderr, "No labels in '%s'!\n", path);
+    }
+  }
+  return true;
+}
+
+// Write the guest profile to <name>.guest and <name>.guest.folded.
+static void guest_write(runner_t* r, machine_t* m, uint32_t index, const char* name) {
+  if (!r->guest) {
+    return;
+  }
+  char report[1024];
+  char folded[1024];
+  snprintf(report, sizeof(report), "%s.guest", name);
+  snprintf(folded, sizeof(folded), "%s.guest.folded", name);
+  if (!profiler_write(m, report, false) || !profiler_write(m, folded, true)) {
+    fprintf(stderr, "[%u] %s: unable to write the guest profile\n", index, name);
+  }
+}
+
+static bool run_job(runner_t* r, uint32_t index) {
+
+  const char* disk = r->disks[index];
+
+  machine_t* m = machine_create();
+  if (!m) {
+    return false;
+  }
+  cpu_set_jit(m, r->jit);
+
+  if (!start(r, m, disk) || !record(r, m, disk) || !guest_start(r, m) ||
+      !start_trace(r, m, disk)) {
+    machine_destroy(m);
+    return false;
+  }
+
+  const uint32_t frames = run(r, m, NULL, 0);
+  if (!trace_close(m)) {
+    fprintf(stderr, "[%u] %s: unable to write the trace\n", index, disk);
+  }
+
+  char out[4096];
+  report(m, r, index, disk, frames, out, sizeof(out));
+  if (!dump(r, m, disk)) {
+    fprintf(stderr, "[%u] %s: unable to save the screen\n", index, disk);
+  }
+  guest_write(r, m, index, disk);
+#ifdef CPU_PROFILE
+  write_profile(r, m, index, disk);
+#endif
+
+  pthread_mutex_lock(&r->lock);
+  fputs(out, stdout);
+  fflush(stdout);
+  pthread_mutex_unlock(&r->lock);
+
+  machine_destroy(m);
+  return true;
+}
+
+static void* worker(void* arg) {
+  runner_t* r = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&r->lock);
+    const uint32_t index = r->next++;
+    pthread_mutex_unlock(&r->lock);
+
+    if (index >= r->num_disks) {
+      break;
+    }
+    if (!run_job(r, index)) {
+      pthread_mutex_lock(&r->lock);
+      fprintf(stderr, "[%u] %s: failed to start\n", index, r->disks[index]);
+      r->failed += 1;
+      pthread_mutex_unlock(&r->lock);
+    }
+  }
+  return NULL;
+}
+
+static int run_threads(runner_t* r, uint32_t threads) {
+
+  if (threads > r->num_disks) {
+    threads = r->num_disks;
+  }
+
+  pthread_mutex_init(&r->lock, NULL);
+
+  pthread_t* pool = calloc(threads, sizeof(pthread_t));
+  for (uint32_t i = 0; i < threads; ++i) {
+    pthread_create(&pool[i], NULL, worker, r);
+  }
+  for (uint32_t i = 0; i < threads; ++i) {
+    pthread_join(pool[i], NULL);
+  }
+
+  pthread_mutex_destroy(&r->lock);
+  free(pool);
+
+  printf("%u of %u machines ran\n", r->num_disks - r->failed, r->num_disks);
+  return r->failed ? 1 : 0;
+}
+
+static char* read_file(const char* path, size_t* size) {
+  FILE* fd = fopen(path, "rb");
+  if (!fd) {
+    return NULL;
+  }
+  fseek(fd, 0, SEEK_END);
+  *size = ftell(fd);
+  fseek(fd, 0, SEEK_SET);
+  char* data = malloc(*size + 1);
+  if (data) {
+    *size = fread(data, 1, *size, fd);
+  }
+  fclose(fd);
+  return data;
+}
+
+// Body of a forked child, m is its copy of the booted machine.
+static int run_child(runner_t* r, machine_t* m, uint32_t index) {
+
+  const char* script = r->disks[index + 1];
+
+  char overlay[1024];
+  snprintf(overlay, sizeof(overlay), "%s.overlay", script);
+  if (!disk_overlay(m, overlay)) {
+    fprintf(stderr, "[%u] %s: unable to create '%s'\n", index, script, overlay);
+    return 1;
+  }
+
+  size_t size = 0;
+  char* text = read_file(script, &size);
+  if (!text) {
+    fprintf(stderr, "[%u] %s: unable to read script\n", index, script);
+    return 1;
+  }
+  if (!record(r, m, script)) {
+    fprintf(stderr, "[%u] %s: unable to create the journal\n", index, script);
+    free(text);
+    return 1;
+  }
+  if (!guest_start(r, m)) {
+    fprintf(stderr, "[%u] %s: unable to profile\n", index, script);
+    free(text);
+    return 1;
+  }
+  if (!start_trace(r, m, script)) {
+    fprintf(stderr, "[%u] %s: unable to create the trace\n", index, script);
+    free(text);
+    return 1;
+  }
+
+#ifdef CPU_PROFILE
+  cpu_profile_reset(m);  // from the fork point on
+#endif
+  const uint32_t frames = run(r, m, text, size);
+  free(text);
+
+  journal_close(m);
+  if (!trace_close(m)) {
+    fprintf(stderr, "[%u] %s: unable to write the trace\n", index, script);
+  }
+
+  char out[4096];
+  report(m, r, index, script, frames, out, sizeof(out));
+  if (!dump(r, m, script)) {
+    fprintf(stderr, "[%u] %s: unable to save the screen\n", index, script);
+  }
+  guest_write(r, m, index, script);
+#ifdef CPU_PROFILE
+  write_profile(r, m, index, script);
+#endif
+  fflush(stdout);
+  write(STDOUT_FILENO, out, strlen(out));
+  return 0;
+}
+
+static int run_fork(runner_t* r, uint32_t threads) {
+
+  const char* disk = r->disks[0];
+
+  machine_t* m = machine_create();
+  if (!m) {
+    return 1;
+  }
+  cpu_set_jit(m, r->jit);
+
+  if (!start(r, m, disk)) {
+    return 1;
+  }
+
+  // boot up to the fork point
+  if (r->fork_at_ip) {
+    machine_stop_at_ip(m, r->fork_cs, r->fork_ip);
+  }
+  machine_stop_at_port(m, r->fork_port);
+
+  const uint32_t limit = r->fork_frames ? r->fork_frames : FORK_SEARCH_FRAMES;
+  bool hit = false;
+  for (uint32_t i = 0; i < limit && !hit; ++i) {
+    cpu_set_debug(m, false);
+    hit = machine_run_frame(m);
+  }
+  if (!hit && !r->fork_frames) {
+    fprintf(stderr, "Fork point not reached in %u frames!\n", limit);
+    return 1;
+  }
+  machine_stop_clear(m);
+
+  if (r->save && !snapshot_save(m, r->save)) {
+    fprintf(stderr, "Unable to save '%s'!\n", r->save);
+    return 1;
+  }
+
+  printf("forking at %04x:%04x after %llu cycles\n", cpu_get_CS(m),
+    cpu_get_IP(m), (unsigned long long)cpu_get_cycles(m));
+
+  // anything buffered would be written again by every child
+  fflush(NULL);
+
+  const uint32_t children = r->num_disks - 1;
+  uint32_t running = 0;
+  uint32_t failed  = 0;
+
+  for (uint32_t i = 0; i < children; ++i) {
+    int status = 0;
+    if (running == threads) {
+      wait(&status);
+      failed  += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+      running -= 1;
+    }
+    const pid_t pid = fork();
+    if (pid == 0) {
+      const int code = run_child(r, m, i);
+      fflush(NULL);
+      _exit(code);
+    }
+    if (pid < 0) {
+      fprintf(stderr, "[%u] fork failed\n", i);
+      failed += 1;
+      continue;
+    }
+    running += 1;
+  }
+  while (running) {
+    int status = 0;
+    wait(&status);
+    failed  += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    running -= 1;
+  }
+
+  machine_destroy(m);
+
+  printf("%u of %u children ran\n", children - failed, children);
+  return failed ? 1 : 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: iceXtRunner [options] <bios.hex> <diskrom.hex> <disk.img>...\n"
+    "       iceXtRunner --fork-at-* ... [options] <bios.hex> <diskrom.hex>\n"
+    "                   <disk.img> <script>...\n"
+    "  --threads N         machines run at once (default 4)\n"
+    "  --frames N          video frames to run each machine for (default 1000,\n"
+    "                      no limit with --cycles)\n"
+    "  --cycles N          clock cycles to run each machine for\n"
+    "  --until-ip CS:IP    stop a machine before the instruction at CS:IP (hex)\n"
+    "  --until-port N      stop a machine after a write to I/O port N (hex)\n"
+    "  --text              print the text screen of each machine when done\n"
+    "  --dump-screen FMT   save the final screen as <name>.FMT, ppm or png\n"
+    "  --dump-text         save the final text page as UTF-8 to <name>.txt\n"
+    "  --no-jit            interpret everything\n"
+    "  --restore FILE      start from a snapshot, the BIOS and ROM are unused\n"
+    "  --save FILE         save a snapshot at the fork point\n"
+    "  --record            journal the input of each machine to <name>.journal\n"
+    "  --trace             record every instruction of each machine to\n"
+    "                      <name>.trace\n"
+    "  --guest-profile     profile the guest code into <name>.guest and\n"
+    "                      <name>.guest.folded\n"
+    "  --guest-period N    clock cycles between samples (default 1000), 0 to\n"
+    "                      count every instruction exactly\n"
+    "  --symbols FILE@ADDR name the code after the labels of a NASM or wdis\n"
+    "                      listing loaded at linear address ADDR (hex), by\n"
+    "                      default roms/bios/pcxtbios.lst and\n"
+    "                      roms/diskrom/bin/diskrom.lst next to the hex files\n"
+#ifdef CPU_PROFILE
+    "  --profile FMT       write the interpreter profile of each machine, a\n"
+    "                      report to <name>.profile or folded stacks to\n"
+    "                      <name>.folded for FMT report or folded\n"
+#endif
+    "  --fork-at-ip CS:IP  fork before the instruction at CS:IP (hex)\n"
+    "  --fork-at-port N    fork after a write to I/O port N (hex)\n"
+    "  --fork-at-frame N   fork after N frames\n");
+}
+
+int main(int argc, char** args) {
+
+  runner_t r;
+  memset(&r, 0, sizeof(r));
+  r.frames    = 1000;
+  r.jit       = true;
+  r.fork_port  = -1;
+  r.until_port = -1;
+  r.guest_period = 1000;
+  r.listings     = calloc(argc, sizeof(const char*));
+
+  uint32_t threads = 4;
+  bool     fan_out = false;
+  bool     frames  = false;  // --frames given
+
+  const char** paths = calloc(argc, sizeof(const char*));
+  uint32_t numPaths = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(args[i], "--threads") == 0 && has_value) {
+      threads = (uint32_t)atoi(args[++i]);
+      continue;
+    }
+    if (strcmp(args[i], "--frames") == 0 && has_value) {
+      r.frames = (uint32_t)atoi(args[++i]);
+      frames = true;
+      continue;
+    }
+    if (strcmp(args[i], "--cycles") == 0 && has_value) {
+      r.cycles = strtoull(args[++i], NULL, 10);
+      continue;
+    }
+    if (strcmp(args[i], "--until-ip") == 0 && has_value) {
+      unsigned cs = 0, ip = 0;
+      if (sscanf(args[++i], "%x:%x", &cs, &ip) != 2) {
+        fprintf(stderr, "Bad CS:IP '%s'!\n", args[i]);
+        return 1;
+      }
+      r.until_at_ip = true;
+      r.until_cs    = (uint16_t)cs;
+      r.until_ip    = (uint16_t)ip;
+      continue;
+    }
+    if (strcmp(args[i], "--until-port") == 0 && has_value) {
+      r.until_port = (int32_t)strtol(args[++i], NULL, 16) & 0xfff;
+      continue;
+    }
+    if (strcmp(args[i], "--text") == 0) {
+      r.text = true;
+      continue;
+    }
+    if (strcmp(args[i], "--dump-screen") == 0 && has_value) {
+      r.screen = args[++i];
+      if (strcmp(r.screen, "ppm") && strcmp(r.screen, "png")) {
+        fprintf(stderr, "Unknown image format '%s'!\n", r.screen);
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(args[i], "--dump-text") == 0) {
+      r.dump_text = true;
+      continue;
+    }
+    if (strcmp(args[i], "--no-jit") == 0) {
+      r.jit = false;
+      continue;
+    }
+    if (strcmp(args[i], "--restore") == 0 && has_value) {
+      r.restore = args[++i];
+      continue;
+    }
+    if (strcmp(args[i], "--save") == 0 && has_value) {
+      r.save = args[++i];
+      continue;
+    }
+    if (strcmp(args[i], "--record") == 0) {
+      r.record = true;
+      continue;
+    }
+    if (strcmp(args[i], "--trace") == 0) {
+      r.trace = true;
+      continue;
+    }
+    if (strcmp(args[i], "--guest-profile") == 0) {
+      r.guest = true;
+      continue;
+    }
+    if (strcmp(args[i], "--guest-period") == 0 && has_value) {
+      r.guest_period = (uint32_t)strtoul(args[++i], NULL, 0);
+      continue;
+    }
+    if (strcmp(args[i], "--symbols") == 0 && has_value) {
+      const char* listing = args[++i];
+      if (!strrchr(listing, '@')) {
+        fprintf(stderr, "Expected FILE@ADDR, got '%s'!\n", listing);
+        return 1;
+      }
+      r.listings[r.num_listings++] = listing;
+      continue;
+    }
+#ifdef CPU_PROFILE
+    if (strcmp(args[i], "--profile") == 0 && has_value) {
+      const char* format = args[++i];
+      if (strcmp(format, "report") && strcmp(format, "folded")) {
+        fprintf(stderr, "Unknown profile format '%s'!\n", format);
+        return 1;
+      }
+      r.profile        = true;
+      r.profile_folded = strcmp(format, "folded") == 0;
+      continue;
+    }
+#endif
+    if (strcmp(args[i], "--fork-at-ip") == 0 && has_value) {
+      unsigned cs = 0, ip = 0;
+      if (sscanf(args[++i], "%x:%x", &cs, &ip) != 2) {
+        fprintf(stderr, "Bad CS:IP '%s'!\n", args[i]);
+        return 1;
+      }
+      r.fork_at_ip = true;
+      r.fork_cs    = (uint16_t)cs;
+      r.fork_ip    = (uint16_t)ip;
+      fan_out = true;
+      continue;
+    }
+    if (strcmp(args[i], "--fork-at-port") == 0 && has_value) {
+      r.fork_port = (int32_t)strtol(args[++i], NULL, 16) & 0xfff;
+      fan_out = true;
+      continue;
+    }
+    if (strcmp(args[i], "--fork-at-frame") == 0 && has_value) {
+      r.fork_frames = (uint32_t)atoi(args[++i]);
+      fan_out = true;
+      continue;
+    }
+    if (strncmp(args[i], "--", 2) == 0) {
+      fprintf(stderr, "Unknown option '%s'!\n", args[i]);
+      usage();
+      return 1;
+    }
+    paths[numPaths++] = args[i];
+  }
+
+  if (numPaths < (fan_out ? 4u : 3u)) {
+    usage();
+    return 1;
+  }
+
+  r.bios      = paths[0];
+  r.rom       = paths[1];
+  r.disks     = paths + 2;
+  r.num_disks = numPaths - 2;
+
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (r.cycles && !frames) {
+    r.frames = UINT32_MAX;
+  }
+
+  const int ret = fan_out ? run_fork(&r, threads) : run_threads(&r, threads);
+  free(r.listings);
+  free(paths);
+  return ret;
+}
@@ -0,0 +1,244 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "screenshot.h"
+#include "machine.h"
+
+
+// Unicode of the code page 437 characters 00h..1Fh and 80h..FFh, 7Fh is
+// U+2302 and the rest is ASCII. 00h is shown as a space.
+static const uint16_t cp437_low[32] = {
+  0x0020, 0x263A, 0x263B, 0x2665, 0x2666, 0x2663, 0x2660, 0x2022,
+  0x25D8, 0x25CB, 0x25D9, 0x2642, 0x2640, 0x266A, 0x266B, 0x263C,
+  0x25BA, 0x25C4, 0x2195, 0x203C, 0x00B6, 0x00A7, 0x25AC, 0x21A8,
+  0x2191, 0x2193, 0x2192, 0x2190, 0x221F, 0x2194, 0x25B2, 0x25BC,
+};
+
+static const uint16_t cp437_high[128] = {
+  0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7,
+  0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+  0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9,
+  0x00FF, 0x00D6, 0x00DC, 0x00A2, 0x00A3, 0x00A5, 0x20A7, 0x0192,
+  0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA,
+  0x00BF, 0x2310, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+  0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+  0x2555, 0x2563, 0x2551, 0x2557, 0x255D, 0x255C, 0x255B, 0x2510,
+  0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x255E, 0x255F,
+  0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x2567,
+  0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256B,
+  0x256A, 0x2518, 0x250C, 0x2588, 0x2584, 0x258C, 0x2590, 0x2580,
+  0x03B1, 0x00DF, 0x0393, 0x03C0, 0x03A3, 0x03C3, 0x00B5, 0x03C4,
+  0x03A6, 0x0398, 0x03A9, 0x03B4, 0x221E, 0x03C6, 0x03B5, 0x2229,
+  0x2261, 0x00B1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00F7, 0x2248,
+  0x00B0, 0x2219, 0x00B7, 0x221A, 0x207F, 0x00B2, 0x25A0, 0x00A0,
+};
+
+static uint32_t* render(machine_t *m) {
+  uint32_t* pixels = malloc(DISPLAY_WIDTH * DISPLAY_HEIGHT * sizeof(uint32_t));
+  if (pixels) {
+    display_draw(m, pixels, DISPLAY_WIDTH);
+  }
+  return pixels;
+}
+
+// Rows of 8 bit RGB, each preceded by filter when it is not negative.
+static uint8_t* pack_rgb(const uint32_t* pixels, int filter, size_t* size) {
+  const size_t row = (filter >= 0) + DISPLAY_WIDTH * 3;
+  *size = row * DISPLAY_HEIGHT;
+  uint8_t* out = malloc(*size);
+  if (!out) {
+    return NULL;
+  }
+  uint8_t* dst = out;
+  for (uint32_t y = 0; y < DISPLAY_HEIGHT; ++y) {
+    if (filter >= 0) {
+      *dst++ = (uint8_t)filter;
+    }
+    for (uint32_t x = 0; x < DISPLAY_WIDTH; ++x) {
+      const uint32_t rgb = *pixels++;
+      *dst++ = (rgb >> 16) & 0xff;
+      *dst++ = (rgb >>  8) & 0xff;
+      *dst++ = (rgb >>  0) & 0xff;
+    }
+  }
+  return out;
+}
+
+bool screenshot_ppm(machine_t *m, const char* path) {
+  uint32_t* pixels = render(m);
+  if (!pixels) {
+    return false;
+  }
+  size_t   size = 0;
+  uint8_t* rgb  = pack_rgb(pixels, -1, &size);
+  free(pixels);
+  if (!rgb) {
+    return false;
+  }
+  FILE* fd = fopen(path, "wb");
+  if (!fd) {
+    free(rgb);
+    return false;
+  }
+  fprintf(fd, "P6\n%u %u\n255\n", DISPLAY_WIDTH, DISPLAY_HEIGHT);
+  const bool ok = fwrite(rgb, 1, size, fd) == size;
+  free(rgb);
+  return (fclose(fd) == 0) && ok;
+}
+
+//----------------------------------------------------------------
+// PNG, with the image data in stored (uncompressed) deflate blocks
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t size) {
+  crc = ~crc;
+  while (size--) {
+    crc ^= *data++;
+    for (int i = 0; i < 8; ++i) {
+      crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+static void put32be(uint8_t* dst, uint32_t v) {
+  dst[0] = v >> 24;
+  dst[1] = v >> 16;
+  dst[2] = v >>  8;
+  dst[3] = v >>  0;
+}
+
+static bool write_chunk(FILE* fd, const char* type, const uint8_t* data, uint32_t size) {
+  uint8_t head[8];
+  put32be(head, size);
+  memcpy(head + 4, type, 4);
+  uint32_t crc = crc32_update(0, head + 4, 4);
+  crc = crc32_update(crc, data, size);
+  uint8_t tail[4];
+  put32be(tail, crc);
+  return fwrite(head, 1, 8, fd) == 8 &&
+         (size == 0 || fwrite(data, 1, size, fd) == size) &&
+         fwrite(tail, 1, 4, fd) == 4;
+}
+
+// zlib stream of src in stored blocks of up to 65535 bytes.
+static uint8_t* zlib_stored(const uint8_t* src, size_t size, size_t* out_size) {
+  const size_t blocks = size / 0xffff + 1;
+  uint8_t* out = malloc(2 + blocks * 5 + size + 4);
+  if (!out) {
+    return NULL;
+  }
+  uint8_t* dst = out;
+  *dst++ = 0x78;  // deflate, 32KB window
+  *dst++ = 0x01;  // no preset dictionary, header checksum
+  uint32_t a = 1, b = 0;  // adler32
+  size_t   left = size;
+  do {
+    const uint32_t n = left < 0xffff ? (uint32_t)left : 0xffff;
+    *dst++ = (left == n) ? 1 : 0;  // BFINAL, BTYPE=00
+    *dst++ = n & 0xff;
+    *dst++ = n >> 8;
+    *dst++ = ~n & 0xff;
+    *dst++ = (~n >> 8) & 0xff;
+    for (uint32_t i = 0; i < n; ++i) {
+      a = (a + src[i]) % 65521;
+      b = (b + a) % 65521;
+    }
+    memcpy(dst, src, n);
+    dst  += n;
+    src  += n;
+    left -= n;
+  } while (left);
+  put32be(dst, (b << 16) | a);
+  dst += 4;
+  *out_size = dst - out;
+  return out;
+}
+
+bool screenshot_png(machine_t *m, const char* path) {
+  uint32_t* pixels = render(m);
+  if (!pixels) {
+    return false;
+  }
+  size_t   size = 0;
+  uint8_t* rows = pack_rgb(pixels, 0, &size);  // filter type none
+  free(pixels);
+  if (!rows) {
+    return false;
+  }
+  size_t   zsize = 0;
+  uint8_t* zdata = zlib_stored(rows, size, &zsize);
+  free(rows);
+  if (!zdata) {
+    return false;
+  }
+  FILE* fd = fopen(path, "wb");
+  if (!fd) {
+    free(zdata);
+    return false;
+  }
+
+  static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  uint8_t ihdr[13];
+  put32be(ihdr + 0, DISPLAY_WIDTH);
+  put32be(ihdr + 4, DISPLAY_HEIGHT);
+  ihdr[8]  = 8;  // bit depth
+  ihdr[9]  = 2;  // truecolour
+  ihdr[10] = 0;  // deflate
+  ihdr[11] = 0;  // adaptive filtering
+  ihdr[12] = 0;  // no interlace
+
+  const bool ok = fwrite(signature, 1, 8, fd) == 8 &&
+                  write_chunk(fd, "IHDR", ihdr, sizeof(ihdr)) &&
+                  write_chunk(fd, "IDAT", zdata, (uint32_t)zsize) &&
+                  write_chunk(fd, "IEND", NULL, 0);
+  free(zdata);
+  return (fclose(fd) == 0) && ok;
+}
+
+//----------------------------------------------------------------
+// text page
+
+static size_t put_utf8(char* dst, uint16_t c) {
+  if (c < 0x80) {
+    dst[0] = (char)c;
+    return 1;
+  }
+  if (c < 0x800) {
+    dst[0] = (char)(0xc0 | (c >> 6));
+    dst[1] = (char)(0x80 | (c & 0x3f));
+    return 2;
+  }
+  dst[0] = (char)(0xe0 | (c >> 12));
+  dst[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+  dst[2] = (char)(0x80 | (c & 0x3f));
+  return 3;
+}
+
+bool screenshot_text(machine_t *m, const char* path) {
+  FILE* fd = fopen(path, "wb");
+  if (!fd) {
+    return false;
+  }
+  bool ok = true;
+  for (uint32_t y = 0; y < 25; ++y) {
+    char   line[80 * 3 + 1];
+    size_t len = 0;
+    size_t end = 0;  // length without the trailing spaces
+    for (uint32_t x = 0; x < 80; ++x) {
+      const uint8_t ch = mem_read(m, 0xB8000 + (y * 80 + x) * 2);
+      const uint16_t c = (ch <  0x20) ? cp437_low[ch] :
+                         (ch <  0x7f) ? ch :
+                         (ch == 0x7f) ? 0x2302 : cp437_high[ch - 0x80];
+      len += put_utf8(line + len, c);
+      if (c != 0x20) {
+        end = len;
+      }
+    }
+    line[end++] = '\n';
+    ok &= fwrite(line, 1, end, fd) == end;
+  }
+  return (fclose(fd) == 0) && ok;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+
+
+// Render the current frame and write it as a binary PPM (P6) image.
+bool screenshot_ppm (machine_t *m, const char* path);
+// Render the current frame and write it as an uncompressed PNG image.
+bool screenshot_png (machine_t *m, const char* path);
+// Write the 80x25 text page at B800:0000 as UTF-8, mapping the characters
+// from code page 437. Trailing spaces are trimmed.
+bool screenshot_text(machine_t *m, const char* path);
@@ -1,5 +1,9 @@
+#include <stdio.h>
+#include <string.h>
+
 #include "serial.h"
-#include "cpu.h"
+#include "journal.h"
+#include "machine.h"
 
 
 // notes:
@@ -10,48 +14,35 @@
 //  COM4 2E8 IRQ3
 //
 
-static uint8_t RBR;         // 3F8 receiver buffer
-static uint8_t THR;         // 3F8 transmit holding register
-static uint8_t IER;         // 3F9 interrupt enable
-static uint8_t IIR = 1;     // 3FA interrupt ident
-static uint8_t LCR;         // 3FB line control
-static uint8_t MCR;         // 3FC modem control
-
-static uint8_t LSR = 0b1100000;  // 3FD line status
-// { 0, TEMT, THRE, BI, FE, PE, OE, DR }
-// DR   - data ready
-// OE   - overrun error
-// PE   - parity error
-// FE   - framing error
-// BI   - break interrupt
-// THRE - transmitter holding register
-// TEMT - transmitter empty
-
-static uint8_t MSR = 0x30;  // 3FE modem status
-static uint8_t SCR;  // 3FF scratch reg
-static uint8_t DLL;  // 3F8 divisor lsb
-static uint8_t DLM;  // 3F9 divisor msb
-
-#define DLAB ((LCR & 0x80) ? 1 : 0)
-
-
-static void mouse_send(uint8_t data) {
-  RBR = data;
-  LSR |= (LSR & 1) ? 2 : 0;  // OE<=DR
-  LSR |= 1;                  // DR<=1
+#define DLAB ((u->LCR & 0x80) ? 1 : 0)
+
+
+static void mouse_send(uart_t *u, uint8_t data) {
+  u->RBR = data;
+  u->LSR |= (u->LSR & 1) ? 2 : 0;  // OE<=DR
+  u->LSR |= 1;                     // DR<=1
 }
 
-void mouse_poll() {
+static void mouse_poll(uart_t *u) {
 
 }
 
-void mouse_reset(uint8_t RTS) {
+static void mouse_reset(uart_t *u, uint8_t RTS) {
   if (/*@posedge */RTS) {
-    mouse_send('M');
+    mouse_send(u, 'M');
   }
 }
 
-void serial_io_write(uint16_t port, uint8_t value) {
+void serial_init(machine_t *m) {
+  uart_t *u = &m->serial;
+  memset(u, 0, sizeof(*u));
+  u->IIR = 1;
+  u->LSR = 0b1100000;
+  u->MSR = 0x30;
+}
+
+void serial_io_write(machine_t *m, uint16_t port, uint8_t value) {
+  uart_t *u = &m->serial;
 
   if (port >= 0x3F8 && port <= 0x3FF) {
     printf("%03x <= %02x\n", port, value);
@@ -59,98 +50,98 @@ void serial_io_write(uint16_t port, uint8_t value) {
 
   if (port == (0x3F8+0)) {  // 3F8
     if (DLAB) {
-      DLL = value;
+      u->DLL = value;
     }
     else {
       // write to transmit buffer
-      THR = value;
-      LSR &= ~0b1100000; // lower TEMT, THRE
+      u->THR = value;
+      u->LSR &= ~0b1100000; // lower TEMT, THRE
     }
   }
   if (port == (0x3F8+1)) {  // 3F9
     if (DLAB) {
-      DLM = value;
+      u->DLM = value;
     }
     else {
       // interrupt enable
-      IER = value;
+      u->IER = value;
     }
   }
   if (port == (0x3F8+3)) {  // 3FB
-    LCR = value;
+    u->LCR = value;
   }
   if (port == (0x3F8+4)) {  // 3FC
-    uint8_t delta = MCR ^ value;
-    MCR = value;
+    uint8_t delta = u->MCR ^ value;
+    u->MCR = value;
     if (delta & 2) {
-      mouse_reset(MCR & 2);  // call when DTR changes
+      mouse_reset(u, u->MCR & 2);  // call when DTR changes
     }
   }
   if (port == (0x3F8+5)) {  // 3FD
-    LSR = value;
+    u->LSR = value;
   }
   if (port == (0x3F8+6)) {  // 3FE
-    MSR = value;
+    u->MSR = value;
   }
   if (port == (0x3F8+7)) {  // 3FF
-    SCR = value;
+    u->SCR = value;
   }
 }
 
-bool _serial_io_read(uint16_t port, uint8_t* out) {
+static bool _serial_io_read(uart_t *u, uint16_t port, uint8_t* out) {
   if (port == (0x3F8+0)) {  // 3F8
     if (DLAB) {
-      *out = DLL;
+      *out = u->DLL;
     }
     else {
-      *out = RBR;
-      LSR &= ~1;  // DR<=0
-      mouse_poll();
+      *out = u->RBR;
+      u->LSR &= ~1;  // DR<=0
+      mouse_poll(u);
     }
     return true;
   }
   if (port == (0x3F8+1)) {  // 3F9
     if (DLAB) {
-      *out = DLM;
+      *out = u->DLM;
     }
     else {
-      *out = IER;
+      *out = u->IER;
     }
     return true;
   }
   if (port == (0x3F8+2)) {  // 3FA
-    *out = IIR;
-    IIR = 0b001;
+    *out = u->IIR;
+    u->IIR = 0b001;
     return true;
   }
   if (port == (0x3F8+3)) {  // 3FB
-    *out = LCR;
+    *out = u->LCR;
     return true;
   }
   if (port == (0x3F8+4)) {  // 3FC
-    *out = MCR;
+    *out = u->MCR;
     return true;
   }
   if (port == (0x3F8+5)) {  // 3FD
-    *out = LSR;
-    LSR &= 0b01100001;
+    *out = u->LSR;
+    u->LSR &= 0b01100001;
     return true;
   }
   if (port == (0x3F8+6)) {  // 3FE
-    *out = MSR;
+    *out = u->MSR;
     return true;
   }
   if (port == (0x3F8+7)) {  // 3FF
-    *out = SCR;
+    *out = u->SCR;
     return true;
   }
   return false;
 }
 
 
-bool serial_io_read(uint16_t port, uint8_t* out) {
+bool serial_io_read(machine_t *m, uint16_t port, uint8_t* out) {
 
-  if (!_serial_io_read(port, out)) {
+  if (!_serial_io_read(&m->serial, port, out)) {
     return false;
   }
 
@@ -161,3 +152,13 @@ bool serial_io_read(uint16_t port, uint8_t* out) {
   }
   return true;
 }
+
+void serial_latch(machine_t *m, uint8_t data) {
+  mouse_send(&m->serial, data);
+}
+
+void serial_receive(machine_t *m, uint8_t data) {
+  if (journal_input(m, JOURNAL_SERIAL, data)) {
+    serial_latch(m, data);
+  }
+}
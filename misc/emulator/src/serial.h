@@ -2,6 +2,41 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "cpu.h"
 
-void serial_io_write(uint16_t port, uint8_t value);
-bool serial_io_read(uint16_t port, uint8_t* out);
+
+// 8250 UART at COM1, with a serial mouse attached
+typedef struct {
+  uint8_t RBR;  // 3F8 receiver buffer
+  uint8_t THR;  // 3F8 transmit holding register
+  uint8_t IER;  // 3F9 interrupt enable
+  uint8_t IIR;  // 3FA interrupt ident
+  uint8_t LCR;  // 3FB line control
+  uint8_t MCR;  // 3FC modem control
+
+  uint8_t LSR;  // 3FD line status
+  // { 0, TEMT, THRE, BI, FE, PE, OE, DR }
+  // DR   - data ready
+  // OE   - overrun error
+  // PE   - parity error
+  // FE   - framing error
+  // BI   - break interrupt
+  // THRE - transmitter holding register
+  // TEMT - transmitter empty
+
+  uint8_t MSR;  // 3FE modem status
+  uint8_t SCR;  // 3FF scratch reg
+  uint8_t DLL;  // 3F8 divisor lsb
+  uint8_t DLM;  // 3F9 divisor msb
+} uart_t;
+
+void serial_init(machine_t *m);
+
+void serial_io_write(machine_t *m, uint16_t port, uint8_t value);
+bool serial_io_read(machine_t *m, uint16_t port, uint8_t* out);
+
+// A byte received by COM1 from outside the machine, it goes through the
+// journal, see journal_input().
+void serial_receive(machine_t *m, uint8_t data);
+// Receive a byte as is, for replaying a journal.
+void serial_latch  (machine_t *m, uint8_t data);
@@ -0,0 +1,604 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "machine.h"
+
+
+#define SNAPSHOT_MAGIC "iceXtSnp"
+
+#define PAGE_SIZE 4096
+
+//----------------------------------------------------------------
+// LZ compression of memory pages
+//
+// A page is a list of tokens, 00h..7Fh copy the next 1..128 bytes
+// literally, 80h..FFh repeat 3..130 bytes starting a 16 bit little endian
+// offset back. Repeats may overlap the bytes they produce.
+
+#define LZ_MIN  3
+#define LZ_MAX  (0x7f + LZ_MIN)
+#define LZ_HASH 12
+
+static bool lz_literals(const uint8_t* src, uint32_t size, uint8_t* dst,
+                        uint32_t* out, uint32_t cap) {
+  while (size) {
+    const uint32_t n = size < 0x80 ? size : 0x80;
+    if (*out + 1 + n > cap) {
+      return false;
+    }
+    dst[(*out)++] = n - 1;
+    memcpy(dst + *out, src, n);
+    *out += n;
+    src  += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Returns the compressed size, or 0 when it would not be smaller than cap.
+static uint32_t lz_compress(const uint8_t* src, uint32_t size, uint8_t* dst, uint32_t cap) {
+
+  uint16_t table[1 << LZ_HASH];  // position + 1 of the last 3 bytes with a hash
+  memset(table, 0, sizeof(table));
+
+  uint32_t out = 0;
+  uint32_t lit = 0;  // start of the literals not yet written
+  uint32_t i   = 0;
+
+  while (i + LZ_MIN <= size) {
+    const uint32_t key  = src[i] | (src[i + 1] << 8) | (src[i + 2] << 16);
+    const uint32_t hash = (key * 2654435761u) >> (32 - LZ_HASH);
+    const uint32_t cand = table[hash];
+    table[hash] = i + 1;
+
+    uint32_t len  = 0;
+    uint32_t from = 0;
+    if (cand) {
+      from = cand - 1;
+      while (i + len < size && len < LZ_MAX && src[from + len] == src[i + len]) {
+        ++len;
+      }
+    }
+    if (len < LZ_MIN) {
+      ++i;
+      continue;
+    }
+
+    if (!lz_literals(src + lit, i - lit, dst, &out, cap) || out + 3 > cap) {
+      return 0;
+    }
+    const uint32_t offset = i - from;
+    dst[out++] = 0x80 | (len - LZ_MIN);
+    dst[out++] = offset & 0xff;
+    dst[out++] = offset >> 8;
+    i  += len;
+    lit = i;
+  }
+
+  if (!lz_literals(src + lit, size - lit, dst, &out, cap) || out >= cap) {
+    return 0;
+  }
+  return out;
+}
+
+static bool lz_decompress(const uint8_t* src, uint32_t size, uint8_t* dst, uint32_t cap) {
+  uint32_t in  = 0;
+  uint32_t out = 0;
+  while (in < size) {
+    const uint8_t token = src[in++];
+    if (token < 0x80) {
+      const uint32_t n = token + 1;
+      if (in + n > size || out + n > cap) {
+        return false;
+      }
+      memcpy(dst + out, src + in, n);
+      in  += n;
+      out += n;
+    }
+    else {
+      const uint32_t n = token - 0x80 + LZ_MIN;
+      if (in + 2 > size) {
+        return false;
+      }
+      const uint32_t offset = src[in] | (src[in + 1] << 8);
+      in += 2;
+      if (offset == 0 || offset > out || out + n > cap) {
+        return false;
+      }
+      for (uint32_t i = 0; i < n; ++i, ++out) {
+        dst[out] = dst[out - offset];
+      }
+    }
+  }
+  return out == cap;
+}
+
+//----------------------------------------------------------------
+// Section data
+
+typedef struct {
+  uint8_t* data;
+  size_t   size;
+  size_t   cap;
+} buf_t;
+
+static void put(buf_t* b, const void* data, size_t size) {
+  if (b->size + size > b->cap) {
+    b->cap  = (b->size + size) * 2;
+    b->data = realloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->size, data, size);
+  b->size += size;
+}
+
+static void put8(buf_t* b, uint8_t v) {
+  put(b, &v, 1);
+}
+
+static void put16(buf_t* b, uint16_t v) {
+  const uint8_t d[] = { v & 0xff, v >> 8 };
+  put(b, d, sizeof(d));
+}
+
+static void put32(buf_t* b, uint32_t v) {
+  put16(b, v & 0xffff);
+  put16(b, v >> 16);
+}
+
+static void put64(buf_t* b, uint64_t v) {
+  put32(b, (uint32_t)v);
+  put32(b, (uint32_t)(v >> 32));
+}
+
+typedef struct {
+  const uint8_t* data;
+  size_t         left;
+  bool           ok;    // cleared when reading past the end
+} reader_t;
+
+static const uint8_t* get(reader_t* r, size_t size) {
+  if (size > r->left) {
+    r->ok   = false;
+    r->left = 0;
+    return NULL;
+  }
+  const uint8_t* p = r->data;
+  r->data += size;
+  r->left -= size;
+  return p;
+}
+
+static uint8_t get8(reader_t* r) {
+  const uint8_t* p = get(r, 1);
+  return p ? p[0] : 0;
+}
+
+static uint16_t get16(reader_t* r) {
+  const uint8_t* p = get(r, 2);
+  return p ? (p[0] | (p[1] << 8)) : 0;
+}
+
+static uint32_t get32(reader_t* r) {
+  const uint32_t lo = get16(r);
+  return lo | ((uint32_t)get16(r) << 16);
+}
+
+static uint64_t get64(reader_t* r) {
+  const uint64_t lo = get32(r);
+  return lo | ((uint64_t)get32(r) << 32);
+}
+
+static void save_cpu(machine_t *m, buf_t* b) {
+  cpu_state_t s;
+  cpu_get_state(m, &s);
+  for (int i = 0; i < 8; ++i) {
+    put16(b, s.regs[i]);
+  }
+  for (int i = 0; i < 4; ++i) {
+    put16(b, s.segs[i]);
+  }
+  put16(b, s.pc);
+  put16(b, s.flags);
+  put16(b, s.irqs);
+  put8 (b, s.sleeping);
+  put64(b, s.clock);
+}
+
+static bool load_cpu(machine_t *m, reader_t* r) {
+  cpu_state_t s;
+  for (int i = 0; i < 8; ++i) {
+    s.regs[i] = get16(r);
+  }
+  for (int i = 0; i < 4; ++i) {
+    s.segs[i] = get16(r);
+  }
+  s.pc       = get16(r);
+  s.flags    = get16(r);
+  s.irqs     = get16(r);
+  s.sleeping = get8(r);
+  s.clock    = get64(r);
+  if (r->ok) {
+    cpu_set_state(m, &s);
+  }
+  return r->ok;
+}
+
+// Store a block of up to 256 pages: its size and the number of pages
+// stored, then index, stored size and data of every page which is not all
+// zero. A page which does not pack is stored as is.
+static void save_pages(buf_t* b, const uint8_t* data, uint32_t size) {
+  static const uint8_t zero[PAGE_SIZE];
+  uint8_t packed[PAGE_SIZE];
+
+  uint32_t count = 0;
+  for (uint32_t page = 0; page * PAGE_SIZE < size; ++page) {
+    const uint32_t len = (size - page * PAGE_SIZE < PAGE_SIZE) ? size - page * PAGE_SIZE : PAGE_SIZE;
+    count += memcmp(data + page * PAGE_SIZE, zero, len) != 0;
+  }
+  put32(b, size);
+  put16(b, count);
+  for (uint32_t page = 0; page * PAGE_SIZE < size; ++page) {
+    const uint8_t* src = data + page * PAGE_SIZE;
+    const uint32_t len = (size - page * PAGE_SIZE < PAGE_SIZE) ? size - page * PAGE_SIZE : PAGE_SIZE;
+    if (memcmp(src, zero, len) == 0) {
+      continue;
+    }
+    const uint32_t packed_len = lz_compress(src, len, packed, len);
+    put8 (b, page);
+    put16(b, packed_len ? packed_len : len);
+    put  (b, packed_len ? packed : src, packed_len ? packed_len : len);
+  }
+}
+
+static bool load_pages(reader_t* r, uint8_t* data, uint32_t size) {
+  if (get32(r) != size) {
+    return false;
+  }
+  memset(data, 0, size);
+
+  for (uint32_t count = get16(r); r->ok && count; --count) {
+    const uint32_t page   = get8(r);
+    const uint32_t stored = get16(r);
+    const uint8_t* src    = get(r, stored);
+    if (!src || page * PAGE_SIZE >= size) {
+      return false;
+    }
+    const uint32_t len = (size - page * PAGE_SIZE < PAGE_SIZE) ? size - page * PAGE_SIZE : PAGE_SIZE;
+    uint8_t* dst = data + page * PAGE_SIZE;
+    if (stored == len) {
+      memcpy(dst, src, len);
+    }
+    else if (!lz_decompress(src, stored, dst, len)) {
+      return false;
+    }
+  }
+  return r->ok;
+}
+
+static void save_disk(machine_t *m, buf_t* b) {
+  const disk_t* d = &m->disk;
+  put64(b, d->disk_size);
+  put8 (b, d->spi_cs);
+  put8 (b, d->sd_idle);
+  put64(b, d->shift_in);
+  put64(b, d->shift_out);
+  put32(b, d->sector);
+  put32(b, d->read_count);
+  put32(b, d->write_count);
+  put32(b, d->write_sum);
+  put8 (b, d->wait_for_start);
+  put64(b, d->io ? (uint64_t)ftell(d->io) : 0);
+}
+
+static bool load_disk(machine_t *m, reader_t* r) {
+  disk_t* d = &m->disk;
+  const uint64_t size = get64(r);
+  if (d->disk && size != d->disk_size) {
+    fprintf(stderr, "Snapshot was taken with a different disk image!\n");
+    return false;
+  }
+  d->spi_cs         = get8(r);
+  d->sd_idle        = get8(r);
+  d->shift_in       = get64(r);
+  d->shift_out      = get64(r);
+  d->sector         = get32(r);
+  d->read_count     = get32(r);
+  d->write_count    = get32(r);
+  d->write_sum      = get32(r);
+  d->wait_for_start = get8(r);
+  const uint64_t pos = get64(r);
+  if (d->disk) {
+    d->io = d->disk;
+    fseek(d->io, (long)pos, SEEK_SET);
+  }
+  return r->ok;
+}
+
+static void save_pit(machine_t *m, buf_t* b) {
+  const pit_t* p = &m->pit;
+  for (int i = 0; i < 3; ++i) {
+    const pit_counter_t* c = &p->counter[i];
+    put32(b, c->reload);
+    put8 (b, c->mode);
+    put8 (b, c->access);
+    put8 (b, c->msb);
+    put8 (b, c->low);
+    put8 (b, c->latched);
+    put16(b, c->latch);
+    put8 (b, c->running);
+    put64(b, c->start);
+  }
+  put64(b, p->irq0_tick);
+}
+
+static bool load_pit(machine_t *m, reader_t* r) {
+  pit_t* p = &m->pit;
+  for (int i = 0; i < 3; ++i) {
+    pit_counter_t* c = &p->counter[i];
+    c->reload  = get32(r);
+    c->mode    = get8(r);
+    c->access  = get8(r);
+    c->msb     = get8(r);
+    c->low     = get8(r);
+    c->latched = get8(r);
+    c->latch   = get16(r);
+    c->running = get8(r);
+    c->start   = get64(r);
+  }
+  p->irq0_tick = get64(r);
+  return r->ok;
+}
+
+static void save_serial(machine_t *m, buf_t* b) {
+  const uart_t* u = &m->serial;
+  put8(b, u->RBR);
+  put8(b, u->THR);
+  put8(b, u->IER);
+  put8(b, u->IIR);
+  put8(b, u->LCR);
+  put8(b, u->MCR);
+  put8(b, u->LSR);
+  put8(b, u->MSR);
+  put8(b, u->SCR);
+  put8(b, u->DLL);
+  put8(b, u->DLM);
+}
+
+static bool load_serial(machine_t *m, reader_t* r) {
+  uart_t* u = &m->serial;
+  u->RBR = get8(r);
+  u->THR = get8(r);
+  u->IER = get8(r);
+  u->IIR = get8(r);
+  u->LCR = get8(r);
+  u->MCR = get8(r);
+  u->LSR = get8(r);
+  u->MSR = get8(r);
+  u->SCR = get8(r);
+  u->DLL = get8(r);
+  u->DLM = get8(r);
+  return r->ok;
+}
+
+static void save_keyboard(machine_t *m, buf_t* b) {
+  const keyboard_t* k = &m->keyboard;
+  put8(b, k->buffer_recv);
+  put (b, k->queue, sizeof(k->queue));
+  put8(b, k->queue_head);
+  put8(b, k->queue_tail);
+}
+
+static bool load_keyboard(machine_t *m, reader_t* r) {
+  keyboard_t* k = &m->keyboard;
+  k->buffer_recv = get8(r);
+  const uint8_t* queue = get(r, sizeof(k->queue));
+  if (queue) {
+    memcpy(k->queue, queue, sizeof(k->queue));
+  }
+  k->queue_head = get8(r);
+  k->queue_tail = get8(r);
+  return r->ok;
+}
+
+// The registers, then the video memory and EGA planes as pages.
+static void save_display(machine_t *m, buf_t* b) {
+  const display_t* d = &m->display;
+  put8(b, d->display_mode);
+  put8(b, d->reg3D8);
+  put8(b, d->reg3D9);
+  put8(b, d->latch0);
+  put8(b, d->latch1);
+  put8(b, d->latch2);
+  put8(b, d->latch3);
+  put (b, d->palette, sizeof(d->palette));
+  put8(b, d->p3C0_ff);
+  put8(b, d->p3C0_index);
+  put8(b, d->p3C4_index);
+  put8(b, d->p3C4_2);
+  put8(b, d->p3CE_index);
+  put8(b, d->p3CE_0);
+  put8(b, d->p3CE_1);
+  put8(b, d->p3CE_2);
+  put8(b, d->p3CE_3);
+  put8(b, d->p3CE_4);
+  put8(b, d->p3CE_5);
+  put8(b, d->p3CE_7);
+  put8(b, d->p3CE_8);
+  save_pages(b, d->vram,   sizeof(d->vram));
+  save_pages(b, d->plane0, sizeof(d->plane0));
+  save_pages(b, d->plane1, sizeof(d->plane1));
+  save_pages(b, d->plane2, sizeof(d->plane2));
+  save_pages(b, d->plane3, sizeof(d->plane3));
+}
+
+static bool load_display(machine_t *m, reader_t* r) {
+  display_t* d = &m->display;
+  d->display_mode = get8(r);
+  d->reg3D8       = get8(r);
+  d->reg3D9       = get8(r);
+  d->latch0       = get8(r);
+  d->latch1       = get8(r);
+  d->latch2       = get8(r);
+  d->latch3       = get8(r);
+  const uint8_t* palette = get(r, sizeof(d->palette));
+  if (palette) {
+    memcpy(d->palette, palette, sizeof(d->palette));
+  }
+  d->p3C0_ff      = get8(r);
+  d->p3C0_index   = get8(r);
+  d->p3C4_index   = get8(r);
+  d->p3C4_2       = get8(r);
+  d->p3CE_index   = get8(r);
+  d->p3CE_0       = get8(r);
+  d->p3CE_1       = get8(r);
+  d->p3CE_2       = get8(r);
+  d->p3CE_3       = get8(r);
+  d->p3CE_4       = get8(r);
+  d->p3CE_5       = get8(r);
+  d->p3CE_7       = get8(r);
+  d->p3CE_8       = get8(r);
+  return r->ok &&
+         load_pages(r, d->vram,   sizeof(d->vram))   &&
+         load_pages(r, d->plane0, sizeof(d->plane0)) &&
+         load_pages(r, d->plane1, sizeof(d->plane1)) &&
+         load_pages(r, d->plane2, sizeof(d->plane2)) &&
+         load_pages(r, d->plane3, sizeof(d->plane3));
+}
+
+//----------------------------------------------------------------
+
+static bool write_section(FILE* fd, const char* tag, buf_t* b) {
+  uint8_t head[8];
+  memcpy(head, tag, 4);
+  for (int i = 0; i < 4; ++i) {
+    head[4 + i] = (uint8_t)(b->size >> (i * 8));
+  }
+  const bool ok = fwrite(head, 1, sizeof(head), fd) == sizeof(head) &&
+                  fwrite(b->data, 1, b->size, fd) == b->size;
+  b->size = 0;
+  return ok;
+}
+
+bool snapshot_save(machine_t *m, const char* path) {
+
+  FILE* fd = fopen(path, "wb");
+  if (!fd) {
+    return false;
+  }
+
+  buf_t b = { 0 };
+  put(&b, SNAPSHOT_MAGIC, 8);
+  put32(&b, SNAPSHOT_VERSION);
+  bool ok = fwrite(b.data, 1, b.size, fd) == b.size;
+  b.size = 0;
+
+  save_cpu(m, &b);
+  ok = ok && write_section(fd, "CPU ", &b);
+  save_pages(&b, m->memory, sizeof(m->memory));
+  ok = ok && write_section(fd, "MEM ", &b);
+  save_display(m, &b);
+  ok = ok && write_section(fd, "DISP", &b);
+  save_disk(m, &b);
+  ok = ok && write_section(fd, "DISK", &b);
+  save_serial(m, &b);
+  ok = ok && write_section(fd, "UART", &b);
+  save_keyboard(m, &b);
+  ok = ok && write_section(fd, "KBD ", &b);
+  save_pit(m, &b);
+  ok = ok && write_section(fd, "PIT ", &b);
+  put64(&b, m->frame_end);
+  ok = ok && write_section(fd, "MACH", &b);
+
+  free(b.data);
+  ok = (fclose(fd) == 0) && ok;
+  return ok;
+}
+
+static bool load_section(machine_t *m, const uint8_t* tag, reader_t* r) {
+  if (!memcmp(tag, "CPU ", 4)) {
+    return load_cpu(m, r);
+  }
+  if (!memcmp(tag, "MEM ", 4)) {
+    return load_pages(r, m->memory, sizeof(m->memory));
+  }
+  if (!memcmp(tag, "DISP", 4)) {
+    return load_display(m, r);
+  }
+  if (!memcmp(tag, "DISK", 4)) {
+    return load_disk(m, r);
+  }
+  if (!memcmp(tag, "UART", 4)) {
+    return load_serial(m, r);
+  }
+  if (!memcmp(tag, "KBD ", 4)) {
+    return load_keyboard(m, r);
+  }
+  if (!memcmp(tag, "PIT ", 4)) {
+    return load_pit(m, r);
+  }
+  if (!memcmp(tag, "MACH", 4)) {
+    m->frame_end = get64(r);
+    return r->ok;
+  }
+  return true;  // from a later version
+}
+
+bool snapshot_restore(machine_t *m, const char* path) {
+
+  FILE* fd = fopen(path, "rb");
+  if (!fd) {
+    return false;
+  }
+  fseek(fd, 0, SEEK_END);
+  const long size = ftell(fd);
+  fseek(fd, 0, SEEK_SET);
+
+  uint8_t* data = malloc(size);
+  const bool read = data && fread(data, 1, size, fd) == (size_t)size;
+  fclose(fd);
+
+  reader_t file = { data, read ? size : 0, read };
+  const uint8_t* magic = get(&file, 8);
+  if (!magic || memcmp(magic, SNAPSHOT_MAGIC, 8) != 0) {
+    fprintf(stderr, "'%s' is not a snapshot!\n", path);
+    free(data);
+    return false;
+  }
+  const uint32_t version = get32(&file);
+  if (version != SNAPSHOT_VERSION) {
+    fprintf(stderr, "Snapshot version %u is not supported!\n", version);
+    free(data);
+    return false;
+  }
+
+  // memory is restored ahead of the CPU, which then drops its stale code
+  // caches
+  bool ok = true;
+  for (int pass = 0; pass < 2 && ok; ++pass) {
+    reader_t r = file;
+    while (ok && r.left) {
+      const uint8_t* tag  = get(&r, 4);
+      const uint32_t len  = get32(&r);
+      const uint8_t* body = get(&r, len);
+      if (!body) {
+        ok = false;
+        break;
+      }
+      const bool is_cpu = !memcmp(tag, "CPU ", 4);
+      if (is_cpu == (pass == 1)) {
+        reader_t section = { body, len, true };
+        ok = load_section(m, tag, &section);
+      }
+    }
+  }
+
+  free(data);
+  if (!ok) {
+    fprintf(stderr, "Snapshot '%s' is damaged!\n", path);
+  }
+  return ok;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+
+
+// Snapshot file layout, all values little endian:
+//
+//   "iceXtSnp"  magic
+//   u32         SNAPSHOT_VERSION
+//   sections    u8[4] tag, u32 size, size bytes of data
+//
+// Sections are CPU, MEM, DISP, DISK, UART, KBD, PIT and MACH, each field
+// stored on its own. Memory and the video memory are stored as their non
+// zero 4KB pages, LZ compressed. Unknown sections are skipped when a
+// snapshot is restored.
+#define SNAPSHOT_VERSION 2
+
+// Save the state of the whole machine. The disk image is not part of the
+// snapshot, it must be restored along with the image as it was when saved.
+bool snapshot_save(machine_t *m, const char* path);
+
+// Restore a snapshot into a machine which already has its disk image
+// loaded. The ROMs are part of the snapshot.
+bool snapshot_restore(machine_t *m, const char* path);
@@ -0,0 +1,602 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#define TRACE_THREAD
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
+#include "trace.h"
+#include "machine.h"
+
+
+#define TRACE_MAGIC "iceXtTrc"
+
+#define BLOCK_SIZE TRACE_BLOCK_SIZE
+#define BLOCKS     32            // blocks in the ring
+#define RECORD_MAX 64            // room for any record, see trace_insn()
+
+#define LINE_BITS  4             // instruction bytes are tracked in lines
+
+struct trace_t {
+  machine_t* m;
+  FILE*      file;
+  bool       gated;    // enabled by the guest only
+  bool       enabled;
+  bool       failed;   // a write to the file failed
+
+  // encoder
+  trace_state_t last;      // state at the previous instruction
+  uint64_t   index;        // instruction records written
+  bool       sequential;   // next_ip is known to the reader
+  uint16_t   next_ip;
+  bool       write_valid;  // write_addr is known to the reader
+  uint32_t   write_addr;
+
+  // Instruction bytes the reader has since the last sync, where known
+  // equals gen, and the lines they are in.
+  uint8_t    gen;
+  uint8_t    known[1024 * 1024];
+  uint8_t    lines[(1024 * 1024) >> LINE_BITS];
+
+  // ring of blocks, tail up to head are waiting for the writer
+  uint8_t*   blocks;
+  uint32_t   used[BLOCKS];
+  uint32_t   head;
+  uint32_t   tail;
+  uint8_t*   pos;  // in the head block
+  uint8_t*   end;
+#ifdef TRACE_THREAD
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  bool            done;
+#endif
+};
+
+static inline uint8_t* put16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static inline uint8_t* put64(uint8_t* p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = (v >> (i * 8)) & 0xff;
+  }
+  return p + 8;
+}
+
+static void write_block(trace_t* t, uint32_t block) {
+  const uint32_t size = t->used[block];
+  if (fwrite(t->blocks + (size_t)block * BLOCK_SIZE, 1, size, t->file) != size) {
+    t->failed = true;
+  }
+}
+
+#ifdef TRACE_THREAD
+// Drains the full blocks to the file, so the CPU never waits for the disk
+// unless the whole ring is full.
+static void* writer(void* arg) {
+  trace_t* t = arg;
+  pthread_mutex_lock(&t->lock);
+  for (;;) {
+    while (t->tail == t->head && !t->done) {
+      pthread_cond_wait(&t->cond, &t->lock);
+    }
+    if (t->tail == t->head) {
+      break;
+    }
+    const uint32_t block = t->tail;
+    pthread_mutex_unlock(&t->lock);
+    write_block(t, block);
+    pthread_mutex_lock(&t->lock);
+    t->tail = (t->tail + 1) % BLOCKS;
+    pthread_cond_broadcast(&t->cond);
+  }
+  pthread_mutex_unlock(&t->lock);
+  return NULL;
+}
+#endif
+
+// Hand the head block to the writer and start filling the next one, padded
+// to its full size unless it is the last.
+static void flush_block(trace_t* t, bool last) {
+  uint8_t* base = t->blocks + (size_t)t->head * BLOCK_SIZE;
+  if (!last) {
+    memset(t->pos, TRACE_PAD, t->end - t->pos);
+    t->pos = t->end;
+  }
+  t->used[t->head] = (uint32_t)(t->pos - base);
+#ifdef TRACE_THREAD
+  pthread_mutex_lock(&t->lock);
+  while ((t->head + 1) % BLOCKS == t->tail) {
+    pthread_cond_wait(&t->cond, &t->lock);
+  }
+  t->head = (t->head + 1) % BLOCKS;
+  pthread_cond_broadcast(&t->cond);
+  pthread_mutex_unlock(&t->lock);
+#else
+  write_block(t, t->head);
+  t->head = (t->head + 1) % BLOCKS;
+#endif
+  t->pos = t->blocks + (size_t)t->head * BLOCK_SIZE;
+  t->end = t->pos + BLOCK_SIZE;
+}
+
+// Write the full state, the records after it are encoded against it.
+static void put_sync(trace_t* t) {
+  uint8_t* p = t->pos;
+  *p++ = TRACE_SYNC;
+  p = put64(p, t->index);
+  p = put64(p, cpu_get_cycles(t->m));
+  for (int i = 0; i < TRACE_REGS; ++i) {
+    p = put16(p, t->last.regs[i]);
+  }
+  p = put16(p, t->last.pc);
+  t->pos = p;
+
+  t->sequential  = false;
+  t->write_valid = false;
+  if (++t->gen == 0) {
+    memset(t->known, 0, sizeof(t->known));
+    memset(t->lines, 0, sizeof(t->lines));
+    t->gen = 1;
+  }
+}
+
+// Room for a record, a new block starts with a sync.
+static inline void reserve(trace_t* t) {
+  if (t->end - t->pos < RECORD_MAX) {
+    flush_block(t, false);
+    put_sync(t);
+  }
+}
+
+static void take_state(trace_t* t) {
+  cpu_state_t s;
+  cpu_get_state(t->m, &s);
+  memcpy(t->last.regs, s.regs, sizeof(s.regs));
+  memcpy(t->last.regs + 8, s.segs, sizeof(s.segs));
+  t->last.regs[12] = s.flags;
+  t->last.pc = s.pc;
+}
+
+// Mask of the registers that differ, as in a TRACE_F_REGS record.
+static inline uint32_t changed(const trace_state_t* s, const trace_state_t* last) {
+#if defined(__SSE2__) && defined(__GNUC__)
+  // AX to DI, and the overlapping SI to the flags, compared in one go
+  const __m128i lo = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)s->regs),
+                                     _mm_loadu_si128((const __m128i*)last->regs));
+  const __m128i hi = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(s->regs + 5)),
+                                     _mm_loadu_si128((const __m128i*)(last->regs + 5)));
+  const uint32_t same = _mm_movemask_epi8(_mm_packs_epi16(lo, hi));
+  return ~((same & 0xff) | ((same >> 8) << 5)) & ((1 << TRACE_REGS) - 1);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TRACE_REGS; ++i) {
+    mask |= (uint32_t)(s->regs[i] != last->regs[i]) << i;
+  }
+  return mask;
+#endif
+}
+
+void trace_insn(trace_t *t, const trace_state_t *s, uint32_t addr,
+                const uint8_t *bytes, uint32_t len, bool cached) {
+  reserve(t);
+
+  uint8_t* p   = t->pos;
+  uint8_t* tag = p++;
+  uint8_t  flags = 0;
+
+  if (!t->sequential || s->pc != t->next_ip || s->regs[8 + CS] != t->last.regs[8 + CS]) {
+    flags |= TRACE_F_IP;
+    p = put16(p, s->pc);
+  }
+
+  const uint32_t mask = changed(s, &t->last);
+  if (mask) {
+    flags |= TRACE_F_REGS;
+    p = put16(p, (uint16_t)mask);
+#if defined(__GNUC__)
+    for (uint32_t bits = mask; bits; bits &= bits - 1) {
+      p = put16(p, s->regs[__builtin_ctz(bits)]);
+    }
+#else
+    for (int i = 0; i < TRACE_REGS; ++i) {
+      if (mask & (1 << i)) {
+        p = put16(p, s->regs[i]);
+      }
+    }
+#endif
+  }
+
+  if (len > TRACE_MAX_LEN) {
+    len = TRACE_MAX_LEN;
+  }
+  uint32_t count = 0;
+  if (!cached || t->known[addr] != t->gen) {
+    memcpy(p, bytes, TRACE_MAX_LEN + 1);
+    p += len;
+    count = len;
+    if (cached) {
+      t->known[addr] = t->gen;
+      t->lines[addr >> LINE_BITS] = t->gen;
+      t->lines[((addr + len - 1) & 0xfffff) >> LINE_BITS] = t->gen;
+    }
+  }
+  *tag = TRACE_INSN | flags | count;
+
+  t->pos        = p;
+  t->last       = *s;
+  t->sequential = cached;
+  t->next_ip    = s->pc + len;
+  t->index     += 1;
+}
+
+void trace_write(trace_t *t, uint32_t addr, uint16_t data, bool word) {
+  reserve(t);
+
+  uint8_t* p = t->pos;
+  const int32_t delta = (int32_t)(addr - t->write_addr);
+  if (t->write_valid && delta >= -128 && delta < 128) {
+    *p++ = TRACE_WRITE | TRACE_F_DELTA | (word ? TRACE_F_WORD : 0);
+    *p++ = (uint8_t)delta;
+  }
+  else {
+    *p++ = TRACE_WRITE | (word ? TRACE_F_WORD : 0);
+    *p++ = addr & 0xff;
+    *p++ = (addr >> 8) & 0xff;
+    *p++ = (addr >> 16) & 0xff;
+  }
+  *p++ = data & 0xff;
+  if (word) {
+    *p++ = data >> 8;
+  }
+  t->pos         = p;
+  t->write_addr  = addr;
+  t->write_valid = true;
+
+  // code written over has to be recorded again
+  const uint32_t last = (addr + (word ? 1 : 0)) & 0xfffff;
+  if (t->lines[addr >> LINE_BITS] == t->gen || t->lines[last >> LINE_BITS] == t->gen) {
+    for (uint32_t i = 0; i < TRACE_MAX_LEN + 1; ++i) {
+      t->known[(last - i) & 0xfffff] = 0;
+    }
+  }
+}
+
+void trace_int(trace_t *t, uint8_t num) {
+  reserve(t);
+  t->pos[0] = TRACE_INT;
+  t->pos[1] = num;
+  t->pos += 2;
+}
+
+bool trace_open(machine_t *m, const char* path, bool gated) {
+  if (m->trace) {
+    return false;
+  }
+  trace_t* t = calloc(1, sizeof(trace_t));
+  if (!t) {
+    return false;
+  }
+  t->blocks = malloc((size_t)BLOCKS * BLOCK_SIZE);
+  t->file   = fopen(path, "wb");
+  if (!t->blocks || !t->file) {
+    if (t->file) {
+      fclose(t->file);
+    }
+    free(t->blocks);
+    free(t);
+    return false;
+  }
+  t->m     = m;
+  t->gated = gated;
+  t->pos   = t->blocks;
+  t->end   = t->blocks + BLOCK_SIZE;
+
+  uint8_t header[TRACE_HEADER];
+  memcpy(header, TRACE_MAGIC, 8);
+  header[8]  = TRACE_VERSION & 0xff;
+  header[9]  = (TRACE_VERSION >> 8) & 0xff;
+  header[10] = (TRACE_VERSION >> 16) & 0xff;
+  header[11] = (TRACE_VERSION >> 24) & 0xff;
+  fwrite(header, 1, sizeof(header), t->file);
+
+#ifdef TRACE_THREAD
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->cond, NULL);
+  if (pthread_create(&t->thread, NULL, writer, t)) {
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    fclose(t->file);
+    free(t->blocks);
+    free(t);
+    return false;
+  }
+#endif
+
+  m->trace = t;
+  if (!gated) {
+    trace_enable(m, true);
+  }
+  return true;
+}
+
+bool trace_close(machine_t *m) {
+  trace_t* t = m->trace;
+  if (!t) {
+    return true;
+  }
+  trace_enable(m, false);
+  *t->pos++ = TRACE_END;
+  flush_block(t, true);
+#ifdef TRACE_THREAD
+  pthread_mutex_lock(&t->lock);
+  t->done = true;
+  pthread_cond_broadcast(&t->cond);
+  pthread_mutex_unlock(&t->lock);
+  pthread_join(t->thread, NULL);
+  pthread_cond_destroy(&t->cond);
+  pthread_mutex_destroy(&t->lock);
+#endif
+  const bool ok = !t->failed && fclose(t->file) == 0;
+  free(t->blocks);
+  free(t);
+  m->trace = NULL;
+  return ok;
+}
+
+void trace_enable(machine_t *m, bool enable) {
+  trace_t* t = m->trace;
+  if (!t || t->enabled == enable) {
+    return;
+  }
+  t->enabled = enable;
+  if (enable) {
+    // writes were not followed while paused
+    take_state(t);
+    reserve(t);
+    put_sync(t);
+  }
+  cpu_set_trace(m, enable ? t : NULL);
+  cpu_stop(m);  // leave translated code
+}
+
+bool trace_gated(machine_t *m) {
+  return m->trace && m->trace->gated;
+}
+
+
+#define READ_SIZE (1024 * 1024)
+
+struct trace_reader_t {
+  FILE*       file;
+  const char* error;
+  uint8_t*    buf;
+  uint32_t    pos;
+  uint32_t    size;
+  uint64_t    offset;  // of buf in the file
+
+  trace_state_t state;
+  uint64_t    index;
+  bool        sequential;
+  uint16_t    next_ip;
+  uint32_t    write_addr;
+  uint8_t     code[1024 * 1024 + TRACE_MAX_LEN];  // recorded instruction bytes
+  uint8_t     lens[1024 * 1024];
+};
+
+// Pointer to the next n bytes of the file, NULL at its end.
+static const uint8_t* take(trace_reader_t* r, uint32_t n) {
+  if (r->size - r->pos < n) {
+    memmove(r->buf, r->buf + r->pos, r->size - r->pos);
+    r->offset += r->pos;
+    r->size   -= r->pos;
+    r->pos     = 0;
+    r->size   += (uint32_t)fread(r->buf + r->size, 1, READ_SIZE - r->size, r->file);
+    if (r->size < n) {
+      return NULL;
+    }
+  }
+  const uint8_t* p = r->buf + r->pos;
+  r->pos += n;
+  return p;
+}
+
+static inline uint16_t get16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static inline uint64_t get64(const uint8_t* p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; ++i) {
+    v |= (uint64_t)p[i] << (i * 8);
+  }
+  return v;
+}
+
+trace_reader_t* trace_reader_open(const char* path) {
+  trace_reader_t* r = calloc(1, sizeof(trace_reader_t));
+  if (!r) {
+    return NULL;
+  }
+  r->buf  = malloc(READ_SIZE);
+  r->file = fopen(path, "rb");
+  const uint8_t* header = (r->buf && r->file) ? take(r, TRACE_HEADER) : NULL;
+  if (!header || memcmp(header, TRACE_MAGIC, 8) ||
+      (header[8] | (header[9] << 8) | (header[10] << 16) | ((uint32_t)header[11] << 24)) != TRACE_VERSION) {
+    trace_reader_close(r);
+    return NULL;
+  }
+  return r;
+}
+
+void trace_reader_close(trace_reader_t *r) {
+  if (!r) {
+    return;
+  }
+  if (r->file) {
+    fclose(r->file);
+  }
+  free(r->buf);
+  free(r);
+}
+
+const char* trace_reader_error(trace_reader_t *r) {
+  return r->error;
+}
+
+bool trace_reader_seek(trace_reader_t *r, uint64_t block) {
+  const uint64_t offset = TRACE_HEADER + block * TRACE_BLOCK_SIZE;
+#ifdef _WIN32
+  if (_fseeki64(r->file, (long long)offset, SEEK_SET)) {
+#else
+  if (fseeko(r->file, (off_t)offset, SEEK_SET)) {
+#endif
+    return false;
+  }
+  r->offset     = offset;
+  r->pos        = 0;
+  r->size       = 0;
+  r->error      = NULL;
+  r->index      = 0;
+  r->sequential = false;
+  memset(&r->state, 0, sizeof(r->state));
+  return true;
+}
+
+static bool damaged(trace_reader_t* r, const char* error) {
+  r->error = error;
+  return false;
+}
+
+bool trace_read(trace_reader_t *r, trace_record_t *rec) {
+  if (r->error) {
+    return false;
+  }
+  uint64_t offset;
+  const uint8_t* p;
+  do {
+    offset = r->offset + r->pos;
+    if (!(p = take(r, 1))) {
+      return damaged(r, "the trace is cut short");
+    }
+  } while (*p == TRACE_PAD);
+  const uint8_t tag = *p;
+
+  memset(rec, 0, sizeof(*rec));
+  rec->type   = tag;
+  rec->offset = offset;
+
+  if (tag < TRACE_WRITE) {
+    rec->type = TRACE_INSN;
+    trace_state_t s = r->state;
+    if (tag & TRACE_F_IP) {
+      if (!(p = take(r, 2))) {
+        return damaged(r, "the trace is cut short");
+      }
+      s.pc = get16(p);
+    }
+    else if (r->sequential) {
+      s.pc = r->next_ip;
+    }
+    else {
+      return damaged(r, "instruction without an address");
+    }
+    if (tag & TRACE_F_REGS) {
+      if (!(p = take(r, 2))) {
+        return damaged(r, "the trace is cut short");
+      }
+      rec->changed = get16(p);
+      for (int i = 0; i < TRACE_REGS; ++i) {
+        if ((rec->changed & (1 << i)) && (p = take(r, 2))) {
+          s.regs[i] = get16(p);
+        }
+      }
+      if (!p) {
+        return damaged(r, "the trace is cut short");
+      }
+    }
+    const uint32_t addr  = (s.regs[8 + CS] * 16 + s.pc) & 0xfffff;
+    const uint32_t count = tag & 0x0f;
+    if (count) {
+      if (!(p = take(r, count))) {
+        return damaged(r, "the trace is cut short");
+      }
+      memcpy(r->code + addr, p, count);
+      r->lens[addr] = (uint8_t)count;
+      rec->fresh = true;
+    }
+    rec->len = r->lens[addr];
+    memcpy(rec->bytes, r->code + addr, rec->len);
+
+    rec->index    = r->index++;
+    rec->state    = s;
+    rec->addr     = addr;
+    r->state      = s;
+    r->sequential = rec->len != 0;
+    r->next_ip    = s.pc + rec->len;
+    return true;
+  }
+
+  rec->index = r->index ? r->index - 1 : 0;
+  rec->state = r->state;
+
+  switch (tag) {
+  case TRACE_WRITE:
+  case TRACE_WRITE | TRACE_F_WORD:
+  case TRACE_WRITE | TRACE_F_DELTA:
+  case TRACE_WRITE | TRACE_F_DELTA | TRACE_F_WORD: {
+    rec->type = TRACE_WRITE;
+    rec->word = (tag & TRACE_F_WORD) != 0;
+    const uint32_t size = ((tag & TRACE_F_DELTA) ? 1 : 3) + (rec->word ? 2 : 1);
+    if (!(p = take(r, size))) {
+      return damaged(r, "the trace is cut short");
+    }
+    if (tag & TRACE_F_DELTA) {
+      rec->addr = (r->write_addr + (int8_t)*p++) & 0xfffff;
+    }
+    else {
+      rec->addr = p[0] | (p[1] << 8) | (p[2] << 16);
+      p += 3;
+    }
+    rec->data = rec->word ? get16(p) : p[0];
+    r->write_addr = rec->addr;
+    return true;
+  }
+  case TRACE_INT:
+    if (!(p = take(r, 1))) {
+      return damaged(r, "the trace is cut short");
+    }
+    rec->num = *p;
+    return true;
+  case TRACE_SYNC:
+    if (!(p = take(r, 16 + (TRACE_REGS + 1) * 2))) {
+      return damaged(r, "the trace is cut short");
+    }
+    r->index = get64(p);
+    rec->cycles = get64(p + 8);
+    p += 16;
+    for (int i = 0; i < TRACE_REGS; ++i, p += 2) {
+      r->state.regs[i] = get16(p);
+    }
+    r->state.pc   = get16(p);
+    r->sequential = false;
+    rec->index    = r->index;
+    rec->state    = r->state;
+    return true;
+  case TRACE_END:
+    return false;
+  default:
+    return damaged(r, "unknown record");
+  }
+}
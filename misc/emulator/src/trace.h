@@ -0,0 +1,120 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+
+
+// Binary instruction trace, the compact form of what cpu_set_debug() prints.
+// The CPU appends a record per instruction to a ring of blocks in memory and
+// a writer thread drains the full blocks to the file. All values are little
+// endian:
+//
+//   "iceXtTrc"  magic
+//   u32         TRACE_VERSION
+//   records     up to TRACE_END
+//
+// An instruction record is written before the instruction is executed:
+//
+//   u8   tag, TRACE_INSN | flags | number of instruction bytes that follow
+//   u16  IP, with TRACE_F_IP, otherwise it is the IP plus the length of the
+//        previous instruction and CS is unchanged
+//   u16  mask of the registers that changed since the previous record, with
+//        TRACE_F_REGS, then a u16 per set bit: bits 0 to 7 are AX to DI,
+//        8 to 11 ES to DS, 12 the flags
+//   u8[] instruction bytes, none when they are the same as the last time
+//        the instruction at this linear address was recorded
+//
+// The memory writes and interrupts of an instruction follow its record:
+//
+//   TRACE_WRITE | TRACE_F_WORD? | TRACE_F_DELTA?
+//        u24 linear address, or with TRACE_F_DELTA an s8 distance from the
+//        address of the previous write, then the u8 or u16 written
+//   TRACE_INT   u8 interrupt number, the CPU enters the interrupt
+//
+// The records are written in blocks of TRACE_BLOCK_SIZE bytes, block n
+// starts at byte 12 + n * TRACE_BLOCK_SIZE of the file. Every block starts
+// with a TRACE_SYNC of the full state, the deltas after it do not depend on
+// anything before it, and is filled up with TRACE_PAD bytes. Only the last
+// one is shorter.
+//
+//   TRACE_SYNC  u64 number of the next instruction record, u64 clock cycle,
+//               u16 AX to DI, ES to DS, flags and IP
+//
+// Writes from devices other than the CPU are not traced.
+#define TRACE_VERSION    2
+#define TRACE_HEADER     12
+#define TRACE_BLOCK_SIZE (256 * 1024)
+
+enum {
+  TRACE_INSN    = 0x00,  // 0x00 to 0x3f
+  TRACE_F_IP    = 0x10,
+  TRACE_F_REGS  = 0x20,
+  TRACE_WRITE   = 0x40,  // 0x40 to 0x43
+  TRACE_F_WORD  = 0x01,
+  TRACE_F_DELTA = 0x02,
+  TRACE_INT     = 0x80,
+  TRACE_SYNC    = 0x81,
+  TRACE_PAD     = 0xfe,
+  TRACE_END     = 0xff,
+};
+
+#define TRACE_REGS     13  // AX to DI, ES to DS, flags
+#define TRACE_MAX_LEN  15  // instruction bytes in a record
+
+// CPU state at an instruction boundary as the records carry it.
+typedef struct {
+  uint16_t regs[TRACE_REGS];
+  uint16_t pc;  // IP
+} trace_state_t;
+
+// Trace every instruction from now on to a new file at path. When gated the
+// trace only runs while enabled by the guest, from a write to port B0h up to
+// one to port B2h, instead of the text trace those ports select otherwise.
+bool trace_open (machine_t *m, const char* path, bool gated);
+// Flush the trace and close the file. Returns false when anything could not
+// be written.
+bool trace_close(machine_t *m);
+// Start or pause tracing, for the debug ports.
+void trace_enable(machine_t *m, bool enable);
+bool trace_gated (machine_t *m);
+
+// Used by the CPU. The instruction about to be executed at linear address
+// addr, bytes has to point at TRACE_MAX_LEN + 1 readable bytes, of which
+// the first len are only valid to keep when cached. Then its memory writes
+// and interrupt entries.
+void trace_insn (trace_t *t, const trace_state_t *s, uint32_t addr,
+                 const uint8_t *bytes, uint32_t len, bool cached);
+void trace_write(trace_t *t, uint32_t addr, uint16_t data, bool word);
+void trace_int  (trace_t *t, uint8_t num);
+
+
+// Reading a trace back, for the tools.
+typedef struct trace_reader_t trace_reader_t;
+
+typedef struct {
+  uint8_t  type;       // TRACE_INSN, TRACE_WRITE, TRACE_INT or TRACE_SYNC
+  uint64_t index;      // number of the instruction, or of the last one
+  uint64_t cycles;     // clock cycle of a TRACE_SYNC
+  uint64_t offset;     // file offset of the record
+  trace_state_t state; // at the start of the instruction
+  uint16_t changed;    // registers changed since the previous instruction
+  uint32_t addr;       // linear address of the instruction or write
+  uint8_t  bytes[TRACE_MAX_LEN + 1];
+  uint8_t  len;        // instruction bytes, as far as known
+  bool     fresh;      // the bytes were recorded with this instruction
+  uint16_t data;       // value written
+  bool     word;
+  uint8_t  num;        // interrupt number
+} trace_record_t;
+
+trace_reader_t* trace_reader_open (const char* path);
+void            trace_reader_close(trace_reader_t *r);
+// Read the next record, false at the end of the trace or when it is cut
+// short or damaged, see trace_reader_error().
+bool            trace_read        (trace_reader_t *r, trace_record_t *rec);
+const char*     trace_reader_error(trace_reader_t *r);
+// Continue reading at the start of a block. The instruction numbers are
+// known again from its TRACE_SYNC on.
+bool            trace_reader_seek (trace_reader_t *r, uint64_t block);
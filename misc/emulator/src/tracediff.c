@@ -0,0 +1,394 @@
+// Finds where two binary instruction traces, see trace.h, part ways, no SDL.
+//
+//   iceXtTraceDiff [options] <a.trace> <b.trace>
+//
+// The traces are compared byte for byte, 64 bytes at a time, from memory
+// mapped files or with --stream from reads of STREAM_CHUNK bytes for
+// traces that do not fit the address space. Only the block holding the
+// first difference and the one before it are decoded, every block starts
+// from a full state. The report shows the instructions the traces have in
+// common before it, the records that differ and how each trace goes on.
+//
+// Exits with 0 when the traces are the same, 1 when they differ and 2 when
+// one could not be read.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
+#include "udis86/udis86.h"
+
+#include "trace.h"
+
+
+#define STREAM_CHUNK (4 * 1024 * 1024)
+#define MAX_CONTEXT  64
+#define SYNC_SIZE    (1 + 16 + (TRACE_REGS + 1) * 2)  // bytes of a TRACE_SYNC
+
+static const char* const reg_names[TRACE_REGS] = {
+  "AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI", "ES", "CS", "SS", "DS", "FL",
+};
+
+// Offset of the first byte that differs in a and b of size bytes, size when
+// they are the same.
+static uint64_t first_difference(const uint8_t* a, const uint8_t* b, uint64_t size) {
+  uint64_t i = 0;
+#if defined(__SSE2__) && defined(__GNUC__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 64 <= size; i += 64) {
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i)),
+                              _mm_loadu_si128((const __m128i*)(b + i)));
+    x = _mm_or_si128(x, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i + 16)),
+                                      _mm_loadu_si128((const __m128i*)(b + i + 16))));
+    x = _mm_or_si128(x, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i + 32)),
+                                      _mm_loadu_si128((const __m128i*)(b + i + 32))));
+    x = _mm_or_si128(x, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i + 48)),
+                                      _mm_loadu_si128((const __m128i*)(b + i + 48))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xffff) {
+      break;
+    }
+  }
+#else
+  for (; i + 64 <= size && !memcmp(a + i, b + i, 64); i += 64) {
+  }
+#endif
+  while (i < size && a[i] == b[i]) {
+    ++i;
+  }
+  return i;
+}
+
+typedef struct {
+  const uint8_t* data;
+  uint64_t       size;
+} mapped_t;
+
+static bool map_file(const char* path, mapped_t* m) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+  m->data = data;
+  m->size = (uint64_t)st.st_size;
+  return true;
+}
+
+// Offset of the first difference of the files, or the length of the
+// shorter one when it is a prefix of the other. *same is set when they are
+// identical.
+static bool compare_mapped(const char* a, const char* b, uint64_t from, uint64_t* diff, bool* same) {
+  mapped_t ma, mb;
+  if (!map_file(a, &ma)) {
+    return false;
+  }
+  if (!map_file(b, &mb)) {
+    munmap((void*)ma.data, ma.size);
+    return false;
+  }
+  const uint64_t size = (ma.size < mb.size) ? ma.size : mb.size;
+  *diff = (from < size) ? from + first_difference(ma.data + from, mb.data + from, size - from) : size;
+  *same = *diff == size && ma.size == mb.size;
+  munmap((void*)ma.data, ma.size);
+  munmap((void*)mb.data, mb.size);
+  return true;
+}
+
+static bool compare_stream(const char* a, const char* b, uint64_t from, uint64_t* diff, bool* same) {
+  FILE* fa = fopen(a, "rb");
+  FILE* fb = fopen(b, "rb");
+  uint8_t* ba = malloc(STREAM_CHUNK);
+  uint8_t* bb = malloc(STREAM_CHUNK);
+  bool ok = fa && fb && ba && bb && !fseeko(fa, (off_t)from, SEEK_SET) && !fseeko(fb, (off_t)from, SEEK_SET);
+
+  *diff = from;
+  *same = false;
+  while (ok) {
+    const size_t na = fread(ba, 1, STREAM_CHUNK, fa);
+    const size_t nb = fread(bb, 1, STREAM_CHUNK, fb);
+    const size_t n  = (na < nb) ? na : nb;
+    const uint64_t i = first_difference(ba, bb, n);
+    *diff += i;
+    if (i < n || na != nb) {
+      break;
+    }
+    if (na < STREAM_CHUNK) {
+      *same = true;
+      break;
+    }
+  }
+  if (fa) {
+    fclose(fa);
+  }
+  if (fb) {
+    fclose(fb);
+  }
+  free(ba);
+  free(bb);
+  return ok;
+}
+
+static bool same_record(const trace_record_t* a, const trace_record_t* b) {
+  if (a->type != b->type) {
+    return false;
+  }
+  switch (a->type) {
+  case TRACE_INSN:
+    return a->addr == b->addr && a->len == b->len && !memcmp(a->bytes, b->bytes, a->len) &&
+           !memcmp(&a->state, &b->state, sizeof(a->state));
+  case TRACE_WRITE:
+    return a->addr == b->addr && a->data == b->data && a->word == b->word;
+  case TRACE_INT:
+    return a->num == b->num;
+  case TRACE_SYNC:
+    return a->index == b->index && a->cycles == b->cycles &&
+           !memcmp(&a->state, &b->state, sizeof(a->state));
+  }
+  return true;
+}
+
+typedef struct {
+  ud_t ud;
+  bool regs;  // print all registers of an instruction
+} printer_t;
+
+static void print_record(printer_t* p, const char* prefix, const trace_record_t* rec) {
+  switch (rec->type) {
+  case TRACE_INSN: {
+    const char* text = "?";
+    if (rec->len) {
+      ud_set_input_buffer(&p->ud, rec->bytes, rec->len);
+      ud_set_pc(&p->ud, rec->state.pc);
+      if (ud_disassemble(&p->ud)) {
+        text = ud_insn_asm(&p->ud);
+      }
+    }
+    printf("%s%10llu %04x:%04x %05x: %-28s", prefix, (unsigned long long)rec->index,
+      rec->state.regs[8 + CS], rec->state.pc, rec->addr, text);
+    if (p->regs) {
+      for (int i = 0; i < TRACE_REGS; ++i) {
+        printf(" %s=%04x", reg_names[i], rec->state.regs[i]);
+      }
+    }
+    printf("\n");
+    break;
+  }
+  case TRACE_WRITE:
+    printf(rec->word ? "%s%10s [%05x] <= %04x\n" : "%s%10s [%05x] <= %02x\n",
+      prefix, "", rec->addr, rec->data);
+    break;
+  case TRACE_INT:
+    printf("%s%10s int %02x\n", prefix, "", rec->num);
+    break;
+  case TRACE_SYNC:
+    printf("%s%10s sync, next instruction %llu at cycle %llu\n", prefix, "",
+      (unsigned long long)rec->index, (unsigned long long)rec->cycles);
+    break;
+  }
+}
+
+// What differs between two records of the same type.
+static void print_difference(const trace_record_t* a, const trace_record_t* b) {
+  if (a->type != b->type) {
+    printf("  the records differ in kind\n");
+    return;
+  }
+  if (a->type == TRACE_SYNC && a->cycles != b->cycles) {
+    printf("  clock cycle %llu vs %llu, the timing diverged\n",
+      (unsigned long long)a->cycles, (unsigned long long)b->cycles);
+  }
+  if (a->type == TRACE_INSN || a->type == TRACE_SYNC) {
+    for (int i = 0; i < TRACE_REGS; ++i) {
+      if (a->state.regs[i] != b->state.regs[i]) {
+        printf("  %s %04x vs %04x\n", reg_names[i], a->state.regs[i], b->state.regs[i]);
+      }
+    }
+    if (a->state.pc != b->state.pc) {
+      printf("  IP %04x vs %04x\n", a->state.pc, b->state.pc);
+    }
+  }
+  if (a->type == TRACE_INSN && (a->len != b->len || memcmp(a->bytes, b->bytes, a->len))) {
+    printf("  the instruction bytes differ\n");
+  }
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: iceXtTraceDiff [options] <a.trace> <b.trace>\n"
+    "  --context N    instructions to show before and after (default 8)\n"
+    "  --regs         show all registers of every instruction shown\n"
+    "  --stream       read the files instead of mapping them\n"
+    "  --ignore-cycles  look past differences in the clock cycle only\n");
+}
+
+int main(int argc, char** args) {
+
+  printer_t p;
+  memset(&p, 0, sizeof(p));
+
+  uint32_t    context  = 8;
+  bool        stream   = false;
+  bool        ignore   = false;
+  const char* paths[2] = { NULL, NULL };
+  uint32_t    numPaths = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(args[i], "--context") == 0 && has_value) {
+      context = (uint32_t)atoi(args[++i]);
+      context = (context > MAX_CONTEXT) ? MAX_CONTEXT : context;
+      continue;
+    }
+    if (strcmp(args[i], "--regs") == 0) {
+      p.regs = true;
+      continue;
+    }
+    if (strcmp(args[i], "--stream") == 0) {
+      stream = true;
+      continue;
+    }
+    if (strcmp(args[i], "--ignore-cycles") == 0) {
+      ignore = true;
+      continue;
+    }
+    if (strncmp(args[i], "--", 2) == 0 || numPaths == 2) {
+      usage();
+      return 2;
+    }
+    paths[numPaths++] = args[i];
+  }
+  if (numPaths != 2) {
+    usage();
+    return 2;
+  }
+
+  trace_reader_t* ra = trace_reader_open(paths[0]);
+  trace_reader_t* rb = trace_reader_open(paths[1]);
+  if (!ra || !rb) {
+    fprintf(stderr, "'%s' is not a trace!\n", paths[ra ? 1 : 0]);
+    return 2;
+  }
+  ud_init(&p.ud);
+  ud_set_mode(&p.ud, 16);
+  ud_set_syntax(&p.ud, UD_SYN_INTEL);
+
+  trace_record_t ctx[MAX_CONTEXT];  // instructions in common, a ring
+  uint32_t       num_ctx = 0;
+  trace_record_t a, b;
+  bool           found = false;
+  bool           ended = false;  // one trace ends before the other
+  uint64_t       from  = 0;
+
+  while (!found) {
+    uint64_t diff = 0;
+    bool     same = false;
+    const bool ok = stream ? compare_stream(paths[0], paths[1], from, &diff, &same) :
+                             (compare_mapped(paths[0], paths[1], from, &diff, &same) ||
+                              compare_stream(paths[0], paths[1], from, &diff, &same));
+    if (!ok) {
+      fprintf(stderr, "Unable to read the traces!\n");
+      return 2;
+    }
+    if (same) {
+      printf("the traces are the same\n");
+      return 0;
+    }
+
+    // decode from the block before the one with the difference, for context
+    const uint64_t block = (diff < TRACE_HEADER) ? 0 : (diff - TRACE_HEADER) / TRACE_BLOCK_SIZE;
+    const uint64_t start = block ? block - 1 : 0;
+    if (!trace_reader_seek(ra, start) || !trace_reader_seek(rb, start)) {
+      fprintf(stderr, "Unable to read the traces!\n");
+      return 2;
+    }
+    num_ctx = 0;
+    for (;;) {
+      const bool more_a = trace_read(ra, &a);
+      const bool more_b = trace_read(rb, &b);
+      if (!more_a && !more_b) {
+        printf("the traces are the same\n");  // up to the end of both
+        return 0;
+      }
+      if (!more_a || !more_b) {
+        trace_reader_t* r = more_a ? rb : ra;
+        const char* error = trace_reader_error(r);
+        printf("'%s' ends after instruction %llu%s%s\n", paths[more_a ? 1 : 0],
+          (unsigned long long)(num_ctx ? ctx[(num_ctx - 1) % MAX_CONTEXT].index : 0),
+          error ? ", " : "", error ? error : "");
+        found = ended = true;
+        break;
+      }
+      if (!same_record(&a, &b)) {
+        if (ignore && a.type == TRACE_SYNC && b.type == TRACE_SYNC &&
+            a.index == b.index && !memcmp(&a.state, &b.state, sizeof(a.state))) {
+          from = a.offset + SYNC_SIZE;  // compare on from the next record
+          break;
+        }
+        found = true;
+        break;
+      }
+      if (a.type == TRACE_INSN) {
+        ctx[num_ctx++ % MAX_CONTEXT] = a;
+      }
+    }
+  }
+
+  if (!ended) {
+    printf("the traces diverge at instruction %llu, byte %llu\n",
+      (unsigned long long)a.index, (unsigned long long)a.offset);
+  }
+  const uint32_t shown = (num_ctx < context) ? num_ctx : context;
+  if (shown) {
+    printf("in common:\n");
+    for (uint32_t i = num_ctx - shown; i < num_ctx; ++i) {
+      print_record(&p, "    ", &ctx[i % MAX_CONTEXT]);
+    }
+  }
+  if (ended) {
+    trace_reader_close(ra);
+    trace_reader_close(rb);
+    return 1;
+  }
+  printf("%s:\n", paths[0]);
+  print_record(&p, "  > ", &a);
+  printf("%s:\n", paths[1]);
+  print_record(&p, "  > ", &b);
+  print_difference(&a, &b);
+
+  // how each trace goes on
+  for (int side = 0; side < 2; ++side) {
+    trace_reader_t* r = side ? rb : ra;
+    trace_record_t  rec;
+    uint32_t        insns = 0;
+    printf("then %s:\n", paths[side]);
+    while (insns < context && trace_read(r, &rec)) {
+      print_record(&p, "    ", &rec);
+      insns += rec.type == TRACE_INSN;
+    }
+  }
+
+  trace_reader_close(ra);
+  trace_reader_close(rb);
+  return 1;
+}
@@ -0,0 +1,220 @@
+// Prints a binary instruction trace, see trace.h, as text, no SDL.
+//
+//   iceXtTraceDump [options] <file.trace>
+//
+// Every instruction is shown with its flags, CS:IP, linear address, bytes
+// and disassembly, after the registers it found changed by the one before,
+// followed by its memory writes and the interrupts entered. The
+// disassembly is kept per linear address until the trace records new bytes
+// there.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "udis86/udis86.h"
+
+#include "trace.h"
+
+
+static const char* const reg_names[TRACE_REGS] = {
+  "AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI", "ES", "CS", "SS", "DS", "FL",
+};
+
+typedef struct {
+  char*   text;
+  uint8_t len;  // of the instruction, the trace may hold more bytes
+} insn_t;
+
+typedef struct {
+  ud_t    ud;
+  insn_t* cache;  // disassembly by linear address
+  bool    writes;
+  bool    regs;
+  bool    bytes;
+} dump_t;
+
+static const insn_t* disassemble(dump_t* d, const trace_record_t* rec) {
+  static const insn_t unknown = { "?", 0 };
+  insn_t* entry = &d->cache[rec->addr];
+  if (entry->text && !rec->fresh) {
+    return entry;
+  }
+  free(entry->text);
+  entry->text = NULL;
+  if (!rec->len) {
+    return &unknown;  // the bytes were recorded before the trace was opened
+  }
+  ud_set_input_buffer(&d->ud, rec->bytes, rec->len);
+  ud_set_pc(&d->ud, rec->state.pc);
+  if (!ud_disassemble(&d->ud) || !(entry->text = strdup(ud_insn_asm(&d->ud)))) {
+    return &unknown;
+  }
+  entry->len = (uint8_t)ud_insn_len(&d->ud);
+  return entry;
+}
+
+static void print_flags(uint16_t f) {
+  printf("%c%c%c%c%c%c%c%c",
+    (f & 0x800) ? 'O' : '.',
+    (f & 0x400) ? 'D' : '.',
+    (f & 0x200) ? 'I' : '.',
+    (f & 0x080) ? 'S' : '.',
+    (f & 0x040) ? 'Z' : '.',
+    (f & 0x010) ? 'A' : '.',
+    (f & 0x004) ? 'P' : '.',
+    (f & 0x001) ? 'C' : '.');
+}
+
+static void print_insn(dump_t* d, const trace_record_t* rec, const trace_state_t* prev) {
+  if (d->regs) {
+    for (int i = 0; i < TRACE_REGS; ++i) {
+      if (rec->changed & (1 << i)) {
+        printf("  %s %04x => %04x\n", reg_names[i], prev->regs[i], rec->state.regs[i]);
+      }
+    }
+  }
+  print_flags(rec->state.regs[12]);
+  printf(" %10llu %04x:%04x %05x: ", (unsigned long long)rec->index,
+    rec->state.regs[8 + CS], rec->state.pc, rec->addr);
+  const insn_t* insn = disassemble(d, rec);
+  if (d->bytes) {
+    char hex[2 * TRACE_MAX_LEN + 1] = "";
+    for (uint32_t i = 0; i < insn->len; ++i) {
+      snprintf(hex + i * 2, sizeof(hex) - i * 2, "%02x", rec->bytes[i]);
+    }
+    printf("%-12s ", hex);
+  }
+  printf("%s\n", insn->text);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: iceXtTraceDump [options] <file.trace>\n"
+    "  --from N     start at instruction N\n"
+    "  --count N    print N instructions\n"
+    "  --no-regs    leave out the register changes\n"
+    "  --no-writes  leave out the memory writes\n"
+    "  --bytes      show the instruction bytes\n"
+    "  --summary    only count the records\n");
+}
+
+int main(int argc, char** args) {
+
+  dump_t d;
+  memset(&d, 0, sizeof(d));
+  d.writes = true;
+  d.regs   = true;
+
+  uint64_t    from    = 0;
+  uint64_t    count   = UINT64_MAX;
+  bool        summary = false;
+  const char* path    = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(args[i], "--from") == 0 && has_value) {
+      from = strtoull(args[++i], NULL, 0);
+      continue;
+    }
+    if (strcmp(args[i], "--count") == 0 && has_value) {
+      count = strtoull(args[++i], NULL, 0);
+      continue;
+    }
+    if (strcmp(args[i], "--no-regs") == 0) {
+      d.regs = false;
+      continue;
+    }
+    if (strcmp(args[i], "--no-writes") == 0) {
+      d.writes = false;
+      continue;
+    }
+    if (strcmp(args[i], "--bytes") == 0) {
+      d.bytes = true;
+      continue;
+    }
+    if (strcmp(args[i], "--summary") == 0) {
+      summary = true;
+      continue;
+    }
+    if (strncmp(args[i], "--", 2) == 0 || path) {
+      usage();
+      return 1;
+    }
+    path = args[i];
+  }
+  if (!path) {
+    usage();
+    return 1;
+  }
+
+  trace_reader_t* r = trace_reader_open(path);
+  if (!r) {
+    fprintf(stderr, "'%s' is not a trace!\n", path);
+    return 1;
+  }
+  d.cache = calloc(1024 * 1024, sizeof(insn_t));
+  ud_init(&d.ud);
+  ud_set_mode(&d.ud, 16);
+  ud_set_syntax(&d.ud, UD_SYN_INTEL);
+
+  uint64_t insns = 0, writes = 0, ints = 0, syncs = 0;
+  trace_state_t  prev;
+  trace_record_t rec;
+  memset(&prev, 0, sizeof(prev));
+
+  while (trace_read(r, &rec)) {
+    if (!summary && rec.type == TRACE_INSN && rec.index >= from && rec.index - from >= count) {
+      break;
+    }
+    const bool shown = !summary && rec.index >= from && rec.index - from < count;
+    switch (rec.type) {
+    case TRACE_INSN:
+      insns += 1;
+      if (shown) {
+        print_insn(&d, &rec, &prev);
+      }
+      else if (rec.fresh) {
+        disassemble(&d, &rec);  // drop what was cached for the old bytes
+      }
+      prev = rec.state;
+      break;
+    case TRACE_WRITE:
+      writes += 1;
+      if (shown && d.writes) {
+        printf(rec.word ? "  [%05x] <= %04x\n" : "  [%05x] <= %02x\n", rec.addr, rec.data);
+      }
+      break;
+    case TRACE_INT:
+      ints += 1;
+      if (shown) {
+        printf("  int %02x\n", rec.num);
+      }
+      break;
+    case TRACE_SYNC:
+      syncs += 1;
+      prev = rec.state;
+      break;
+    }
+  }
+
+  const char* error = trace_reader_error(r);
+  if (error) {
+    fprintf(stderr, "%s at instruction %llu: %s\n", path,
+      (unsigned long long)insns, error);
+  }
+  if (summary) {
+    printf("%llu instructions, %llu writes, %llu interrupts, %llu syncs\n",
+      (unsigned long long)insns, (unsigned long long)writes,
+      (unsigned long long)ints, (unsigned long long)syncs);
+  }
+
+  for (uint32_t i = 0; i < 1024 * 1024; ++i) {
+    free(d.cache[i].text);
+  }
+  free(d.cache);
+  trace_reader_close(r);
+  return error ? 1 : 0;
+}